@@ -0,0 +1,580 @@
+#include "../src/gtfs.hpp"
+
+// Latency and throughput benchmark of the GTFileSystem API. Every measurement is printed
+// as one line, JSON objects by default or CSV rows with --csv, so results can be compared
+// between builds. Latencies are in microseconds, taken from a log-linear histogram.
+//
+// Usage: ./gtfs_bench [--dir path] [--quick] [--csv] [--only name]
+
+string directory = "bench_data";
+bool quick = false;
+bool csv = false;
+string only;
+
+// Log-linear histogram of nanosecond latencies: 16 buckets per power of two, so a
+// percentile is off by at most 1/16. Plain data, so children can send it over a pipe.
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS (HIST_SUB + (64 - HIST_SUB_BITS) * HIST_SUB)
+
+typedef struct histogram {
+    uint64_t counts[HIST_BUCKETS];
+    uint64_t total;
+    uint64_t sum;
+    uint64_t max;
+} histogram_t;
+
+int hist_bucket(uint64_t ns) {
+    if (ns < HIST_SUB) {
+        return ns;
+    }
+    int e = 63 - __builtin_clzll(ns);
+    return HIST_SUB + (e - HIST_SUB_BITS) * HIST_SUB + ((ns >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+}
+
+// Largest value that falls into bucket idx
+uint64_t hist_upper(int idx) {
+    if (idx < HIST_SUB) {
+        return idx;
+    }
+    int e = (idx - HIST_SUB) / HIST_SUB + HIST_SUB_BITS;
+    uint64_t low = (uint64_t)(HIST_SUB + (idx - HIST_SUB) % HIST_SUB) << (e - HIST_SUB_BITS);
+    return low + ((uint64_t)1 << (e - HIST_SUB_BITS)) - 1;
+}
+
+void hist_record(histogram_t *hist, uint64_t ns) {
+    hist->counts[hist_bucket(ns)]++;
+    hist->total++;
+    hist->sum += ns;
+    hist->max = max(hist->max, ns);
+}
+
+void hist_merge(histogram_t *into, const histogram_t *from) {
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        into->counts[i] += from->counts[i];
+    }
+    into->total += from->total;
+    into->sum += from->sum;
+    into->max = max(into->max, from->max);
+}
+
+uint64_t hist_percentile(const histogram_t *hist, double p) {
+    uint64_t rank = (uint64_t)(p * hist->total);
+    uint64_t seen = 0;
+    for (int i = 0; i < HIST_BUCKETS; i++) {
+        seen += hist->counts[i];
+        if (seen > rank) {
+            return min(hist_upper(i), hist->max);
+        }
+    }
+    return hist->max;
+}
+
+// Parameters of a measurement, printed with its results
+typedef struct config {
+    string bench;
+    int size;
+    int writes_per_sync;
+    int files;
+    int threads;
+    int procs;
+} config_t;
+
+uint64_t now_ns() {
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+void report(const config_t& cfg, const histogram_t *hist, double seconds, int64_t bytes, int64_t errors) {
+    static bool header = false;
+    double ops_per_sec = seconds > 0 ? hist->total / seconds : 0;
+    double mb_per_sec = seconds > 0 ? bytes / seconds / (1 << 20) : 0;
+    double mean_us = hist->total ? hist->sum / 1000.0 / hist->total : 0;
+    if (csv) {
+        if (!header) {
+            printf("bench,size,writes_per_sync,files,threads,procs,ops,errors,bytes,seconds,ops_per_sec,mb_per_sec,mean_us,p50_us,p99_us,p999_us,max_us\n");
+            header = true;
+        }
+        printf("%s,%d,%d,%d,%d,%d,%llu,%lld,%lld,%.6f,%.1f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f\n",
+               cfg.bench.c_str(), cfg.size, cfg.writes_per_sync, cfg.files, cfg.threads, cfg.procs,
+               (unsigned long long)hist->total, (long long)errors, (long long)bytes, seconds, ops_per_sec, mb_per_sec, mean_us,
+               hist_percentile(hist, 0.5) / 1000.0, hist_percentile(hist, 0.99) / 1000.0,
+               hist_percentile(hist, 0.999) / 1000.0, hist->max / 1000.0);
+    } else {
+        printf("{\"bench\":\"%s\",\"size\":%d,\"writes_per_sync\":%d,\"files\":%d,\"threads\":%d,\"procs\":%d,"
+               "\"ops\":%llu,\"errors\":%lld,\"bytes\":%lld,\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"mb_per_sec\":%.2f,"
+               "\"mean_us\":%.2f,\"p50_us\":%.2f,\"p99_us\":%.2f,\"p999_us\":%.2f,\"max_us\":%.2f}\n",
+               cfg.bench.c_str(), cfg.size, cfg.writes_per_sync, cfg.files, cfg.threads, cfg.procs,
+               (unsigned long long)hist->total, (long long)errors, (long long)bytes, seconds, ops_per_sec, mb_per_sec, mean_us,
+               hist_percentile(hist, 0.5) / 1000.0, hist_percentile(hist, 0.99) / 1000.0,
+               hist_percentile(hist, 0.999) / 1000.0, hist->max / 1000.0);
+    }
+    fflush(stdout);
+}
+
+bool selected(const string& name) {
+    return only.empty() || only == name;
+}
+
+// Every measurement starts on files of its own
+int bench_run = 0;
+
+string bench_file(int i) {
+    return "bench" + to_string(bench_run) + "_" + to_string(i) + ".dat";
+}
+
+// Closes the files of a measurement and removes them with their logs
+void remove_files(gtfs_t *gtfs, vector<file_t*>& fls) {
+    for (file_t *fl : fls) {
+        if (fl) {
+            gtfs_close_file(gtfs, fl);
+            gtfs_remove_file(gtfs, fl);
+        }
+    }
+    fls.clear();
+    bench_run++;
+}
+
+// Number of commits for a configuration: enough to be stable, bounded by a byte budget
+int commit_count(int size, int writes_per_sync) {
+    int64_t budget = quick ? (8 << 20) : (128 << 20);
+    int64_t ops = quick ? 200 : 5000;
+    return (int)max((int64_t)20, min(ops, budget / ((int64_t)size * writes_per_sync)));
+}
+
+// Results of one writer (a thread or a forked process)
+typedef struct writer_result {
+    histogram_t write;
+    histogram_t sync;
+    int64_t errors;
+} writer_result_t;
+
+// Writes writes_per_sync writes of size bytes into the writer's own region of fl and
+// commits them (a sync for one write, a transaction for more), commits times over
+void run_writer(gtfs_t *gtfs, file_t *fl, int region, int size, int writes_per_sync, int commits, writer_result_t *result) {
+    vector<char> buf(size, 'a' + region % 26);
+    vector<write_t*> writes(writes_per_sync);
+    for (int c = 0; c < commits; c++) {
+        uint64_t start = now_ns();
+        for (int w = 0; w < writes_per_sync; w++) {
+            int offset = (region * writes_per_sync + w) * size;
+            writes[w] = gtfs_write_file(gtfs, fl, offset, size, buf.data());
+            result->errors += writes[w] == NULL;
+        }
+        uint64_t written = now_ns();
+        hist_record(&result->write, (written - start) / writes_per_sync);
+        if (writes_per_sync == 1) {
+            result->errors += gtfs_sync_write_file(writes[0]) != size;
+        } else {
+            txn_t *txn = gtfs_begin_txn(gtfs);
+            for (write_t *write_id : writes) {
+                gtfs_add_write_txn(txn, write_id);
+            }
+            result->errors += gtfs_commit_txn(txn) != size * writes_per_sync;
+        }
+        hist_record(&result->sync, now_ns() - written);
+        for (write_t *write_id : writes) {
+            gtfs_release_write(write_id);
+        }
+    }
+}
+
+void report_writers(const config_t& cfg, const writer_result_t *total, double seconds, int64_t bytes) {
+    config_t write_cfg = cfg;
+    write_cfg.bench = cfg.bench + "_write";
+    report(write_cfg, &total->write, seconds, bytes, total->errors);
+    config_t sync_cfg = cfg;
+    sync_cfg.bench = cfg.bench + "_sync";
+    report(sync_cfg, &total->sync, seconds, bytes, total->errors);
+}
+
+void merge_writer(writer_result_t *into, const writer_result_t *from) {
+    hist_merge(&into->write, &from->write);
+    hist_merge(&into->sync, &from->sync);
+    into->errors += from->errors;
+}
+
+// Write and sync with threads threads in this process, spread over files files
+void bench_write_sync(const config_t& cfg) {
+    gtfs_t *gtfs = gtfs_init(directory, 0);
+    gtfs_enable_checkpointer(gtfs, 16 << 20, 0); // Keeps the logs bounded, as a deployment would
+    int regions_per_file = (cfg.threads + cfg.files - 1) / cfg.files;
+    int file_length = regions_per_file * cfg.writes_per_sync * cfg.size;
+    vector<file_t*> fls;
+    for (int f = 0; f < cfg.files; f++) {
+        fls.push_back(gtfs_open_file(gtfs, bench_file(f), file_length));
+    }
+
+    int commits = commit_count(cfg.size, cfg.writes_per_sync);
+    vector<writer_result_t> results(cfg.threads);
+    memset(results.data(), 0, results.size() * sizeof(writer_result_t));
+    vector<thread> threads;
+    uint64_t start = now_ns();
+    for (int t = 0; t < cfg.threads; t++) {
+        threads.push_back(thread(run_writer, gtfs, fls[t % cfg.files], t / cfg.files, cfg.size, cfg.writes_per_sync, commits, &results[t]));
+    }
+    for (thread& t : threads) {
+        t.join();
+    }
+    double seconds = (now_ns() - start) / 1e9;
+
+    writer_result_t *total = (writer_result_t*)calloc(1, sizeof(writer_result_t));
+    for (writer_result_t& result : results) {
+        merge_writer(total, &result);
+    }
+    report_writers(cfg, total, seconds, (int64_t)cfg.threads * commits * cfg.writes_per_sync * cfg.size);
+    free(total);
+
+    gtfs_disable_checkpointer(gtfs);
+    remove_files(gtfs, fls);
+}
+
+// Rewrites a record of size bytes with one byte changed each time and syncs it, with
+// delta encoded records or full images. bytes is what went to the log here.
+void bench_rewrite(int size, bool delta) {
+    gtfs_t *gtfs = gtfs_init(directory, 0);
+    gtfs_enable_checkpointer(gtfs, 16 << 20, 0);
+    if (delta) {
+        gtfs_enable_delta_records(gtfs);
+    }
+    vector<file_t*> fls = { gtfs_open_file(gtfs, bench_file(0), size) };
+    vector<char> buf(size, 'r');
+    int commits = commit_count(size, 1);
+    histogram_t hist;
+    memset(&hist, 0, sizeof(hist));
+    int64_t errors = 0;
+    gtfs_stats_t before, after;
+    gtfs_get_file_stats(fls[0], &before);
+    uint64_t start = now_ns();
+    for (int c = 0; c < commits; c++) {
+        buf[(c * 977) % size]++;
+        uint64_t op_start = now_ns();
+        write_t *write_id = gtfs_write_file(gtfs, fls[0], 0, size, buf.data());
+        errors += gtfs_sync_write_file(write_id) != size;
+        hist_record(&hist, now_ns() - op_start);
+        gtfs_release_write(write_id);
+    }
+    double seconds = (now_ns() - start) / 1e9;
+    gtfs_get_file_stats(fls[0], &after);
+    report({ delta ? "rewrite_delta" : "rewrite_full", size, 1, 1, 1, 1 }, &hist, seconds, after.bytes_logged - before.bytes_logged, errors);
+
+    gtfs_disable_delta_records(gtfs);
+    gtfs_disable_checkpointer(gtfs);
+    remove_files(gtfs, fls);
+}
+
+// Write and sync from procs forked processes, each on a file of its own
+void bench_processes(const config_t& cfg) {
+    int commits = commit_count(cfg.size, cfg.writes_per_sync);
+    vector<int> pids;
+    vector<int> pipes;
+    uint64_t start = now_ns();
+    for (int p = 0; p < cfg.procs; p++) {
+        int fds[2];
+        if (pipe(fds) != 0) {
+            perror("pipe");
+            exit(-1);
+        }
+        int pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            exit(-1);
+        }
+        if (pid == 0) {
+            close(fds[0]);
+            gtfs_t *gtfs = gtfs_init(directory, 0);
+            gtfs_enable_checkpointer(gtfs, 16 << 20, 0);
+            file_t *fl = gtfs_open_file(gtfs, bench_file(p), cfg.writes_per_sync * cfg.size);
+            writer_result_t *result = (writer_result_t*)calloc(1, sizeof(writer_result_t));
+            if (fl) {
+                run_writer(gtfs, fl, 0, cfg.size, cfg.writes_per_sync, commits, result);
+            } else {
+                result->errors++;
+            }
+            gtfs_disable_checkpointer(gtfs);
+            gtfs_close_file(gtfs, fl);
+            write(fds[1], result, sizeof(writer_result_t));
+            _exit(0);
+        }
+        close(fds[1]);
+        pids.push_back(pid);
+        pipes.push_back(fds[0]);
+    }
+
+    writer_result_t *total = (writer_result_t*)calloc(1, sizeof(writer_result_t));
+    writer_result_t *result = (writer_result_t*)malloc(sizeof(writer_result_t));
+    for (int p = 0; p < cfg.procs; p++) {
+        char *pos = (char*)result;
+        size_t left = sizeof(writer_result_t);
+        ssize_t got;
+        while (left > 0 && (got = read(pipes[p], pos, left)) > 0) {
+            pos += got;
+            left -= got;
+        }
+        if (left == 0) {
+            merge_writer(total, result);
+        } else {
+            total->errors++;
+        }
+        close(pipes[p]);
+        waitpid(pids[p], NULL, 0);
+    }
+    double seconds = (now_ns() - start) / 1e9;
+    report_writers(cfg, total, seconds, (int64_t)cfg.procs * commits * cfg.writes_per_sync * cfg.size);
+    free(result);
+    free(total);
+
+    // The children closed the files, remove them from here
+    gtfs_t *gtfs = gtfs_init(directory, 0);
+    vector<file_t*> fls;
+    for (int p = 0; p < cfg.procs; p++) {
+        fls.push_back(gtfs_open_file(gtfs, bench_file(p), cfg.writes_per_sync * cfg.size));
+    }
+    remove_files(gtfs, fls);
+}
+
+void bench_open_close() {
+    int iterations = quick ? 200 : 2000;
+    gtfs_t *gtfs = gtfs_init(directory, 0);
+    histogram_t open_hist, close_hist;
+    memset(&open_hist, 0, sizeof(open_hist));
+    memset(&close_hist, 0, sizeof(close_hist));
+    double open_seconds = 0, close_seconds = 0;
+    int64_t errors = 0;
+    for (int i = 0; i < iterations; i++) {
+        uint64_t start = now_ns();
+        file_t *fl = gtfs_open_file(gtfs, bench_file(i % 16), 4096);
+        uint64_t opened = now_ns();
+        errors += fl == NULL || gtfs_close_file(gtfs, fl) != 0;
+        uint64_t closed = now_ns();
+        hist_record(&open_hist, opened - start);
+        hist_record(&close_hist, closed - opened);
+        open_seconds += (opened - start) / 1e9;
+        close_seconds += (closed - opened) / 1e9;
+    }
+    report({ "open", 4096, 0, 16, 1, 1 }, &open_hist, open_seconds, 0, errors);
+    report({ "close", 4096, 0, 16, 1, 1 }, &close_hist, close_seconds, 0, errors);
+
+    vector<file_t*> fls;
+    for (int f = 0; f < 16; f++) {
+        fls.push_back(gtfs_open_file(gtfs, bench_file(f), 4096));
+    }
+    remove_files(gtfs, fls);
+}
+
+void bench_read(int size) {
+    int iterations = quick ? 2000 : 100000;
+    gtfs_t *gtfs = gtfs_init(directory, 0);
+    vector<file_t*> fls = { gtfs_open_file(gtfs, bench_file(0), 64 * size) };
+    vector<char> buf(size);
+    histogram_t hist;
+    memset(&hist, 0, sizeof(hist));
+    int64_t errors = 0;
+    uint64_t start = now_ns();
+    for (int i = 0; i < iterations; i++) {
+        uint64_t before = now_ns();
+        errors += gtfs_read_file_into(gtfs, fls[0], (i % 64) * size, size, buf.data()) != size;
+        hist_record(&hist, now_ns() - before);
+    }
+    double seconds = (now_ns() - start) / 1e9;
+    report({ "read", size, 0, 1, 1, 1 }, &hist, seconds, (int64_t)iterations * size, errors);
+    remove_files(gtfs, fls);
+}
+
+void bench_abort(int size) {
+    int iterations = quick ? 2000 : 50000;
+    gtfs_t *gtfs = gtfs_init(directory, 0);
+    vector<file_t*> fls = { gtfs_open_file(gtfs, bench_file(0), 64 * size) };
+    vector<char> buf(size, 'x');
+    histogram_t hist;
+    memset(&hist, 0, sizeof(hist));
+    int64_t errors = 0;
+    uint64_t start = now_ns();
+    for (int i = 0; i < iterations; i++) {
+        uint64_t before = now_ns();
+        write_t *write_id = gtfs_write_file(gtfs, fls[0], (i % 64) * size, size, buf.data());
+        errors += gtfs_abort_write_file(write_id) != 0;
+        hist_record(&hist, now_ns() - before);
+        gtfs_release_write(write_id);
+    }
+    double seconds = (now_ns() - start) / 1e9;
+    report({ "write_abort", size, 1, 1, 1, 1 }, &hist, seconds, (int64_t)iterations * size, errors);
+    remove_files(gtfs, fls);
+}
+
+// Fills the logs of the files with records of size bytes, records in total.
+// Returns the number of failed syncs.
+int64_t fill_logs(gtfs_t *gtfs, vector<file_t*>& fls, int size, int records) {
+    vector<char> buf(size, 'c');
+    int64_t errors = 0;
+    for (int i = 0; i < records; i++) {
+        file_t *fl = fls[i % fls.size()];
+        write_t *write_id = gtfs_write_file(gtfs, fl, (i / fls.size() % 64) * size, size, buf.data());
+        errors += gtfs_sync_write_file(write_id) != size;
+        gtfs_release_write(write_id);
+    }
+    return errors;
+}
+
+// gtfs_clean of full logs, and gtfs_clean_n_bytes in steps of a quarter of a log
+void bench_clean(int files) {
+    int size = 4096;
+    int records = quick ? 256 : 4096;
+    int rounds = quick ? 3 : 10;
+    gtfs_t *gtfs = gtfs_init(directory, 0);
+    vector<file_t*> fls;
+    for (int f = 0; f < files; f++) {
+        fls.push_back(gtfs_open_file(gtfs, bench_file(f), 64 * size));
+    }
+    histogram_t clean_hist, clean_n_hist;
+    memset(&clean_hist, 0, sizeof(clean_hist));
+    memset(&clean_n_hist, 0, sizeof(clean_n_hist));
+    double clean_seconds = 0, clean_n_seconds = 0;
+    int64_t errors = 0;
+    for (int r = 0; r < rounds; r++) {
+        errors += fill_logs(gtfs, fls, size, records);
+        uint64_t start = now_ns();
+        errors += gtfs_clean(gtfs) != 0;
+        uint64_t end = now_ns();
+        hist_record(&clean_hist, end - start);
+        clean_seconds += (end - start) / 1e9;
+
+        errors += fill_logs(gtfs, fls, size, records);
+        int step = records * size / 4;
+        while (true) {
+            start = now_ns();
+            int cleaned = gtfs_clean_n_bytes(gtfs, step);
+            end = now_ns();
+            if (cleaned <= 0) {
+                errors += cleaned < 0;
+                break;
+            }
+            hist_record(&clean_n_hist, end - start);
+            clean_n_seconds += (end - start) / 1e9;
+        }
+    }
+    report({ "clean", size, 1, files, 1, 1 }, &clean_hist, clean_seconds, (int64_t)rounds * records * size, errors);
+    report({ "clean_n_bytes", size, 1, files, 1, 1 }, &clean_n_hist, clean_n_seconds, (int64_t)rounds * records * size, errors);
+    remove_files(gtfs, fls);
+}
+
+// gtfs_init plus opening the files after a process crashed with records in the logs
+void bench_recovery(int files, int records) {
+    int size = 4096;
+    int rounds = quick ? 2 : 5;
+    histogram_t hist;
+    memset(&hist, 0, sizeof(hist));
+    double seconds = 0;
+    int64_t errors = 0;
+    gtfs_t *gtfs = NULL;
+    vector<file_t*> fls;
+    for (int r = 0; r < rounds; r++) {
+        int pid = fork();
+        if (pid < 0) {
+            perror("fork");
+            exit(-1);
+        }
+        if (pid == 0) {
+            gtfs_t *gtfs = gtfs_init(directory, 0);
+            vector<file_t*> fls;
+            for (int f = 0; f < files; f++) {
+                fls.push_back(gtfs_open_file(gtfs, bench_file(f), 64 * size));
+            }
+            int64_t failed = fill_logs(gtfs, fls, size, records);
+            _exit(failed == 0 ? 0 : 1); // Crash, everything is left in the logs
+        }
+        int status;
+        waitpid(pid, &status, 0);
+        errors += !WIFEXITED(status) || WEXITSTATUS(status) != 0;
+
+        uint64_t start = now_ns();
+        gtfs = gtfs_init(directory, 0);
+        for (int f = 0; f < files; f++) {
+            fls.push_back(gtfs_open_file(gtfs, bench_file(f), 64 * size));
+            errors += fls.back() == NULL;
+        }
+        uint64_t end = now_ns();
+        hist_record(&hist, end - start);
+        seconds += (end - start) / 1e9;
+        for (file_t *fl : fls) {
+            gtfs_close_file(gtfs, fl);
+        }
+        fls.clear();
+    }
+    report({ "recovery", size, records, files, 1, 1 }, &hist, seconds, (int64_t)rounds * records * size, errors);
+    for (int f = 0; f < files; f++) {
+        fls.push_back(gtfs_open_file(gtfs, bench_file(f), 64 * size));
+    }
+    remove_files(gtfs, fls);
+}
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "--quick") {
+            quick = true;
+        } else if (arg == "--csv") {
+            csv = true;
+        } else if (arg == "--dir" && i + 1 < argc) {
+            directory = argv[++i];
+        } else if (arg == "--only" && i + 1 < argc) {
+            only = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [--dir path] [--quick] [--csv] [--only open|read|abort|sync|rewrite|files|threads|procs|clean|recovery]\n", argv[0]);
+            return 1;
+        }
+    }
+    mkdir(directory.c_str(), 0755);
+
+    if (selected("open")) {
+        bench_open_close();
+    }
+    if (selected("read")) {
+        for (int size : { 64, 512, 4096, 65536 }) {
+            bench_read(size);
+        }
+    }
+    if (selected("abort")) {
+        for (int size : { 64, 4096 }) {
+            bench_abort(size);
+        }
+    }
+    if (selected("sync")) {
+        for (int size : { 64, 512, 4096, 65536 }) {
+            for (int writes_per_sync : { 1, 8, 64 }) {
+                bench_write_sync({ "sync", size, writes_per_sync, 1, 1, 1 });
+            }
+        }
+    }
+    if (selected("rewrite")) {
+        for (int size : { 4096, 65536 }) {
+            bench_rewrite(size, false);
+            bench_rewrite(size, true);
+        }
+    }
+    if (selected("files")) {
+        for (int files : { 1, 4, 16 }) {
+            bench_write_sync({ "files", 512, 1, files, files, 1 });
+        }
+    }
+    if (selected("threads")) {
+        for (int threads : { 1, 2, 4, 8 }) {
+            bench_write_sync({ "threads", 512, 1, 1, threads, 1 });
+        }
+    }
+    if (selected("procs")) {
+        for (int procs : { 1, 2, 4 }) {
+            bench_processes({ "procs", 512, 1, procs, 1, procs });
+        }
+    }
+    if (selected("clean")) {
+        for (int files : { 1, 4 }) {
+            bench_clean(files);
+        }
+    }
+    if (selected("recovery")) {
+        for (int records : { 1000, 10000 }) {
+            bench_recovery(4, quick ? records / 10 : records);
+        }
+    }
+    return 0;
+}
@@ -3,11 +3,11 @@
 DO_VERBOSE=$1
 
 make clean
-make
+make TRACE_LEVEL=3 # Keeps the verbose text
 
 cd tests
 make clean
-make
+make TRACE_LEVEL=3 # Passed on to the library the tests build
 
 if [  $# -le 0 ] 
 then 
@@ -0,0 +1,216 @@
+#include "crc32c.hpp"
+
+#include <mutex>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+using namespace std;
+
+// CRC32C polynomial, bit reversed
+#define POLY 0x82f63b78
+
+// Lane lengths for the interleaved hardware path. Each must be a power of two.
+#define LONG_LANE 8192
+#define SHORT_LANE 256
+
+static uint32_t crc32c_table[8][256]; // Slicing-by-8 tables for the software version
+static uint32_t crc32c_long[4][256];  // Shifts a CRC over LONG_LANE zero bytes
+static uint32_t crc32c_short[4][256]; // Shifts a CRC over SHORT_LANE zero bytes
+static once_flag crc32c_once;
+static bool crc32c_has_sse42;
+
+// Helper function to multiply a 32x32 GF(2) matrix by a vector
+static uint32_t gf2_matrix_times(const uint32_t *mat, uint32_t vec) {
+    uint32_t sum = 0;
+    while (vec) {
+        if (vec & 1) {
+            sum ^= *mat;
+        }
+        vec >>= 1;
+        mat++;
+    }
+    return sum;
+}
+
+// Helper function to square a GF(2) matrix
+static void gf2_matrix_square(uint32_t *square, const uint32_t *mat) {
+    for (int n = 0; n < 32; n++) {
+        square[n] = gf2_matrix_times(mat, mat[n]);
+    }
+}
+
+// Helper function to build the operator that feeds len zero bytes (a power of two) through the CRC
+static void crc32c_zeros_op(uint32_t *even, size_t len) {
+    uint32_t odd[32];
+
+    // Operator for one zero bit
+    odd[0] = POLY;
+    uint32_t row = 1;
+    for (int n = 1; n < 32; n++) {
+        odd[n] = row;
+        row <<= 1;
+    }
+
+    gf2_matrix_square(even, odd); // Two zero bits
+    gf2_matrix_square(odd, even); // Four zero bits
+
+    // Keep squaring until the operator covers len bytes
+    do {
+        gf2_matrix_square(even, odd);
+        len >>= 1;
+        if (len == 0) {
+            return;
+        }
+        gf2_matrix_square(odd, even);
+        len >>= 1;
+    } while (len);
+
+    for (int n = 0; n < 32; n++) {
+        even[n] = odd[n];
+    }
+}
+
+// Helper function to turn a zeros operator into byte-wise lookup tables
+static void crc32c_zeros(uint32_t zeros[][256], size_t len) {
+    uint32_t op[32];
+    crc32c_zeros_op(op, len);
+    for (uint32_t n = 0; n < 256; n++) {
+        zeros[0][n] = gf2_matrix_times(op, n);
+        zeros[1][n] = gf2_matrix_times(op, n << 8);
+        zeros[2][n] = gf2_matrix_times(op, n << 16);
+        zeros[3][n] = gf2_matrix_times(op, n << 24);
+    }
+}
+
+// Helper function to apply a zeros operator to a CRC
+static inline uint32_t crc32c_shift(uint32_t zeros[][256], uint32_t crc) {
+    return zeros[0][crc & 0xff] ^ zeros[1][(crc >> 8) & 0xff] ^ zeros[2][(crc >> 16) & 0xff] ^ zeros[3][crc >> 24];
+}
+
+static void crc32c_init() {
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = n;
+        for (int k = 0; k < 8; k++) {
+            crc = (crc & 1) ? (crc >> 1) ^ POLY : crc >> 1;
+        }
+        crc32c_table[0][n] = crc;
+    }
+    for (uint32_t n = 0; n < 256; n++) {
+        uint32_t crc = crc32c_table[0][n];
+        for (int k = 1; k < 8; k++) {
+            crc = crc32c_table[0][crc & 0xff] ^ (crc >> 8);
+            crc32c_table[k][n] = crc;
+        }
+    }
+
+    crc32c_zeros(crc32c_long, LONG_LANE);
+    crc32c_zeros(crc32c_short, SHORT_LANE);
+
+#if defined(__x86_64__)
+    crc32c_has_sse42 = __builtin_cpu_supports("sse4.2");
+#else
+    crc32c_has_sse42 = false;
+#endif
+}
+
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len) {
+    call_once(crc32c_once, crc32c_init);
+
+    const unsigned char *next = (const unsigned char *)buf;
+    uint64_t crc0 = crc ^ 0xffffffff;
+
+    while (len && ((uintptr_t)next & 7) != 0) {
+        crc0 = crc32c_table[0][(crc0 ^ *next++) & 0xff] ^ (crc0 >> 8);
+        len--;
+    }
+    // Slicing-by-8: eight table lookups per 64-bit word
+    while (len >= 8) {
+        crc0 ^= *(const uint64_t *)next;
+        crc0 = crc32c_table[7][crc0 & 0xff] ^
+               crc32c_table[6][(crc0 >> 8) & 0xff] ^
+               crc32c_table[5][(crc0 >> 16) & 0xff] ^
+               crc32c_table[4][(crc0 >> 24) & 0xff] ^
+               crc32c_table[3][(crc0 >> 32) & 0xff] ^
+               crc32c_table[2][(crc0 >> 40) & 0xff] ^
+               crc32c_table[1][(crc0 >> 48) & 0xff] ^
+               crc32c_table[0][crc0 >> 56];
+        next += 8;
+        len -= 8;
+    }
+    while (len) {
+        crc0 = crc32c_table[0][(crc0 ^ *next++) & 0xff] ^ (crc0 >> 8);
+        len--;
+    }
+    return (uint32_t)crc0 ^ 0xffffffff;
+}
+
+#if defined(__x86_64__)
+// Hardware version. The crc32 instruction has a latency of three cycles but a
+// throughput of one per cycle, so large buffers are split into three lanes
+// that are checksummed in parallel and then merged with the zeros tables.
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw(uint32_t crc, const void *buf, size_t len) {
+    const unsigned char *next = (const unsigned char *)buf;
+    uint64_t crc0 = crc ^ 0xffffffff;
+
+    while (len && ((uintptr_t)next & 7) != 0) {
+        crc0 = _mm_crc32_u8((uint32_t)crc0, *next++);
+        len--;
+    }
+
+    while (len >= LONG_LANE * 3) {
+        uint64_t crc1 = 0;
+        uint64_t crc2 = 0;
+        const unsigned char *end = next + LONG_LANE;
+        do {
+            crc0 = _mm_crc32_u64(crc0, *(const uint64_t *)next);
+            crc1 = _mm_crc32_u64(crc1, *(const uint64_t *)(next + LONG_LANE));
+            crc2 = _mm_crc32_u64(crc2, *(const uint64_t *)(next + LONG_LANE * 2));
+            next += 8;
+        } while (next < end);
+        crc0 = crc32c_shift(crc32c_long, (uint32_t)crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_long, (uint32_t)crc0) ^ crc2;
+        next += LONG_LANE * 2;
+        len -= LONG_LANE * 3;
+    }
+
+    while (len >= SHORT_LANE * 3) {
+        uint64_t crc1 = 0;
+        uint64_t crc2 = 0;
+        const unsigned char *end = next + SHORT_LANE;
+        do {
+            crc0 = _mm_crc32_u64(crc0, *(const uint64_t *)next);
+            crc1 = _mm_crc32_u64(crc1, *(const uint64_t *)(next + SHORT_LANE));
+            crc2 = _mm_crc32_u64(crc2, *(const uint64_t *)(next + SHORT_LANE * 2));
+            next += 8;
+        } while (next < end);
+        crc0 = crc32c_shift(crc32c_short, (uint32_t)crc0) ^ crc1;
+        crc0 = crc32c_shift(crc32c_short, (uint32_t)crc0) ^ crc2;
+        next += SHORT_LANE * 2;
+        len -= SHORT_LANE * 3;
+    }
+
+    while (len >= 8) {
+        crc0 = _mm_crc32_u64(crc0, *(const uint64_t *)next);
+        next += 8;
+        len -= 8;
+    }
+    while (len) {
+        crc0 = _mm_crc32_u8((uint32_t)crc0, *next++);
+        len--;
+    }
+    return (uint32_t)crc0 ^ 0xffffffff;
+}
+#endif
+
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+    call_once(crc32c_once, crc32c_init);
+#if defined(__x86_64__)
+    if (crc32c_has_sse42) {
+        return crc32c_hw(crc, buf, len);
+    }
+#endif
+    return crc32c_sw(crc, buf, len);
+}
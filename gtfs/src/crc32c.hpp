@@ -0,0 +1,17 @@
+#ifndef GTFS_CRC32C
+#define GTFS_CRC32C
+
+#include <cstddef>
+#include <cstdint>
+
+// CRC32C (Castagnoli) used to seal log records.
+// Pass 0 to start a new checksum, or a previous result to continue it over
+// more data: crc32c(crc32c(0, a, n), b, m) == crc32c(0, a || b, n + m).
+// Uses the SSE4.2 crc32 instruction when the CPU has it, a table driven
+// software version otherwise.
+uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+
+// Software version, kept separate so the hardware path can be checked against it
+uint32_t crc32c_sw(uint32_t crc, const void *buf, size_t len);
+
+#endif
@@ -0,0 +1,160 @@
+#include "delta.hpp"
+
+#include <cstring>
+#include <mutex>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+// A scan moves with two primitives: the first index from pos on where the buffers
+// differ, and the first where they are equal again. Both return len if there is none.
+typedef size_t (*delta_scan_fn)(const uint8_t *a, const uint8_t *b, size_t pos, size_t len);
+
+static once_flag delta_once;
+static bool delta_has_avx2;
+
+static void delta_init() {
+#if defined(__x86_64__)
+    delta_has_avx2 = __builtin_cpu_supports("avx2");
+#else
+    delta_has_avx2 = false;
+#endif
+}
+
+static size_t next_diff_sw(const uint8_t *a, const uint8_t *b, size_t pos, size_t len) {
+    while (pos + 8 <= len) {
+        uint64_t x, y;
+        memcpy(&x, a + pos, 8);
+        memcpy(&y, b + pos, 8);
+        if (x != y) {
+            return pos + __builtin_ctzll(x ^ y) / 8; // Little endian, the lowest byte comes first
+        }
+        pos += 8;
+    }
+    while (pos < len && a[pos] == b[pos]) {
+        pos++;
+    }
+    return pos;
+}
+
+static size_t next_same_sw(const uint8_t *a, const uint8_t *b, size_t pos, size_t len) {
+    while (pos + 8 <= len) {
+        uint64_t x, y;
+        memcpy(&x, a + pos, 8);
+        memcpy(&y, b + pos, 8);
+        // The lowest zero byte of x ^ y sets the lowest flag, later flags may be false positives
+        uint64_t d = x ^ y;
+        uint64_t zero = (d - 0x0101010101010101ULL) & ~d & 0x8080808080808080ULL;
+        if (zero) {
+            return pos + __builtin_ctzll(zero) / 8;
+        }
+        pos += 8;
+    }
+    while (pos < len && a[pos] != b[pos]) {
+        pos++;
+    }
+    return pos;
+}
+
+#if defined(__x86_64__)
+// SSE2 is part of x86-64, no check needed
+static size_t next_diff_sse2(const uint8_t *a, const uint8_t *b, size_t pos, size_t len) {
+    while (pos + 16 <= len) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + pos));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + pos));
+        unsigned diff = ~(unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) & 0xffff;
+        if (diff) {
+            return pos + __builtin_ctz(diff);
+        }
+        pos += 16;
+    }
+    return next_diff_sw(a, b, pos, len);
+}
+
+static size_t next_same_sse2(const uint8_t *a, const uint8_t *b, size_t pos, size_t len) {
+    while (pos + 16 <= len) {
+        __m128i x = _mm_loadu_si128((const __m128i *)(a + pos));
+        __m128i y = _mm_loadu_si128((const __m128i *)(b + pos));
+        unsigned same = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(x, y));
+        if (same) {
+            return pos + __builtin_ctz(same);
+        }
+        pos += 16;
+    }
+    return next_same_sw(a, b, pos, len);
+}
+
+__attribute__((target("avx2")))
+static size_t next_diff_avx2(const uint8_t *a, const uint8_t *b, size_t pos, size_t len) {
+    while (pos + 32 <= len) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + pos));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + pos));
+        unsigned diff = ~(unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+        if (diff) {
+            return pos + __builtin_ctz(diff);
+        }
+        pos += 32;
+    }
+    return next_diff_sse2(a, b, pos, len);
+}
+
+__attribute__((target("avx2")))
+static size_t next_same_avx2(const uint8_t *a, const uint8_t *b, size_t pos, size_t len) {
+    while (pos + 32 <= len) {
+        __m256i x = _mm256_loadu_si256((const __m256i *)(a + pos));
+        __m256i y = _mm256_loadu_si256((const __m256i *)(b + pos));
+        unsigned same = (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(x, y));
+        if (same) {
+            return pos + __builtin_ctz(same);
+        }
+        pos += 32;
+    }
+    return next_same_sse2(a, b, pos, len);
+}
+#endif
+
+// Helper function to collect the runs with the given primitives
+static bool delta_scan(const uint8_t *a, const uint8_t *b, size_t len, size_t overhead, size_t limit, vector<delta_run_t>& runs,
+                       delta_scan_fn next_diff, delta_scan_fn next_same) {
+    size_t cost = 0;
+    size_t pos = next_diff(a, b, 0, len);
+    while (pos < len) {
+        size_t start = pos;
+        size_t end = next_same(a, b, pos, len);
+        // Take in the next run as well while the equal bytes before it cost less than a run
+        while (end < len) {
+            size_t window = min(len, end + overhead);
+            size_t next = next_diff(a, b, end, window);
+            if (next == window) {
+                break;
+            }
+            end = next_same(a, b, next, len);
+        }
+        cost += overhead + (end - start);
+        if (cost >= limit) {
+            return false;
+        }
+        runs.push_back(delta_run_t{ start, end - start });
+        pos = next_diff(a, b, end, len);
+    }
+    return true;
+}
+
+bool delta_runs_sw(const void *a, const void *b, size_t len, size_t overhead, size_t limit, vector<delta_run_t>& runs) {
+    return delta_scan((const uint8_t *)a, (const uint8_t *)b, len, overhead, limit, runs, next_diff_sw, next_same_sw);
+}
+
+bool delta_runs(const void *a, const void *b, size_t len, size_t overhead, size_t limit, vector<delta_run_t>& runs) {
+    call_once(delta_once, delta_init);
+#if defined(__x86_64__)
+    if (delta_has_avx2) {
+        return delta_scan((const uint8_t *)a, (const uint8_t *)b, len, overhead, limit, runs, next_diff_avx2, next_same_avx2);
+    }
+    return delta_scan((const uint8_t *)a, (const uint8_t *)b, len, overhead, limit, runs, next_diff_sse2, next_same_sse2);
+#else
+    return delta_runs_sw(a, b, len, overhead, limit, runs);
+#endif
+}
@@ -0,0 +1,25 @@
+#ifndef GTFS_DELTA
+#define GTFS_DELTA
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Byte-wise diff of two buffers of the same length, used to log only the bytes a write
+// changed. Compares 32 bytes at a time with AVX2 when the CPU has it, 16 with SSE2
+// otherwise, and falls back to 64-bit words off x86-64.
+typedef struct delta_run {
+    size_t offset;
+    size_t length;
+} delta_run_t;
+
+// Appends the runs of bytes where a and b differ to runs, in order. Every run costs
+// overhead bytes on top of its length to encode, so runs separated by fewer equal bytes
+// than that are merged into one. Returns false as soon as the encoded runs would take
+// limit bytes or more, runs holds some of them then.
+bool delta_runs(const void *a, const void *b, size_t len, size_t overhead, size_t limit, std::vector<delta_run_t>& runs);
+
+// Word at a time version, kept separate so the vector paths can be checked against it
+bool delta_runs_sw(const void *a, const void *b, size_t len, size_t overhead, size_t limit, std::vector<delta_run_t>& runs);
+
+#endif
@@ -1,8 +1,17 @@
 #include "gtfs.hpp"
+#include "gtfs_testing.hpp"
 
+// Text messages are only compiled in at GTFS_TRACE_TEXT, see trace.hpp. Below that level
+// the message is still type checked but never formatted.
+#if GTFS_TRACE_LEVEL >= GTFS_TRACE_TEXT
 #define VERBOSE_PRINT(verbose, str...) do { \
-    if (verbose) cout << "VERBOSE: "<< __FILE__ << ":" << __LINE__ << " " << __func__ << "(): " << str; \
+    if (__builtin_expect(!!(verbose), 0)) cout << "VERBOSE: "<< __FILE__ << ":" << __LINE__ << " " << __func__ << "(): " << str; \
 } while(0)
+#else
+#define VERBOSE_PRINT(verbose, str...) do { \
+    if (false) cout << str; \
+} while(0)
+#endif
 
 int do_verbose;
 
@@ -22,6 +31,80 @@ bool release_lock(int fd) {
     return true;
 }
 
+// Helper function to take (or with F_UNLCK drop) an OFD lock on a byte range of a file.
+// OFD locks belong to the open file description, so unlike flock they can cover ranges
+// and unlike classic fcntl locks they are not lost when another descriptor is closed.
+bool lock_range(int fd, short type, int64_t offset, int64_t length, bool wait) {
+    struct flock lock;
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = type;
+    lock.l_whence = SEEK_SET;
+    lock.l_start = offset;
+    lock.l_len = length;
+    int ret;
+    do {
+        ret = fcntl(fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &lock);
+    } while (ret != 0 && errno == EINTR);
+    return ret == 0;
+}
+
+// Helper function to become the writer of a data file
+bool acquire_writer_lock(int fd, bool wait) {
+    return lock_range(fd, F_WRLCK, GTFS_WRITER_LOCK_OFFSET, 1, wait);
+}
+
+bool release_writer_lock(int fd) {
+    return lock_range(fd, F_UNLCK, GTFS_WRITER_LOCK_OFFSET, 1, false);
+}
+
+// Helper function to give up the lock on [offset, offset + length) taken by hold_range.
+// OFD locks do not stack, bytes that another range still held by fl covers stay locked.
+void drop_range(file_t *fl, int64_t offset, int64_t length) {
+    if (length == 0) {
+        return;
+    }
+    lock_guard<mutex> lock(fl->range_mtx);
+    auto it = lower_bound(fl->ranges.begin(), fl->ranges.end(), make_pair(offset, length));
+    if (it != fl->ranges.end() && *it == make_pair(offset, length)) {
+        fl->ranges.erase(it);
+    }
+    int64_t start = offset;
+    int64_t end = offset + length;
+    for (const pair<int64_t, int64_t>& range : fl->ranges) {
+        if (range.first >= end || start >= end) {
+            break;
+        }
+        if (range.first + range.second <= start) {
+            continue;
+        }
+        if (range.first > start) {
+            lock_range(fl->fd, F_UNLCK, start, range.first - start, false);
+        }
+        start = max(start, range.first + range.second);
+    }
+    if (start < end) {
+        lock_range(fl->fd, F_UNLCK, start, end - start, false);
+    }
+}
+
+// Helper function to lock [offset, offset + length) of the data file, shared for a read
+// open and exclusive for a write open, waiting for other processes that hold it. The range
+// is noted first so that a concurrent drop_range keeps the bytes locked.
+bool hold_range(file_t *fl, int64_t offset, int64_t length) {
+    if (length == 0) {
+        return true;
+    }
+    {
+        lock_guard<mutex> lock(fl->range_mtx);
+        fl->ranges.insert(upper_bound(fl->ranges.begin(), fl->ranges.end(), make_pair(offset, length)), make_pair(offset, length));
+    }
+    if (lock_range(fl->fd, fl->mode == GTFS_OPEN_READ ? F_RDLCK : F_WRLCK, offset, length, true)) {
+        return true;
+    }
+    drop_range(fl, offset, length);
+    return false;
+}
+
 // Helper function to create a directory if it doesn't exist
 bool create_directory(const string& path) {
     struct stat st;
@@ -42,566 +125,5729 @@ string get_log_path(const string& dirname, const string& filename) {
     return dirname + "/.logs/" + filename + ".log";
 }
 
+// Helper function to take the registry lock. A process that died holding it leaves
+// nothing half done that matters (entries are published by their used flag last).
+void registry_lock(gtfs_registry_t *registry) {
+    if (pthread_mutex_lock(&registry->lock) == EOWNERDEAD) {
+        pthread_mutex_consistent(&registry->lock);
+    }
+}
 
-// Helper function to apply logs 
-/*
-bool apply_log(string directory, string filename) {
-    string log_path = get_log_path(directory, filename);
-    string file_path = directory + "/" + filename;
+void registry_unlock(gtfs_registry_t *registry) {
+    pthread_mutex_unlock(&registry->lock);
+}
 
-    FILE* log_file = fopen(log_path.c_str(), "rb");
-    FILE* fp = fopen(file_path.c_str(), "rb+");
-    if (!log_file) return false;
-    if (!fp) return false;
+// Helper function to read the id of the current boot into boot_id (GTFS_BOOT_ID_LEN + 1
+// bytes). It stays empty where the kernel does not have one.
+void read_boot_id(char *boot_id) {
+    memset(boot_id, 0, GTFS_BOOT_ID_LEN + 1);
+    int fd = open("/proc/sys/kernel/random/boot_id", O_RDONLY);
+    if (fd == -1) {
+        return;
+    }
+    if (read(fd, boot_id, GTFS_BOOT_ID_LEN) != GTFS_BOOT_ID_LEN) {
+        memset(boot_id, 0, GTFS_BOOT_ID_LEN + 1);
+    }
+    close(fd);
+}
 
-    // Opens log file, and then read commits from log and write them to the file
-    commit_t commit_meta;
-    while (fread(&commit_meta, sizeof(commit_t), 1, log_file) == 1) {
-        if (commit_meta.commited) {
-            // Apply the commit
-            // This is wrong, this should be writing to the file, not the in memory copy?
-            //memcpy(fl->data + commit_meta.offset, fl->data, commit_meta.length);
+// Helper function to map the shared registry of a directory, creating it on first use.
+// *created tells the caller that nothing is known yet about the files of the directory.
+// A registry from an earlier boot is created again: whatever of it reached the disk before
+// the machine went down need not be current, and its lock may be held by a thread that
+// no longer exists.
+gtfs_registry_t* attach_registry(const string& directory, bool *created) {
+    string registry_path = directory + "/.logs/.registry";
+    int fd = open(registry_path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        VERBOSE_PRINT(do_verbose, "Failed to open registry " << registry_path << "\n");
+        return NULL;
+    }
+    // Serializes creation between processes attaching at the same time
+    if (!acquire_lock(fd)) {
+        close(fd);
+        return NULL;
+    }
+
+    struct stat st;
+    *created = false;
+    gtfs_registry_t *registry = NULL;
+    if (fstat(fd, &st) == 0 && (st.st_size == (off_t)sizeof(gtfs_registry_t) ||
+                                (ftruncate(fd, 0) == 0 && ftruncate(fd, sizeof(gtfs_registry_t)) == 0))) {
+        registry = (gtfs_registry_t*)mmap(NULL, sizeof(gtfs_registry_t), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (registry == MAP_FAILED) {
+            registry = NULL;
+        }
+    }
+    char boot_id[GTFS_BOOT_ID_LEN + 1];
+    read_boot_id(boot_id);
+    if (registry && (registry->magic != GTFS_REGISTRY_MAGIC || registry->version != GTFS_REGISTRY_VERSION ||
+                     memcmp(registry->boot_id, boot_id, sizeof(boot_id)) != 0)) {
+        memset((void*)registry, 0, sizeof(gtfs_registry_t));
+        memcpy(registry->boot_id, boot_id, sizeof(boot_id));
+        pthread_mutexattr_t attr;
+        pthread_mutexattr_init(&attr);
+        pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+        pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+        pthread_mutex_init(&registry->lock, &attr);
+        pthread_mutexattr_destroy(&attr);
+        registry->version = GTFS_REGISTRY_VERSION;
+        registry->txn_logs = 1; // Unknown, the first gtfs_init counts them
+        registry->magic = GTFS_REGISTRY_MAGIC;
+        *created = true;
+    }
+    release_lock(fd);
+    close(fd); // The mapping stays
+    if (!registry) {
+        VERBOSE_PRINT(do_verbose, "Failed to map registry " << registry_path << "\n");
+    }
+    return registry;
+}
 
+// Helper function to find the registry entry of a file, claiming a free slot for it if
+// it has none yet (*created is set then). Returns NULL once the table is full.
+gtfs_registry_entry_t* registry_find(gtfs_registry_t *registry, const string& filename, bool *created) {
+    uint32_t slot = crc32c(0, filename.data(), filename.length()) % GTFS_REGISTRY_SLOTS;
+    gtfs_registry_entry_t *entry = NULL;
+    *created = false;
+    registry_lock(registry);
+    for (int probe = 0; probe < GTFS_REGISTRY_SLOTS; probe++) {
+        gtfs_registry_entry_t *candidate = &registry->entries[(slot + probe) % GTFS_REGISTRY_SLOTS];
+        if (!candidate->used) {
+            memset(candidate, 0, sizeof(gtfs_registry_entry_t));
+            memcpy(candidate->filename, filename.data(), filename.length());
+            __atomic_store_n(&candidate->used, 1, __ATOMIC_RELEASE); // Readers take the entry from here on
+            registry->files++;
+            entry = candidate;
+            *created = true;
+            break;
+        }
+        if (filename.compare(candidate->filename) == 0) {
+            entry = candidate;
+            break;
         }
-        // Skip the data
-        fseek(log_file, commit_meta.length, SEEK_CUR);
     }
+    registry_unlock(registry);
+    return entry;
+}
 
-    fclose(log_file);
-    return true;
+// Helper function to publish the log state of an open file in its registry entry
+void publish_log_state(file_t *fl) {
+    if (!fl->reg) {
+        return;
+    }
+    if (fl->gtfs->wal) {
+        fl->reg->log_head = 0;
+        fl->reg->log_tail = fl->wal_pending;
+    } else {
+        fl->reg->log_head = fl->log_meta.head;
+        fl->reg->log_tail = fl->log_tail;
+    }
+    fl->reg->head_seq = fl->log_meta.head_seq;
+    fl->reg->next_seq = fl->next_seq;
 }
-*/
 
-// Helper function to apply logs to a specific file
-bool apply_log(const string& directory, const string& filename) {
-    string log_path = get_log_path(directory, filename);
-    string file_path = directory + "/" + filename;
+// Statistics an event is counted in: those of the directory and those of the file,
+// either may be NULL
+typedef struct stats_ref {
+    gtfs_stats_t *dir;
+    gtfs_stats_t *file;
+} stats_ref_t;
 
-    // Open the log file in binary read mode
-    FILE* log_file = fopen(log_path.c_str(), "rb");
-    if (!log_file) {
-        VERBOSE_PRINT(do_verbose, "Log file " << log_path << " does not exist or cannot be opened.\n");
-        return false;
+// Helper function to get the shard of the directory statistics that the calling thread
+// bumps. Threads take the shards in turn, offset by the pid so that the first threads of
+// each process do not all land on the same one.
+gtfs_stats_t* stats_shard(gtfs_stats_shard_t *shards) {
+    static atomic<unsigned> next_shard(0);
+    thread_local unsigned shard = (next_shard.fetch_add(1, memory_order_relaxed) + getpid()) % GTFS_STATS_SHARDS;
+    return &shards[shard].stats;
+}
+
+stats_ref_t stats_of(file_t *fl) {
+    return stats_ref_t{ stats_shard(fl->gtfs->stats), fl->stats };
+}
+
+// Helper function to add n to a counter of the statistics
+void stat_add(stats_ref_t stats, uint64_t gtfs_stats_t::*counter, uint64_t n) {
+    for (gtfs_stats_t *target : { stats.dir, stats.file }) {
+        if (target) {
+            __atomic_fetch_add(&(target->*counter), n, __ATOMIC_RELAXED);
+        }
     }
+}
 
-    // Open the target file in binary read-write mode
-    FILE* fp = fopen(file_path.c_str(), "rb+");
-    if (!fp) {
-        VERBOSE_PRINT(do_verbose, "Target file " << file_path << " does not exist or cannot be opened.\n");
-        fclose(log_file);
-        return false;
+// Helper function to record the time since start in a latency histogram of the statistics
+void stat_latency(stats_ref_t stats, gtfs_histogram_t gtfs_stats_t::*histogram, chrono::steady_clock::time_point start) {
+    uint64_t ns = chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::now() - start).count();
+    int bucket = min(63 - __builtin_clzll(ns | 1), GTFS_STATS_BUCKETS - 1);
+    for (gtfs_stats_t *target : { stats.dir, stats.file }) {
+        if (!target) {
+            continue;
+        }
+        gtfs_histogram_t *hist = &(target->*histogram);
+        __atomic_fetch_add(&hist->count, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&hist->sum_ns, ns, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&hist->buckets[bucket], 1, __ATOMIC_RELAXED);
+        uint64_t seen = __atomic_load_n(&hist->max_ns, __ATOMIC_RELAXED);
+        while (seen < ns && !__atomic_compare_exchange_n(&hist->max_ns, &seen, ns, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        }
     }
+}
 
-    commit_t commit_meta;
-    // Each loop, read the meta data for one commit from the log file
-    while (fread(&commit_meta, sizeof(commit_t), 1, log_file) == 1) {
-        if (commit_meta.commited) {
-            // Allocate buffer to read the data associated with this commit
-            char* buffer = new char[commit_meta.length];
-
-            //Read from log after metadata is read
-            size_t bytes_read = fread(buffer, sizeof(char), commit_meta.length, log_file);
-
-            //Verify that the amount read is what we expect
-            if (bytes_read != static_cast<size_t>(commit_meta.length)) {
-                VERBOSE_PRINT(do_verbose, "Failed to read the expected amount of data from log " << log_path << ". Expected " << commit_meta.length << " bytes, got " << bytes_read << " bytes.\n");
-                VERBOSE_PRINT(do_verbose, "Data read: " << buffer << "(END)");
-                delete[] buffer;
-                fclose(log_file);
-                //remove(log_path.c_str()); // Remove corrupted logs (prevent future logs from being corrupted)
-                fclose(fp);
-                return false;
-            }
-            
-            // Seek to the specified offset in the target file
-            if (fseek(fp, commit_meta.offset, SEEK_SET) != 0) {
-                VERBOSE_PRINT(do_verbose, "Failed to seek to offset " << commit_meta.offset << " in file " << file_path << ".\n");
-                delete[] buffer;
-                fclose(log_file);
-                remove(log_path.c_str());
-                fclose(fp);
-                return false;
-            }
+// Helper function to flush the data of fd to disk, counted in stats
+bool flush_fd(int fd, stats_ref_t stats) {
+    stat_add(stats, &gtfs_stats_t::flushes, 1);
+    return fdatasync(fd) == 0;
+}
 
-            // Write the data from the log to the target file
-            size_t bytes_written = fwrite(buffer, sizeof(char), commit_meta.length, fp);
-            if (bytes_written != static_cast<size_t>(commit_meta.length)) {
-                VERBOSE_PRINT(do_verbose, "Failed to write data to file " << file_path << " at offset " << commit_meta.offset << ".\n");
-                delete[] buffer;
-                fclose(log_file);
-                fclose(fp);
-                return false;
-            }
+// Helper function to copy statistics that other threads and processes keep updating.
+// Every field is a 64 bit integer, each is read atomically on its own.
+void copy_stats(gtfs_stats_t *to, const gtfs_stats_t *from) {
+    static_assert(sizeof(gtfs_stats_t) % sizeof(uint64_t) == 0, "gtfs_stats_t must only hold 64 bit fields");
+    for (size_t i = 0; i < sizeof(gtfs_stats_t) / sizeof(uint64_t); i++) {
+        ((uint64_t*)to)[i] = __atomic_load_n((const uint64_t*)from + i, __ATOMIC_RELAXED);
+    }
+}
 
-            // Flush the changes to ensure data is written to disk
-            if (fflush(fp) != 0) {
-                VERBOSE_PRINT(do_verbose, "Failed to flush data to file " << file_path << " after writing.\n");
-                delete[] buffer;
-                fclose(log_file);
-                fclose(fp);
-                return false;
-            }
+// Helper function to sum the shards of the directory statistics, see copy_stats. Latency
+// maxima are the largest of the shards, everything else adds up.
+void sum_stats(gtfs_stats_t *to, const gtfs_stats_shard_t *shards) {
+    memset(to, 0, sizeof(gtfs_stats_t));
+    for (int i = 0; i < GTFS_STATS_SHARDS; i++) {
+        gtfs_stats_t shard;
+        copy_stats(&shard, &shards[i].stats);
+        for (gtfs_histogram_t gtfs_stats_t::*histogram : { &gtfs_stats_t::sync_latency, &gtfs_stats_t::clean_latency,
+                                                            &gtfs_stats_t::recovery_latency, &gtfs_stats_t::durable_latency }) {
+            (to->*histogram).max_ns = max((to->*histogram).max_ns, (shard.*histogram).max_ns);
+            (shard.*histogram).max_ns = 0;
+        }
+        for (size_t j = 0; j < sizeof(gtfs_stats_t) / sizeof(uint64_t); j++) {
+            ((uint64_t*)to)[j] += ((uint64_t*)&shard)[j];
+        }
+    }
+}
+
+// Helper function to get the log bytes that the registry entry of a file still has pending
+int64_t registry_log_bytes(const gtfs_registry_entry_t *entry) {
+    if (!__atomic_load_n(&entry->open, __ATOMIC_RELAXED)) {
+        return 0; // Closed cleanly or recovered, the log state is stale
+    }
+    int64_t head = __atomic_load_n(&entry->log_head, __ATOMIC_RELAXED);
+    int64_t tail = __atomic_load_n(&entry->log_tail, __ATOMIC_RELAXED);
+    return max((int64_t)0, tail - head);
+}
 
-            delete[] buffer;
+// Helper function to find the registry entry of a file without claiming a slot or taking
+// the lock, for processes that only read the registry. Returns NULL if there is none.
+const gtfs_registry_entry_t* registry_lookup(const gtfs_registry_t *registry, const string& filename) {
+    uint32_t slot = crc32c(0, filename.data(), filename.length()) % GTFS_REGISTRY_SLOTS;
+    for (int probe = 0; probe < GTFS_REGISTRY_SLOTS; probe++) {
+        const gtfs_registry_entry_t *candidate = &registry->entries[(slot + probe) % GTFS_REGISTRY_SLOTS];
+        if (!__atomic_load_n(&candidate->used, __ATOMIC_ACQUIRE)) {
+            return NULL;
+        }
+        if (filename.compare(candidate->filename) == 0) {
+            return candidate;
+        }
+    }
+    return NULL;
+}
 
-            if (do_verbose) {
-                VERBOSE_PRINT(do_verbose, "Applied commit to file " << file_path << " at offset " << commit_meta.offset << " for " << commit_meta.length << " bytes.\n");
-            }
-            
-        } else {
-            // If the commit is not marked as committed, skip the data
-            VERBOSE_PRINT(do_verbose, "Skipping uncommitted data. Moving reader by " << commit_meta.length << " bytes. \n");
-            if (fseek(log_file, commit_meta.length, SEEK_CUR) != 0) {
-                VERBOSE_PRINT(do_verbose, "Failed to skip uncommitted data in log " << log_path << ".\n");
-                fclose(log_file);
-                fclose(fp);
-                return false;
+// Helper function to take a snapshot of the statistics in a registry: those of the file
+// filename, or those of the whole directory if filename is empty. Returns false if the
+// file has no entry.
+bool registry_stats(const gtfs_registry_t *registry, const string& filename, gtfs_stats_t *stats) {
+    if (filename.empty()) {
+        sum_stats(stats, registry->stats);
+        stats->log_bytes = 0;
+        for (int slot = 0; slot < GTFS_REGISTRY_SLOTS; slot++) {
+            const gtfs_registry_entry_t *entry = &registry->entries[slot];
+            if (__atomic_load_n(&entry->used, __ATOMIC_ACQUIRE)) {
+                stats->log_bytes += registry_log_bytes(entry);
             }
         }
+        return true;
+    }
+    const gtfs_registry_entry_t *entry = registry_lookup(registry, filename);
+    if (!entry) {
+        return false;
     }
+    copy_stats(stats, &entry->stats);
+    stats->log_bytes = registry_log_bytes(entry);
+    return true;
+}
 
-    fclose(log_file);
-    fclose(fp);
+// Helper function to check that a record read from a log is complete and intact
+bool commit_record_valid(const commit_t *header, const char *payload, const commit_trailer_t *trailer, uint64_t expected_seq) {
+    if (trailer->magic != COMMIT_TRAILER_MAGIC || header->seq != expected_seq) {
+        return false;
+    }
+    uint32_t crc = crc32c(0, payload, header->length);
+    crc = crc32c(crc, header, sizeof(commit_t));
+    return crc == trailer->crc;
+}
 
-    //Delete the Log file after we are done
-    //log_file = fopen(log_path.c_str(), "wb");
-    //if (log_file) fclose(log_file);
-    remove(log_path.c_str());
+// Helper function to check that a record header of a file log is sane before trusting
+// its length. The extents of a COMMIT_TYPE_MULTI record are checked by for_each_extent.
+bool commit_header_valid(const commit_t *header, int64_t file_size, int64_t log_remaining) {
+    if (header->magic != COMMIT_MAGIC || header->version != LOG_FORMAT_VERSION ||
+        header->length < 0 || header->length > log_remaining) {
+        return false;
+    }
+    if (header->type == COMMIT_TYPE_MULTI) {
+        return true;
+    }
+    return header->type == COMMIT_TYPE_WRITE && header->offset >= 0 && header->offset <= file_size - header->length;
+}
 
-    if (do_verbose) {
-        VERBOSE_PRINT(do_verbose, "Successfully applied logs from " << log_path << " to file " << file_path << ".\n");
+// Helper function to walk the extents of a COMMIT_TYPE_WRITE or COMMIT_TYPE_MULTI payload.
+// fn(offset, length, pos) is called for every extent, pos being where its data starts
+// in the payload. Returns false if the payload is malformed or an extent does not fit
+// in a file of file_size bytes, fn may have been called for earlier extents by then.
+template <typename F>
+bool for_each_extent(uint16_t type, int64_t offset, int64_t length, const char *payload, int64_t file_size, F fn) {
+    if (type == COMMIT_TYPE_WRITE) {
+        fn(offset, length, (int64_t)0);
+        return true;
+    }
+    int64_t pos = 0;
+    while (pos < length) {
+        commit_extent_t extent;
+        if (length - pos < (int64_t)sizeof(commit_extent_t)) {
+            return false;
+        }
+        memcpy(&extent, payload + pos, sizeof(commit_extent_t));
+        pos += sizeof(commit_extent_t);
+        if (extent.offset < 0 || extent.length < 0 || extent.length > length - pos || extent.offset > file_size - extent.length) {
+            return false;
+        }
+        fn(extent.offset, extent.length, pos);
+        pos += extent.length;
     }
+    return true;
+}
 
+// Helper function to write a record to a log at offset with a single vectored write.
+// A short write simply continues where it stopped.
+bool append_log(int log_fd, struct iovec *iov, int iovcnt, int64_t offset) {
+    int idx = 0;
+    while (idx < iovcnt) {
+        ssize_t written = pwritev(log_fd, iov + idx, min(iovcnt - idx, IOV_MAX), offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        offset += written;
+        // Skip the buffers that were fully written and trim the partially written one
+        while (idx < iovcnt && written >= (ssize_t)iov[idx].iov_len) {
+            written -= iov[idx].iov_len;
+            idx++;
+        }
+        if (idx < iovcnt) {
+            iov[idx].iov_base = (char*)iov[idx].iov_base + written;
+            iov[idx].iov_len -= written;
+        }
+    }
     return true;
 }
 
+// Helper function to read exactly length bytes at offset
+bool read_full(int fd, void *buf, size_t length, int64_t offset) {
+    while (length > 0) {
+        ssize_t bytes_read = pread(fd, buf, length, offset);
+        if (bytes_read < 0 && errno == EINTR) {
+            continue;
+        }
+        if (bytes_read <= 0) {
+            return false;
+        }
+        buf = (char*)buf + bytes_read;
+        length -= bytes_read;
+        offset += bytes_read;
+    }
+    return true;
+}
 
+// Helper function to read the log header, picking the newest valid copy.
+// Returns false if neither copy is valid.
+bool read_log_header(int log_fd, log_meta_t *meta) {
+    bool found = false;
+    for (int slot = 0; slot < 2; slot++) {
+        log_meta_t copy;
+        if (!read_full(log_fd, &copy, sizeof(log_meta_t), slot * LOG_HEADER_SLOT_SIZE)) {
+            continue;
+        }
+        if (copy.magic != LOG_HEADER_MAGIC || copy.version != LOG_FORMAT_VERSION ||
+            copy.crc != crc32c(0, &copy, offsetof(log_meta_t, crc))) {
+            continue;
+        }
+        if (!found || copy.generation > meta->generation) {
+            *meta = copy;
+            found = true;
+        }
+    }
+    return found;
+}
 
-gtfs_t* gtfs_init(string directory, int verbose_flag) {
-    do_verbose = verbose_flag;
-    gtfs_t *gtfs = NULL;
-    VERBOSE_PRINT(do_verbose, "Initializing GTFileSystem inside directory " << directory << "\n");
-    //TODO: Add any additional initializations and checks, and complete the functionality
+// Helper function to tell whether the log at log_path has a record past its head, so that
+// an open has to replay or adopt it. Only the header and the head record's header are read,
+// a record that turns out to be torn just costs the open a scan of the log.
+bool log_has_records(const string& log_path) {
+    int log_fd = open(log_path.c_str(), O_RDONLY);
+    if (log_fd == -1) {
+        return false;
+    }
+    log_meta_t meta;
+    commit_t header;
+    bool found = read_log_header(log_fd, &meta) && read_full(log_fd, &header, sizeof(commit_t), meta.head) &&
+                 header.magic == COMMIT_MAGIC && header.version == LOG_FORMAT_VERSION && header.seq == meta.head_seq;
+    close(log_fd);
+    return found;
+}
 
-    // Create directory if it doesn't exist
-    if (!create_directory(directory)) {
-        VERBOSE_PRINT(do_verbose, "Failed to create or access directory " << directory << "\n");
-        return NULL;
+// Helper function to persist the log header into the slot not holding the current copy
+bool write_log_header(int log_fd, log_meta_t *meta) {
+    meta->generation++;
+    meta->crc = crc32c(0, meta, offsetof(log_meta_t, crc));
+    int64_t slot = meta->generation % 2;
+    return pwrite(log_fd, meta, sizeof(log_meta_t), slot * LOG_HEADER_SLOT_SIZE) == (ssize_t)sizeof(log_meta_t);
+}
+
+// Helper function to pick the id of a new log, it only has to differ from earlier logs of the file
+uint64_t new_log_id() {
+    static random_device device;
+    static mutex device_mutex;
+    lock_guard<mutex> lock(device_mutex);
+    uint64_t id = ((uint64_t)device() << 32) | device();
+    return id ^ (uint64_t)chrono::steady_clock::now().time_since_epoch().count();
+}
+
+// Helper function to allocate a preallocated log in whole extents up to at least end, so
+// that appends below it do not have to allocate. Appends past the allocated bytes still
+// work if this fails, they extend the log. Needs fl->mtx held.
+void grow_log(file_t *fl, int64_t end) {
+    if (fl->log_prealloc == 0 || end <= fl->log_allocated) {
+        return;
+    }
+    int64_t allocated = (end + fl->log_prealloc - 1) / fl->log_prealloc * fl->log_prealloc;
+    if (fallocate(fl->log_fd, 0, fl->log_allocated, allocated - fl->log_allocated) != 0) {
+        VERBOSE_PRINT(do_verbose, "Failed to preallocate log " << fl->log_path << "\n");
+        return;
     }
+    fl->log_allocated = allocated;
+}
 
-    // Create .logs directory
-    string logs_dir = directory + "/.logs";
-    if (!create_directory(logs_dir)) {
-        VERBOSE_PRINT(do_verbose, "Failed to create or access logs directory " << logs_dir << "\n");
-        return NULL;
+// Helper function to cut a log off at offset, so that no record after it can be taken for
+// one that follows the records before it. A preallocated log keeps its size and blocks,
+// the bytes after offset are zeroed instead. Needs fl->mtx held.
+bool cut_log(file_t *fl, int64_t offset) {
+    struct stat log_st;
+    if (fl->log_prealloc > 0 && fstat(fl->log_fd, &log_st) == 0) {
+        if (log_st.st_size <= offset || fallocate(fl->log_fd, FALLOC_FL_ZERO_RANGE | FALLOC_FL_KEEP_SIZE, offset, log_st.st_size - offset) == 0) {
+            return true;
+        }
     }
+    fl->log_allocated = min(fl->log_allocated, offset);
+    return ftruncate(fl->log_fd, offset) == 0;
+}
 
-    /* Later, replace this such that it checked shared memory first to look for a gtfs instance*/
-    // Initialize gtfs struct
-    gtfs = new gtfs_t();
-    gtfs->dirname = directory;
+// Helper function to bring a freshly created log to its empty state
+bool init_log(file_t *fl) {
+    // A log left by an earlier open keeps its header slots, the header generation carries
+    // on so that the new header wins over the old one. A preallocated one is reused as it
+    // is: its records are only overwritten, so the new ones are numbered past any the old
+    // log can hold.
+    struct stat log_st;
+    log_meta_t old_meta;
+    bool old = read_log_header(fl->log_fd, &old_meta);
+    bool reuse = old && fl->log_prealloc > 0 && fstat(fl->log_fd, &log_st) == 0 && log_st.st_size > LOG_HEADER_SIZE;
+    if (reuse) {
+        fl->next_seq = max(fl->next_seq, old_meta.head_seq + (log_st.st_size - LOG_HEADER_SIZE) / (sizeof(commit_t) + sizeof(commit_trailer_t)) + 1);
+    }
+    memset(&fl->log_meta, 0, sizeof(log_meta_t));
+    fl->log_meta.generation = old ? old_meta.generation : 0;
+    fl->log_meta.magic = LOG_HEADER_MAGIC;
+    fl->log_meta.version = LOG_FORMAT_VERSION;
+    fl->log_meta.head = LOG_HEADER_SIZE;
+    fl->log_meta.head_seq = fl->next_seq;
+    fl->log_meta.head_done = 0;
+    fl->log_meta.log_id = new_log_id();
+    fl->log_tail = LOG_HEADER_SIZE;
+    fl->log_reclaimed = LOG_HEADER_SIZE;
+    publish_log_state(fl);
+    if (fl->log_prealloc == 0) {
+        return ftruncate(fl->log_fd, LOG_HEADER_SIZE) == 0 && write_log_header(fl->log_fd, &fl->log_meta);
+    }
+    // Back to a single extent if the old log had grown past it
+    fl->log_allocated = reuse ? min((int64_t)log_st.st_size, fl->log_prealloc) : 0;
+    if (reuse && log_st.st_size > fl->log_prealloc && ftruncate(fl->log_fd, fl->log_prealloc) != 0) {
+        return false;
+    }
+    grow_log(fl, LOG_HEADER_SIZE + 1);
+    return write_log_header(fl->log_fd, &fl->log_meta);
+}
 
-    /* Should initialize a way to keep track of open file structs to make implementations of clean and abort simpler*/
+// Helper function to return the number of log bytes that still have to be applied
+int64_t log_pending(file_t *fl) {
+    if (fl->gtfs->wal) {
+        return fl->wal_pending;
+    }
+    return fl->log_tail - fl->log_meta.head;
+}
 
-    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns non NULL.
-    return gtfs;
+// Helper function to fill in a record header and its trailer.
+// payload_crc is crc32c(0, payload, length), so only the header is checksummed here.
+void seal_record(commit_t *header, commit_trailer_t *trailer, uint16_t type, uint64_t seq, int64_t offset, int64_t length, uint32_t payload_crc) {
+    header->magic = COMMIT_MAGIC;
+    header->version = LOG_FORMAT_VERSION;
+    header->type = type;
+    header->seq = seq;
+    header->offset = offset;
+    header->length = length;
+    trailer->crc = crc32c(payload_crc, header, sizeof(commit_t));
+    trailer->magic = COMMIT_TRAILER_MAGIC;
 }
 
-int gtfs_clean(gtfs_t *gtfs) {
-    int ret = -1;
-    if (gtfs) {
-        VERBOSE_PRINT(do_verbose, "Cleaning up GTFileSystem inside directory " << gtfs->dirname << "\n");
-    } else {
-        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
-        return ret;
+// Helper function to describe one log record (header, payload, trailer) as three iovecs
+void build_log_record(write_t *write_id, uint64_t seq, uint32_t payload_crc, commit_t *header, commit_trailer_t *trailer, struct iovec *iov) {
+    seal_record(header, trailer, COMMIT_TYPE_WRITE, seq, write_id->offset, write_id->length, payload_crc);
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(commit_t);
+    iov[1].iov_base = write_id->data;
+    iov[1].iov_len = write_id->length;
+    iov[2].iov_base = trailer;
+    iov[2].iov_len = sizeof(commit_trailer_t);
+}
+
+// Helper function to delta encode a write: a COMMIT_TYPE_MULTI payload (laid out as by
+// build_multi_payload) with only the runs of bytes that differ from old_data. Recovery
+// finds the other bytes in place, so only writes marked delta qualify. Returns false if
+// the write has to be logged in full, also when the delta would not be smaller. The
+// payload goes to delta and its checksum to *payload_crc.
+bool encode_delta(write_t *write_id, vector<char>& delta, uint32_t *payload_crc) {
+    delta.clear();
+    if (!write_id->fl->gtfs->delta_records || !write_id->delta || write_id->length == 0) {
+        return false;
     }
-    //TODO: Add any additional initializations and checks, and complete the functionality
+    vector<delta_run_t> runs;
+    if (!delta_runs(write_id->old_data, write_id->data, write_id->length, sizeof(commit_extent_t), write_id->length, runs)) {
+        return false;
+    }
+    size_t length = 0;
+    for (const delta_run_t& run : runs) {
+        length += sizeof(commit_extent_t) + run.length;
+    }
+    delta.resize(length);
+    char *pos = delta.data();
+    for (const delta_run_t& run : runs) {
+        commit_extent_t extent = { write_id->offset + (int64_t)run.offset, (int64_t)run.length };
+        memcpy(pos, &extent, sizeof(commit_extent_t));
+        memcpy(pos + sizeof(commit_extent_t), write_id->data + run.offset, run.length);
+        pos += sizeof(commit_extent_t) + run.length;
+    }
+    *payload_crc = crc32c(0, delta.data(), delta.size());
+    return true;
+}
 
-    /* This implementation should eventually use whatever datastructure within gtfs supports multiple file_t structs */
+// Helper function to describe a delta encoded record (see encode_delta) as three iovecs
+void build_delta_record(const vector<char>& delta, uint64_t seq, uint32_t payload_crc, commit_t *header, commit_trailer_t *trailer, struct iovec *iov) {
+    seal_record(header, trailer, COMMIT_TYPE_MULTI, seq, 0, delta.size(), payload_crc);
 
-    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
-    return ret;
+    iov[0].iov_base = header;
+    iov[0].iov_len = sizeof(commit_t);
+    iov[1].iov_base = (void*)delta.data();
+    iov[1].iov_len = delta.size();
+    iov[2].iov_base = trailer;
+    iov[2].iov_len = sizeof(commit_trailer_t);
 }
 
-file_t* gtfs_open_file(gtfs_t* gtfs, string filename, int file_length) {
-    file_t *fl = NULL;
-    if (gtfs) {
-        VERBOSE_PRINT(do_verbose, "Opening file " << filename << " inside directory " << gtfs->dirname << "\n");
-    } else {
-        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
-        return NULL;
+// Helper function to describe the payload of a COMMIT_TYPE_MULTI record carrying writes
+// as its extents. Fills extents (one per write) and iov (two per write), and returns the
+// payload length. Its checksum goes to *payload_crc.
+int64_t build_multi_payload(const vector<write_t*>& writes, commit_extent_t *extents, struct iovec *iov, uint32_t *payload_crc) {
+    int64_t length = 0;
+    uint32_t crc = 0;
+    for (size_t k = 0; k < writes.size(); k++) {
+        extents[k].offset = writes[k]->offset;
+        extents[k].length = writes[k]->length;
+        iov[2 * k].iov_base = &extents[k];
+        iov[2 * k].iov_len = sizeof(commit_extent_t);
+        iov[2 * k + 1].iov_base = writes[k]->data;
+        iov[2 * k + 1].iov_len = writes[k]->length;
+        crc = crc32c(crc, &extents[k], sizeof(commit_extent_t));
+        crc = crc32c(crc, writes[k]->data, writes[k]->length);
+        length += sizeof(commit_extent_t) + writes[k]->length;
     }
-    
+    *payload_crc = crc;
+    return length;
+}
 
-    if (filename.length() > MAX_FILENAME_LEN) {
-        VERBOSE_PRINT(do_verbose, "Filename exceeds maximum length\n");
-        return NULL;
-    }
+// Helpers for insert_extent: the part of an extent that starts skip bytes later
+log_extent_t extent_skip(const log_extent_t& extent, int64_t skip) {
+    return { extent.end, extent.src + skip };
+}
 
-    string file_path = gtfs->dirname + "/" + filename;
-    string log_path = get_log_path(gtfs->dirname, filename);
+// A seq extent keeps the same seq however far it is skipped
+seq_extent_t extent_skip(const seq_extent_t& extent, int64_t /*skip*/) {
+    return extent;
+}
 
-    // Apply existing logs
-    /* Should double check this portion */
-    struct stat log_st;
-    if (stat(log_path.c_str(), &log_st) == 0) {
-        VERBOSE_PRINT(do_verbose, "Detecting logs from previous instance, recovering data\n");
-        apply_log(gtfs->dirname, filename);
-    }
+overlay_extent_t extent_skip(const overlay_extent_t& extent, int64_t skip) {
+    return { extent.end, extent.pos + skip };
+}
 
-    // Acquire lock
-    int fd = open(file_path.c_str(), O_RDWR | O_CREAT, 0644);
-    if (fd == -1) {
-        VERBOSE_PRINT(do_verbose, "Failed to open or create file " << file_path << "\n");
-        return NULL;
+// Helper function to insert value over [offset, value.end) into an interval map.
+// Ranges are inserted in log order, so the newest writer always wins.
+template <typename T>
+void insert_extent(map<int64_t, T>& extents, int64_t offset, T value) {
+    int64_t end = value.end;
+    if (end <= offset) {
+        return;
     }
 
-    if (!acquire_lock(fd)) {
-        VERBOSE_PRINT(do_verbose, "Failed to acquire lock on file " << file_path << "\n");
-        close(fd);
-        return NULL;
+    auto it = extents.lower_bound(offset);
+    // An extent that starts before the new range keeps only its head, and its tail if it sticks out
+    if (it != extents.begin()) {
+        auto before = prev(it);
+        if (before->second.end > offset) {
+            if (before->second.end > end) {
+                extents[end] = extent_skip(before->second, end - before->first);
+            }
+            before->second.end = offset;
+        }
+    }
+    // Extents that start inside the new range are dropped, the last one may keep its tail
+    while (it != extents.end() && it->first < end) {
+        if (it->second.end > end) {
+            T tail = extent_skip(it->second, end - it->first);
+            extents.erase(it);
+            extents[end] = tail;
+            break;
+        }
+        it = extents.erase(it);
     }
+    extents[offset] = value;
+}
 
-    // Check if file exists
-    struct stat st;
-    if (fstat(fd, &st) == -1) {
-        VERBOSE_PRINT(do_verbose, "Failed to stat file " << file_path << "\n");
-        release_lock(fd);
-        close(fd);
-        return NULL;
+void note_log_append(file_t *fl, int64_t bytes);
+
+// Helper function to append count records to an open file's log. A failed append is cut
+// off again so that later records are not hidden behind a torn one. The caller records
+// the bytes the new records cover with note_newest. Needs fl->mtx held.
+bool append_file_log(file_t *fl, struct iovec *iov, int iovcnt, size_t count, int64_t bytes) {
+    grow_log(fl, fl->log_tail + bytes);
+    auto start = chrono::steady_clock::now();
+    bool ok = append_log(fl->log_fd, iov, iovcnt, fl->log_tail);
+    if (fl->durability == GTFS_DURABLE_DSYNC) {
+        stat_latency(stats_of(fl), &gtfs_stats_t::durable_latency, start);
+    }
+    if (!ok) {
+        GTFS_TRACE_EVENT(GTFS_OP_LOG_APPEND, fl->trace_id, fl->log_tail, bytes, -1);
+        if (!cut_log(fl, fl->log_tail)) {
+            VERBOSE_PRINT(do_verbose, "Failed to cut torn records off log " << fl->log_path << "\n");
+        }
+        return false;
     }
+    GTFS_TRACE_EVENT(GTFS_OP_LOG_APPEND, fl->trace_id, fl->log_tail, bytes, count);
+    fl->next_seq += count;
+    note_log_append(fl, bytes);
+    return true;
+}
 
-    if (st.st_size == 0) {
-        // New file, set size
-        if (ftruncate(fd, file_length) == -1) {
-            VERBOSE_PRINT(do_verbose, "Failed to set file size for " << file_path << "\n");
-            release_lock(fd);
+// Helper function to flush the records appended to an open file's log so far, timed in
+// durable_latency. With lock, fl->mtx is dropped during the fdatasync (on a duplicate of
+// the descriptor, so a close meanwhile does not matter) and taken again. Needs fl->mtx
+// held, through lock if given.
+bool flush_file_log(file_t *fl, unique_lock<mutex> *lock) {
+    if (fl->log_fd < 0) {
+        return true;
+    }
+    fl->log_unflushed = fl->appends != NULL; // Records still being written are left to the next flush
+    int fd = lock ? dup(fl->log_fd) : fl->log_fd;
+    if (lock) {
+        lock->unlock();
+    }
+    auto start = chrono::steady_clock::now();
+    bool ok = fd >= 0 && flush_fd(fd, stats_of(fl));
+    stat_latency(stats_of(fl), &gtfs_stats_t::durable_latency, start);
+    if (lock) {
+        if (fd >= 0) {
             close(fd);
-            return NULL;
         }
+        lock->lock();
+    }
+    if (ok) {
+        fl->log_flushed = chrono::steady_clock::now();
     } else {
-        if (file_length < st.st_size) {
-            VERBOSE_PRINT(do_verbose, "New file length is smaller than existing length\n");
-            release_lock(fd);
-            close(fd);
-            return NULL;
-        }
-        if (file_length > st.st_size) {
-            if (ftruncate(fd, file_length) == -1) {
-                VERBOSE_PRINT(do_verbose, "Failed to extend file size for " << file_path << "\n");
-                release_lock(fd);
-                close(fd);
-                return NULL;
-            }
-        }
+        fl->log_unflushed = 1;
     }
+    return ok;
+}
 
+// Helper function to note that record seq is now the newest one for [offset, offset + length).
+// Needs fl->mtx held.
+void note_newest(file_t *fl, int64_t offset, int64_t length, uint64_t seq) {
+    insert_extent(fl->newest, offset, seq_extent_t{ offset + length, seq });
+}
 
-    // Memory map the file
-    char* data = (char*)mmap(NULL, file_length, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
-    if (data == MAP_FAILED) {
-        VERBOSE_PRINT(do_verbose, "Failed to mmap file " << file_path << "\n");
-        release_lock(fd);
-        close(fd);
-        return NULL;
+// Helper function for snapshots: forgets the committed copies of the pages around
+// [offset, offset + length) that no outstanding write touches any more, the mapping
+// has their committed bytes. Needs fl->mtx held.
+void mvcc_drop_pages(file_t *fl, int64_t offset, int64_t length) {
+    if (!fl->mvcc || length == 0) {
+        return;
     }
-
-    // Initialize file_t struct
+    int64_t page = sysconf(_SC_PAGESIZE);
+    for (int64_t p = offset / page; p <= (offset + length - 1) / page; p++) {
+        bool touched = false;
+        for (write_t *write_id : fl->outstanding) {
+            touched = touched || (write_id->offset < (p + 1) * page && p * page < write_id->offset + write_id->length);
+        }
+        if (!touched) {
+            fl->committed_pages.erase(p);
+        }
+    }
+}
+
+// Helper function for snapshots: the bytes of a write are committed, they go into the
+// committed copies of its pages. What a page held before is kept if an open snapshot may
+// read it, which is not the case when no snapshot was taken since the page last changed.
+// Needs fl->mtx held.
+void mvcc_commit(file_t *fl, write_t *write_id) {
+    fl->commit_version++;
+    if (write_id->length == 0) {
+        return;
+    }
+    int64_t page = sysconf(_SC_PAGESIZE);
+    int64_t end = write_id->offset + write_id->length;
+    for (int64_t p = write_id->offset / page; p <= (end - 1) / page; p++) {
+        auto it = fl->committed_pages.find(p);
+        if (it == fl->committed_pages.end()) {
+            continue; // Saved when the write was made, unless snapshots were off then
+        }
+        if (!fl->snapshot_versions.empty()) {
+            vector<page_version_t>& versions = fl->page_versions[p];
+            if (versions.empty() || *fl->snapshot_versions.rbegin() >= versions.back().until) {
+                versions.push_back(page_version_t{ fl->commit_version, it->second });
+            }
+        }
+        int64_t from = max(write_id->offset, p * page);
+        int64_t to = min(end, (p + 1) * page);
+        memcpy(it->second.data() + (from - p * page), write_id->data + (from - write_id->offset), to - from);
+    }
+}
+
+// Helper function to mark a write as committed. Needs fl->mtx held.
+void mark_synced(write_t *write_id) {
+    file_t *fl = write_id->fl;
+    write_id->synced = 1;
+    vector<write_t*>& outstanding = fl->outstanding;
+    outstanding.erase(remove(outstanding.begin(), outstanding.end(), write_id), outstanding.end());
+    if (fl->mvcc) {
+        mvcc_commit(fl, write_id);
+        mvcc_drop_pages(fl, write_id->offset, write_id->length);
+    }
+    drop_range(fl, write_id->offset, write_id->length);
+}
+
+bool checkpoint_file(file_t *fl);
+
+// Helper function to wait until no append or copy runs without fl->mtx, so that the log
+// and the mapping can be worked on. Needs fl->mtx held, it is dropped while waiting.
+void wait_inflight(file_t *fl) {
+    unique_lock<mutex> lock(fl->mtx, adopt_lock);
+    fl->inflight_cv.wait(lock, [fl] { return fl->inflight == 0; });
+    lock.release();
+}
+
+void async_progress(struct async_request *request);
+
+// Helper function to settle the appends that finished. Replay stops at the first record
+// that is not intact, so a record is committed once every record before it is on the
+// log, and everything after a failed record is lost with it. Once nothing runs any more
+// the lost records are cut off and the log is checkpointed, which also drops them from
+// newest. Their writes stay outstanding. Needs fl->mtx held.
+void settle_appends(file_t *fl) {
+    while (fl->appends) {
+        append_slot_t *slot = fl->appends;
+        if (slot->written == 0) {
+            break;
+        }
+        if (slot->written < 0) {
+            fl->append_failed = slot->pos;
+            fl->append_failed_seq = slot->seq;
+            for (append_slot_t *lost = slot, *next; lost; lost = next) {
+                next = lost->next;
+                lost->state = -1;
+                if (lost->async) {
+                    async_progress(lost->async);
+                }
+            }
+            fl->appends = fl->appends_tail = NULL;
+            break;
+        }
+        slot->state = 1;
+        mark_synced(slot->write_id);
+        fl->appends = slot->next;
+        if (!fl->appends) {
+            fl->appends_tail = NULL;
+        }
+        if (slot->async) {
+            async_progress(slot->async);
+        }
+    }
+
+    if (fl->append_failed >= 0 && fl->inflight == 0) {
+        if (!cut_log(fl, fl->append_failed)) {
+            VERBOSE_PRINT(do_verbose, "Failed to cut torn records off log " << fl->log_path << "\n");
+        }
+        fl->log_tail = fl->append_failed;
+        fl->next_seq = fl->append_failed_seq;
+        fl->append_failed = -1;
+        if (!checkpoint_file(fl)) {
+            VERBOSE_PRINT(do_verbose, "Failed to checkpoint " << fl->filename << " after a failed append\n");
+        }
+    }
+}
+
+// Helper function to reserve the place and sequence number of a write's record at the
+// end of the log and queue its slot for settle_appends. The record carries delta (see
+// encode_delta, payload_crc is its checksum then) or, if that is NULL, the whole write.
+// The caller appends the record without fl->mtx and then settles the slot. Needs fl->mtx held.
+void reserve_write_record(file_t *fl, write_t *write_id, const vector<char> *delta, uint32_t payload_crc, commit_t *header, commit_trailer_t *trailer,
+                          struct iovec *iov, append_slot_t *slot) {
+    // A write overlapping this one may have come in since the delta was taken
+    if (delta && !write_id->delta) {
+        delta = NULL;
+        payload_crc = crc32c(0, write_id->data, write_id->length);
+    }
+    if (delta) {
+        build_delta_record(*delta, fl->next_seq, payload_crc, header, trailer, iov);
+    } else {
+        build_log_record(write_id, fl->next_seq, payload_crc, header, trailer, iov);
+    }
+    *slot = { fl->log_tail, header->seq, write_id, 0, 0, NULL, NULL };
+    if (fl->appends_tail) {
+        fl->appends_tail->next = slot;
+    } else {
+        fl->appends = slot;
+    }
+    fl->appends_tail = slot;
+    fl->next_seq++;
+    grow_log(fl, fl->log_tail + sizeof(commit_t) + header->length + sizeof(commit_trailer_t));
+    note_log_append(fl, sizeof(commit_t) + header->length + sizeof(commit_trailer_t));
+    for_each_extent(header->type, header->offset, header->length, (const char*)iov[1].iov_base, fl->file_length,
+                    [&](int64_t offset, int64_t length, int64_t) { note_newest(fl, offset, length, header->seq); });
+    fl->inflight++;
+}
+
+// Helper function for gtfs_sync_write_file: appends the record of one write to the file's
+// log. Its place and sequence number are taken under fl->mtx, the pwritev runs without
+// it so that syncs of the same file overlap. Returns once the record is settled, true if
+// it is committed (the write is marked synced then). delta and payload_crc are as for
+// reserve_write_record. Needs fl->mtx held through lock.
+bool append_write_record(file_t *fl, unique_lock<mutex>& lock, write_t *write_id, const vector<char> *delta, uint32_t payload_crc, commit_t *header) {
+    commit_trailer_t trailer;
+    struct iovec iov[3];
+    append_slot_t slot;
+    reserve_write_record(fl, write_id, delta, payload_crc, header, &trailer, iov, &slot);
+
+    bool dsync = fl->durability == GTFS_DURABLE_DSYNC;
+    lock.unlock();
+    auto start = chrono::steady_clock::now();
+    bool ok = append_log(fl->log_fd, iov, 3, slot.pos);
+    if (dsync) {
+        stat_latency(stats_of(fl), &gtfs_stats_t::durable_latency, start);
+    }
+    GTFS_TRACE_EVENT(GTFS_OP_LOG_APPEND, fl->trace_id, slot.pos, sizeof(commit_t) + header->length + sizeof(commit_trailer_t), ok ? 1 : -1);
+    lock.lock();
+
+    slot.written = ok ? 1 : -1;
+    fl->inflight--;
+    settle_appends(fl);
+    fl->inflight_cv.notify_all();
+    fl->inflight_cv.wait(lock, [&slot] { return slot.state != 0; });
+    return slot.state == 1;
+}
+
+// Helper function to check whether [offset, offset + length) overlaps one of ranges
+bool range_overlaps(const vector<pair<int64_t, int64_t>>& ranges, int64_t offset, int64_t length) {
+    for (const pair<int64_t, int64_t>& range : ranges) {
+        if (range.first >= offset + length) {
+            break;
+        }
+        if (range.first + range.second > offset) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Helper function to write the surviving extents to the data file in offset order.
+// Runs of adjacent extents are written with a single pwritev.
+bool write_extents(int fd, const map<int64_t, log_extent_t>& extents) {
+    vector<struct iovec> iov;
+    auto it = extents.begin();
+    while (it != extents.end()) {
+        int64_t run_start = it->first;
+        int64_t run_end = it->first;
+        iov.clear();
+        while (it != extents.end() && it->first == run_end && (int)iov.size() < IOV_MAX) {
+            struct iovec v;
+            v.iov_base = (void*)it->second.src;
+            v.iov_len = it->second.end - it->first;
+            iov.push_back(v);
+            run_end = it->second.end;
+            it++;
+        }
+
+        // pwritev may stop short, continue from where it left off
+        size_t idx = 0;
+        int64_t pos = run_start;
+        while (idx < iov.size()) {
+            ssize_t written = pwritev(fd, iov.data() + idx, iov.size() - idx, pos);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                return false;
+            }
+            pos += written;
+            while (idx < iov.size() && written >= (ssize_t)iov[idx].iov_len) {
+                written -= iov[idx].iov_len;
+                idx++;
+            }
+            if (idx < iov.size()) {
+                iov[idx].iov_base = (char*)iov[idx].iov_base + written;
+                iov[idx].iov_len -= written;
+            }
+        }
+    }
+    return true;
+}
+
+// Helper function to walk the committed records of a log mapped at log, from the head in
+// meta up to end. Stops at the first torn or corrupt record, or at the first one for which
+// fn(header, payload) returns false. Returns the log offset after the last record taken,
+// the sequence number of the record that would follow it goes to *next_seq.
+template <typename F>
+int64_t scan_log(const char *log, const log_meta_t *meta, int64_t end, int64_t file_size, const string& log_path, uint64_t *next_seq, F fn) {
+    int64_t pos = meta->head;
+    uint64_t expected_seq = meta->head_seq;
+    // Each loop, validate one record and hand it to fn
+    while (pos + (int64_t)(sizeof(commit_t) + sizeof(commit_trailer_t)) <= end) {
+        commit_t commit_meta;
+        commit_trailer_t trailer;
+        memcpy(&commit_meta, log + pos, sizeof(commit_t));
+        int64_t remaining = end - pos - sizeof(commit_t) - sizeof(commit_trailer_t);
+        if (!commit_header_valid(&commit_meta, file_size, remaining)) {
+            VERBOSE_PRINT(do_verbose, "Torn or corrupt record header in log " << log_path << ", ignoring the rest of the log.\n");
+            break;
+        }
+        const char *payload = log + pos + sizeof(commit_t);
+        memcpy(&trailer, payload + commit_meta.length, sizeof(commit_trailer_t));
+        if (!commit_record_valid(&commit_meta, payload, &trailer, expected_seq)) {
+            VERBOSE_PRINT(do_verbose, "Checksum or sequence mismatch for record " << expected_seq << " in log " << log_path << ", ignoring the rest of the log.\n");
+            break;
+        }
+        if (!fn(&commit_meta, payload)) {
+            break;
+        }
+        pos += sizeof(commit_t) + commit_meta.length + sizeof(commit_trailer_t);
+        expected_seq++;
+    }
+    *next_seq = expected_seq;
+    return pos;
+}
+
+// Recovery engine: applies the committed records of the log open on log_fd, starting
+// at the head recorded in meta, to the data file open on fd. The log is mapped and
+// scanned once into an interval map where the last writer wins, only the surviving
+// bytes are written, in offset order, followed by a single flush. The scan stops at
+// end, or at the first torn or corrupt record when end is -1. The log is left untouched.
+// After a crash, redo holds the parts of cross-file transactions found for this file,
+// the one that continues the log (if any) is applied as its next record. The number of
+// records applied goes to *replayed (if not NULL), the flush is counted in stats.
+bool replay_log(int log_fd, int fd, const string& log_path, const log_meta_t *meta, int64_t end, const vector<txn_redo_t> *redo,
+                stats_ref_t stats, uint64_t *replayed) {
+    // Sizes used to reject headers whose length cannot be trusted
+    struct stat log_st, file_st;
+    if (fstat(log_fd, &log_st) != 0 || fstat(fd, &file_st) != 0) {
+        VERBOSE_PRINT(do_verbose, "Failed to stat log " << log_path << " or its data file.\n");
+        return false;
+    }
+    if (end < 0 || end > log_st.st_size) {
+        end = log_st.st_size;
+    }
+    if (replayed) {
+        *replayed = 0;
+    }
+    if (end <= meta->head && redo == NULL) {
+        return true;
+    }
+    end = max(end, meta->head);
+
+    char *log = (char*)mmap(NULL, end, PROT_READ, MAP_PRIVATE, log_fd, 0);
+    if (log == MAP_FAILED) {
+        VERBOSE_PRINT(do_verbose, "Failed to mmap log " << log_path << ".\n");
+        return false;
+    }
+    madvise(log + meta->head - meta->head % LOG_HEADER_SIZE, end - meta->head + meta->head % LOG_HEADER_SIZE, MADV_SEQUENTIAL);
+
+    map<int64_t, log_extent_t> extents;
+    int64_t skip = meta->head_done; // Part of the head record that an earlier clean already applied
+    auto add_record = [&](uint16_t type, int64_t offset, int64_t length, const char *payload) {
+        // Check every extent before adding any of them, a record applies in full or not at all
+        if (!for_each_extent(type, offset, length, payload, file_st.st_size, [](int64_t, int64_t, int64_t) {})) {
+            return false;
+        }
+        for_each_extent(type, offset, length, payload, file_st.st_size, [&](int64_t extent_offset, int64_t extent_length, int64_t extent_pos) {
+            int64_t from = max(skip, extent_pos) - extent_pos;
+            if (from < extent_length) {
+                insert_extent(extents, extent_offset + from, log_extent_t{ extent_offset + extent_length, payload + extent_pos + from });
+            }
+        });
+        skip = 0;
+        return true;
+    };
+    // Add the payload of every committed record to the interval map
+    uint64_t expected_seq;
+    scan_log(log, meta, end, file_st.st_size, log_path, &expected_seq, [&](const commit_t *commit_meta, const char *payload) {
+        if (!add_record(commit_meta->type, commit_meta->offset, commit_meta->length, payload)) {
+            VERBOSE_PRINT(do_verbose, "Malformed extents in record " << commit_meta->seq << " of log " << log_path << ", ignoring the rest of the log.\n");
+            return false;
+        }
+        return true;
+    });
+
+    // A cross-file transaction may have committed without reaching this log
+    for (bool found = true; found && redo != NULL;) {
+        found = false;
+        for (const txn_redo_t& part : *redo) {
+            if (part.log_id == meta->log_id && part.seq == expected_seq &&
+                add_record(COMMIT_TYPE_MULTI, 0, part.payload.size(), part.payload.data())) {
+                VERBOSE_PRINT(do_verbose, "Recovered record " << expected_seq << " of log " << log_path << " from a transaction log.\n");
+                expected_seq++;
+                found = true;
+                break;
+            }
+        }
+    }
+
+    bool ok = write_extents(fd, extents) && flush_fd(fd, stats);
+    munmap(log, end);
+    if (!ok) {
+        VERBOSE_PRINT(do_verbose, "Failed to apply log " << log_path << " to its data file.\n");
+        return false;
+    }
+    if (replayed) {
+        *replayed = expected_seq - meta->head_seq;
+    }
+    VERBOSE_PRINT(do_verbose, "Replayed " << (expected_seq - meta->head_seq) << " records as " << extents.size() << " extents from " << log_path << ".\n");
+    return true;
+}
+
+// Helper function to apply a log to the data file open on fd and remove the log afterwards.
+// redo, stats and replayed are as for replay_log, redo is passed when recovering from a crash.
+bool apply_log(const string& log_path, int fd, const vector<txn_redo_t> *redo, stats_ref_t stats, uint64_t *replayed) {
+    int log_fd = open(log_path.c_str(), O_RDWR);
+    if (log_fd == -1) {
+        VERBOSE_PRINT(do_verbose, "Log file " << log_path << " does not exist or cannot be opened.\n");
+        return false;
+    }
+
+    // Resume from the head left by earlier cleans. A log without a valid header
+    // never had a record committed to it.
+    log_meta_t meta;
+    if (replayed) {
+        *replayed = 0;
+    }
+    bool valid = read_log_header(log_fd, &meta);
+    if (valid && !replay_log(log_fd, fd, log_path, &meta, -1, redo, stats, replayed)) {
+        close(log_fd);
+        return false;
+    }
+
+    // A log that grew past its header, as a preallocated one always has, keeps its blocks
+    // for the next open (see init_log): only its header is reset, numbered past any record
+    // the log can hold so that none of them is replayed again. An empty log is deleted.
+    struct stat log_st;
+    bool keep = valid && fstat(log_fd, &log_st) == 0 && log_st.st_size > LOG_HEADER_SIZE;
+    if (keep) {
+        meta.head_seq += (log_st.st_size - LOG_HEADER_SIZE) / (sizeof(commit_t) + sizeof(commit_trailer_t)) + 1;
+        meta.head = LOG_HEADER_SIZE;
+        meta.head_done = 0;
+        meta.log_id = new_log_id();
+        keep = write_log_header(log_fd, &meta) && flush_fd(log_fd, stats);
+    }
+    close(log_fd);
+    if (!keep) {
+        remove(log_path.c_str());
+    }
+
+    VERBOSE_PRINT(do_verbose, "Successfully applied logs from " << log_path << ".\n");
+    return true;
+}
+
+// Helper function for a lazy open: takes over the log that a crashed writer left behind
+// instead of applying it. Its committed records are scanned once into newest and into the
+// overlay, accesses to the mapping see their bytes from then on (materialize_overlay) and
+// the data file gets them with the next checkpoint or clean, or at close. A torn tail is
+// cut off so that new records follow the last committed one. meta is the log's header,
+// the number of records adopted goes to *adopted.
+bool adopt_log(file_t *fl, const log_meta_t *meta, uint64_t *adopted) {
+    struct stat log_st;
+    if (fstat(fl->log_fd, &log_st) != 0) {
+        VERBOSE_PRINT(do_verbose, "Failed to stat log " << fl->log_path << "\n");
+        return false;
+    }
+    int64_t end = max((int64_t)log_st.st_size, meta->head);
+    int64_t tail = meta->head;
+    uint64_t next_seq = meta->head_seq;
+    if (end > meta->head) {
+        char *log = (char*)mmap(NULL, end, PROT_READ, MAP_PRIVATE, fl->log_fd, 0);
+        if (log == MAP_FAILED) {
+            VERBOSE_PRINT(do_verbose, "Failed to mmap log " << fl->log_path << "\n");
+            return false;
+        }
+        madvise(log + meta->head - meta->head % LOG_HEADER_SIZE, end - meta->head + meta->head % LOG_HEADER_SIZE, MADV_SEQUENTIAL);
+
+        int64_t skip = meta->head_done; // Part of the head record that an earlier clean already applied
+        tail = scan_log(log, meta, end, fl->file_length, fl->log_path, &next_seq, [&](const commit_t *commit_meta, const char *payload) {
+            if (!for_each_extent(commit_meta->type, commit_meta->offset, commit_meta->length, payload, fl->file_length, [](int64_t, int64_t, int64_t) {})) {
+                VERBOSE_PRINT(do_verbose, "Malformed extents in record " << commit_meta->seq << " of log " << fl->log_path << ", ignoring the rest of the log.\n");
+                return false;
+            }
+            int64_t payload_pos = payload - log;
+            for_each_extent(commit_meta->type, commit_meta->offset, commit_meta->length, payload, fl->file_length,
+                            [&](int64_t extent_offset, int64_t extent_length, int64_t extent_pos) {
+                int64_t from = max(skip, extent_pos) - extent_pos;
+                if (from < extent_length) {
+                    note_newest(fl, extent_offset + from, extent_length - from, commit_meta->seq);
+                    insert_extent(fl->overlay, extent_offset + from, overlay_extent_t{ extent_offset + extent_length, payload_pos + extent_pos + from });
+                }
+            });
+            skip = 0;
+            return true;
+        });
+        munmap(log, end);
+    }
+    fl->log_allocated = fl->log_prealloc > 0 ? log_st.st_size : 0;
+    if (log_st.st_size > tail && !cut_log(fl, tail)) {
+        VERBOSE_PRINT(do_verbose, "Failed to cut torn records off log " << fl->log_path << "\n");
+        return false;
+    }
+
+    fl->log_meta = *meta;
+    fl->next_seq = next_seq;
+    fl->log_tail = tail;
+    fl->log_reclaimed = LOG_HEADER_SIZE;
+    fl->log_oldest = chrono::steady_clock::time_point(); // Written before the crash, due at the first age check
+    fl->overlaid.store(!fl->overlay.empty());
+    publish_log_state(fl);
+    *adopted = next_seq - meta->head_seq;
+    VERBOSE_PRINT(do_verbose, "Adopted " << *adopted << " records as " << fl->overlay.size() << " overlay extents from " << fl->log_path << "\n");
+    return true;
+}
+
+// Helper function to forget the overlay over [start, end), the mapping holds the newest
+// bytes there now. Needs fl->mtx held.
+void drop_overlay(file_t *fl, int64_t start, int64_t end) {
+    if (fl->overlay.empty() || start >= end) {
+        return;
+    }
+    // Cover the range with a single extent and erase that one
+    insert_extent(fl->overlay, start, overlay_extent_t{ end, 0 });
+    fl->overlay.erase(start);
+    fl->overlaid.store(!fl->overlay.empty());
+}
+
+// Helper function to bring [offset, offset + length) of the mapping up to date with a log
+// adopted at open: the overlaid bytes are read in from the log. The pages become dirty
+// but are never flushed ahead of the log, which still holds the bytes. Needs fl->mtx held.
+bool materialize_overlay(file_t *fl, int64_t offset, int64_t length) {
+    int64_t end = offset + length;
+    auto it = fl->overlay.upper_bound(offset);
+    if (it != fl->overlay.begin()) {
+        it--;
+    }
+    for (; it != fl->overlay.end() && it->first < end; it++) {
+        int64_t from = max(offset, it->first);
+        int64_t to = min(end, it->second.end);
+        if (from < to && !read_full(fl->log_fd, fl->data + from, to - from, it->second.pos + (from - it->first))) {
+            VERBOSE_PRINT(do_verbose, "Failed to read overlaid bytes of file " << fl->filename << " from its log\n");
+            return false;
+        }
+    }
+    drop_overlay(fl, offset, end);
+    return true;
+}
+
+// Helper function for reads: materializes the overlay over their bytes, if any is left.
+// The mapping has to be pinned.
+bool resolve_overlay(file_t *fl, int64_t offset, int64_t length) {
+    if (!fl->overlaid.load()) {
+        return true;
+    }
+    lock_guard<mutex> file_lock(fl->mtx);
+    return materialize_overlay(fl, offset, length);
+}
+
+// Helper function for snapshots: saves the committed bytes of the pages around
+// [offset, offset + length) before a write changes them, unless an outstanding write
+// saved them already. The mapping has the committed bytes of any other page. Needs
+// fl->mtx held.
+bool mvcc_save_pages(file_t *fl, int64_t offset, int64_t length) {
+    if (!fl->mvcc || length == 0) {
+        return true;
+    }
+    int64_t page = sysconf(_SC_PAGESIZE);
+    for (int64_t p = offset / page; p <= (offset + length - 1) / page; p++) {
+        if (fl->committed_pages.count(p)) {
+            continue;
+        }
+        int64_t bytes = min(page, fl->file_length - p * page);
+        if (fl->overlaid.load() && !materialize_overlay(fl, p * page, bytes)) {
+            return false;
+        }
+        vector<char>& copy = fl->committed_pages[p];
+        copy.assign(page, 0);
+        memcpy(copy.data(), fl->data + p * page, bytes);
+    }
+    return true;
+}
+
+// Helper function for private mappings: the page-aligned ranges around [start, end) whose
+// copies have to stay, because an outstanding write or a committed record that is not in
+// the data file yet has bytes there. Sorted by start. Needs fl->mtx held.
+vector<pair<int64_t, int64_t>> private_keep(file_t *fl, int64_t start, int64_t end) {
+    int64_t page = sysconf(_SC_PAGESIZE);
+    vector<pair<int64_t, int64_t>> keep;
+    auto add = [&](int64_t from, int64_t to) {
+        if (from < end && start < to) {
+            keep.push_back(pair<int64_t, int64_t>(from / page * page, (to + page - 1) / page * page));
+        }
+    };
+    for (write_t *write_id : fl->outstanding) {
+        add(write_id->offset, write_id->offset + write_id->length);
+    }
+    auto it = fl->newest.upper_bound(start);
+    if (it != fl->newest.begin()) {
+        it--;
+    }
+    for (; it != fl->newest.end() && it->first < end; it++) {
+        add(it->first, it->second.end);
+    }
+    sort(keep.begin(), keep.end());
+    return keep;
+}
+
+// Helper function for private mappings: gives back the copied pages around [start, end)
+// that private_keep does not hold on to. They fault in again from the data file, which
+// has their newest committed bytes. Needs fl->mtx held.
+void drop_private_pages(file_t *fl, int64_t start, int64_t end) {
+    int64_t page = sysconf(_SC_PAGESIZE);
+    start = start / page * page;
+    end = min((end + page - 1) / page * page, (fl->file_length + page - 1) / page * page);
+    int64_t pos = start;
+    for (const pair<int64_t, int64_t>& range : private_keep(fl, start, end)) {
+        if (range.first > pos) {
+            madvise(fl->data + pos, range.first - pos, MADV_DONTNEED);
+        }
+        pos = max(pos, range.second);
+    }
+    if (pos < end) {
+        madvise(fl->data + pos, end - pos, MADV_DONTNEED);
+    }
+}
+
+// Helper function to take back the bytes of an aborted write and forget it. A private
+// mapping drops the pages of the write when nothing else needs them, otherwise
+// old_data is copied back. Needs fl->mtx held.
+void undo_write(file_t *fl, write_t *write_id) {
+    vector<write_t*>& outstanding = fl->outstanding;
+    outstanding.erase(remove(outstanding.begin(), outstanding.end(), write_id), outstanding.end());
+    write_id->aborted = 1;
+    mvcc_drop_pages(fl, write_id->offset, write_id->length);
+    if (fl->private_map) {
+        int64_t page = sysconf(_SC_PAGESIZE);
+        int64_t start = write_id->offset / page * page;
+        int64_t end = (write_id->offset + write_id->length + page - 1) / page * page;
+        if (private_keep(fl, start, end).empty() && madvise(fl->data + start, end - start, MADV_DONTNEED) == 0) {
+            return;
+        }
+    }
+    memcpy(fl->data + write_id->offset, write_id->old_data, write_id->length);
+}
+
+// Helper function to copy outstanding writes back over bytes that were just written
+// to the data file underneath the shared mapping. Needs fl->mtx held.
+// The pwrite never reaches the copied pages of a private mapping, which keep the
+// outstanding writes; the copies left with nothing newer than the file are dropped.
+void restore_outstanding(file_t *fl, int64_t start, int64_t end) {
+    if (fl->private_map) {
+        drop_private_pages(fl, start, end);
+        return;
+    }
+    for (write_t *write_id : fl->outstanding) {
+        int64_t from = max(start, (int64_t)write_id->offset);
+        int64_t to = min(end, (int64_t)write_id->offset + write_id->length);
+        if (from < to) {
+            memcpy(fl->data + from, write_id->data + (from - write_id->offset), to - from);
+        }
+    }
+}
+
+// Helper function to empty the log of an open file once everything in it is applied.
+// The new head is persisted before the log is cut back. Needs fl->mtx held.
+bool reset_log(file_t *fl) {
+    fl->log_meta.head = LOG_HEADER_SIZE;
+    fl->log_meta.head_seq = fl->next_seq;
+    fl->log_meta.head_done = 0;
+    // A preallocated log keeps its blocks, it only goes back to one extent
+    int64_t size = fl->log_prealloc > 0 ? fl->log_prealloc : LOG_HEADER_SIZE;
+    bool cut = fl->log_prealloc == 0 || fl->log_allocated > size;
+    if (!write_log_header(fl->log_fd, &fl->log_meta) || (cut && ftruncate(fl->log_fd, size) != 0) || !flush_fd(fl->log_fd, stats_of(fl))) {
+        VERBOSE_PRINT(do_verbose, "Failed to reset log " << fl->log_path << "\n");
+        return false;
+    }
+    fl->log_tail = LOG_HEADER_SIZE;
+    fl->log_reclaimed = LOG_HEADER_SIZE;
+    fl->log_allocated = min(fl->log_allocated, size);
+    fl->newest.clear();
+    fl->overlay.clear(); // Everything was applied to the data file
+    fl->overlaid.store(0);
+    publish_log_state(fl);
+    return true;
+}
+
+// Helper function to tell whether a checkpoint can take the committed bytes from the mapping:
+// every byte of a record that is not applied yet must hold its newest committed value there,
+// so no outstanding write may overlap one. Needs fl->mtx held.
+bool mapping_committed(file_t *fl) {
+    for (write_t *write_id : fl->outstanding) {
+        auto it = fl->newest.upper_bound(write_id->offset);
+        if (it != fl->newest.begin() && prev(it)->second.end > write_id->offset) {
+            return false;
+        }
+        if (it != fl->newest.end() && it->first < write_id->offset + write_id->length) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Helper function for checkpoints when mapping_committed holds: brings the data file up to
+// date without reading the records back. A shared mapping is the file's page cache, its
+// committed ranges only have to be written back, page by page. A private one has its
+// committed bytes written out of its copies. Bytes overlaid by an adopted log are read in
+// first. Needs fl->mtx held.
+bool flush_committed(file_t *fl) {
+    if (fl->overlaid.load() && !materialize_overlay(fl, 0, fl->file_length)) {
+        return false;
+    }
+    int64_t page = sysconf(_SC_PAGESIZE);
+    auto it = fl->newest.begin();
+    while (it != fl->newest.end()) {
+        // Adjacent extents go out together, whole pages for writeback
+        int64_t start = it->first;
+        int64_t end = it->second.end;
+        for (it++; it != fl->newest.end() && it->first <= (fl->private_map ? end : (end + page - 1) / page * page); it++) {
+            end = max(end, it->second.end);
+        }
+        if (fl->private_map) {
+            for (int64_t pos = start; pos < end;) {
+                ssize_t written = pwrite(fl->fd, fl->data + pos, end - pos, pos);
+                if (written < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    VERBOSE_PRINT(do_verbose, "Failed to write committed bytes of file " << fl->filename << "\n");
+                    return false;
+                }
+                pos += written;
+            }
+        } else {
+            start = start / page * page;
+            sync_file_range(fl->fd, start, end - start, SYNC_FILE_RANGE_WRITE); // Only starts the writeback, the flush waits for it
+        }
+    }
+    if (!flush_fd(fl->fd, stats_of(fl))) {
+        VERBOSE_PRINT(do_verbose, "Failed to flush file " << fl->filename << "\n");
+        return false;
+    }
+    return true;
+}
+
+bool wal_checkpoint_file(file_t *fl);
+
+// Helper function to checkpoint an open file: applies its committed records to the
+// data file and empties the log. Must be called with fl->mtx held.
+// The bytes come from the mapping unless an outstanding write covers some of them, then
+// the log is replayed. The data file shares its pages with a shared mapping, so writes
+// that are still outstanding are copied back over the replayed bytes afterwards.
+bool checkpoint_file(file_t *fl) {
+    wait_inflight(fl);
+    if (fl->data == NULL || log_pending(fl) == 0) {
+        return true;
+    }
+    int64_t pending = log_pending(fl);
+    if (fl->gtfs->wal) {
+        if (!wal_checkpoint_file(fl)) {
+            return false;
+        }
+        stat_add(stats_of(fl), &gtfs_stats_t::checkpoint_bytes, pending);
+        GTFS_TRACE_EVENT(GTFS_OP_CHECKPOINT, fl->trace_id, 0, pending, 0);
+        return true;
+    }
+
+    bool from_mapping = mapping_committed(fl);
+    if (from_mapping) {
+        if (!flush_committed(fl)) {
+            return false;
+        }
+    } else {
+        // Copied pages of a private mapping do not see the replay, overlaid bytes are read in first
+        if (fl->private_map && fl->overlaid.load() && !materialize_overlay(fl, 0, fl->file_length)) {
+            return false;
+        }
+        if (!replay_log(fl->log_fd, fl->fd, fl->log_path, &fl->log_meta, fl->log_tail, NULL, stats_of(fl), NULL)) {
+            return false;
+        }
+    }
+    if (!reset_log(fl)) {
+        return false;
+    }
+    if (!from_mapping || fl->private_map) {
+        restore_outstanding(fl, 0, fl->file_length);
+    }
+    stat_add(stats_of(fl), &gtfs_stats_t::checkpoint_bytes, pending);
+    GTFS_TRACE_EVENT(GTFS_OP_CHECKPOINT, fl->trace_id, 0, pending, 0);
+
+    VERBOSE_PRINT(do_verbose, "Checkpointed " << pending << " log bytes of file " << fl->filename << "\n");
+    return true;
+}
+
+// Helper function to list the extents of a record whose payload is at payload_pos in
+// src_fd, and where the data of each starts in the payload. Only the extent headers are read.
+bool read_record_extents(int src_fd, const commit_t *header, int64_t payload_pos, vector<commit_extent_t>& extents, vector<int64_t>& positions) {
+    if (header->type == COMMIT_TYPE_WRITE) {
+        extents.push_back(commit_extent_t{ header->offset, header->length });
+        positions.push_back(0);
+        return true;
+    }
+    int64_t pos = 0;
+    while (pos < header->length) {
+        commit_extent_t extent;
+        if (!read_full(src_fd, &extent, sizeof(commit_extent_t), payload_pos + pos)) {
+            return false;
+        }
+        pos += sizeof(commit_extent_t);
+        extents.push_back(extent);
+        positions.push_back(pos);
+        pos += extent.length;
+    }
+    return true;
+}
+
+// Helper function for clean_file_bytes: applies payload bytes [slice_start, slice_end) of
+// a record whose payload is at payload_pos in src_fd. Only the bytes for which the record
+// is still the newest are written, so the shared mapping never goes back to older data.
+// The extents of the record are returned in extents. Needs fl->mtx held.
+bool apply_record_slice(file_t *fl, int src_fd, const commit_t *header, int64_t payload_pos, int64_t slice_start, int64_t slice_end,
+                        vector<commit_extent_t>& extents, int64_t *touched_start, int64_t *touched_end) {
+    vector<int64_t> positions;
+    if (!read_record_extents(src_fd, header, payload_pos, extents, positions)) {
+        VERBOSE_PRINT(do_verbose, "Failed to read the extents of record " << header->seq << " of file " << fl->filename << "\n");
+        return false;
+    }
+
+    vector<char> buffer;
+    for (size_t e = 0; e < extents.size(); e++) {
+        // The part of this extent's data that falls inside the slice
+        int64_t from_pos = max(slice_start, positions[e]);
+        int64_t to_pos = min(slice_end, positions[e] + extents[e].length);
+        if (from_pos >= to_pos) {
+            continue;
+        }
+        buffer.resize(to_pos - from_pos);
+        if (!read_full(src_fd, buffer.data(), buffer.size(), payload_pos + from_pos)) {
+            VERBOSE_PRINT(do_verbose, "Failed to read the payload of record " << header->seq << " of file " << fl->filename << "\n");
+            return false;
+        }
+
+        int64_t start = extents[e].offset + (from_pos - positions[e]);
+        int64_t end = start + (to_pos - from_pos);
+        auto it = fl->newest.upper_bound(start);
+        if (it != fl->newest.begin()) {
+            it--;
+        }
+        for (; it != fl->newest.end() && it->first < end; it++) {
+            if (it->second.seq != header->seq) {
+                continue;
+            }
+            int64_t from = max(start, it->first);
+            int64_t to = min(end, it->second.end);
+            if (from < to && pwrite(fl->fd, buffer.data() + (from - start), to - from, from) != to - from) {
+                VERBOSE_PRINT(do_verbose, "Failed to apply log bytes to file " << fl->filename << "\n");
+                return false;
+            }
+            // Copied pages of a private mapping do not see the pwrite, the bytes are read in
+            if (!fl->private_map) {
+                drop_overlay(fl, from, to);
+            } else if (!materialize_overlay(fl, from, to - from)) {
+                return false;
+            }
+        }
+        *touched_start = min(*touched_start, start);
+        *touched_end = max(*touched_end, end);
+    }
+    return true;
+}
+
+// Helper function to drop a fully applied record from the newest map, it no longer owns any bytes
+void forget_record(file_t *fl, const vector<commit_extent_t>& extents, uint64_t seq) {
+    for (const commit_extent_t& extent : extents) {
+        auto it = fl->newest.upper_bound(extent.offset);
+        if (it != fl->newest.begin()) {
+            it--;
+        }
+        while (it != fl->newest.end() && it->first < extent.offset + extent.length) {
+            it = (it->second.seq == seq) ? fl->newest.erase(it) : next(it);
+        }
+    }
+}
+
+int64_t wal_clean_file_bytes(file_t *fl, int64_t budget);
+
+// Helper function for gtfs_clean_n_bytes: applies at most budget payload bytes from
+// the head of an open file's log, then persists the new head. Records may be applied
+// in pieces. Returns the bytes applied, or -1 on error. Needs fl->mtx held.
+int64_t clean_file_bytes(file_t *fl, int64_t budget) {
+    if (fl->mode == GTFS_OPEN_READ) {
+        return 0; // Logs nothing
+    }
+    wait_inflight(fl);
+    if (fl->data == NULL) {
+        return 0; // Closed while waiting
+    }
+    if (fl->gtfs->wal) {
+        return wal_clean_file_bytes(fl, budget);
+    }
+    log_meta_t& meta = fl->log_meta;
+    int64_t applied = 0;
+    int64_t touched_start = INT64_MAX, touched_end = 0;
+    bool moved = false;
+
+    while (meta.head < fl->log_tail && applied < budget) {
+        commit_t commit_meta;
+        if (!read_full(fl->log_fd, &commit_meta, sizeof(commit_t), meta.head)) {
+            VERBOSE_PRINT(do_verbose, "Failed to read record at " << meta.head << " in log " << fl->log_path << "\n");
+            return -1;
+        }
+        int64_t n = min(budget - applied, commit_meta.length - meta.head_done);
+        vector<commit_extent_t> extents;
+        if (!apply_record_slice(fl, fl->log_fd, &commit_meta, meta.head + sizeof(commit_t), meta.head_done, meta.head_done + n,
+                                extents, &touched_start, &touched_end)) {
+            return -1;
+        }
+        applied += n;
+        meta.head_done += n;
+        moved = true;
+
+        if (meta.head_done == commit_meta.length) {
+            forget_record(fl, extents, commit_meta.seq);
+            meta.head += sizeof(commit_t) + commit_meta.length + sizeof(commit_trailer_t);
+            meta.head_seq++;
+            meta.head_done = 0;
+        }
+    }
+
+    if (!moved) {
+        return 0;
+    }
+    restore_outstanding(fl, touched_start, touched_end);
+
+    // The applied bytes must be in the data file before the head moves past them
+    stat_add(stats_of(fl), &gtfs_stats_t::checkpoint_bytes, applied);
+    GTFS_TRACE_EVENT(GTFS_OP_CLEAN_FILE, fl->trace_id, meta.head, applied, 0);
+    if (!flush_fd(fl->fd, stats_of(fl))) {
+        VERBOSE_PRINT(do_verbose, "Failed to flush file " << fl->filename << "\n");
+        return -1;
+    }
+    if (meta.head == fl->log_tail) {
+        return reset_log(fl) ? applied : -1;
+    }
+    if (!write_log_header(fl->log_fd, &meta)) {
+        VERBOSE_PRINT(do_verbose, "Failed to persist head of log " << fl->log_path << "\n");
+        return -1;
+    }
+    publish_log_state(fl);
+
+    // Give whole segments behind the head back to the file system. The header has to
+    // be durable first, or recovery could start from a head that was punched out.
+    // A preallocated log keeps them, they are overwritten once the log is emptied.
+    int64_t segment_end = LOG_HEADER_SIZE + (meta.head - LOG_HEADER_SIZE) / GTFS_LOG_SEGMENT_SIZE * GTFS_LOG_SEGMENT_SIZE;
+    if (fl->log_prealloc == 0 && segment_end > fl->log_reclaimed) {
+        if (flush_fd(fl->log_fd, stats_of(fl)) &&
+            fallocate(fl->log_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, fl->log_reclaimed, segment_end - fl->log_reclaimed) == 0) {
+            VERBOSE_PRINT(do_verbose, "Reclaimed " << (segment_end - fl->log_reclaimed) << " bytes of log " << fl->log_path << "\n");
+            fl->log_reclaimed = segment_end;
+        }
+    }
+    return applied;
+}
+
+// Background checkpointer: wakes up periodically (or when a log crosses the size
+// threshold) and checkpoints open files whose log is too large or too old.
+// Each file is locked on its own, so writers on other files are never blocked.
+void checkpointer_main(gtfs_t *gtfs) {
+    unique_lock<mutex> lock(gtfs->ckpt_mutex);
+    while (!gtfs->ckpt_stop) {
+        // Check often enough to honour the age threshold
+        int period_ms = max(1, min(GTFS_CHECKPOINT_POLL_MS, gtfs->checkpoint_age_ms / 2));
+        gtfs->ckpt_cv.wait_for(lock, chrono::milliseconds(period_ms));
+        if (gtfs->ckpt_stop) {
+            break;
+        }
+        int64_t max_bytes = gtfs->checkpoint_bytes;
+        int max_age_ms = gtfs->checkpoint_age_ms;
+        lock.unlock();
+
+        vector<file_t*> files;
+        {
+            lock_guard<mutex> files_lock(gtfs->files_mutex);
+            for (auto &entry : gtfs->open_files) {
+                files.push_back(entry.second);
+            }
+        }
+
+        auto now = chrono::steady_clock::now();
+        for (file_t *fl : files) {
+            lock_guard<mutex> file_lock(fl->mtx);
+            if (fl->data == NULL || log_pending(fl) == 0) {
+                continue; // Closed in the meantime, or nothing to do
+            }
+            bool too_big = max_bytes > 0 && log_pending(fl) >= max_bytes;
+            bool too_old = max_age_ms > 0 && now - fl->log_oldest >= chrono::milliseconds(max_age_ms);
+            if (!too_big && !too_old) {
+                continue;
+            }
+            auto start = chrono::steady_clock::now();
+            if (!checkpoint_file(fl)) {
+                VERBOSE_PRINT(do_verbose, "Background checkpoint of " << fl->filename << " failed\n");
+            }
+            stat_latency(stats_of(fl), &gtfs_stats_t::clean_latency, start);
+        }
+
+        // With the WAL, apply the files that keep the oldest segment from being reused
+        wal_segment_t *oldest = NULL;
+        if (gtfs->wal) {
+            lock_guard<mutex> wal_lock(gtfs->wal_mutex);
+            if ((int)gtfs->wal_segments.size() > gtfs->wal_max_segments) {
+                oldest = gtfs->wal_segments.front();
+            }
+        }
+        for (file_t *fl : files) {
+            if (oldest == NULL) {
+                break;
+            }
+            lock_guard<mutex> file_lock(fl->mtx);
+            if (fl->data != NULL && !fl->wal_records.empty() && fl->wal_records.front().segment == oldest && !checkpoint_file(fl)) {
+                VERBOSE_PRINT(do_verbose, "Background checkpoint of " << fl->filename << " failed\n");
+            }
+        }
+        lock.lock();
+    }
+}
+
+// Helper function to start the checkpointer in the calling process if it is enabled
+// and not running here yet (a forked child inherits the settings but not the thread)
+void ensure_checkpointer(gtfs_t *gtfs) {
+    lock_guard<mutex> lock(gtfs->ckpt_mutex);
+    if (gtfs->checkpointer_enabled && gtfs->checkpointer_pid != getpid()) {
+        gtfs->ckpt_stop = 0;
+        gtfs->checkpointer = new thread(checkpointer_main, gtfs);
+        gtfs->checkpointer_pid = getpid();
+    }
+}
+
+// Helper function for the sync paths: accounts for a record appended to the log and
+// wakes the checkpointer once the log crosses the size threshold. Needs fl->mtx held.
+void note_log_append(file_t *fl, int64_t bytes) {
+    if (log_pending(fl) == 0) {
+        fl->log_oldest = chrono::steady_clock::now();
+    }
+    if (fl->gtfs->wal) {
+        fl->wal_pending += bytes;
+    } else {
+        fl->log_tail += bytes;
+        fl->log_unflushed = 1;
+    }
+    stat_add(stats_of(fl), &gtfs_stats_t::bytes_logged, bytes);
+    publish_log_state(fl);
+    gtfs_t *gtfs = fl->gtfs;
+    if (gtfs->checkpointer_enabled && gtfs->checkpoint_bytes > 0 && log_pending(fl) >= gtfs->checkpoint_bytes) {
+        gtfs->ckpt_cv.notify_one();
+    }
+}
+
+// Helper function to get the directory holding the segments of the directory WAL
+string get_wal_dir(const string& dirname) {
+    return dirname + "/.logs/.wal";
+}
+
+// Helper function to write the header of a WAL segment
+bool write_wal_segment_header(wal_segment_t *segment) {
+    wal_segment_header_t header;
+    memset(&header, 0, sizeof(wal_segment_header_t));
+    header.magic = WAL_SEGMENT_MAGIC;
+    header.version = LOG_FORMAT_VERSION;
+    header.index = segment->index;
+    header.first_seq = segment->first_seq;
+    header.crc = crc32c(0, &header, offsetof(wal_segment_header_t, crc));
+    return pwrite(segment->fd, &header, sizeof(wal_segment_header_t), 0) == (ssize_t)sizeof(wal_segment_header_t);
+}
+
+// Helper function to read and check the header of a WAL segment
+bool read_wal_segment_header(int fd, wal_segment_header_t *header) {
+    return read_full(fd, header, sizeof(wal_segment_header_t), 0) && header->magic == WAL_SEGMENT_MAGIC &&
+           header->version == LOG_FORMAT_VERSION && header->crc == crc32c(0, header, offsetof(wal_segment_header_t, crc));
+}
+
+// Helper function to close and delete a WAL segment
+void drop_wal_segment(wal_segment_t *segment) {
+    munmap(segment->map, segment->size);
+    close(segment->fd);
+    remove(segment->path.c_str());
+    delete segment;
+}
+
+// Helper function to start a new active segment. The oldest segment is reused when all of
+// its records are applied, else a new one is created and preallocated. min_size makes room
+// for a record larger than the configured segment size. Needs gtfs->wal_mutex held.
+bool wal_roll_segment(gtfs_t *gtfs, int64_t min_size) {
+    wal_segment_t *segment = NULL;
+    deque<wal_segment_t*>& segments = gtfs->wal_segments;
+    if (segments.size() > 1 && segments.front()->pending == 0 && segments.front()->size >= min_size) {
+        segment = segments.front();
+        segments.pop_front();
+    } else {
+        segment = new wal_segment_t();
+        segment->path = get_wal_dir(gtfs->dirname) + "/segment." + to_string(gtfs->wal_next_name++);
+        segment->size = max(gtfs->wal_segment_size, min_size);
+        segment->fd = open(segment->path.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (segment->fd == -1) {
+            VERBOSE_PRINT(do_verbose, "Failed to create WAL segment " << segment->path << "\n");
+            delete segment;
+            return false;
+        }
+        // Appends then never change the size of the segment
+        if (fallocate(segment->fd, 0, 0, segment->size) != 0 && ftruncate(segment->fd, segment->size) != 0) {
+            VERBOSE_PRINT(do_verbose, "Failed to preallocate WAL segment " << segment->path << "\n");
+            close(segment->fd);
+            remove(segment->path.c_str());
+            delete segment;
+            return false;
+        }
+        segment->map = (char*)mmap(NULL, segment->size, PROT_READ, MAP_SHARED, segment->fd, 0);
+        if (segment->map == MAP_FAILED) {
+            VERBOSE_PRINT(do_verbose, "Failed to mmap WAL segment " << segment->path << "\n");
+            close(segment->fd);
+            remove(segment->path.c_str());
+            delete segment;
+            return false;
+        }
+    }
+
+    // Records left over from an earlier use are older than first_seq, so recovery never takes them
+    segment->index = gtfs->wal_next_index++;
+    segment->first_seq = gtfs->wal_next_seq;
+    segment->tail = LOG_HEADER_SIZE;
+    segment->pending = 0;
+    segment->named.clear();
+    if (!write_wal_segment_header(segment)) {
+        VERBOSE_PRINT(do_verbose, "Failed to write the header of WAL segment " << segment->path << "\n");
+        drop_wal_segment(segment);
+        return false;
+    }
+    segments.push_back(segment);
+
+    if ((int)segments.size() > gtfs->wal_max_segments) {
+        gtfs->ckpt_cv.notify_one();
+    }
+    return true;
+}
+
+// Helper function to flush the records appended to the active WAL segment since its last
+// flush, timed in durable_latency. Needs gtfs->wal_mutex held.
+bool wal_flush_active(gtfs_t *gtfs) {
+    if (!gtfs->wal_unflushed) {
+        return true;
+    }
+    stats_ref_t stats{ stats_shard(gtfs->stats), NULL };
+    auto start = chrono::steady_clock::now();
+    if (!flush_fd(gtfs->wal_segments.back()->fd, stats)) {
+        VERBOSE_PRINT(do_verbose, "Failed to flush WAL segment " << gtfs->wal_segments.back()->path << "\n");
+        return false;
+    }
+    stat_latency(stats, &gtfs_stats_t::durable_latency, start);
+    gtfs->wal_unflushed = 0;
+    gtfs->wal_flushed = chrono::steady_clock::now();
+    return true;
+}
+
+// Helper function to give back segments beyond the configured number once all of
+// their records are applied. Needs gtfs->wal_mutex held.
+void wal_trim(gtfs_t *gtfs) {
+    deque<wal_segment_t*>& segments = gtfs->wal_segments;
+    while ((int)segments.size() > gtfs->wal_max_segments && segments.front()->pending == 0) {
+        drop_wal_segment(segments.front());
+        segments.pop_front();
+    }
+}
+
+// A file's share of a record on its way into the WAL
+typedef struct wal_piece {
+    file_t *fl;
+    uint16_t type; // COMMIT_TYPE_WRITE or COMMIT_TYPE_MULTI
+    int64_t offset; // For COMMIT_TYPE_WRITE
+    int64_t length;
+    struct iovec *iov; // The payload
+    int iovcnt;
+    const commit_extent_t *extents; // The bytes it covers
+    size_t extent_count;
+} wal_piece_t;
+
+// Helper function to append records to the directory WAL. Record r is made of the pieces
+// from record_ends[r - 1] up to record_ends[r]. The mutex of every file involved must
+// be held. Records go out with one write per segment they land in.
+bool wal_append(gtfs_t *gtfs, wal_piece_t *pieces, const size_t *record_ends, size_t records) {
+    // Checksum the payloads before taking the WAL lock
+    vector<wal_part_t> parts(record_ends[records - 1]);
+    vector<uint32_t> payload_crcs(records);
+    vector<int64_t> payload_lengths(records);
+    size_t p = 0;
+    for (size_t r = 0; r < records; r++) {
+        uint32_t crc = 0;
+        int64_t length = 0;
+        for (; p < record_ends[r]; p++) {
+            memset(&parts[p], 0, sizeof(wal_part_t));
+            parts[p].file_id = pieces[p].fl->wal_id;
+            parts[p].type = pieces[p].type;
+            parts[p].offset = pieces[p].offset;
+            parts[p].length = pieces[p].length;
+            crc = crc32c(crc, &parts[p], sizeof(wal_part_t));
+            for (int k = 0; k < pieces[p].iovcnt; k++) {
+                crc = crc32c(crc, pieces[p].iov[k].iov_base, pieces[p].iov[k].iov_len);
+            }
+            length += sizeof(wal_part_t) + pieces[p].length;
+        }
+        payload_crcs[r] = crc;
+        payload_lengths[r] = length;
+    }
+
+    lock_guard<mutex> lock(gtfs->wal_mutex);
+    // Storage for everything the iovecs point at, deques keep it in place as they grow
+    deque<commit_t> headers;
+    deque<commit_trailer_t> trailers;
+    deque<wal_part_t> name_parts;
+    vector<struct iovec> iov;
+    vector<uint32_t> named; // Names this write adds to the segment
+    vector<pair<size_t, wal_ref_t>> refs; // Piece, and where its payload went
+
+    wal_segment_t *segment = gtfs->wal_segments.back();
+    int64_t pos = segment->tail;
+    uint64_t first_seq = gtfs->wal_next_seq;
+
+    // Writes out what was gathered for the current segment and does the bookkeeping
+    auto flush = [&]() {
+        if (!iov.empty() && !append_log(segment->fd, iov.data(), iov.size(), segment->tail)) {
+            VERBOSE_PRINT(do_verbose, "Failed to append to WAL segment " << segment->path << "\n");
+            gtfs->wal_next_seq = first_seq; // Nothing after the torn record may count
+            return false;
+        }
+        GTFS_TRACE_EVENT(GTFS_OP_WAL_APPEND, 0, segment->tail, pos - segment->tail, refs.size());
+        gtfs->wal_unflushed = gtfs->wal_unflushed || !iov.empty();
+        segment->tail = pos;
+        segment->named.insert(segment->named.end(), named.begin(), named.end());
+        for (auto &entry : refs) {
+            wal_piece_t &piece = pieces[entry.first];
+            file_t *fl = piece.fl;
+            if (fl->wal_records.empty()) {
+                fl->wal_done = 0;
+            }
+            fl->wal_records.push_back(entry.second);
+            segment->pending++;
+            for (size_t e = 0; e < piece.extent_count; e++) {
+                note_newest(fl, piece.extents[e].offset, piece.extents[e].length, entry.second.seq);
+            }
+            note_log_append(fl, entry.second.bytes);
+        }
+        iov.clear();
+        named.clear();
+        refs.clear();
+        first_seq = gtfs->wal_next_seq;
+        return true;
+    };
+
+    p = 0;
+    for (size_t r = 0; r < records; r++) {
+        size_t begin = p;
+        size_t end = record_ends[r];
+        // Files of this record whose name is not in the segment yet
+        auto missing_names = [&]() {
+            vector<size_t> missing;
+            for (size_t q = begin; q < end; q++) {
+                uint32_t id = pieces[q].fl->wal_id;
+                bool known = find(segment->named.begin(), segment->named.end(), id) != segment->named.end() ||
+                             find(named.begin(), named.end(), id) != named.end();
+                for (size_t m : missing) {
+                    known = known || pieces[m].fl->wal_id == id;
+                }
+                if (!known) {
+                    missing.push_back(q);
+                }
+            }
+            return missing;
+        };
+        auto record_bytes = [&](const vector<size_t>& missing) {
+            int64_t bytes = sizeof(commit_t) + payload_lengths[r] + sizeof(commit_trailer_t);
+            for (size_t q : missing) {
+                bytes += sizeof(commit_t) + sizeof(wal_part_t) + pieces[q].fl->filename.length() + sizeof(commit_trailer_t);
+            }
+            return bytes;
+        };
+
+        vector<size_t> missing = missing_names();
+        if (pos + record_bytes(missing) > segment->size) {
+            // The syncer only flushes the active segment, the one left behind is flushed here
+            if (!flush() || (gtfs->durability != GTFS_DURABLE_PROCESS && !wal_flush_active(gtfs)) ||
+                !wal_roll_segment(gtfs, LOG_HEADER_SIZE + record_bytes(missing))) {
+                return false;
+            }
+            segment = gtfs->wal_segments.back();
+            pos = segment->tail;
+            missing = missing_names();
+        }
+
+        for (size_t q : missing) {
+            file_t *fl = pieces[q].fl;
+            name_parts.push_back(wal_part_t());
+            wal_part_t& part = name_parts.back();
+            memset(&part, 0, sizeof(wal_part_t));
+            part.file_id = fl->wal_id;
+            part.length = fl->filename.length();
+            headers.push_back(commit_t());
+            trailers.push_back(commit_trailer_t());
+            uint32_t crc = crc32c(crc32c(0, &part, sizeof(wal_part_t)), fl->filename.data(), part.length);
+            seal_record(&headers.back(), &trailers.back(), COMMIT_TYPE_WAL_NAME, gtfs->wal_next_seq++, 0, sizeof(wal_part_t) + part.length, crc);
+            iov.push_back({ &headers.back(), sizeof(commit_t) });
+            iov.push_back({ &part, sizeof(wal_part_t) });
+            iov.push_back({ (void*)fl->filename.data(), (size_t)part.length });
+            iov.push_back({ &trailers.back(), sizeof(commit_trailer_t) });
+            pos += sizeof(commit_t) + sizeof(wal_part_t) + part.length + sizeof(commit_trailer_t);
+            named.push_back(fl->wal_id);
+        }
+
+        headers.push_back(commit_t());
+        trailers.push_back(commit_trailer_t());
+        uint64_t seq = gtfs->wal_next_seq++;
+        seal_record(&headers.back(), &trailers.back(), COMMIT_TYPE_WAL, seq, 0, payload_lengths[r], payload_crcs[r]);
+        iov.push_back({ &headers.back(), sizeof(commit_t) });
+        pos += sizeof(commit_t);
+        for (; p < end; p++) {
+            iov.push_back({ &parts[p], sizeof(wal_part_t) });
+            iov.insert(iov.end(), pieces[p].iov, pieces[p].iov + pieces[p].iovcnt);
+            pos += sizeof(wal_part_t);
+            wal_ref_t ref;
+            ref.segment = segment;
+            ref.pos = pos;
+            ref.type = pieces[p].type;
+            ref.offset = pieces[p].offset;
+            ref.length = pieces[p].length;
+            ref.seq = seq;
+            ref.bytes = sizeof(commit_t) + sizeof(wal_part_t) + pieces[p].length + sizeof(commit_trailer_t);
+            refs.push_back(make_pair(p, ref));
+            pos += pieces[p].length;
+        }
+        iov.push_back({ &trailers.back(), sizeof(commit_trailer_t) });
+        pos += sizeof(commit_trailer_t);
+    }
+    if (!flush()) {
+        return false;
+    }
+    // Segments are preallocated and reused, so O_DSYNC would not cover them; both levels flush
+    if (gtfs->durability == GTFS_DURABLE_COMMIT || gtfs->durability == GTFS_DURABLE_DSYNC) {
+        return wal_flush_active(gtfs);
+    }
+    return true;
+}
+
+// Background syncer: flushes the logs of GTFS_DURABLE_PERIODIC files that have new records
+// once their interval has passed since the last flush, and the active WAL segment when the
+// WAL is at that level. Each file is locked on its own and the fdatasync runs without it.
+// A transaction part in such a log keeps the transaction log from being cut back until a
+// pass has flushed it, so the syncer then flushes every log with new records. The syncer
+// exits once a pass finds no periodic file or WAL and no level was chosen meanwhile.
+void syncer_main(gtfs_t *gtfs) {
+    unique_lock<mutex> lock(gtfs->syncer_mutex);
+    while (!gtfs->syncer_stop) {
+        gtfs->syncer_wanted = 0; // Levels chosen from here on are seen by this pass or the next
+        lock.unlock();
+
+        uint64_t parts = gtfs->periodic_parts.load();
+        bool forced = parts != gtfs->periodic_flushed.load();
+        vector<file_t*> files;
+        {
+            lock_guard<mutex> files_lock(gtfs->files_mutex);
+            for (auto &entry : gtfs->open_files) {
+                files.push_back(entry.second);
+            }
+        }
+
+        auto now = chrono::steady_clock::now();
+        auto wake = now + chrono::milliseconds(GTFS_SYNCER_POLL_MS);
+        bool flushed = true;
+        bool periodic = false;
+        for (file_t *fl : files) {
+            unique_lock<mutex> file_lock(fl->mtx);
+            if (fl->data == NULL || fl->durability != GTFS_DURABLE_PERIODIC) {
+                continue; // Closed in the meantime, or not ours to flush
+            }
+            periodic = true;
+            auto interval = chrono::milliseconds(fl->durable_interval_ms);
+            if (fl->log_unflushed && (forced || now - fl->log_flushed >= interval) && !flush_file_log(fl, &file_lock)) {
+                VERBOSE_PRINT(do_verbose, "Background flush of the log of " << fl->filename << " failed\n");
+                flushed = false;
+            }
+            wake = min(wake, max(now, fl->log_flushed) + interval);
+        }
+        if (flushed) {
+            gtfs->periodic_flushed.store(parts);
+        }
+
+        if (gtfs->wal) {
+            lock_guard<mutex> wal_lock(gtfs->wal_mutex);
+            if (gtfs->durability == GTFS_DURABLE_PERIODIC && !gtfs->wal_segments.empty()) {
+                periodic = true;
+                auto interval = chrono::milliseconds(gtfs->durable_interval_ms);
+                if (now - gtfs->wal_flushed >= interval) {
+                    wal_flush_active(gtfs);
+                }
+                wake = min(wake, max(now, gtfs->wal_flushed) + interval);
+            }
+        }
+
+        lock.lock();
+        if (!periodic && !gtfs->syncer_wanted) {
+            break;
+        }
+        wake = max(wake, chrono::steady_clock::now() + chrono::milliseconds(1));
+        gtfs->syncer_cv.wait_until(lock, wake, [gtfs] { return gtfs->syncer_stop != 0; });
+    }
+    gtfs->syncer_running = 0;
+}
+
+// Helper function to start the syncer in the calling process if there are periodic logs to
+// flush (periodic: a periodic level was just chosen, or a file opened at one) and it is not
+// running here (a forked child inherits the levels but not the thread). A syncer of this
+// process that exited on its own is joined first, one being stopped is waited for.
+void ensure_syncer(gtfs_t *gtfs, bool periodic) {
+    unique_lock<mutex> lock(gtfs->syncer_mutex);
+    gtfs->syncer_cv.wait(lock, [gtfs] { return gtfs->syncer_stop == 0; });
+    if (periodic) {
+        gtfs->syncer_wanted = 1;
+    }
+    if (!gtfs->syncer_wanted) {
+        return;
+    }
+    if (gtfs->syncer_pid == getpid()) {
+        if (gtfs->syncer_running) {
+            return;
+        }
+        gtfs->syncer->join();
+        delete gtfs->syncer;
+    }
+    gtfs->syncer_running = 1;
+    gtfs->syncer = new thread(syncer_main, gtfs); // An inherited handle is dropped, it is not ours to join
+    gtfs->syncer_pid = getpid();
+}
+
+// Helper function to tell whether the syncer still has logs to flush. Takes files_mutex
+// and the files' locks, so it may be called with syncer_mutex held.
+bool periodic_left(gtfs_t *gtfs) {
+    if (gtfs->wal && gtfs->durability == GTFS_DURABLE_PERIODIC) {
+        return true;
+    }
+    lock_guard<mutex> files_lock(gtfs->files_mutex);
+    for (auto &entry : gtfs->open_files) {
+        lock_guard<mutex> file_lock(entry.second->mtx);
+        if (entry.second->data != NULL && entry.second->durability == GTFS_DURABLE_PERIODIC) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Helper function for the setters: stops the syncer of the calling process and joins it,
+// unless some periodic file or WAL is left
+void stop_syncer(gtfs_t *gtfs) {
+    thread *syncer = NULL;
+    {
+        unique_lock<mutex> lock(gtfs->syncer_mutex);
+        gtfs->syncer_cv.wait(lock, [gtfs] { return gtfs->syncer_stop == 0; }); // One stop at a time
+        if (periodic_left(gtfs)) {
+            return;
+        }
+        if (gtfs->syncer_pid == getpid()) {
+            syncer = gtfs->syncer;
+        }
+        gtfs->syncer_stop = 1;
+        gtfs->syncer_wanted = 0;
+        gtfs->syncer = NULL;
+        gtfs->syncer_pid = 0;
+    }
+    gtfs->syncer_cv.notify_all();
+
+    if (syncer) {
+        syncer->join();
+        delete syncer;
+    }
+    {
+        lock_guard<mutex> lock(gtfs->syncer_mutex);
+        gtfs->syncer_stop = 0;
+    }
+    gtfs->syncer_cv.notify_all(); // Wakes an ensure_syncer that waited for the stop
+}
+
+// Helper function to log writes of one file in the WAL, one record each. Needs fl->mtx held.
+bool wal_append_writes(file_t *fl, write_t **writes, size_t count) {
+    vector<wal_piece_t> pieces(count);
+    vector<struct iovec> iov(count);
+    vector<commit_extent_t> extents(count);
+    vector<size_t> record_ends(count);
+    for (size_t k = 0; k < count; k++) {
+        extents[k] = commit_extent_t{ writes[k]->offset, writes[k]->length };
+        iov[k] = { writes[k]->data, (size_t)writes[k]->length };
+        pieces[k] = { fl, COMMIT_TYPE_WRITE, writes[k]->offset, writes[k]->length, &iov[k], 1, &extents[k], 1 };
+        record_ends[k] = k + 1;
+    }
+    return wal_append(fl->gtfs, pieces.data(), record_ends.data(), count);
+}
+
+// Helper function to log that a file was closed with all of its records applied, so
+// recovery does not take its older records from the WAL. Needs fl->mtx held.
+bool wal_note_close(file_t *fl) {
+    gtfs_t *gtfs = fl->gtfs;
+    lock_guard<mutex> lock(gtfs->wal_mutex);
+    wal_part_t part;
+    memset(&part, 0, sizeof(wal_part_t));
+    part.file_id = fl->wal_id;
+
+    int64_t bytes = sizeof(commit_t) + sizeof(wal_part_t) + sizeof(commit_trailer_t);
+    wal_segment_t *segment = gtfs->wal_segments.back();
+    if (segment->tail + bytes > segment->size) {
+        if (!wal_roll_segment(gtfs, LOG_HEADER_SIZE + bytes)) {
+            return false;
+        }
+        segment = gtfs->wal_segments.back();
+    }
+    // A file only named in earlier segments needs no name, recovery drops whatever it has for the id
+    commit_t header;
+    commit_trailer_t trailer;
+    seal_record(&header, &trailer, COMMIT_TYPE_WAL_CLOSE, gtfs->wal_next_seq, 0, sizeof(wal_part_t), crc32c(0, &part, sizeof(wal_part_t)));
+    struct iovec iov[3] = { { &header, sizeof(commit_t) }, { &part, sizeof(wal_part_t) }, { &trailer, sizeof(commit_trailer_t) } };
+    if (!append_log(segment->fd, iov, 3, segment->tail)) {
+        VERBOSE_PRINT(do_verbose, "Failed to log the close of " << fl->filename << " in WAL segment " << segment->path << "\n");
+        return false;
+    }
+    gtfs->wal_next_seq++;
+    segment->tail += bytes;
+    return true;
+}
+
+// Helper function to drop the count oldest records of a file once they are applied, and to
+// give back segments that are no longer needed. Needs fl->mtx held.
+void wal_release_records(file_t *fl, size_t count) {
+    gtfs_t *gtfs = fl->gtfs;
+    lock_guard<mutex> lock(gtfs->wal_mutex);
+    for (size_t k = 0; k < count; k++) {
+        wal_ref_t& ref = fl->wal_records.front();
+        ref.segment->pending--;
+        fl->wal_pending -= ref.bytes;
+        fl->wal_records.pop_front();
+    }
+    fl->wal_done = 0;
+    wal_trim(gtfs);
+    publish_log_state(fl);
+}
+
+// Helper function to checkpoint an open file in WAL mode: its records are read straight
+// from the mapped segments, applied like replay_log does, and released. As in
+// checkpoint_file the mapping is used instead when it holds the committed bytes.
+// Needs fl->mtx held.
+bool wal_checkpoint_file(file_t *fl) {
+    if (fl->wal_records.empty()) {
+        return true;
+    }
+
+    bool from_mapping = mapping_committed(fl);
+    if (from_mapping) {
+        if (!flush_committed(fl)) {
+            return false;
+        }
+    } else {
+        map<int64_t, log_extent_t> extents;
+        int64_t skip = fl->wal_done; // Part of the oldest record that gtfs_clean_n_bytes already applied
+        for (const wal_ref_t& ref : fl->wal_records) {
+            const char *payload = ref.segment->map + ref.pos;
+            for_each_extent(ref.type, ref.offset, ref.length, payload, fl->file_length, [&](int64_t extent_offset, int64_t extent_length, int64_t extent_pos) {
+                int64_t from = max(skip, extent_pos) - extent_pos;
+                if (from < extent_length) {
+                    insert_extent(extents, extent_offset + from, log_extent_t{ extent_offset + extent_length, payload + extent_pos + from });
+                }
+            });
+            skip = 0;
+        }
+        if (!write_extents(fl->fd, extents) || !flush_fd(fl->fd, stats_of(fl))) {
+            VERBOSE_PRINT(do_verbose, "Failed to apply the WAL records of file " << fl->filename << "\n");
+            return false;
+        }
+    }
+
+    size_t count = fl->wal_records.size();
+    wal_release_records(fl, count);
+    fl->newest.clear();
+    if (!from_mapping || fl->private_map) {
+        restore_outstanding(fl, 0, fl->file_length);
+    }
+    VERBOSE_PRINT(do_verbose, "Checkpointed " << count << " WAL records of file " << fl->filename << "\n");
+    return true;
+}
+
+// Helper function for gtfs_clean_n_bytes in WAL mode, the counterpart of clean_file_bytes.
+// Nothing has to be persisted: recovery replays the retained segments in order, which
+// leaves every byte with its newest committed value. Needs fl->mtx held.
+int64_t wal_clean_file_bytes(file_t *fl, int64_t budget) {
+    int64_t applied = 0;
+    int64_t touched_start = INT64_MAX, touched_end = 0;
+    size_t finished = 0;
+
+    while (finished < fl->wal_records.size() && applied < budget) {
+        const wal_ref_t& ref = fl->wal_records[finished];
+        commit_t header;
+        header.type = ref.type;
+        header.seq = ref.seq;
+        header.offset = ref.offset;
+        header.length = ref.length;
+        int64_t n = min(budget - applied, ref.length - fl->wal_done);
+        vector<commit_extent_t> extents;
+        if (!apply_record_slice(fl, ref.segment->fd, &header, ref.pos, fl->wal_done, fl->wal_done + n, extents, &touched_start, &touched_end)) {
+            return -1;
+        }
+        applied += n;
+        fl->wal_done += n;
+        if (fl->wal_done == ref.length) {
+            forget_record(fl, extents, ref.seq);
+            fl->wal_done = 0;
+            finished++;
+        }
+    }
+    if (touched_start >= touched_end && finished == 0) {
+        return applied;
+    }
+    restore_outstanding(fl, touched_start, touched_end);
+    stat_add(stats_of(fl), &gtfs_stats_t::checkpoint_bytes, applied);
+    GTFS_TRACE_EVENT(GTFS_OP_CLEAN_FILE, fl->trace_id, 0, applied, 0);
+    if (!flush_fd(fl->fd, stats_of(fl))) {
+        VERBOSE_PRINT(do_verbose, "Failed to flush file " << fl->filename << "\n");
+        return -1;
+    }
+    int64_t done = fl->wal_done;
+    wal_release_records(fl, finished);
+    fl->wal_done = done;
+    return applied;
+}
+
+// Helper function to replay a WAL left behind by a process that is gone, and delete it.
+// The caller holds the WAL lock. Every file with records in it is brought up to date;
+// held_name is already locked by the caller on held_fd. The replay is counted in stats.
+bool replay_wal(const string& directory, const string& held_name, int held_fd, gtfs_stats_t *stats) {
+    string wal_dir = get_wal_dir(directory);
+    DIR *dir = opendir(wal_dir.c_str());
+    if (!dir) {
+        return true;
+    }
+    vector<string> paths;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (strncmp(entry->d_name, "segment.", 8) == 0) {
+            paths.push_back(wal_dir + "/" + entry->d_name);
+        }
+    }
+    closedir(dir);
+    if (paths.empty()) {
+        return true;
+    }
+
+    // Order the segments by their index, segments without a valid header hold nothing
+    typedef struct { uint64_t index; uint64_t first_seq; char *map; int64_t size; } mapped_segment_t;
+    vector<mapped_segment_t> segments;
+    for (const string& path : paths) {
+        int fd = open(path.c_str(), O_RDONLY);
+        struct stat st;
+        wal_segment_header_t header;
+        if (fd != -1 && fstat(fd, &st) == 0 && st.st_size > LOG_HEADER_SIZE && read_wal_segment_header(fd, &header)) {
+            char *map = (char*)mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map != MAP_FAILED) {
+                segments.push_back({ header.index, header.first_seq, map, st.st_size });
+            }
+        }
+        if (fd != -1) {
+            close(fd);
+        }
+    }
+    sort(segments.begin(), segments.end(), [](const mapped_segment_t& a, const mapped_segment_t& b) { return a.index < b.index; });
+
+    map<uint32_t, string> names;
+    map<string, map<int64_t, log_extent_t>> files;
+    uint64_t expected_seq = segments.empty() ? 0 : segments[0].first_seq;
+    size_t records = 0;
+    for (const mapped_segment_t& segment : segments) {
+        if (segment.first_seq != expected_seq) {
+            break; // The chain ended in an earlier segment
+        }
+        int64_t pos = LOG_HEADER_SIZE;
+        while (pos + (int64_t)(sizeof(commit_t) + sizeof(commit_trailer_t)) <= segment.size) {
+            commit_t commit_meta;
+            commit_trailer_t trailer;
+            memcpy(&commit_meta, segment.map + pos, sizeof(commit_t));
+            int64_t remaining = segment.size - pos - sizeof(commit_t) - sizeof(commit_trailer_t);
+            if (commit_meta.magic != COMMIT_MAGIC || commit_meta.version != LOG_FORMAT_VERSION ||
+                commit_meta.length < (int64_t)sizeof(wal_part_t) || commit_meta.length > remaining) {
+                break;
+            }
+            const char *payload = segment.map + pos + sizeof(commit_t);
+            memcpy(&trailer, payload + commit_meta.length, sizeof(commit_trailer_t));
+            if (!commit_record_valid(&commit_meta, payload, &trailer, expected_seq)) {
+                break;
+            }
+
+            wal_part_t part;
+            memcpy(&part, payload, sizeof(wal_part_t));
+            if (commit_meta.type == COMMIT_TYPE_WAL_NAME) {
+                names[part.file_id] = string(payload + sizeof(wal_part_t), min(part.length, commit_meta.length - (int64_t)sizeof(wal_part_t)));
+            } else if (commit_meta.type == COMMIT_TYPE_WAL_CLOSE) {
+                if (names.count(part.file_id)) {
+                    files.erase(names[part.file_id]);
+                }
+            } else if (commit_meta.type == COMMIT_TYPE_WAL) {
+                // Check every part before adding any of them, a record applies in full or not at all
+                bool valid = true;
+                for (int pass = 0; pass < 2 && valid; pass++) {
+                    int64_t part_pos = 0;
+                    while (valid && part_pos < commit_meta.length) {
+                        memcpy(&part, payload + part_pos, sizeof(wal_part_t));
+                        part_pos += sizeof(wal_part_t);
+                        valid = part.length >= 0 && part.length <= commit_meta.length - part_pos && names.count(part.file_id) &&
+                                for_each_extent(part.type, part.offset, part.length, payload + part_pos, INT64_MAX, [&](int64_t offset, int64_t length, int64_t extent_pos) {
+                                    if (pass == 1) {
+                                        insert_extent(files[names[part.file_id]], offset, log_extent_t{ offset + length, payload + part_pos + extent_pos });
+                                    }
+                                });
+                        part_pos += part.length;
+                    }
+                }
+                if (!valid) {
+                    VERBOSE_PRINT(do_verbose, "Malformed WAL record " << expected_seq << ", ignoring the rest of the WAL.\n");
+                    break;
+                }
+            } else {
+                break;
+            }
+            pos += sizeof(commit_t) + commit_meta.length + sizeof(commit_trailer_t);
+            expected_seq++;
+            records++;
+        }
+    }
+
+    bool ok = true;
+    for (auto &file : files) {
+        string file_path = directory + "/" + file.first;
+        int fd = held_fd;
+        if (file.first != held_name) {
+            fd = open(file_path.c_str(), O_RDWR);
+            if (fd == -1) {
+                VERBOSE_PRINT(do_verbose, "WAL records for " << file_path << " have no data file, skipping\n");
+                continue;
+            }
+            if (!acquire_writer_lock(fd, false)) {
+                VERBOSE_PRINT(do_verbose, "File " << file_path << " is open elsewhere, skipping its WAL records\n");
+                close(fd);
+                continue;
+            }
+        }
+        if (!write_extents(fd, file.second) || !flush_fd(fd, stats_ref_t{ stats, NULL })) {
+            VERBOSE_PRINT(do_verbose, "Failed to apply WAL records to " << file_path << "\n");
+            ok = false;
+        }
+        if (fd != held_fd) {
+            release_writer_lock(fd);
+            close(fd);
+        }
+    }
+    for (const mapped_segment_t& segment : segments) {
+        munmap(segment.map, segment.size);
+    }
+    if (!ok) {
+        return false;
+    }
+
+    // Everything is in the data files now, a new WAL starts from scratch
+    for (const string& path : paths) {
+        remove(path.c_str());
+    }
+    stat_add(stats_ref_t{ stats, NULL }, &gtfs_stats_t::recovery_records, records);
+    GTFS_TRACE_EVENT(GTFS_OP_RECOVER, 0, 0, records, 0);
+    VERBOSE_PRINT(do_verbose, "Replayed " << records << " WAL records into " << files.size() << " files\n");
+    return true;
+}
+
+// Helper function to recover the directory WAL if the process that used it is gone.
+// A live owner keeps the WAL locked, and the files it covers with it. Returns 1 if a
+// WAL was replayed, 0 if there is none or its owner is alive, -1 on failure.
+int recover_wal(const string& directory, const string& held_name, int held_fd, gtfs_stats_t *stats) {
+    string wal_dir = get_wal_dir(directory);
+    struct stat st;
+    if (stat(wal_dir.c_str(), &st) != 0) {
+        return 0;
+    }
+    string lock_path = wal_dir + "/lock";
+    int lock_fd = open(lock_path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (lock_fd == -1) {
+        VERBOSE_PRINT(do_verbose, "Failed to open WAL lock " << lock_path << "\n");
+        return -1;
+    }
+    if (flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+        close(lock_fd);
+        return 0;
+    }
+    bool ok = replay_wal(directory, held_name, held_fd, stats);
+    close(lock_fd);
+    return ok ? 1 : -1;
+}
+
+// Helper function to replay the WAL of a dead process, unless the registry knows that no
+// process has used one since. Returns false on failure.
+bool recover_registered_wal(gtfs_registry_t *registry, const string& directory, const string& held_name, int held_fd) {
+    if (registry && registry->wal_owner == 0) {
+        return true;
+    }
+    int replayed = recover_wal(directory, held_name, held_fd, registry ? stats_shard(registry->stats) : NULL);
+    if (replayed == 1 && registry) {
+        registry_lock(registry);
+        registry->wal_owner = 0;
+        registry_unlock(registry);
+    }
+    return replayed >= 0;
+}
+
+// Helper function to tell transaction logs apart from the logs of files in .logs
+bool is_txn_log_name(const string& name) {
+    const string prefix = ".txn.";
+    const string suffix = ".log";
+    return name.compare(0, prefix.length(), prefix) == 0 &&
+           !(name.length() >= suffix.length() && name.compare(name.length() - suffix.length(), suffix.length(), suffix) == 0);
+}
+
+// Helper function to collect, per file name, the parts of every intact cross-file
+// transaction in the transaction logs of the directory. Each log is read up to its
+// first torn or corrupt record.
+map<string, vector<txn_redo_t>> load_txn_redo(const string& directory) {
+    map<string, vector<txn_redo_t>> redo;
+    string logs_dir = directory + "/.logs";
+    DIR *dir = opendir(logs_dir.c_str());
+    if (!dir) {
+        return redo;
+    }
+    vector<string> names;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (is_txn_log_name(entry->d_name)) {
+            names.push_back(entry->d_name);
+        }
+    }
+    closedir(dir);
+
+    for (const string& name : names) {
+        string txn_path = logs_dir + "/" + name;
+        int txn_fd = open(txn_path.c_str(), O_RDONLY);
+        struct stat st;
+        if (txn_fd == -1 || fstat(txn_fd, &st) != 0) {
+            if (txn_fd != -1) {
+                close(txn_fd);
+            }
+            continue;
+        }
+        // Read, not mapped: a live owner may cut the log back while we look at it
+        vector<char> log(st.st_size);
+        bool ok = st.st_size == 0 || read_full(txn_fd, log.data(), log.size(), 0);
+        close(txn_fd);
+        if (!ok) {
+            continue;
+        }
+
+        int64_t pos = 0;
+        int64_t end = log.size();
+        uint64_t expected_seq = 1;
+        while (pos + (int64_t)(sizeof(commit_t) + sizeof(commit_trailer_t)) <= end) {
+            commit_t commit_meta;
+            commit_trailer_t trailer;
+            memcpy(&commit_meta, log.data() + pos, sizeof(commit_t));
+            int64_t remaining = end - pos - sizeof(commit_t) - sizeof(commit_trailer_t);
+            if (commit_meta.magic != COMMIT_MAGIC || commit_meta.version != LOG_FORMAT_VERSION || commit_meta.type != COMMIT_TYPE_TXN ||
+                commit_meta.length < 0 || commit_meta.length > remaining) {
+                break;
+            }
+            const char *payload = log.data() + pos + sizeof(commit_t);
+            memcpy(&trailer, payload + commit_meta.length, sizeof(commit_trailer_t));
+            if (!commit_record_valid(&commit_meta, payload, &trailer, expected_seq)) {
+                break;
+            }
+
+            // Split the record into its parts, all of them or none
+            vector<pair<string, txn_redo_t>> parts;
+            int64_t part_pos = 0;
+            while (part_pos + (int64_t)sizeof(txn_part_t) <= commit_meta.length) {
+                txn_part_t part;
+                memcpy(&part, payload + part_pos, sizeof(txn_part_t));
+                part_pos += sizeof(txn_part_t);
+                if (part.name_length > MAX_FILENAME_LEN || part.length < 0 ||
+                    (int64_t)part.name_length + part.length > commit_meta.length - part_pos) {
+                    break;
+                }
+                txn_redo_t part_redo;
+                part_redo.log_id = part.log_id;
+                part_redo.seq = part.seq;
+                part_redo.payload.assign(payload + part_pos + part.name_length, payload + part_pos + part.name_length + part.length);
+                parts.push_back(make_pair(string(payload + part_pos, part.name_length), part_redo));
+                part_pos += part.name_length + part.length;
+            }
+            if (part_pos != commit_meta.length) {
+                VERBOSE_PRINT(do_verbose, "Malformed transaction " << expected_seq << " in " << txn_path << ", ignoring the rest of the log.\n");
+                break;
+            }
+            for (auto &part : parts) {
+                redo[part.first].push_back(move(part.second));
+            }
+            pos += sizeof(commit_t) + commit_meta.length + sizeof(commit_trailer_t);
+            expected_seq++;
+        }
+    }
+    return redo;
+}
+
+// Helper function for gtfs_init: removes the transaction logs of processes that are
+// gone, once every file they cover has been recovered. A live owner keeps its log locked.
+// The registry (if any) is left with the number of logs that are still in use.
+void remove_dead_txn_logs(const string& directory, gtfs_registry_t *registry) {
+    string logs_dir = directory + "/.logs";
+    DIR *dir = opendir(logs_dir.c_str());
+    if (!dir) {
+        return;
+    }
+    int live = 0;
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        if (!is_txn_log_name(entry->d_name)) {
+            continue;
+        }
+        string txn_path = logs_dir + "/" + entry->d_name;
+        int txn_fd = open(txn_path.c_str(), O_RDONLY);
+        if (txn_fd == -1) {
+            continue;
+        }
+        if (flock(txn_fd, LOCK_EX | LOCK_NB) == 0) {
+            VERBOSE_PRINT(do_verbose, "Removing transaction log " << txn_path << " of a finished process\n");
+            remove(txn_path.c_str());
+        } else {
+            live++;
+        }
+        close(txn_fd);
+    }
+    closedir(dir);
+    if (registry) {
+        registry_lock(registry);
+        registry->txn_logs = live;
+        registry_unlock(registry);
+    }
+}
+
+// Helper function for gtfs_init: looks at the logs that the given files have left behind,
+// spreading them over a pool of threads. A log is left in place for the next open to adopt
+// (or apply), so gtfs_init does not wait for the replays. Only a file with parts of
+// cross-file transactions that may not have reached its log is brought up to date here,
+// before the transaction logs go away; txn_logs tells whether there may be any. Files that
+// currently have a writer in another process are left to that process. In the registry,
+// recovered files are marked closed and the others left open without an owner.
+void recover_files(const string& directory, const vector<string>& filenames, gtfs_registry_t *registry, bool txn_logs) {
+    if (filenames.empty()) {
+        return;
+    }
+    map<string, vector<txn_redo_t>> redo;
+    if (txn_logs) {
+        redo = load_txn_redo(directory);
+    }
+
+    atomic<size_t> next(0);
+    atomic<size_t> applied(0);
+    auto worker = [&]() {
+        size_t i;
+        while ((i = next.fetch_add(1)) < filenames.size()) {
+            string file_path = directory + "/" + filenames[i];
+            string log_path = get_log_path(directory, filenames[i]);
+            int fd = open(file_path.c_str(), O_RDWR);
+            if (fd == -1) {
+                VERBOSE_PRINT(do_verbose, "Log " << log_path << " has no data file, skipping\n");
+                continue;
+            }
+            if (!acquire_writer_lock(fd, false)) {
+                VERBOSE_PRINT(do_verbose, "File " << file_path << " is open elsewhere, skipping its log\n");
+                close(fd);
+                continue;
+            }
+            bool created;
+            gtfs_registry_entry_t *entry = registry ? registry_find(registry, filenames[i], &created) : NULL;
+            struct stat log_st;
+            auto file_redo = redo.find(filenames[i]);
+            bool logged = stat(log_path.c_str(), &log_st) == 0;
+            if (logged && file_redo == redo.end()) {
+                VERBOSE_PRINT(do_verbose, "Leaving log " << log_path << " for the next open\n");
+                if (entry) {
+                    entry->open = 1;
+                    entry->owner = 0;
+                }
+                release_writer_lock(fd);
+                close(fd);
+                continue;
+            }
+            stats_ref_t stats{ registry ? stats_shard(registry->stats) : NULL, entry ? &entry->stats : NULL };
+            auto start = chrono::steady_clock::now();
+            uint64_t replayed = 0;
+            bool ok = !logged || apply_log(log_path, fd, &file_redo->second, stats, &replayed);
+            if (!ok) {
+                VERBOSE_PRINT(do_verbose, "Failed to recover file " << file_path << "\n");
+            } else {
+                if (logged) {
+                    applied++;
+                    GTFS_TRACE_EVENT(GTFS_OP_RECOVER, gtfs_trace_file_id(filenames[i]), 0, replayed, 0);
+                    stat_add(stats, &gtfs_stats_t::recovery_records, replayed);
+                    stat_latency(stats, &gtfs_stats_t::recovery_latency, start);
+                }
+                if (entry) {
+                    entry->open = 0;
+                    entry->owner = 0;
+                }
+            }
+            release_writer_lock(fd);
+            close(fd);
+        }
+    };
+
+    size_t num_threads = min((size_t)max(1u, thread::hardware_concurrency()), (size_t)GTFS_MAX_RECOVERY_THREADS);
+    num_threads = min(num_threads, filenames.size());
+    vector<thread> pool;
+    for (size_t t = 1; t < num_threads; t++) {
+        pool.push_back(thread(worker));
+    }
+    worker(); // The calling thread takes part as well
+    for (thread &t : pool) {
+        t.join();
+    }
+    VERBOSE_PRINT(do_verbose, "Recovered " << applied.load() << " of " << filenames.size() << " files with " << num_threads << " threads\n");
+}
+
+// Helper function for gtfs_init without a usable registry: recovers every file that
+// still has a log in the directory.
+void recover_directory(const string& directory, gtfs_registry_t *registry) {
+    // Records in a WAL left behind by a crashed process go first
+    if (recover_wal(directory, "", -1, registry ? stats_shard(registry->stats) : NULL) < 0) {
+        VERBOSE_PRINT(do_verbose, "Failed to recover the WAL of " << directory << "\n");
+    }
+
+    string logs_dir = directory + "/.logs";
+    DIR *dir = opendir(logs_dir.c_str());
+    if (!dir) {
+        return;
+    }
+
+    vector<string> filenames;
+    const string suffix = ".log";
+    struct dirent *entry;
+    while ((entry = readdir(dir)) != NULL) {
+        string name = entry->d_name;
+        if (name.length() > suffix.length() && name.compare(name.length() - suffix.length(), suffix.length(), suffix) == 0) {
+            filenames.push_back(name.substr(0, name.length() - suffix.length()));
+        }
+    }
+    closedir(dir);
+    recover_files(directory, filenames, registry, true);
+    remove_dead_txn_logs(directory, registry);
+}
+
+// Helper function for gtfs_init with the registry: only the files that a process left
+// open are looked at, and the WAL and transaction logs only if some process used them.
+void recover_registered(const string& directory, gtfs_registry_t *registry) {
+    if (!recover_registered_wal(registry, directory, "", -1)) {
+        VERBOSE_PRINT(do_verbose, "Failed to recover the WAL of " << directory << "\n");
+    }
+
+    vector<string> filenames;
+    registry_lock(registry);
+    for (int slot = 0; slot < GTFS_REGISTRY_SLOTS; slot++) {
+        gtfs_registry_entry_t *entry = &registry->entries[slot];
+        if (entry->used && entry->open) {
+            filenames.push_back(entry->filename);
+        }
+    }
+    int txn_logs = registry->txn_logs;
+    registry_unlock(registry);
+
+    recover_files(directory, filenames, registry, txn_logs > 0);
+    if (txn_logs > 0) {
+        remove_dead_txn_logs(directory, registry);
+    }
+}
+
+// Helper function that appends a batch of queued syncs to their logs.
+// Records for the same log are written with a single vectored append.
+void flush_commit_batch(vector<pending_commit_t*>& batch) {
+    GTFS_TRACE_EVENT(GTFS_OP_GROUP_FLUSH, 0, 0, batch.size(), 0);
+    size_t i = 0;
+    while (i < batch.size()) {
+        // Gather the run of records that belong to the same log
+        file_t *fl = batch[i]->write_id->fl;
+        size_t j = i;
+        while (j < batch.size() && batch[j]->write_id->fl == fl) {
+            j++;
+        }
+
+        // Describe the records of the whole run so they go out in one append
+        size_t count = j - i;
+        vector<commit_t> headers(count);
+        vector<commit_trailer_t> trailers(count);
+        vector<struct iovec> iov(3 * count);
+        vector<write_t*> writes(count);
+        for (size_t k = 0; k < count; k++) {
+            writes[k] = batch[i + k]->write_id;
+        }
+
+        int ret = -1;
+        {
+            lock_guard<mutex> file_lock(fl->mtx);
+            wait_inflight(fl); // Appended in one go after the records already reserved
+            int64_t total = 0;
+            for (size_t k = 0; k < count; k++) {
+                build_log_record(batch[i + k]->write_id, fl->next_seq + k, batch[i + k]->payload_crc, &headers[k], &trailers[k], &iov[3 * k]);
+                total += sizeof(commit_t) + headers[k].length + sizeof(commit_trailer_t);
+            }
+
+            if (fl->data == NULL) {
+                VERBOSE_PRINT(do_verbose, "File " << fl->filename << " was closed before its group commit\n");
+            } else if (fl->gtfs->wal ? !wal_append_writes(fl, writes.data(), count) : !append_file_log(fl, iov.data(), iov.size(), count, total)) {
+                VERBOSE_PRINT(do_verbose, "Failed to append " << count << " records to log " << fl->log_path << "\n");
+            } else {
+                ret = 0;
+                for (size_t k = 0; k < count; k++) {
+                    if (!fl->gtfs->wal) {
+                        note_newest(fl, headers[k].offset, headers[k].length, headers[k].seq);
+                    }
+                    mark_synced(batch[i + k]->write_id);
+                }
+                VERBOSE_PRINT(do_verbose, "Group committed " << count << " records (" << total << " bytes) to log " << fl->log_path << "\n");
+                // One flush for the whole run, the flusher is the only one waiting on it
+                if (!fl->gtfs->wal && fl->durability == GTFS_DURABLE_COMMIT && !flush_file_log(fl, NULL)) {
+                    VERBOSE_PRINT(do_verbose, "Failed to flush log " << fl->log_path << "\n");
+                    ret = -1;
+                }
+            }
+        }
+
+        for (size_t k = i; k < j; k++) {
+            batch[k]->ret = (ret == 0) ? batch[k]->write_id->length : -1;
+        }
+        i = j;
+    }
+}
+
+// Background flusher: waits for queued syncs, lets a batch fill for up to the
+// batching window (or until it reaches the maximum size) and commits it at once.
+void group_commit_flusher(gtfs_t *gtfs) {
+    unique_lock<mutex> lock(gtfs->gc_mutex);
+    while (true) {
+        gtfs->gc_cv.wait(lock, [gtfs] { return gtfs->gc_stop || !gtfs->gc_queue.empty(); });
+        if (gtfs->gc_queue.empty() && gtfs->gc_stop) {
+            break;
+        }
+
+        // Give other syncs a chance to join the batch
+        auto deadline = chrono::steady_clock::now() + chrono::microseconds(gtfs->group_commit_window_us);
+        gtfs->gc_cv.wait_until(lock, deadline, [gtfs] {
+            return gtfs->gc_stop || (int)gtfs->gc_queue.size() >= gtfs->group_commit_max_batch;
+        });
+
+        vector<pending_commit_t*> batch;
+        while (!gtfs->gc_queue.empty() && (int)batch.size() < gtfs->group_commit_max_batch) {
+            batch.push_back(gtfs->gc_queue.front());
+            gtfs->gc_queue.pop_front();
+        }
+
+        // Do the I/O without holding the queue lock so new syncs can keep queueing
+        lock.unlock();
+        // Keep the records of each log together while preserving their order within a log
+        stable_sort(batch.begin(), batch.end(), [](pending_commit_t *a, pending_commit_t *b) {
+            return a->write_id->fl < b->write_id->fl;
+        });
+        flush_commit_batch(batch);
+        lock.lock();
+
+        for (pending_commit_t *pending : batch) {
+            pending->done = 1;
+        }
+        gtfs->gc_done_cv.notify_all();
+    }
+}
+
+// Helper function to hand a sync to the flusher and wait until its record is durable.
+// Returns false without queueing it if group commit is off or being turned off, the
+// caller appends the record itself then. ret gets the result of a queued sync.
+bool group_commit_sync(write_t *write_id, int64_t *ret) {
+    gtfs_t *gtfs = write_id->fl->gtfs;
+    pending_commit_t pending;
+    pending.write_id = write_id;
+    pending.payload_crc = crc32c(0, write_id->data, write_id->length); // Checksum outside the flusher
+    pending.done = 0;
+    pending.ret = -1;
+
+    unique_lock<mutex> lock(gtfs->gc_mutex);
+    // gtfs_disable_group_commit may have run since the caller looked at the flag
+    if (!gtfs->group_commit || gtfs->gc_stop) {
+        return false;
+    }
+    // A forked child inherits the flag but not the thread, so start a flusher for this process
+    if (gtfs->gc_flusher_pid != getpid()) {
+        gtfs->gc_queue.clear();
+        gtfs->gc_flusher = new thread(group_commit_flusher, gtfs); // An inherited handle is dropped, it is not ours to join
+        gtfs->gc_flusher_pid = getpid();
+    }
+    gtfs->gc_queue.push_back(&pending);
+    // The first sync opens a batch window, a full batch closes it early
+    if (gtfs->gc_queue.size() == 1 || (int)gtfs->gc_queue.size() >= gtfs->group_commit_max_batch) {
+        gtfs->gc_cv.notify_one();
+    }
+    gtfs->gc_done_cv.wait(lock, [&pending] { return pending.done != 0; });
+    *ret = pending.ret;
+    return true;
+}
+
+// Asynchronous syncs (gtfs_sync_write_file_async). A sync of a file with its own log takes
+// its record's place in the log like append_write_record, then hands the write and an
+// fdatasync of the log to io_uring as a linked pair. The reaper thread settles the slot
+// once the write has completed; the sync is done when the slot is settled and both
+// completions are in, and the notifier thread reports it. Syncs that go through group
+// commit or the WAL, and all of them when the kernel has no io_uring, run
+// gtfs_sync_write_file and an fdatasync of the logs on a pool thread instead.
+typedef struct async_request {
+    gtfs_async_t *async;
+    struct async_engine *engine;
+    write_t *write_id;
+    file_t *fl;
+    chrono::steady_clock::time_point start;
+    uint64_t start_ns; // The same, for the trace
+    int64_t ret;
+    atomic<int> waiting; // Events still to come before the request is done
+    // Only used by syncs that go through io_uring
+    bool ring;
+    commit_t header;
+    commit_trailer_t trailer;
+    struct iovec iov[3];
+    vector<char> delta; // Payload of a delta encoded record (see encode_delta)
+    int64_t bytes; // Size of the record
+    append_slot_t slot;
+    atomic<int> cqes; // Completions reaped, of the write and of the fdatasync (or stand-ins for them)
+    int flush_res; // Result of the fdatasync
+    bool repaired; // The reaper finished a short write, the linked fdatasync was cancelled
+} async_request_t;
+
+typedef struct async_engine {
+    // io_uring, ring_fd is -1 when the kernel has none
+    int ring_fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    mutex sq_mutex; // Serializes submissions
+    mutex cap_mutex; // Guards in_ring
+    condition_variable cap_cv; // Signalled when a sync leaves the ring
+    unsigned in_ring; // Syncs submitted and not fully reaped, two entries each
+    unsigned ring_capacity; // Most syncs in the ring at once, so the completion queue never overflows
+    thread *reaper;
+
+    // Thread pool, started by the first sync that needs it
+    mutex pool_mutex;
+    condition_variable pool_cv;
+    deque<async_request_t*> pool_queue;
+    vector<thread*> workers;
+
+    // Done requests waiting to be reported
+    mutex done_mutex; // Also guards the done flags, for gtfs_async_wait
+    condition_variable done_cv; // Signals the notifier
+    condition_variable waiters_cv; // Signals gtfs_async_wait
+    deque<async_request_t*> done_queue;
+    thread *notifier;
+} async_engine_t;
+
+// Helper function to set up the io_uring of an engine. Returns false if the kernel has none.
+bool async_ring_setup(async_engine_t *engine) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int fd = syscall(__NR_io_uring_setup, GTFS_ASYNC_RING_ENTRIES, &params);
+    if (fd < 0) {
+        return false;
+    }
+    size_t sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    size_t cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    size_t sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP; // Both rings in one mapping
+    if (single) {
+        sq_size = cq_size = max(sq_size, cq_size);
+    }
+    char *sq = (char*)mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    char *cq = single ? sq : (char*)mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    void *sqes = mmap(NULL, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    if (sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED) {
+        if (sq != MAP_FAILED) {
+            munmap(sq, sq_size);
+        }
+        if (!single && cq != MAP_FAILED) {
+            munmap(cq, cq_size);
+        }
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqes_size);
+        }
+        close(fd);
+        return false;
+    }
+
+    engine->ring_fd = fd;
+    engine->sq_head = (unsigned*)(sq + params.sq_off.head);
+    engine->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    engine->sq_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    engine->sq_array = (unsigned*)(sq + params.sq_off.array);
+    engine->cq_head = (unsigned*)(cq + params.cq_off.head);
+    engine->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    engine->cq_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    engine->sqes = (struct io_uring_sqe*)sqes;
+    engine->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    engine->ring_capacity = min(params.sq_entries, params.cq_entries) / 2;
+    return true;
+}
+
+// Helper function to note that the slot of a request settled, or that its I/O is over.
+// The last event hands the request to the notifier.
+void async_progress(async_request_t *request) {
+    if (request->waiting.fetch_sub(1) != 1) {
+        return;
+    }
+    async_engine_t *engine = request->engine;
+    {
+        lock_guard<mutex> lock(engine->done_mutex);
+        engine->done_queue.push_back(request);
+    }
+    engine->done_cv.notify_one();
+}
+
+void async_write_done(async_request_t *request, int res);
+void async_ring_done(async_engine_t *engine, async_request_t *request);
+
+#ifdef GTFS_TESTING
+int gtfs_async_submit_fault = 0;
+#endif
+
+// Helper function to hand to_submit entries of the ring to the kernel
+long async_ring_enter(async_engine_t *engine, unsigned to_submit) {
+#ifdef GTFS_TESTING
+    if (gtfs_async_submit_fault) {
+        errno = gtfs_async_submit_fault;
+        return -1;
+    }
+#endif
+    return syscall(__NR_io_uring_enter, engine->ring_fd, to_submit, 0, 0, NULL, 0);
+}
+
+// Helper function to submit the write of a reserved record with an fdatasync of the log
+// linked behind it, so the fdatasync only starts once the write has completed. If the
+// kernel refuses the entries they are taken back off the ring and the request fails as
+// if its I/O had, nothing else would ever submit them.
+void async_ring_submit(async_engine_t *engine, async_request_t *request) {
+    {
+        unique_lock<mutex> lock(engine->cap_mutex);
+        engine->cap_cv.wait(lock, [engine] { return engine->in_ring < engine->ring_capacity; });
+        engine->in_ring++;
+    }
+
+    lock_guard<mutex> lock(engine->sq_mutex);
+    unsigned tail = *engine->sq_tail; // Only written here
+    for (unsigned i = 0; i < 2; i++) {
+        unsigned index = (tail + i) & *engine->sq_mask;
+        struct io_uring_sqe *sqe = &engine->sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->fd = request->fl->log_fd;
+        if (i == 0) {
+            sqe->opcode = IORING_OP_WRITEV;
+            sqe->flags = IOSQE_IO_LINK;
+            sqe->addr = (uint64_t)request->iov;
+            sqe->len = 3;
+            sqe->off = request->slot.pos;
+            sqe->user_data = (uint64_t)request;
+        } else {
+            sqe->opcode = IORING_OP_FSYNC;
+            sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+            sqe->user_data = (uint64_t)request | 1; // Requests are aligned, the low bit marks the fdatasync
+        }
+        engine->sq_array[index] = index;
+    }
+    __atomic_store_n(engine->sq_tail, tail + 2, __ATOMIC_RELEASE);
+
+    unsigned to_submit = 2;
+    while (to_submit > 0) {
+        long submitted = async_ring_enter(engine, to_submit);
+        if (submitted >= 0) {
+            to_submit -= min(to_submit, (unsigned)submitted);
+            continue;
+        }
+        if (errno == EINTR || errno == EAGAIN || errno == EBUSY) {
+            this_thread::yield();
+            continue;
+        }
+        VERBOSE_PRINT(do_verbose, "Failed to submit to io_uring, the sync fails\n");
+        // Earlier submissions went out whole, so what the kernel did not take is ours
+        unsigned left = tail + 2 - __atomic_load_n(engine->sq_head, __ATOMIC_ACQUIRE);
+        __atomic_store_n(engine->sq_tail, tail + 2 - left, __ATOMIC_RELEASE);
+        if (left == 2) {
+            async_write_done(request, -EIO);
+            request->cqes += 1; // The fdatasync never ran, its result stays -1
+        }
+        // A write the kernel took completes on its own, the reaper then flushes the log itself
+        if (left >= 1 && ++request->cqes == 2) {
+            async_ring_done(engine, request);
+        }
+        break;
+    }
+}
+
+// Helper function for the reaper: settles the slot of a request whose write completed.
+// A short write is finished with pwritev here (the linked fdatasync is cancelled then).
+void async_write_done(async_request_t *request, int res) {
+    file_t *fl = request->fl;
+    bool ok = res == request->bytes;
+    if (!ok && res >= 0) {
+        ok = append_log(fl->log_fd, request->iov, 3, request->slot.pos); // The whole record again, the start is the same bytes
+        request->repaired = true;
+    }
+    GTFS_TRACE_EVENT(GTFS_OP_LOG_APPEND, fl->trace_id, request->slot.pos, request->bytes, ok ? 1 : -1);
+
+    lock_guard<mutex> lock(fl->mtx);
+    request->slot.written = ok ? 1 : -1;
+    fl->inflight--;
+    settle_appends(fl);
+    fl->inflight_cv.notify_all();
+}
+
+// Helper function for the reaper once both completions of a request are in. A record that
+// is on the log but was not flushed (cancelled, failed or repaired) is flushed here.
+void async_ring_done(async_engine_t *engine, async_request_t *request) {
+    if (request->slot.written == 1) {
+        if (request->flush_res == 0 && !request->repaired) {
+            stat_add(stats_of(request->fl), &gtfs_stats_t::flushes, 1);
+        } else {
+            request->flush_res = flush_fd(request->fl->log_fd, stats_of(request->fl)) ? 0 : -1;
+        }
+    }
+    {
+        lock_guard<mutex> lock(engine->cap_mutex);
+        engine->in_ring--;
+    }
+    engine->cap_cv.notify_one();
+    async_progress(request);
+}
+
+// Reaper thread: takes the completions of the syncs submitted to io_uring
+void async_reaper(async_engine_t *engine) {
+    while (true) {
+        unsigned head = *engine->cq_head; // Only written here
+        if (head == __atomic_load_n(engine->cq_tail, __ATOMIC_ACQUIRE)) {
+            if (syscall(__NR_io_uring_enter, engine->ring_fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 &&
+                errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                VERBOSE_PRINT(do_verbose, "Failed to wait for io_uring completions\n");
+                return;
+            }
+            continue;
+        }
+        struct io_uring_cqe cqe = engine->cqes[head & *engine->cq_mask];
+        __atomic_store_n(engine->cq_head, head + 1, __ATOMIC_RELEASE);
+
+        async_request_t *request = (async_request_t*)(cqe.user_data & ~(uint64_t)1);
+        if (cqe.user_data & 1) {
+            request->flush_res = cqe.res;
+        } else {
+            async_write_done(request, cqe.res);
+        }
+        if (++request->cqes == 2) {
+            async_ring_done(engine, request);
+        }
+    }
+}
+
+// Helper function for the pool: flushes the logs gtfs_sync_write_file appended to, the
+// file's own or the WAL segments. The descriptors are duplicated under the locks so that
+// the fdatasyncs do not hold them.
+bool async_flush_logs(file_t *fl) {
+    gtfs_t *gtfs = fl->gtfs;
+    vector<int> fds;
+    {
+        lock_guard<mutex> file_lock(fl->mtx);
+        if (fl->log_fd >= 0) {
+            fds.push_back(dup(fl->log_fd));
+        }
+    }
+    if (gtfs->wal) {
+        lock_guard<mutex> wal_lock(gtfs->wal_mutex);
+        for (wal_segment_t *segment : gtfs->wal_segments) {
+            fds.push_back(dup(segment->fd));
+        }
+    }
+    bool ok = true;
+    for (int fd : fds) {
+        ok = fd >= 0 && flush_fd(fd, stats_of(fl)) && ok;
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    return ok;
+}
+
+// Pool thread: runs the syncs that do not go through io_uring
+void async_worker(async_engine_t *engine) {
+    unique_lock<mutex> lock(engine->pool_mutex);
+    while (true) {
+        engine->pool_cv.wait(lock, [engine] { return !engine->pool_queue.empty(); });
+        async_request_t *request = engine->pool_queue.front();
+        engine->pool_queue.pop_front();
+        lock.unlock();
+
+        request->ret = gtfs_sync_write_file(request->write_id);
+        if (request->ret >= 0 && !async_flush_logs(request->fl)) {
+            VERBOSE_PRINT(do_verbose, "Failed to flush the log of " << request->fl->filename << "\n");
+            request->ret = -1;
+        }
+        async_progress(request);
+        lock.lock();
+    }
+}
+
+// Helper function to queue a request for the pool
+void async_pool_submit(async_engine_t *engine, async_request_t *request) {
+    {
+        lock_guard<mutex> lock(engine->pool_mutex);
+        while (engine->workers.size() < GTFS_ASYNC_POOL_THREADS) {
+            engine->workers.push_back(new thread(async_worker, engine));
+        }
+        engine->pool_queue.push_back(request);
+    }
+    engine->pool_cv.notify_one();
+}
+
+// Helper function to report a done request: the eventfd, then done, then the callback
+// (see gtfs_async_t). The request is freed.
+void async_complete(async_request_t *request) {
+    async_engine_t *engine = request->engine;
+    gtfs_async_t *async = request->async;
+    write_t *write_id = request->write_id;
+    file_t *fl = request->fl;
+    if (request->ring) {
+        request->ret = (request->slot.state == 1 && request->flush_res == 0) ? write_id->length : -1;
+        if (request->ret >= 0) {
+            stat_add(stats_of(fl), &gtfs_stats_t::commits, 1);
+            stat_latency(stats_of(fl), &gtfs_stats_t::sync_latency, request->start);
+        }
+    }
+    int64_t ret = request->ret;
+#if GTFS_TRACE_LEVEL >= GTFS_TRACE_API
+    gtfs_trace_record(GTFS_OP_ASYNC_DONE, fl->trace_id, write_id->offset, write_id->length, ret, request->start_ns, gtfs_trace_now() - request->start_ns);
+#endif
+    {
+        lock_guard<mutex> file_lock(fl->mtx);
+        fl->async_pending--;
+        fl->inflight_cv.notify_all(); // Close waits for it
+    }
+    delete request;
+
+    gtfs_async_callback_t callback = async->callback;
+    void *arg = async->arg;
+    if (async->eventfd >= 0) {
+        uint64_t one = 1;
+        if (write(async->eventfd, &one, sizeof(one)) != sizeof(one)) {
+            VERBOSE_PRINT(do_verbose, "Failed to signal the eventfd of an asynchronous sync\n");
+        }
+    }
+    {
+        lock_guard<mutex> lock(engine->done_mutex);
+        async->ret = ret;
+        async->done.store(1, memory_order_release);
+    }
+    engine->waiters_cv.notify_all();
+    if (callback) {
+        callback(write_id, ret, arg);
+    }
+}
+
+// Notifier thread: reports done requests outside of any file's lock, so callbacks may
+// go on to write and sync
+void async_notifier(async_engine_t *engine) {
+    unique_lock<mutex> lock(engine->done_mutex);
+    while (true) {
+        engine->done_cv.wait(lock, [engine] { return !engine->done_queue.empty(); });
+        async_request_t *request = engine->done_queue.front();
+        engine->done_queue.pop_front();
+        lock.unlock();
+        async_complete(request);
+        lock.lock();
+    }
+}
+
+// Helper function to get the async engine of gtfs, started for this process if needed
+async_engine_t* ensure_async_engine(gtfs_t *gtfs) {
+    lock_guard<mutex> lock(gtfs->async_mutex);
+    if (gtfs->async_engine && gtfs->async_pid == getpid()) {
+        return gtfs->async_engine;
+    }
+    if (gtfs->async_engine && gtfs->async_engine->ring_fd >= 0) {
+        close(gtfs->async_engine->ring_fd); // Inherited from the parent, whose ring stays with it
+    }
+    async_engine_t *engine = new async_engine_t(); // An inherited engine is dropped, its threads are not ours
+    engine->ring_fd = -1;
+    engine->in_ring = 0;
+    engine->reaper = NULL;
+    if (async_ring_setup(engine)) {
+        engine->reaper = new thread(async_reaper, engine);
+    } else {
+        VERBOSE_PRINT(do_verbose, "No io_uring, asynchronous syncs run on a thread pool\n");
+    }
+    engine->notifier = new thread(async_notifier, engine);
+    gtfs->async_engine = engine;
+    gtfs->async_pid = getpid();
+    return engine;
+}
+
+// Helper function to create the transaction log of this process if it has none yet.
+// The log stays locked while the process lives, so gtfs_init in another process
+// knows it must not remove it. Needs gtfs->txn_mutex held.
+bool ensure_txn_log(gtfs_t *gtfs) {
+    if (gtfs->txn_fd >= 0 && gtfs->txn_pid == getpid()) {
+        return true;
+    }
+    if (gtfs->txn_fd >= 0) {
+        close(gtfs->txn_fd); // Inherited from the parent, whose lock stays with its own descriptor
+        gtfs->txn_fd = -1;
+    }
+
+    static atomic<int> counter(0);
+    while (true) {
+        string txn_path = gtfs->dirname + "/.logs/.txn." + to_string(getpid()) + "-" + to_string(counter.fetch_add(1));
+        int txn_fd = open(txn_path.c_str(), O_RDWR | O_CREAT | O_EXCL, 0644);
+        if (txn_fd == -1) {
+            if (errno == EEXIST) {
+                continue;
+            }
+            VERBOSE_PRINT(do_verbose, "Failed to create transaction log " << txn_path << "\n");
+            return false;
+        }
+        // gtfs_init elsewhere may have taken the unlocked log for a dead one and removed it
+        struct stat st;
+        if (flock(txn_fd, LOCK_EX) != 0 || fstat(txn_fd, &st) != 0 || st.st_nlink == 0) {
+            close(txn_fd);
+            continue;
+        }
+        gtfs->txn_fd = txn_fd;
+        break;
+    }
+    if (gtfs->registry) {
+        registry_lock(gtfs->registry);
+        gtfs->registry->txn_logs++;
+        registry_unlock(gtfs->registry);
+    }
+    gtfs->txn_pid = getpid();
+    gtfs->txn_tail = 0;
+    gtfs->txn_next_seq = 1;
+    gtfs->txn_inflight = 0;
+    return true;
+}
+
+// A file taking part in a transaction, with the transaction's writes on it
+typedef struct txn_file {
+    file_t *fl;
+    vector<write_t*> writes;
+    vector<commit_extent_t> extents;
+    vector<struct iovec> payload_iov; // The COMMIT_TYPE_MULTI payload
+    int64_t payload_length;
+    uint32_t payload_crc;
+    txn_part_t part;
+} txn_file_t;
+
+// Helper function to append a file's part of a transaction to its log as a single
+// COMMIT_TYPE_MULTI record. Needs fl->mtx held.
+bool append_txn_part(txn_file_t& tf) {
+    file_t *fl = tf.fl;
+    commit_t header;
+    commit_trailer_t trailer;
+    seal_record(&header, &trailer, COMMIT_TYPE_MULTI, fl->next_seq, 0, tf.payload_length, tf.payload_crc);
+
+    vector<struct iovec> iov;
+    iov.push_back({ &header, sizeof(commit_t) });
+    iov.insert(iov.end(), tf.payload_iov.begin(), tf.payload_iov.end());
+    iov.push_back({ &trailer, sizeof(commit_trailer_t) });
+    if (!append_file_log(fl, iov.data(), iov.size(), 1, sizeof(commit_t) + header.length + sizeof(commit_trailer_t))) {
+        return false;
+    }
+    for (const commit_extent_t& extent : tf.extents) {
+        note_newest(fl, extent.offset, extent.length, header.seq);
+    }
+    if (fl->durability == GTFS_DURABLE_PERIODIC) {
+        fl->gtfs->periodic_parts++;
+    }
+    return fl->durability != GTFS_DURABLE_COMMIT || flush_file_log(fl, NULL);
+}
+
+// Helper function to commit a transaction as one record of the directory WAL, however
+// many files it spans. Needs the mutex of every file held.
+bool wal_append_txn(vector<txn_file_t>& files) {
+    vector<wal_piece_t> pieces;
+    for (txn_file_t& tf : files) {
+        pieces.push_back({ tf.fl, COMMIT_TYPE_MULTI, 0, tf.payload_length, tf.payload_iov.data(), (int)tf.payload_iov.size(),
+                           tf.extents.data(), tf.extents.size() });
+    }
+    size_t record_end = pieces.size();
+    return wal_append(files[0].fl->gtfs, pieces.data(), &record_end, 1);
+}
+
+// Helper function to commit a transaction that spans several files. The single
+// COMMIT_TYPE_TXN record in the transaction log is the commit point, the parts are
+// then copied into the file logs under the sequence numbers they were given.
+// Needs the mutex of every file held.
+bool commit_cross_file(gtfs_t *gtfs, vector<txn_file_t>& files) {
+    commit_t header;
+    commit_trailer_t trailer;
+    vector<struct iovec> iov;
+    iov.push_back({ &header, sizeof(commit_t) });
+    int64_t length = 0;
+    for (txn_file_t& tf : files) {
+        tf.part.log_id = tf.fl->log_meta.log_id;
+        tf.part.seq = tf.fl->next_seq;
+        tf.part.name_length = tf.fl->filename.length();
+        tf.part.reserved = 0;
+        tf.part.length = tf.payload_length;
+        iov.push_back({ &tf.part, sizeof(txn_part_t) });
+        iov.push_back({ (void*)tf.fl->filename.data(), tf.fl->filename.length() });
+        iov.insert(iov.end(), tf.payload_iov.begin(), tf.payload_iov.end());
+        length += sizeof(txn_part_t) + tf.part.name_length + tf.payload_length;
+    }
+    uint32_t payload_crc = 0;
+    for (size_t k = 1; k < iov.size(); k++) {
+        payload_crc = crc32c(payload_crc, iov[k].iov_base, iov[k].iov_len);
+    }
+    iov.push_back({ &trailer, sizeof(commit_trailer_t) });
+
+    bool copied = true;
+    {
+        lock_guard<mutex> lock(gtfs->txn_mutex);
+        if (!ensure_txn_log(gtfs)) {
+            return false;
+        }
+        seal_record(&header, &trailer, COMMIT_TYPE_TXN, gtfs->txn_next_seq, 0, length, payload_crc);
+        if (!append_log(gtfs->txn_fd, iov.data(), iov.size(), gtfs->txn_tail)) {
+            if (ftruncate(gtfs->txn_fd, gtfs->txn_tail) != 0) {
+                VERBOSE_PRINT(do_verbose, "Failed to cut a torn transaction off the transaction log\n");
+            }
+            return false;
+        }
+        gtfs->txn_tail += sizeof(commit_t) + length + sizeof(commit_trailer_t);
+        gtfs->txn_next_seq++;
+        stat_add(stats_ref_t{ stats_shard(gtfs->stats), NULL }, &gtfs_stats_t::bytes_logged, sizeof(commit_t) + length + sizeof(commit_trailer_t));
+        gtfs->txn_inflight++;
+
+        // A part may only survive a machine crash if the record it belongs to does
+        bool durable = false;
+        for (txn_file_t& tf : files) {
+            durable = durable || tf.fl->durability != GTFS_DURABLE_PROCESS;
+        }
+        auto start = chrono::steady_clock::now();
+        if (durable && !flush_fd(gtfs->txn_fd, stats_ref_t{ stats_shard(gtfs->stats), NULL })) {
+            VERBOSE_PRINT(do_verbose, "Failed to flush the transaction log\n");
+            copied = false; // Reported as failed, and the log is kept as below
+        } else if (durable) {
+            stat_latency(stats_ref_t{ stats_shard(gtfs->stats), NULL }, &gtfs_stats_t::durable_latency, start);
+        }
+    }
+
+    // Committed. A part that fails to reach its log is still recovered from the
+    // transaction log, which is then kept until the next gtfs_init.
+    for (txn_file_t& tf : files) {
+        if (!append_txn_part(tf)) {
+            VERBOSE_PRINT(do_verbose, "Failed to copy a committed transaction into log " << tf.fl->log_path << "\n");
+            copied = false;
+        }
+    }
+
+    lock_guard<mutex> lock(gtfs->txn_mutex);
+    if (copied) {
+        gtfs->txn_inflight--;
+    }
+    // Cut the log back once nothing in it is needed any more, parts in periodically
+    // flushed logs are only safe once the syncer got to them
+    if (gtfs->txn_inflight == 0 && gtfs->txn_tail >= GTFS_TXN_LOG_RETIRE_BYTES &&
+        gtfs->periodic_flushed.load() == gtfs->periodic_parts.load() && ftruncate(gtfs->txn_fd, 0) == 0) {
+        gtfs->txn_tail = 0;
+        gtfs->txn_next_seq = 1;
+    }
+    return copied;
+}
+
+
+// Pools that still exist, by id, so a thread can give the blocks it kept back to their pool
+mutex live_pools_mutex;
+map<uint64_t, write_pool_t*> live_pools;
+atomic<uint64_t> next_pool_id(1);
+
+// Blocks a thread keeps for the pool it used last
+typedef struct pool_cache {
+    uint64_t pool_id = 0;
+    int count[GTFS_POOL_CLASSES] = {};
+    void *blocks[GTFS_POOL_CLASSES][GTFS_POOL_CACHE_BLOCKS];
+    ~pool_cache();
+} pool_cache_t;
+
+thread_local pool_cache_t pool_cache;
+
+// Helper function to put n blocks on the free list of their class. The mutex of the class must be held.
+void pool_push(pool_class_t *pool, void **blocks, int n) {
+    for (int i = 0; i < n; i++) {
+        *(void**)blocks[i] = pool->free_list;
+        pool->free_list = blocks[i];
+    }
+    pool->free_blocks += n;
+}
+
+// Helper function to give every block a thread kept back to its pool, if the pool still exists
+void pool_cache_drain(pool_cache_t *cache) {
+    bool kept = false;
+    for (int cls = 0; cls < GTFS_POOL_CLASSES; cls++) {
+        kept = kept || cache->count[cls] > 0;
+    }
+    if (kept) {
+        lock_guard<mutex> live_lock(live_pools_mutex);
+        auto it = live_pools.find(cache->pool_id);
+        for (int cls = 0; it != live_pools.end() && cls < GTFS_POOL_CLASSES; cls++) {
+            lock_guard<mutex> lock(it->second->classes[cls].mtx);
+            pool_push(&it->second->classes[cls], cache->blocks[cls], cache->count[cls]);
+        }
+    }
+    memset(cache->count, 0, sizeof(cache->count));
+    cache->pool_id = 0;
+}
+
+pool_cache::~pool_cache() {
+    pool_cache_drain(this);
+}
+
+// Helper function to get the blocks the calling thread keeps for the pool of gtfs
+pool_cache_t* pool_cache_of(gtfs_t *gtfs) {
+    pool_cache_t *cache = &pool_cache;
+    if (cache->pool_id != gtfs->write_pool.id) {
+        pool_cache_drain(cache);
+        cache->pool_id = gtfs->write_pool.id;
+    }
+    return cache;
+}
+
+// Helper function to set up the write pool of a new gtfs_t
+void pool_init(gtfs_t *gtfs) {
+    write_pool_t *pool = &gtfs->write_pool;
+    pool->id = next_pool_id.fetch_add(1);
+    for (int cls = 0; cls < GTFS_POOL_CLASSES; cls++) {
+        pool->classes[cls].free_list = NULL;
+        pool->classes[cls].free_blocks = 0;
+    }
+    pool->carve = NULL;
+    pool->carve_end = NULL;
+    lock_guard<mutex> live_lock(live_pools_mutex);
+    live_pools[pool->id] = pool;
+}
+
+// Helper function to carve a block of size class cls out of the newest chunk, or out of a
+// new one. What is left of the newest chunk when the block does not fit goes to the free
+// lists of the smaller classes.
+void* pool_carve(write_pool_t *pool, int cls) {
+    size_t block_size = (size_t)1 << (GTFS_POOL_MIN_SHIFT + cls);
+    lock_guard<mutex> lock(pool->chunk_mutex);
+    if (pool->carve == NULL || pool->carve + block_size > pool->carve_end) {
+        for (int smaller = cls - 1; smaller >= 0 && pool->carve; smaller--) {
+            size_t smaller_size = (size_t)1 << (GTFS_POOL_MIN_SHIFT + smaller);
+            if (pool->carve + smaller_size <= pool->carve_end) {
+                void *block = pool->carve;
+                pool->carve += smaller_size;
+                lock_guard<mutex> class_lock(pool->classes[smaller].mtx);
+                pool_push(&pool->classes[smaller], &block, 1);
+            }
+        }
+        char *chunk = (char*)malloc(GTFS_POOL_CHUNK_SIZE);
+        if (chunk == NULL) {
+            return NULL;
+        }
+        pool->chunks.push_back(chunk);
+        pool->carve = chunk;
+        pool->carve_end = chunk + GTFS_POOL_CHUNK_SIZE;
+    }
+    void *block = pool->carve;
+    pool->carve += block_size;
+    return block;
+}
+
+// Helper function to take a block of size class cls from the write pool: from the blocks
+// the thread keeps, else a batch from the free list of the class, else a new one
+void* pool_alloc(gtfs_t *gtfs, int cls) {
+    pool_cache_t *cache = pool_cache_of(gtfs);
+    if (cache->count[cls] > 0) {
+        return cache->blocks[cls][--cache->count[cls]];
+    }
+    pool_class_t *pool = &gtfs->write_pool.classes[cls];
+    {
+        lock_guard<mutex> lock(pool->mtx);
+        while (pool->free_list && cache->count[cls] < GTFS_POOL_CACHE_BLOCKS / 2) {
+            cache->blocks[cls][cache->count[cls]++] = pool->free_list;
+            pool->free_list = *(void**)pool->free_list;
+            pool->free_blocks--;
+        }
+    }
+    if (cache->count[cls] > 0) {
+        return cache->blocks[cls][--cache->count[cls]];
+    }
+    return pool_carve(&gtfs->write_pool, cls);
+}
+
+// Helper function to give a block back: the thread keeps it, once it keeps too many half
+// of them go back to the free list of the class
+void pool_free(gtfs_t *gtfs, int cls, void *block) {
+    pool_cache_t *cache = pool_cache_of(gtfs);
+    if (cache->count[cls] == GTFS_POOL_CACHE_BLOCKS) {
+        int moved = GTFS_POOL_CACHE_BLOCKS / 2;
+        cache->count[cls] -= moved;
+        pool_class_t *pool = &gtfs->write_pool.classes[cls];
+        lock_guard<mutex> lock(pool->mtx);
+        pool_push(pool, &cache->blocks[cls][cache->count[cls]], moved);
+    }
+    cache->blocks[cls][cache->count[cls]++] = block;
+}
+
+// Helper function to give the chunks of the write pool back once every block is free. The
+// blocks the calling thread keeps go back first, those kept by other threads mean that
+// some are not free. Returns the number of chunks given back.
+size_t pool_trim(gtfs_t *gtfs) {
+    if (pool_cache.pool_id == gtfs->write_pool.id) {
+        pool_cache_drain(&pool_cache);
+    }
+    write_pool_t *pool = &gtfs->write_pool;
+    lock_guard<mutex> lock(pool->chunk_mutex);
+    vector<unique_lock<mutex>> class_locks;
+    size_t free_bytes = pool->carve_end - pool->carve;
+    for (int cls = 0; cls < GTFS_POOL_CLASSES; cls++) {
+        class_locks.emplace_back(pool->classes[cls].mtx);
+        free_bytes += pool->classes[cls].free_blocks << (GTFS_POOL_MIN_SHIFT + cls);
+    }
+    size_t chunks = pool->chunks.size();
+    if (chunks == 0 || free_bytes != chunks * GTFS_POOL_CHUNK_SIZE) {
+        return 0;
+    }
+    for (int cls = 0; cls < GTFS_POOL_CLASSES; cls++) {
+        pool->classes[cls].free_list = NULL;
+        pool->classes[cls].free_blocks = 0;
+    }
+    for (char *chunk : pool->chunks) {
+        free(chunk);
+    }
+    pool->chunks.clear();
+    pool->carve = NULL;
+    pool->carve_end = NULL;
+    return chunks;
+}
+
+// Helper function to allocate a write together with its data and undo buffers
+write_t* alloc_write(gtfs_t *gtfs, int64_t length) {
+    size_t size = sizeof(write_t) + 2 * (size_t)length;
+    int cls = 0;
+    while (cls < GTFS_POOL_CLASSES && ((size_t)1 << (GTFS_POOL_MIN_SHIFT + cls)) < size) {
+        cls++;
+    }
+    if (cls == GTFS_POOL_CLASSES) {
+        cls = -1;
+    }
+    void *block = cls < 0 ? malloc(size) : pool_alloc(gtfs, cls);
+    if (block == NULL) {
+        return NULL;
+    }
+    write_t *write_id = new (block) write_t();
+    write_id->pool_class = cls;
+    write_id->data = (char*)(write_id + 1);
+    write_id->old_data = write_id->data + length;
+    return write_id;
+}
+
+void free_write(gtfs_t *gtfs, write_t *write_id) {
+    int cls = write_id->pool_class;
+    write_id->~write_t();
+    if (cls < 0) {
+        free(write_id);
+    } else {
+        pool_free(gtfs, cls, write_id);
+    }
+}
+
+// Helper function to map length bytes of a data file. For huge pages the mapping starts
+// at a GTFS_HUGE_PAGE_SIZE boundary (carved out of a larger reservation of address space)
+// and is advised MADV_HUGEPAGE. share is MAP_SHARED or MAP_PRIVATE. Returns MAP_FAILED on failure.
+char* map_file(int fd, int64_t length, int prot, int share, bool huge_pages) {
+    if (!huge_pages) {
+        return (char*)mmap(NULL, length, prot, share, fd, 0);
+    }
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t mapped = ((size_t)length + page - 1) / page * page;
+    size_t reserved = mapped + GTFS_HUGE_PAGE_SIZE;
+    char *area = (char*)mmap(NULL, reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (area == MAP_FAILED) {
+        return (char*)MAP_FAILED;
+    }
+    char *aligned = (char*)(((uintptr_t)area + GTFS_HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(GTFS_HUGE_PAGE_SIZE - 1));
+    char *data = (char*)mmap(aligned, length, prot, share | MAP_FIXED, fd, 0);
+    if (data == MAP_FAILED) {
+        munmap(area, reserved);
+        return (char*)MAP_FAILED;
+    }
+    // Give back the reservation around the mapping
+    if (aligned > area) {
+        munmap(area, aligned - area);
+    }
+    if (area + reserved > aligned + mapped) {
+        munmap(aligned + mapped, area + reserved - (aligned + mapped));
+    }
+    if (madvise(data, length, MADV_HUGEPAGE) != 0) {
+        VERBOSE_PRINT(do_verbose, "No huge pages for this mapping, it stays on regular pages\n");
+    }
+    return data;
+}
+
+void unpin_file(file_t *fl);
+
+// Helper function to pin the mapping of an open file so close cannot unmap it and
+// gtfs_resize_file cannot move it. Returns false if the file is closed or being closed.
+bool pin_file(file_t *fl) {
+    while (true) {
+        fl->pins.fetch_add(1);
+        if (fl->closing.load()) {
+            unpin_file(fl);
+            return false;
+        }
+        if (!fl->remapping.load()) {
+            return true;
+        }
+        // The mapping is being moved, pin it again at its new place
+        unpin_file(fl);
+        unique_lock<mutex> file_lock(fl->mtx);
+        fl->pins_cv.wait(file_lock, [fl] { return !fl->remapping.load() || fl->closing.load(); });
+    }
+}
+
+// Helper function to drop a pin, waking a close that waits for the last one
+void unpin_file(file_t *fl) {
+    if (fl->pins.fetch_sub(1) == 1 && (fl->closing.load() || fl->remapping.load())) {
+        lock_guard<mutex> file_lock(fl->mtx);
+        fl->pins_cv.notify_all();
+    }
+}
+
+gtfs_t* gtfs_init(string directory, int verbose_flag) {
+    do_verbose = verbose_flag;
+    gtfs_t *gtfs = NULL;
+    GTFS_TRACE_CALL(GTFS_OP_INIT, 0, 0, 0, gtfs);
+    VERBOSE_PRINT(do_verbose, "Initializing GTFileSystem inside directory " << directory << "\n");
+    //TODO: Add any additional initializations and checks, and complete the functionality
+
+    // Create directory if it doesn't exist
+    if (!create_directory(directory)) {
+        VERBOSE_PRINT(do_verbose, "Failed to create or access directory " << directory << "\n");
+        return NULL;
+    }
+
+    // Create .logs directory
+    string logs_dir = directory + "/.logs";
+    if (!create_directory(logs_dir)) {
+        VERBOSE_PRINT(do_verbose, "Failed to create or access logs directory " << logs_dir << "\n");
+        return NULL;
+    }
+
+    // Attach to the registry shared by the processes using the directory. The logs that a
+    // previous instance left behind are looked at (see recover_files): with the registry
+    // only those of files that a dead process left open, without it every log in the directory.
+    bool created = false;
+    gtfs_registry_t *registry = attach_registry(directory, &created);
+    if (registry && !created) {
+        recover_registered(directory, registry);
+    } else {
+        recover_directory(directory, registry);
+    }
+
+    // Initialize gtfs struct
+    gtfs = new gtfs_t();
+    gtfs->dirname = directory;
+    gtfs->registry = registry;
+    pool_init(gtfs);
+    memset((void*)gtfs->local_stats, 0, sizeof(gtfs->local_stats));
+    gtfs->stats = registry ? registry->stats : gtfs->local_stats;
+    gtfs->group_commit = 0;
+    gtfs->group_commit_window_us = GTFS_DEFAULT_GROUP_COMMIT_WINDOW_US;
+    gtfs->group_commit_max_batch = GTFS_DEFAULT_GROUP_COMMIT_MAX_BATCH;
+    gtfs->gc_flusher = NULL;
+    gtfs->gc_flusher_pid = 0;
+    gtfs->gc_stop = 0;
+    gtfs->checkpointer_enabled = 0;
+    gtfs->checkpoint_bytes = 0;
+    gtfs->checkpoint_age_ms = 0;
+    gtfs->checkpointer = NULL;
+    gtfs->checkpointer_pid = 0;
+    gtfs->ckpt_stop = 0;
+    gtfs->txn_fd = -1;
+    gtfs->txn_pid = 0;
+    gtfs->txn_tail = 0;
+    gtfs->txn_next_seq = 1;
+    gtfs->txn_inflight = 0;
+    gtfs->wal = 0;
+    gtfs->wal_segment_size = GTFS_DEFAULT_WAL_SEGMENT_SIZE;
+    gtfs->wal_max_segments = GTFS_DEFAULT_WAL_MAX_SEGMENTS;
+    gtfs->wal_lock_fd = -1;
+    gtfs->wal_pid = 0;
+    gtfs->wal_next_seq = 1;
+    gtfs->wal_next_index = 1;
+    gtfs->wal_next_file_id = 1;
+    gtfs->wal_next_name = 0;
+    gtfs->async_engine = NULL;
+    gtfs->async_pid = 0;
+    gtfs->huge_page_min = 0;
+    gtfs->delta_records = 0;
+    gtfs->private_mapping = 0;
+    gtfs->log_prealloc = 0;
+    gtfs->snapshots = 0;
+    gtfs->durability = GTFS_DURABLE_PROCESS;
+    gtfs->durable_interval_ms = 0;
+    gtfs->wal_unflushed = 0;
+    gtfs->syncer_wanted = 0;
+    gtfs->syncer_running = 0;
+    gtfs->syncer_stop = 0;
+    gtfs->syncer = NULL;
+    gtfs->syncer_pid = 0;
+    gtfs->periodic_parts.store(0);
+    gtfs->periodic_flushed.store(0);
+
+    /* Should initialize a way to keep track of open file structs to make implementations of clean and abort simpler*/
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns non NULL.
+    return gtfs;
+}
+
+int gtfs_clean(gtfs_t *gtfs) {
+    int ret = -1;
+    if (gtfs) {
+        VERBOSE_PRINT(do_verbose, "Cleaning up GTFileSystem inside directory " << gtfs->dirname << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
+        return ret;
+    }
+    GTFS_TRACE_CALL(GTFS_OP_CLEAN, 0, 0, 0, ret);
+    //TODO: Add any additional initializations and checks, and complete the functionality
+
+    // Checkpoint every open file now, one file lock at a time
+    vector<file_t*> files;
+    {
+        lock_guard<mutex> files_lock(gtfs->files_mutex);
+        for (auto &entry : gtfs->open_files) {
+            files.push_back(entry.second);
+        }
+    }
+
+    ret = 0;
+    auto start = chrono::steady_clock::now();
+    for (file_t *fl : files) {
+        lock_guard<mutex> file_lock(fl->mtx);
+        if (!checkpoint_file(fl)) {
+            VERBOSE_PRINT(do_verbose, "Failed to checkpoint file " << fl->filename << "\n");
+            ret = -1;
+        }
+    }
+    stat_latency(stats_ref_t{ stats_shard(gtfs->stats), NULL }, &gtfs_stats_t::clean_latency, start);
+    if (ret != 0) {
+        return ret;
+    }
+
+    // With no write left the blocks of the write pool are all free
+    size_t chunks = pool_trim(gtfs);
+    if (chunks > 0) {
+        VERBOSE_PRINT(do_verbose, "Gave back " << chunks << " chunks of the write pool\n");
+    }
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
+
+file_t* gtfs_open_file_mode(gtfs_t* gtfs, string filename, int64_t file_length, int mode) {
+    file_t *fl = NULL;
+    if (gtfs) {
+        VERBOSE_PRINT(do_verbose, "Opening file " << filename << (mode == GTFS_OPEN_READ ? " for reading" : "") << " inside directory " << gtfs->dirname << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
+        return NULL;
+    }
+    uint32_t trace_id = gtfs_trace_file_id(filename);
+    GTFS_TRACE_CALL(GTFS_OP_OPEN, trace_id, mode, file_length, fl);
+    
+
+    if (filename.length() > MAX_FILENAME_LEN) {
+        VERBOSE_PRINT(do_verbose, "Filename exceeds maximum length\n");
+        return NULL;
+    }
+
+    if (mode != GTFS_OPEN_WRITE && mode != GTFS_OPEN_READ) {
+        VERBOSE_PRINT(do_verbose, "Invalid open mode\n");
+        return NULL;
+    }
+
+    if (mode == GTFS_OPEN_WRITE && gtfs->wal && gtfs->wal_pid != getpid()) {
+        VERBOSE_PRINT(do_verbose, "The WAL of " << gtfs->dirname << " belongs to another process\n");
+        return NULL;
+    }
+
+    string file_path = gtfs->dirname + "/" + filename;
+    string log_path = get_log_path(gtfs->dirname, filename);
+
+    {
+        // A second open in the same process would wait on our own lock forever
+        lock_guard<mutex> files_lock(gtfs->files_mutex);
+        if (gtfs->open_files.count(filename)) {
+            VERBOSE_PRINT(do_verbose, "File " << filename << " is already open\n");
+            return NULL;
+        }
+        if (gtfs->open_files.size() >= MAX_NUM_FILES_PER_DIR) {
+            VERBOSE_PRINT(do_verbose, "Too many open files inside directory " << gtfs->dirname << "\n");
+            return NULL;
+        }
+    }
+
+    // Acquire lock. A writer waits for the writer before it, a reader only checks whether
+    // there is one: if not, it may have to recover what a dead writer left behind.
+    // A reader still needs write access to the file for that.
+    int fd = open(file_path.c_str(), mode == GTFS_OPEN_READ ? O_RDWR : O_RDWR | O_CREAT, 0644);
+    if (fd == -1) {
+        VERBOSE_PRINT(do_verbose, "Failed to open or create file " << file_path << "\n");
+        return NULL;
+    }
+
+    bool writer = acquire_writer_lock(fd, mode == GTFS_OPEN_WRITE);
+    if (!writer && mode == GTFS_OPEN_WRITE) {
+        VERBOSE_PRINT(do_verbose, "Failed to acquire lock on file " << file_path << "\n");
+        close(fd);
+        return NULL;
+    }
+
+    // A file that has no entry yet or that a dead process left open has to be looked at.
+    // So does one the registry takes for closed cleanly if its log still has records: the
+    // entry may not have reached the disk before the machine went down.
+    bool created = true;
+    gtfs_registry_entry_t *entry = gtfs->registry ? registry_find(gtfs->registry, filename, &created) : NULL;
+    bool recover = writer && (entry == NULL || created || entry->open || log_has_records(log_path));
+
+    // Apply existing logs, now that no other process can be using them. A writer that keeps
+    // a log of its own adopts it further down instead, so open does not wait for the replay.
+    // Not if a cross-file transaction has a part for the file, that goes through apply_log.
+    struct stat log_st;
+    bool adopt = false;
+    log_meta_t adopt_meta;
+    auto recover_start = chrono::steady_clock::now();
+    stats_ref_t recover_stats{ stats_shard(gtfs->stats), entry ? &entry->stats : NULL };
+    if (recover && stat(log_path.c_str(), &log_st) == 0) {
+        VERBOSE_PRINT(do_verbose, "Detecting logs from previous instance, recovering data\n");
+        // Transaction logs are only read if the registry knows of any
+        map<string, vector<txn_redo_t>> redo;
+        if (!gtfs->registry || gtfs->registry->txn_logs > 0) {
+            redo = load_txn_redo(gtfs->dirname);
+        }
+        auto file_redo = redo.find(filename);
+        if (mode == GTFS_OPEN_WRITE && !gtfs->wal && file_redo == redo.end()) {
+            int header_fd = open(log_path.c_str(), O_RDONLY);
+            adopt = header_fd != -1 && read_log_header(header_fd, &adopt_meta);
+            if (header_fd != -1) {
+                close(header_fd);
+            }
+        }
+        stats_ref_t stats = recover_stats;
+        uint64_t replayed = 0;
+        if (!adopt && !apply_log(log_path, fd, file_redo == redo.end() ? NULL : &file_redo->second, stats, &replayed)) {
+            VERBOSE_PRINT(do_verbose, "Failed to recover " << file_path << " from its log\n");
+            release_writer_lock(fd);
+            close(fd);
+            return NULL;
+        }
+        if (!adopt) {
+            GTFS_TRACE_EVENT(GTFS_OP_RECOVER, trace_id, 0, replayed, 0);
+            stat_add(stats, &gtfs_stats_t::recovery_records, replayed);
+            stat_latency(stats, &gtfs_stats_t::recovery_latency, recover_start);
+        }
+    }
+
+    // So do the file's records in a WAL whose process is gone
+    if (recover && !gtfs->wal && !recover_registered_wal(gtfs->registry, gtfs->dirname, filename, fd)) {
+        VERBOSE_PRINT(do_verbose, "Failed to recover " << file_path << " from the WAL\n");
+        release_writer_lock(fd);
+        close(fd);
+        return NULL;
+    }
+
+    // Check if file exists
+    struct stat st;
+    if (fstat(fd, &st) == -1) {
+        VERBOSE_PRINT(do_verbose, "Failed to stat file " << file_path << "\n");
+        release_writer_lock(fd);
+        close(fd);
+        return NULL;
+    }
+
+    if (mode == GTFS_OPEN_READ) {
+        if (st.st_size < file_length) {
+            VERBOSE_PRINT(do_verbose, "File " << file_path << " is shorter than " << file_length << " bytes\n");
+            release_writer_lock(fd);
+            close(fd);
+            return NULL;
+        }
+    } else if (st.st_size == 0) {
+        // New file, set size
+        if (ftruncate(fd, file_length) == -1) {
+            VERBOSE_PRINT(do_verbose, "Failed to set file size for " << file_path << "\n");
+            release_writer_lock(fd);
+            close(fd);
+            return NULL;
+        }
+    } else {
+        if (file_length < st.st_size) {
+            VERBOSE_PRINT(do_verbose, "New file length is smaller than existing length\n");
+            release_writer_lock(fd);
+            close(fd);
+            return NULL;
+        }
+        if (file_length > st.st_size) {
+            if (ftruncate(fd, file_length) == -1) {
+                VERBOSE_PRINT(do_verbose, "Failed to extend file size for " << file_path << "\n");
+                release_writer_lock(fd);
+                close(fd);
+                return NULL;
+            }
+        }
+    }
+
+
+    // Memory map the file
+    bool huge_pages = gtfs->huge_page_min > 0 && file_length >= gtfs->huge_page_min;
+    bool private_map = mode == GTFS_OPEN_WRITE && gtfs->private_mapping;
+    char* data = map_file(fd, file_length, mode == GTFS_OPEN_READ ? PROT_READ : PROT_READ | PROT_WRITE, private_map ? MAP_PRIVATE : MAP_SHARED, huge_pages);
+    if (data == MAP_FAILED) {
+        VERBOSE_PRINT(do_verbose, "Failed to mmap file " << file_path << "\n");
+        release_writer_lock(fd);
+        close(fd);
+        return NULL;
+    }
+
+    // Keep the log open for the lifetime of the file so syncs only have to append.
+    // With the directory WAL the file has no log of its own, and a reader never has one.
+    bool logged = mode == GTFS_OPEN_WRITE && !gtfs->wal;
+    int log_flags = gtfs->durability == GTFS_DURABLE_DSYNC ? O_DSYNC : 0;
+    int log_fd = logged ? open(log_path.c_str(), O_RDWR | O_CREAT | log_flags, 0644) : -1;
+    if (log_fd == -1 && logged) {
+        VERBOSE_PRINT(do_verbose, "Failed to open or create log " << log_path << "\n");
+        munmap(data, file_length);
+        release_writer_lock(fd);
+        close(fd);
+        return NULL;
+    }
+
+    // Initialize file_t struct
     fl = new file_t();
     fl->filename = filename;
     fl->gtfs = gtfs;
+    fl->trace_id = trace_id;
     fl->fd = fd;
+    fl->mode = mode;
     fl->file_length = file_length;
     fl->data = data;
-    fl->log_path = log_path;
+    fl->huge_pages = huge_pages;
+    fl->private_map = private_map;
+    fl->log_prealloc = logged ? gtfs->log_prealloc : 0;
+    fl->log_allocated = 0;
+    fl->durability = gtfs->durability;
+    fl->durable_interval_ms = gtfs->durable_interval_ms;
+    fl->log_unflushed = 0;
+    fl->log_flushed = chrono::steady_clock::now();
+    fl->mvcc = mode == GTFS_OPEN_WRITE && gtfs->snapshots;
+    fl->commit_version = 0;
+    fl->log_path = log_path;
+    fl->log_fd = log_fd;
+    fl->pins.store(0);
+    fl->closing.store(0);
+    fl->remapping.store(0);
+    fl->overlaid.store(0);
+    fl->next_seq = 1; // Any earlier log was applied and removed above, or is adopted below
+    fl->wal_pending = 0;
+    fl->wal_done = 0;
+    fl->inflight = 0;
+    fl->async_pending = 0;
+    fl->append_failed = -1;
+    fl->reg = mode == GTFS_OPEN_WRITE ? entry : NULL;
+    memset(&fl->local_stats, 0, sizeof(gtfs_stats_t));
+    fl->stats = entry ? &entry->stats : &fl->local_stats;
+    uint64_t adopted = 0;
+    if (mode == GTFS_OPEN_READ) {
+        // Done with recovery, the next writer must not wait for us
+        release_writer_lock(fd);
+        if (entry && recover) {
+            entry->open = 0;
+            entry->owner = 0;
+        }
+    } else if (gtfs->wal) {
+        lock_guard<mutex> wal_lock(gtfs->wal_mutex);
+        fl->wal_id = gtfs->wal_next_file_id++;
+    } else if (adopt ? !adopt_log(fl, &adopt_meta, &adopted) : !init_log(fl)) {
+        VERBOSE_PRINT(do_verbose, "Failed to initialize log " << log_path << "\n");
+        close(log_fd);
+        munmap(data, file_length);
+        release_writer_lock(fd);
+        close(fd);
+        delete fl;
+        return NULL;
+    } else if (adopt) {
+        GTFS_TRACE_EVENT(GTFS_OP_RECOVER, trace_id, 0, adopted, 0);
+        stat_add(recover_stats, &gtfs_stats_t::recovery_records, adopted);
+        stat_latency(recover_stats, &gtfs_stats_t::recovery_latency, recover_start);
+    }
+
+    if (fl->reg) {
+        entry->owner = getpid();
+        entry->file_length = file_length;
+        entry->open = 1;
+        publish_log_state(fl);
+    }
+
+    {
+        lock_guard<mutex> files_lock(gtfs->files_mutex);
+        gtfs->open_files[filename] = fl;
+    }
+    ensure_checkpointer(gtfs);
+    ensure_syncer(gtfs, fl->durability == GTFS_DURABLE_PERIODIC);
+
+    // Close the file descriptor (lock remains held)
+    // Note: Need to keep the fd open to maintain the lock
+    //close(fd);
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns non NULL.
+    return fl;
+}
+
+file_t* gtfs_open_file(gtfs_t* gtfs, string filename, int64_t file_length) {
+    return gtfs_open_file_mode(gtfs, filename, file_length, GTFS_OPEN_WRITE);
+}
+
+int gtfs_close_file(gtfs_t* gtfs, file_t* fl) {
+    int ret = -1;
+    if (gtfs and fl) {
+        VERBOSE_PRINT(do_verbose, "Closing file " << fl->filename << " inside directory " << gtfs->dirname << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem or file does not exist\n");
+        return ret;
+    }
+    GTFS_TRACE_CALL(GTFS_OP_CLOSE, fl->trace_id, 0, fl->file_length, ret);
+    //TODO: Add any additional initializations and checks, and complete the functionality
+
+
+    {
+        lock_guard<mutex> files_lock(gtfs->files_mutex);
+        gtfs->open_files.erase(fl->filename);
+    }
+
+    // The checkpointer may still hold a pointer to the file, it checks log_fd under the lock.
+    // Readers may still hold views into the mapping, wait until they are released.
+    unique_lock<mutex> file_lock(fl->mtx);
+    fl->closing.store(1);
+    fl->pins_cv.wait(file_lock, [fl] { return fl->pins.load() == 0; });
+    fl->inflight_cv.notify_all(); // Writes waiting to copy see closing
+    fl->inflight_cv.wait(file_lock, [fl] { return fl->inflight == 0 && fl->async_pending == 0; });
+
+    // Clean to apply any pending logs. Unless an outstanding write covers some of the
+    // committed bytes they are taken from the mapping, the log is not read back.
+    bool applied = true;
+    if (fl->mode == GTFS_OPEN_READ) {
+        // Nothing logged
+    } else if (gtfs->wal) {
+        applied = wal_checkpoint_file(fl) && wal_note_close(fl);
+    } else if (mapping_committed(fl)) {
+        applied = checkpoint_file(fl) && (fl->log_prealloc > 0 || remove(fl->log_path.c_str()) == 0);
+    } else if (fl->log_prealloc > 0) {
+        // Kept for the next open, emptied instead of removed
+        applied = replay_log(fl->log_fd, fl->fd, fl->log_path, &fl->log_meta, fl->log_tail, NULL, stats_of(fl), NULL) && reset_log(fl);
+    } else {
+        applied = apply_log(fl->log_path, fl->fd, NULL, stats_of(fl), NULL);
+    }
+    if (!applied) {
+        VERBOSE_PRINT(do_verbose, "Failed to apply logs during close\n");
+        return ret;
+    }
+
+    // Unmap the file
+    if (munmap(fl->data, fl->file_length) != 0) {
+        VERBOSE_PRINT(do_verbose, "Failed to unmap file " << fl->filename << "\n");
+        return ret;
+    }
+    fl->data = NULL;
+
+    if (fl->log_fd >= 0) {
+        close(fl->log_fd);
+    }
+    fl->log_fd = -1;
+    fl->newest.clear();
+    fl->overlay.clear();
+    fl->overlaid.store(0);
+    fl->committed_pages.clear();
+    fl->page_versions.clear();
+
+    // Everything is applied, a later open has nothing to recover
+    if (fl->reg) {
+        fl->reg->open = 0;
+        fl->reg->owner = 0;
+        fl->reg->log_head = fl->reg->log_tail = 0;
+        fl->reg = NULL;
+    }
+
+    release_writer_lock(fl->fd);
+    close(fl->fd); // Drops any range locks as well
+    fl->fd = -1;
+    ret = 0;
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
+
+int gtfs_remove_file(gtfs_t* gtfs, file_t* fl) {
+    int ret = -1;
+    if (gtfs and fl) {
+        VERBOSE_PRINT(do_verbose, "Removing file " << fl->filename << " inside directory " << gtfs->dirname << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem or file does not exist\n");
+        return ret;
+    }
+    GTFS_TRACE_CALL(GTFS_OP_REMOVE, fl->trace_id, 0, fl->file_length, ret);
+    //TODO: Add any additional initializations and checks, and complete the functionality
+
+     // Ensure the file is not open by checking if data is mapped
+    if (fl->data) {
+        VERBOSE_PRINT(do_verbose, "File is currently open and cannot be removed\n");
+        return ret;
+    }
+
+    // Remove the actual file
+    string file_path = gtfs->dirname + "/" + fl->filename;
+    if (remove(file_path.c_str()) != 0) {
+        VERBOSE_PRINT(do_verbose, "Failed to remove file " << file_path << "\n");
+        return ret;
+    }
+
+    // Remove the log file
+    string log_path = fl->log_path;
+    remove(log_path.c_str());
+
+    ret = 0;
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
+
+char* gtfs_read_file(gtfs_t* gtfs, file_t* fl, int64_t offset, int64_t length) {
+    char* ret_data = NULL;
+    if (gtfs and fl) {
+        VERBOSE_PRINT(do_verbose, "Reading " << length << " bytes starting from offset " << offset << " inside file " << fl->filename << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem or file does not exist\n");
+        return NULL;
+    }
+    GTFS_TRACE_CALL(GTFS_OP_READ, fl->trace_id, offset, length, ret_data);
+    //TODO: Add any additional initializations and checks, and complete the functionality
+
+    // Check that read is valid
+    if (offset < 0 || length < 0 || offset > fl->file_length - length) {
+        VERBOSE_PRINT(do_verbose, "Invalid offset or length\n");
+        return NULL;
+    }
+
+    // Allocate memory for the read data
+    ret_data = (char*)malloc(length + 1);
+    if (!ret_data) {
+        VERBOSE_PRINT(do_verbose, "Memory allocation failed for read\n");
+        return NULL;
+    }
+
+    if (!pin_file(fl)) {
+        VERBOSE_PRINT(do_verbose, "File " << fl->filename << " is not open\n");
+        free(ret_data);
+        return NULL;
+    }
+    if (!resolve_overlay(fl, offset, length)) {
+        unpin_file(fl);
+        free(ret_data);
+        return NULL;
+    }
+    // A reader waits for writes to the same bytes, the writer sees its own
+    bool ranged = fl->mode == GTFS_OPEN_READ;
+    if (ranged && !hold_range(fl, offset, length)) {
+        VERBOSE_PRINT(do_verbose, "Failed to lock bytes of file " << fl->filename << "\n");
+        unpin_file(fl);
+        free(ret_data);
+        return NULL;
+    }
+    memcpy(ret_data, fl->data + offset, length);
+    if (ranged) {
+        drop_range(fl, offset, length);
+    }
+    unpin_file(fl);
+    ret_data[length] = '\0'; // Null-terminate the string
+
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns pointer to data read.
+    return ret_data;
+}
+
+int gtfs_read_view(gtfs_t* gtfs, file_t* fl, int64_t offset, int64_t length, gtfs_view_t *view) {
+    int ret = -1;
+    if (gtfs and fl and view) {
+        VERBOSE_PRINT(do_verbose, "Viewing " << length << " bytes starting from offset " << offset << " inside file " << fl->filename << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem, file or view does not exist\n");
+        return ret;
+    }
+    GTFS_TRACE_CALL(GTFS_OP_READ, fl->trace_id, offset, length, ret);
+
+    // Check that read is valid
+    if (offset < 0 || length < 0 || offset > fl->file_length - length) {
+        VERBOSE_PRINT(do_verbose, "Invalid offset or length\n");
+        return ret;
+    }
+
+    // The pin keeps the mapping alive until the view is released, for a reader the range
+    // lock keeps writes to the bytes out until then
+    if (!pin_file(fl)) {
+        VERBOSE_PRINT(do_verbose, "File " << fl->filename << " is not open\n");
+        return ret;
+    }
+    if (!resolve_overlay(fl, offset, length)) {
+        unpin_file(fl);
+        return ret;
+    }
+    if (fl->mode == GTFS_OPEN_READ && !hold_range(fl, offset, length)) {
+        VERBOSE_PRINT(do_verbose, "Failed to lock bytes of file " << fl->filename << "\n");
+        unpin_file(fl);
+        return ret;
+    }
+    view->data = fl->data + offset;
+    view->length = length;
+    view->fl = fl;
+    ret = 0;
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
+
+int gtfs_release_view(gtfs_view_t *view) {
+    int ret = -1;
+    if (view and view->fl) {
+        VERBOSE_PRINT(do_verbose, "Releasing view of " << view->length << " bytes inside file " << view->fl->filename << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "View does not exist or was already released\n");
+        return ret;
+    }
+
+    file_t *fl = view->fl;
+    if (fl->mode == GTFS_OPEN_READ) {
+        drop_range(fl, view->data - fl->data, view->length);
+    }
+    view->fl = NULL;
+    view->data = NULL;
+    unpin_file(fl);
+    ret = 0;
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
+
+int64_t gtfs_read_file_into(gtfs_t* gtfs, file_t* fl, int64_t offset, int64_t length, char *buf) {
+    int64_t ret = -1;
+    if (gtfs and fl and buf) {
+        VERBOSE_PRINT(do_verbose, "Reading " << length << " bytes starting from offset " << offset << " inside file " << fl->filename << " into caller buffer\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem, file or buffer does not exist\n");
+        return ret;
+    }
+    GTFS_TRACE_CALL(GTFS_OP_READ, fl->trace_id, offset, length, ret);
+
+    // Check that read is valid
+    if (offset < 0 || length < 0 || offset > fl->file_length - length) {
+        VERBOSE_PRINT(do_verbose, "Invalid offset or length\n");
+        return ret;
+    }
+
+    if (!pin_file(fl)) {
+        VERBOSE_PRINT(do_verbose, "File " << fl->filename << " is not open\n");
+        return ret;
+    }
+    if (!resolve_overlay(fl, offset, length)) {
+        unpin_file(fl);
+        return ret;
+    }
+    bool ranged = fl->mode == GTFS_OPEN_READ;
+    if (ranged && !hold_range(fl, offset, length)) {
+        VERBOSE_PRINT(do_verbose, "Failed to lock bytes of file " << fl->filename << "\n");
+        unpin_file(fl);
+        return ret;
+    }
+    memcpy(buf, fl->data + offset, length);
+    if (ranged) {
+        drop_range(fl, offset, length);
+    }
+    unpin_file(fl);
+    ret = length;
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns number of bytes read.
+    return ret;
+}
+
+int gtfs_resize_file(gtfs_t* gtfs, file_t* fl, int64_t file_length) {
+    int ret = -1;
+    if (gtfs and fl) {
+        VERBOSE_PRINT(do_verbose, "Resizing file " << fl->filename << " to " << file_length << " bytes inside directory " << gtfs->dirname << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem or file does not exist\n");
+        return ret;
+    }
+    GTFS_TRACE_CALL(GTFS_OP_RESIZE, fl->trace_id, 0, file_length, ret);
+
+    if (fl->mode == GTFS_OPEN_READ) {
+        VERBOSE_PRINT(do_verbose, "File " << fl->filename << " is open for reading only\n");
+        return ret;
+    }
+
+    unique_lock<mutex> file_lock(fl->mtx);
+    if (fl->data == NULL || fl->closing.load()) {
+        VERBOSE_PRINT(do_verbose, "File " << fl->filename << " is not open\n");
+        return ret;
+    }
+    if (file_length < fl->file_length) {
+        VERBOSE_PRINT(do_verbose, "New file length is smaller than existing length\n");
+        return ret;
+    }
+    if (file_length > fl->file_length && ftruncate(fl->fd, file_length) != 0) {
+        VERBOSE_PRINT(do_verbose, "Failed to extend file size for " << fl->filename << "\n");
+        return ret;
+    }
+
+    // Grow the mapping in place if the address space after it is free, views and copies
+    // into it carry on then. Otherwise it moves once none is left, new ones wait.
+    char *data = file_length == fl->file_length ? fl->data : (char*)mremap(fl->data, fl->file_length, file_length, 0);
+    if (data == MAP_FAILED) {
+        fl->remapping.store(1);
+        while (!fl->closing.load() && (fl->pins.load() > 0 || fl->inflight > 0)) {
+            if (fl->pins.load() > 0) {
+                fl->pins_cv.wait(file_lock);
+            } else {
+                fl->inflight_cv.wait(file_lock);
+            }
+        }
+        data = fl->closing.load() ? (char*)MAP_FAILED : (char*)mremap(fl->data, fl->file_length, file_length, MREMAP_MAYMOVE);
+        fl->remapping.store(0);
+        fl->pins_cv.notify_all();
+        if (data == MAP_FAILED) {
+            VERBOSE_PRINT(do_verbose, "Failed to remap file " << fl->filename << "\n");
+            return ret;
+        }
+        if (fl->huge_pages && ((uintptr_t)data & (GTFS_HUGE_PAGE_SIZE - 1)) != 0) {
+            VERBOSE_PRINT(do_verbose, "Mapping of " << fl->filename << " moved off a huge page boundary\n");
+        }
+    }
+    if (fl->huge_pages && madvise(data, file_length, MADV_HUGEPAGE) != 0) {
+        VERBOSE_PRINT(do_verbose, "No huge pages for the grown mapping\n");
+    }
+    fl->data = data;
+    fl->file_length = file_length;
+    if (fl->reg) {
+        fl->reg->file_length = file_length;
+    }
+    ret = 0;
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
+
+int gtfs_prefetch(gtfs_t* gtfs, file_t* fl, int64_t offset, int64_t length, int hint) {
+    int ret = -1;
+    if (gtfs and fl) {
+        VERBOSE_PRINT(do_verbose, "Advising " << length << " bytes starting from offset " << offset << " inside file " << fl->filename << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem or file does not exist\n");
+        return ret;
+    }
+    GTFS_TRACE_CALL(GTFS_OP_PREFETCH, fl->trace_id, offset, length, ret);
+
+    static const int advice[] = { MADV_NORMAL, MADV_SEQUENTIAL, MADV_RANDOM, MADV_WILLNEED };
+    if (hint < GTFS_ACCESS_NORMAL || hint > GTFS_ACCESS_WILLNEED) {
+        VERBOSE_PRINT(do_verbose, "Invalid access hint\n");
+        return ret;
+    }
+
+    if (!pin_file(fl)) {
+        VERBOSE_PRINT(do_verbose, "File " << fl->filename << " is not open\n");
+        return ret;
+    }
+    if (offset < 0 || length < 0 || offset > fl->file_length - length) {
+        VERBOSE_PRINT(do_verbose, "Invalid offset or length\n");
+        unpin_file(fl);
+        return ret;
+    }
+
+    // madvise works on whole pages
+    int64_t page = sysconf(_SC_PAGESIZE);
+    int64_t start = offset / page * page;
+    if (length > 0 && madvise(fl->data + start, offset + length - start, advice[hint]) != 0) {
+        VERBOSE_PRINT(do_verbose, "Failed to advise the mapping of " << fl->filename << "\n");
+        unpin_file(fl);
+        return ret;
+    }
+    unpin_file(fl);
+    ret = 0;
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
+
+write_t* gtfs_write_file(gtfs_t* gtfs, file_t* fl, int64_t offset, int64_t length, const char* data) {
+    write_t *write_id = NULL;
+    if (gtfs and fl) {
+        VERBOSE_PRINT(do_verbose, "Writting " << length << " bytes starting from offset " << offset << " inside file " << fl->filename << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem or file does not exist\n");
+        return NULL;
+    }
+    GTFS_TRACE_CALL(GTFS_OP_WRITE, fl->trace_id, offset, length, write_id);
+    //TODO: Add any additional initializations and checks, and complete the functionality
+
+    if (fl->closing.load()) {
+        VERBOSE_PRINT(do_verbose, "File " << fl->filename << " is not open\n");
+        return NULL;
+    }
+
+    if (fl->mode == GTFS_OPEN_READ) {
+        VERBOSE_PRINT(do_verbose, "File " << fl->filename << " is open for reading only\n");
+        return NULL;
+    }
+
+    // Check that write is valid
+    if (offset < 0 || length < 0 || offset > fl->file_length - length) {
+        VERBOSE_PRINT(do_verbose, "Invalid offset or length\n");
+        return NULL;
+    }
+
+    //Modify in memmory copy of the file but not the actual file
+
+    // The write and both of its buffers come from one pooled block
+    write_id = alloc_write(gtfs, length);
+    if (write_id == NULL) {
+        VERBOSE_PRINT(do_verbose, "Could not allocate memory for write struct\n");
+        return NULL;
+    }
+    write_id->filename = fl->filename.c_str();
+    write_id->fl = fl;
+    write_id->offset = offset;
+    write_id->length = length;
+    write_id->synced = 0;
+    write_id->aborted = 0;
+    write_id->txn = NULL;
+    write_id->delta = 0; // Decided under fl->mtx below
+
+    // Copy data over to the write struct
+    memcpy(write_id->data, data, length);
+
+    // Readers in other processes must not see the bytes until the write is synced
+    if (!hold_range(fl, offset, length)) {
+        VERBOSE_PRINT(do_verbose, "Failed to lock bytes of file " << fl->filename << "\n");
+        free_write(gtfs, write_id);
+        return NULL;
+    }
+
+    {
+        // A checkpoint copies outstanding writes back over the bytes it replays, and waits
+        // for the copy below. Copies of overlapping writes go one at a time so that each
+        // saves the bytes the other one left.
+        unique_lock<mutex> file_lock(fl->mtx);
+        fl->inflight_cv.wait(file_lock, [&] { return fl->closing.load() || !range_overlaps(fl->copying, offset, length); });
+        if (fl->closing.load()) {
+            VERBOSE_PRINT(do_verbose, "File " << fl->filename << " was closed\n");
+            file_lock.unlock();
+            drop_range(fl, offset, length);
+            free_write(gtfs, write_id);
+            return NULL;
+        }
+        // The bytes saved for an abort must be the newest committed ones
+        if ((fl->overlaid.load() && !materialize_overlay(fl, offset, length)) || !mvcc_save_pages(fl, offset, length)) {
+            file_lock.unlock();
+            drop_range(fl, offset, length);
+            free_write(gtfs, write_id);
+            return NULL;
+        }
+        // old_data only holds committed bytes if no outstanding write overlaps this one,
+        // and one that does can no longer be logged as a delta of its own old_data
+        write_id->delta = 1;
+        for (write_t *other : fl->outstanding) {
+            if (other->offset < offset + length && offset < other->offset + other->length) {
+                other->delta = 0;
+                write_id->delta = 0;
+            }
+        }
+        fl->copying.insert(upper_bound(fl->copying.begin(), fl->copying.end(), pair<int64_t, int64_t>(offset, length)), pair<int64_t, int64_t>(offset, length));
+        fl->inflight++;
+        fl->outstanding.push_back(write_id);
+    }
+
+    // Threads writing other bytes copy at the same time
+    memcpy(write_id->old_data, fl->data + offset, length);
+
+    //Write data to the in memory copy
+    memcpy(fl->data + offset, data, length);
+
+    {
+        lock_guard<mutex> file_lock(fl->mtx);
+        fl->copying.erase(lower_bound(fl->copying.begin(), fl->copying.end(), pair<int64_t, int64_t>(offset, length)));
+        fl->inflight--;
+        settle_appends(fl); // May have waited for us to cut off a failed append
+    }
+    fl->inflight_cv.notify_all();
+
+    stat_add(stats_of(fl), &gtfs_stats_t::bytes_written, length);
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns non NULL.
+    return write_id;
+}
+
+int64_t gtfs_sync_write_file(write_t* write_id) {
+    int64_t ret = -1;
+    if (write_id) {
+        VERBOSE_PRINT(do_verbose, "Persisting write of " << write_id->length << " bytes starting from offset " << write_id->offset << " inside file " << write_id->filename << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "Write operation does not exist\n");
+        return ret;
+    }
+    GTFS_TRACE_CALL(GTFS_OP_SYNC, write_id->fl->trace_id, write_id->offset, write_id->length, ret);
+    //TODO: Add any additional initializations and checks, and complete the functionality
+
+    // Writes the commit to the log
+    // Maybe store a strict metadata struct?
+
+    /* May need to include a reference to gtfs to have syncs work*/
+    /* Assume this works for now*/
+
+    gtfs_t *gtfs = write_id->fl->gtfs;
+    file_t *fl = write_id->fl;
+
+    if (fl->data == NULL) {
+        VERBOSE_PRINT(do_verbose, "File " << fl->filename << " is not open\n");
+        return ret;
+    }
+
+    if (write_id->aborted) {
+        VERBOSE_PRINT(do_verbose, "Cannot sync a write that has been aborted!\n");
+        return ret;
+    }
+
+    if (write_id->txn) {
+        VERBOSE_PRINT(do_verbose, "Write is part of a transaction, commit the transaction instead\n");
+        return ret;
+    }
+
+    // Group commit: the flusher appends this record together with any other queued syncs
+    auto start = chrono::steady_clock::now();
+    if (gtfs->group_commit && group_commit_sync(write_id, &ret)) {
+        if (ret < 0) {
+            VERBOSE_PRINT(do_verbose, "Group commit failed\n");
+            return ret;
+        }
+        stat_add(stats_of(fl), &gtfs_stats_t::commits, 1);
+        stat_latency(stats_of(fl), &gtfs_stats_t::sync_latency, start);
+        VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns number of bytes written.
+        return ret;
+    }
+
+    // Header, payload and trailer go out in one append on the log held open by the file.
+    // The record only counts as committed once its trailer is on disk. A write that changed
+    // few of its bytes only logs those.
+    commit_t commit_meta;
+    vector<char> delta;
+    uint32_t payload_crc = 0;
+    bool delta_ok = !gtfs->wal && encode_delta(write_id, delta, &payload_crc);
+    if (!delta_ok) {
+        payload_crc = crc32c(0, write_id->data, write_id->length);
+    }
+    {
+        unique_lock<mutex> file_lock(fl->mtx);
+        if (gtfs->wal) {
+            // The record goes to the directory WAL instead
+            if (!wal_append_writes(fl, &write_id, 1)) {
+                VERBOSE_PRINT(do_verbose, "Failed to append commit to the WAL\n");
+                return -1;
+            }
+            mark_synced(write_id);
+            VERBOSE_PRINT(do_verbose, "Committed to the WAL. Offset: " << write_id->offset << " length: " << write_id->length << "\n");
+        } else if (!append_write_record(fl, file_lock, write_id, delta_ok ? &delta : NULL, payload_crc, &commit_meta)) {
+            VERBOSE_PRINT(do_verbose, "Failed to append commit to log " << fl->log_path << "\n");
+            return -1;
+        } else if (fl->durability == GTFS_DURABLE_COMMIT && !flush_file_log(fl, &file_lock)) {
+            VERBOSE_PRINT(do_verbose, "Committed, but failed to flush log " << fl->log_path << "\n");
+            return -1;
+        }
+    }
+    if (!gtfs->wal) {
+        VERBOSE_PRINT(do_verbose, "Commit metadata. Offset: " << commit_meta.offset << " length: " << commit_meta.length << "\n");
+    }
+
+    ret = write_id->length; // Set return code to the number of bytes written
+    stat_add(stats_of(fl), &gtfs_stats_t::commits, 1);
+    stat_latency(stats_of(fl), &gtfs_stats_t::sync_latency, start);
+
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns number of bytes written.
+    return ret;
+}
+
+int gtfs_abort_write_file(write_t* write_id) {
+    int ret = -1;
+    if (write_id) {
+        VERBOSE_PRINT(do_verbose, "Aborting write of " << write_id->length << " bytes starting from offset " << write_id->offset << " inside file " << write_id->filename << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "Write operation does not exist\n");
+        return ret;
+    }
+    GTFS_TRACE_CALL(GTFS_OP_ABORT, write_id->fl->trace_id, write_id->offset, write_id->length, ret);
+    //TODO: Add any additional initializations and checks, and complete the functionality
+    if (write_id->fl == NULL) {
+        VERBOSE_PRINT(do_verbose, "Write_id file does not exist\n");
+    }
+
+    if (write_id->synced) {
+        VERBOSE_PRINT(do_verbose, "Cannot abort a write that has been synced!\n");
+        return ret;
+    }
+
+    if (write_id->txn) {
+        VERBOSE_PRINT(do_verbose, "Write is part of a transaction, abort the transaction instead\n");
+        return ret;
+    }
+    
+    file_t *fl = write_id->fl;
+    {
+        lock_guard<mutex> file_lock(fl->mtx);
+        if (write_id->aborted || fl->data == NULL) {
+            VERBOSE_PRINT(do_verbose, "Write was already aborted or its file is closed\n");
+            return ret;
+        }
+        undo_write(fl, write_id);
+        drop_range(fl, write_id->offset, write_id->length);
+    }
+    stat_add(stats_of(fl), &gtfs_stats_t::aborts, 1);
+    ret = 0;
+
+    VERBOSE_PRINT(do_verbose, "Success.\n"); //On success returns 0.
+    return ret;
+}
+
+int gtfs_release_write(write_t* write_id) {
+    int ret = -1;
+    if (write_id) {
+        VERBOSE_PRINT(do_verbose, "Releasing write of " << write_id->length << " bytes starting from offset " << write_id->offset << " inside file " << write_id->filename << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "Write operation does not exist\n");
+        return ret;
+    }
+    GTFS_TRACE_CALL(GTFS_OP_RELEASE, write_id->fl->trace_id, write_id->offset, write_id->length, ret);
+
+    // An outstanding write is still needed to sync or abort it
+    if (!write_id->synced && !write_id->aborted) {
+        VERBOSE_PRINT(do_verbose, "Cannot release a write that is neither synced nor aborted\n");
+        return ret;
+    }
+
+    free_write(write_id->fl->gtfs, write_id);
+    ret = 0;
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
+
+int gtfs_sync_write_file_async(write_t* write_id, gtfs_async_t *async) {
+    int ret = -1;
+    if (write_id and async) {
+        VERBOSE_PRINT(do_verbose, "Queueing sync of write of " << write_id->length << " bytes starting from offset " << write_id->offset << " inside file " << write_id->filename << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "Write operation or async handle does not exist\n");
+        return ret;
+    }
+    GTFS_TRACE_CALL(GTFS_OP_SYNC_ASYNC, write_id->fl->trace_id, write_id->offset, write_id->length, ret);
+
+    gtfs_t *gtfs = write_id->fl->gtfs;
+    file_t *fl = write_id->fl;
+    async->write_id = write_id;
+    async->ret = -1;
+    async->done.store(1); // Until it is queued, so a sync that fails here is never waited for
+    async->engine = NULL;
+
+    if (write_id->aborted) {
+        VERBOSE_PRINT(do_verbose, "Cannot sync a write that has been aborted!\n");
+        return ret;
+    }
+
+    if (write_id->txn) {
+        VERBOSE_PRINT(do_verbose, "Write is part of a transaction, commit the transaction instead\n");
+        return ret;
+    }
+
+    async_engine_t *engine = ensure_async_engine(gtfs);
+    async_request_t *request = new async_request_t();
+    request->async = async;
+    request->engine = engine;
+    request->write_id = write_id;
+    request->fl = fl;
+    request->start = chrono::steady_clock::now();
+    request->start_ns = gtfs_trace_now();
+    request->ret = -1;
+    request->ring = false;
+    request->cqes.store(0);
+    request->flush_res = -1;
+    request->repaired = false;
+    uint32_t payload_crc = 0;
+    bool delta_ok = engine->ring_fd >= 0 && encode_delta(write_id, request->delta, &payload_crc);
+    if (!delta_ok) {
+        payload_crc = crc32c(0, write_id->data, write_id->length);
+    }
+    {
+        lock_guard<mutex> file_lock(fl->mtx);
+        if (fl->data == NULL || fl->closing.load()) {
+            VERBOSE_PRINT(do_verbose, "File " << fl->filename << " is not open\n");
+            delete request;
+            return ret;
+        }
+        fl->async_pending++;
+        async->engine = engine;
+        async->done.store(0);
+        // With group commit or the WAL the record does not go to the file's own log
+        if (engine->ring_fd >= 0 && !gtfs->group_commit && !gtfs->wal) {
+            reserve_write_record(fl, write_id, delta_ok ? &request->delta : NULL, payload_crc, &request->header, &request->trailer, request->iov, &request->slot);
+            request->slot.async = request;
+            request->bytes = sizeof(commit_t) + request->header.length + sizeof(commit_trailer_t);
+            request->ring = true;
+            request->waiting.store(2); // The slot settling and the end of its I/O
+        } else {
+            request->waiting.store(1); // The pool thread finishing it
+        }
+    }
+
+    if (request->ring) {
+        async_ring_submit(engine, request);
+    } else {
+        async_pool_submit(engine, request);
+    }
+    ret = 0;
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0, the result comes with the completion.
+    return ret;
+}
+
+int gtfs_async_poll(gtfs_async_t *async) {
+    int ret = -1;
+    if (async) {
+        VERBOSE_PRINT(do_verbose, "Polling asynchronous sync\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "Async handle does not exist\n");
+        return ret;
+    }
+
+    ret = async->done.load(memory_order_acquire);
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 1 once the sync has completed, 0 before.
+    return ret;
+}
+
+int64_t gtfs_async_wait(gtfs_async_t *async) {
+    int64_t ret = -1;
+    if (async) {
+        VERBOSE_PRINT(do_verbose, "Waiting for asynchronous sync\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "Async handle does not exist\n");
+        return ret;
+    }
+
+    if (!async->done.load(memory_order_acquire)) {
+        async_engine_t *engine = async->engine;
+        unique_lock<mutex> lock(engine->done_mutex);
+        engine->waiters_cv.wait(lock, [async] { return async->done.load() != 0; });
+    }
+    ret = async->ret;
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns what the sync returned.
+    return ret;
+}
+
+txn_t* gtfs_begin_txn(gtfs_t *gtfs) {
+    txn_t *txn = NULL;
+    if (gtfs) {
+        VERBOSE_PRINT(do_verbose, "Beginning transaction inside directory " << gtfs->dirname << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
+        return NULL;
+    }
+
+    txn = new txn_t();
+    txn->gtfs = gtfs;
+    txn->state = 0;
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns non NULL.
+    return txn;
+}
+
+int gtfs_add_write_txn(txn_t *txn, write_t *write_id) {
+    int ret = -1;
+    if (txn and write_id) {
+        VERBOSE_PRINT(do_verbose, "Adding write of " << write_id->length << " bytes starting from offset " << write_id->offset << " inside file " << write_id->filename << " to transaction\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "Transaction or write operation does not exist\n");
+        return ret;
+    }
+
+    if (txn->state != 0) {
+        VERBOSE_PRINT(do_verbose, "Transaction was already committed or aborted\n");
+        return ret;
+    }
+    if (write_id->fl == NULL || write_id->fl->gtfs != txn->gtfs) {
+        VERBOSE_PRINT(do_verbose, "Write does not belong to the transaction's GTFileSystem\n");
+        return ret;
+    }
+
+    {
+        lock_guard<mutex> file_lock(write_id->fl->mtx);
+        if (write_id->synced || write_id->aborted || write_id->txn) {
+            VERBOSE_PRINT(do_verbose, "Write was already synced, aborted or added to a transaction\n");
+            return ret;
+        }
+        write_id->txn = txn;
+    }
+    txn->writes.push_back(write_id);
+    ret = 0;
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
+
+int64_t gtfs_commit_txn(txn_t *txn) {
+    int64_t ret = -1;
+    if (txn) {
+        VERBOSE_PRINT(do_verbose, "Committing transaction of " << txn->writes.size() << " writes inside directory " << txn->gtfs->dirname << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "Transaction does not exist\n");
+        return ret;
+    }
+    GTFS_TRACE_CALL(GTFS_OP_TXN_COMMIT, 0, 0, txn->writes.size(), ret);
+
+    if (txn->state != 0) {
+        VERBOSE_PRINT(do_verbose, "Transaction was already committed or aborted\n");
+        return ret;
+    }
+
+    // Group the writes per file, files in name order so concurrent commits lock them in the same order
+    map<string, txn_file_t> by_name;
+    for (write_t *write_id : txn->writes) {
+        txn_file_t& tf = by_name[write_id->fl->filename];
+        tf.fl = write_id->fl;
+        tf.writes.push_back(write_id);
+    }
+    vector<txn_file_t> files;
+    int64_t bytes = 0;
+    for (auto &entry : by_name) {
+        txn_file_t& tf = entry.second;
+        tf.extents.resize(tf.writes.size());
+        tf.payload_iov.resize(2 * tf.writes.size());
+        tf.payload_length = build_multi_payload(tf.writes, tf.extents.data(), tf.payload_iov.data(), &tf.payload_crc);
+        for (write_t *write_id : tf.writes) {
+            bytes += write_id->length;
+        }
+        files.push_back(move(tf));
+    }
+
+    auto start = chrono::steady_clock::now();
+    vector<unique_lock<mutex>> locks;
+    for (txn_file_t& tf : files) {
+        locks.push_back(unique_lock<mutex>(tf.fl->mtx));
+        wait_inflight(tf.fl); // Files locked before stay quiet, their appends are done
+        if (tf.fl->data == NULL || tf.fl->closing.load()) {
+            VERBOSE_PRINT(do_verbose, "File " << tf.fl->filename << " is not open\n");
+            return ret;
+        }
+    }
+
+    // A transaction on a single file is just one record in that file's log
+    // With the directory WAL any transaction is a single WAL record.
+    bool committed = files.empty() || (txn->gtfs->wal ? wal_append_txn(files) :
+                                       files.size() == 1 ? append_txn_part(files[0]) : commit_cross_file(txn->gtfs, files));
+    if (!committed) {
+        VERBOSE_PRINT(do_verbose, "Failed to commit transaction\n");
+        return ret;
+    }
+    for (write_t *write_id : txn->writes) {
+        mark_synced(write_id);
+    }
+    locks.clear();
+    stat_add(stats_ref_t{ stats_shard(txn->gtfs->stats), NULL }, &gtfs_stats_t::commits, 1);
+    stat_latency(stats_ref_t{ stats_shard(txn->gtfs->stats), NULL }, &gtfs_stats_t::sync_latency, start);
+    for (txn_file_t& tf : files) {
+        stat_add(stats_ref_t{ NULL, tf.fl->stats }, &gtfs_stats_t::commits, 1);
+        stat_latency(stats_ref_t{ NULL, tf.fl->stats }, &gtfs_stats_t::sync_latency, start);
+    }
+
+    txn->state = 1;
+    delete txn;
+    ret = bytes;
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns number of bytes committed.
+    return ret;
+}
+
+int gtfs_abort_txn(txn_t *txn) {
+    int ret = -1;
+    if (txn) {
+        VERBOSE_PRINT(do_verbose, "Aborting transaction of " << txn->writes.size() << " writes inside directory " << txn->gtfs->dirname << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "Transaction does not exist\n");
+        return ret;
+    }
+    GTFS_TRACE_CALL(GTFS_OP_TXN_ABORT, 0, 0, txn->writes.size(), ret);
+
+    if (txn->state != 0) {
+        VERBOSE_PRINT(do_verbose, "Transaction was already committed or aborted\n");
+        return ret;
+    }
+
+    // Newest first, so overlapping writes of the transaction unwind to the original bytes
+    for (auto it = txn->writes.rbegin(); it != txn->writes.rend(); it++) {
+        write_t *write_id = *it;
+        file_t *fl = write_id->fl;
+        lock_guard<mutex> file_lock(fl->mtx);
+        if (fl->data != NULL) {
+            undo_write(fl, write_id);
+        } else {
+            write_id->aborted = 1;
+            vector<write_t*>& outstanding = fl->outstanding;
+            outstanding.erase(remove(outstanding.begin(), outstanding.end(), write_id), outstanding.end());
+        }
+        drop_range(fl, write_id->offset, write_id->length);
+        stat_add(stats_of(fl), &gtfs_stats_t::aborts, 1);
+    }
+
+    txn->state = 2;
+    delete txn;
+    ret = 0;
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
+
+int gtfs_get_stats(gtfs_t *gtfs, gtfs_stats_t *stats) {
+    int ret = -1;
+    if (gtfs and stats) {
+        VERBOSE_PRINT(do_verbose, "Taking statistics of GTFileSystem inside directory " << gtfs->dirname << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem or statistics buffer does not exist\n");
+        return ret;
+    }
+
+    if (gtfs->registry) {
+        registry_stats(gtfs->registry, "", stats);
+    } else {
+        sum_stats(stats, gtfs->stats);
+        stats->log_bytes = 0;
+        vector<file_t*> files;
+        {
+            lock_guard<mutex> files_lock(gtfs->files_mutex);
+            for (auto &entry : gtfs->open_files) {
+                files.push_back(entry.second);
+            }
+        }
+        for (file_t *fl : files) {
+            lock_guard<mutex> file_lock(fl->mtx);
+            stats->log_bytes += fl->data ? log_pending(fl) : 0;
+        }
+    }
+    ret = 0;
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
+
+int gtfs_get_file_stats(file_t *fl, gtfs_stats_t *stats) {
+    int ret = -1;
+    if (fl and stats) {
+        VERBOSE_PRINT(do_verbose, "Taking statistics of file " << fl->filename << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "File or statistics buffer does not exist\n");
+        return ret;
+    }
+
+    if (!fl->gtfs->registry || !registry_stats(fl->gtfs->registry, fl->filename, stats)) {
+        copy_stats(stats, fl->stats);
+        lock_guard<mutex> file_lock(fl->mtx);
+        stats->log_bytes = fl->data ? log_pending(fl) : 0;
+    }
+    ret = 0;
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
+
+int gtfs_read_stats(string directory, string filename, gtfs_stats_t *stats) {
+    int ret = -1;
+    if (stats) {
+        VERBOSE_PRINT(do_verbose, "Reading statistics of " << (filename.empty() ? "directory " + directory : "file " + filename + " inside directory " + directory) << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "Statistics buffer does not exist\n");
+        return ret;
+    }
+
+    // Map the registry read only, nothing is created or recovered
+    string registry_path = directory + "/.logs/.registry";
+    int fd = open(registry_path.c_str(), O_RDONLY);
+    if (fd == -1) {
+        VERBOSE_PRINT(do_verbose, "No registry at " << registry_path << "\n");
+        return ret;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size != (off_t)sizeof(gtfs_registry_t)) {
+        VERBOSE_PRINT(do_verbose, "Registry " << registry_path << " is missing or of another version\n");
+        close(fd);
+        return ret;
+    }
+    const gtfs_registry_t *registry = (const gtfs_registry_t*)mmap(NULL, sizeof(gtfs_registry_t), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (registry == MAP_FAILED) {
+        VERBOSE_PRINT(do_verbose, "Failed to map registry " << registry_path << "\n");
+        return ret;
+    }
+    bool found = registry->magic == GTFS_REGISTRY_MAGIC && registry->version == GTFS_REGISTRY_VERSION &&
+                 registry_stats(registry, filename, stats);
+    munmap((void*)registry, sizeof(gtfs_registry_t));
+    if (!found) {
+        VERBOSE_PRINT(do_verbose, "No statistics for " << (filename.empty() ? directory : filename) << " in registry " << registry_path << "\n");
+        return ret;
+    }
+    ret = 0;
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
+
+// BONUS: Implement below API calls to get bonus credits
+
+int64_t gtfs_clean_n_bytes(gtfs_t *gtfs, int64_t bytes){
+    int64_t ret = -1;
+    if (gtfs) {
+        VERBOSE_PRINT(do_verbose, "Cleaning up [ " << bytes << " bytes ] GTFileSystem inside directory " << gtfs->dirname << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
+        return ret;
+    }
+    GTFS_TRACE_CALL(GTFS_OP_CLEAN_N_BYTES, 0, 0, bytes, ret);
+
+    if (bytes < 0) {
+        VERBOSE_PRINT(do_verbose, "Invalid number of bytes\n");
+        return ret;
+    }
+
+    // Visit the open files round robin, starting where the previous call ran out of budget
+    vector<file_t*> files;
+    {
+        lock_guard<mutex> files_lock(gtfs->files_mutex);
+        auto start = gtfs->open_files.lower_bound(gtfs->clean_cursor);
+        for (auto it = start; it != gtfs->open_files.end(); it++) {
+            files.push_back(it->second);
+        }
+        for (auto it = gtfs->open_files.begin(); it != start; it++) {
+            files.push_back(it->second);
+        }
+    }
+
+    int64_t cleaned = 0;
+    auto start = chrono::steady_clock::now();
+    for (file_t *fl : files) {
+        if (cleaned >= bytes) {
+            break;
+        }
+        lock_guard<mutex> file_lock(fl->mtx);
+        if (fl->data == NULL) {
+            continue;
+        }
+        int64_t applied = clean_file_bytes(fl, bytes - cleaned);
+        if (applied < 0) {
+            VERBOSE_PRINT(do_verbose, "Failed to clean file " << fl->filename << "\n");
+            return ret;
+        }
+        cleaned += applied;
+        gtfs->clean_cursor = fl->filename; // It may still have records left for the next call
+    }
+    stat_latency(stats_ref_t{ stats_shard(gtfs->stats), NULL }, &gtfs_stats_t::clean_latency, start);
+    ret = cleaned;
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns the number of bytes applied.
+    return ret;
+}
+
+int gtfs_enable_group_commit(gtfs_t *gtfs, int window_us, int max_batch) {
+    int ret = -1;
+    if (gtfs) {
+        VERBOSE_PRINT(do_verbose, "Enabling group commit (window " << window_us << " us, max batch " << max_batch << ") inside directory " << gtfs->dirname << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
+        return ret;
+    }
+
+    if (window_us < 0 || max_batch <= 0) {
+        VERBOSE_PRINT(do_verbose, "Invalid group commit window or batch size\n");
+        return ret;
+    }
+
+    lock_guard<mutex> lock(gtfs->gc_mutex);
+    gtfs->group_commit_window_us = window_us;
+    gtfs->group_commit_max_batch = max_batch;
+    gtfs->group_commit = 1; // The flusher is started by the first sync
+    ret = 0;
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
+
+int gtfs_disable_group_commit(gtfs_t *gtfs) {
+    int ret = -1;
+    if (gtfs) {
+        VERBOSE_PRINT(do_verbose, "Disabling group commit inside directory " << gtfs->dirname << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
+        return ret;
+    }
+
+    // Syncs that come after this go to the logs themselves, and no flusher is started
+    // until gc_stop is cleared below
+    thread *flusher = NULL;
+    {
+        lock_guard<mutex> lock(gtfs->gc_mutex);
+        gtfs->group_commit = 0;
+        gtfs->gc_stop = 1;
+        if (gtfs->gc_flusher_pid == getpid()) {
+            flusher = gtfs->gc_flusher;
+        }
+        gtfs->gc_flusher = NULL;
+        gtfs->gc_flusher_pid = 0;
+    }
+    gtfs->gc_cv.notify_all();
+
+    // The flusher drains whatever is still queued before exiting
+    if (flusher) {
+        flusher->join();
+        delete flusher;
+    }
+    {
+        lock_guard<mutex> lock(gtfs->gc_mutex);
+        gtfs->gc_stop = 0;
+    }
+    ret = 0;
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
+
+int gtfs_enable_checkpointer(gtfs_t *gtfs, int64_t max_log_bytes, int max_log_age_ms) {
+    int ret = -1;
+    if (gtfs) {
+        VERBOSE_PRINT(do_verbose, "Enabling checkpointer (" << max_log_bytes << " bytes, " << max_log_age_ms << " ms) inside directory " << gtfs->dirname << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
+        return ret;
+    }
+
+    if (max_log_bytes < 0 || max_log_age_ms < 0 || (max_log_bytes == 0 && max_log_age_ms == 0)) {
+        VERBOSE_PRINT(do_verbose, "Invalid checkpoint thresholds\n");
+        return ret;
+    }
+
+    {
+        lock_guard<mutex> lock(gtfs->ckpt_mutex);
+        gtfs->checkpoint_bytes = max_log_bytes;
+        gtfs->checkpoint_age_ms = max_log_age_ms;
+        gtfs->checkpointer_enabled = 1;
+    }
+    gtfs->ckpt_cv.notify_one(); // A running checkpointer picks up the new thresholds
+    ensure_checkpointer(gtfs);
+    ret = 0;
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
+
+int gtfs_disable_checkpointer(gtfs_t *gtfs) {
+    int ret = -1;
+    if (gtfs) {
+        VERBOSE_PRINT(do_verbose, "Disabling checkpointer inside directory " << gtfs->dirname << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
+        return ret;
+    }
+
+    {
+        lock_guard<mutex> lock(gtfs->ckpt_mutex);
+        gtfs->checkpointer_enabled = 0;
+        gtfs->ckpt_stop = 1;
+    }
+    gtfs->ckpt_cv.notify_one();
+
+    if (gtfs->checkpointer && gtfs->checkpointer_pid == getpid()) {
+        gtfs->checkpointer->join();
+        delete gtfs->checkpointer;
+    }
+    gtfs->checkpointer = NULL;
+    gtfs->checkpointer_pid = 0;
+    gtfs->ckpt_stop = 0;
+    ret = 0;
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
+
+int gtfs_enable_huge_pages(gtfs_t *gtfs, int64_t min_length) {
+    int ret = -1;
+    if (gtfs) {
+        VERBOSE_PRINT(do_verbose, "Enabling huge pages for files of " << min_length << " bytes or more inside directory " << gtfs->dirname << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
+        return ret;
+    }
+
+    if (min_length <= 0) {
+        VERBOSE_PRINT(do_verbose, "Invalid minimum length\n");
+        return ret;
+    }
+    gtfs->huge_page_min = min_length; // Taken up by the next opens
+    ret = 0;
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
+
+int gtfs_disable_huge_pages(gtfs_t *gtfs) {
+    int ret = -1;
+    if (gtfs) {
+        VERBOSE_PRINT(do_verbose, "Disabling huge pages inside directory " << gtfs->dirname << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
+        return ret;
+    }
+
+    gtfs->huge_page_min = 0; // Files open already keep their mappings
+    ret = 0;
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
+
+int gtfs_enable_delta_records(gtfs_t *gtfs) {
+    int ret = -1;
+    if (gtfs) {
+        VERBOSE_PRINT(do_verbose, "Enabling delta encoded records inside directory " << gtfs->dirname << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
+        return ret;
+    }
 
-    // Close the file descriptor (lock remains held)
-    // Note: Need to keep the fd open to maintain the lock
-    //close(fd);
+    gtfs->delta_records = 1; // Taken up by the next syncs
+    ret = 0;
 
-    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns non NULL.
-    return fl;
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
 }
 
-int gtfs_close_file(gtfs_t* gtfs, file_t* fl) {
+int gtfs_disable_delta_records(gtfs_t *gtfs) {
     int ret = -1;
-    if (gtfs and fl) {
-        VERBOSE_PRINT(do_verbose, "Closing file " << fl->filename << " inside directory " << gtfs->dirname << "\n");
+    if (gtfs) {
+        VERBOSE_PRINT(do_verbose, "Disabling delta encoded records inside directory " << gtfs->dirname << "\n");
     } else {
-        VERBOSE_PRINT(do_verbose, "GTFileSystem or file does not exist\n");
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
         return ret;
     }
-    //TODO: Add any additional initializations and checks, and complete the functionality
 
+    gtfs->delta_records = 0;
+    ret = 0;
 
-    string log_path = get_log_path(gtfs->dirname, fl->filename);
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
 
-    // Clean to apply any pending logs
-    if (!apply_log(gtfs->dirname, fl->filename)) {
-        VERBOSE_PRINT(do_verbose, "Failed to apply logs during close\n");
+int gtfs_enable_private_mapping(gtfs_t *gtfs) {
+    int ret = -1;
+    if (gtfs) {
+        VERBOSE_PRINT(do_verbose, "Enabling private mappings inside directory " << gtfs->dirname << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
         return ret;
     }
 
-    // Unmap the file
-    if (munmap(fl->data, fl->file_length) != 0) {
-        VERBOSE_PRINT(do_verbose, "Failed to unmap file " << fl->filename << "\n");
+    gtfs->private_mapping = 1; // Taken up by the next opens
+    ret = 0;
+
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
+
+int gtfs_disable_private_mapping(gtfs_t *gtfs) {
+    int ret = -1;
+    if (gtfs) {
+        VERBOSE_PRINT(do_verbose, "Disabling private mappings inside directory " << gtfs->dirname << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
         return ret;
     }
 
-    release_lock(fl->fd);
+    gtfs->private_mapping = 0; // Files open already keep their mappings
+    ret = 0;
 
     VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
     return ret;
 }
 
-int gtfs_remove_file(gtfs_t* gtfs, file_t* fl) {
+int gtfs_enable_log_preallocation(gtfs_t *gtfs, int64_t extent_size) {
     int ret = -1;
-    if (gtfs and fl) {
-        VERBOSE_PRINT(do_verbose, "Removing file " << fl->filename << " inside directory " << gtfs->dirname << "\n");
+    if (gtfs) {
+        VERBOSE_PRINT(do_verbose, "Enabling log preallocation in extents of " << extent_size << " bytes inside directory " << gtfs->dirname << "\n");
     } else {
-        VERBOSE_PRINT(do_verbose, "GTFileSystem or file does not exist\n");
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
         return ret;
     }
-    //TODO: Add any additional initializations and checks, and complete the functionality
 
-     // Ensure the file is not open by checking if data is mapped
-    if (fl->data) {
-        VERBOSE_PRINT(do_verbose, "File is currently open and cannot be removed\n");
+    if (extent_size <= LOG_HEADER_SIZE) {
+        VERBOSE_PRINT(do_verbose, "Extents must be larger than the log header\n");
         return ret;
     }
+    gtfs->log_prealloc = extent_size; // Taken up by the next opens
+    ret = 0;
 
-    // Remove the actual file
-    string file_path = gtfs->dirname + "/" + fl->filename;
-    if (remove(file_path.c_str()) != 0) {
-        VERBOSE_PRINT(do_verbose, "Failed to remove file " << file_path << "\n");
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
+
+int gtfs_disable_log_preallocation(gtfs_t *gtfs) {
+    int ret = -1;
+    if (gtfs) {
+        VERBOSE_PRINT(do_verbose, "Disabling log preallocation inside directory " << gtfs->dirname << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
         return ret;
     }
 
-    // Remove the log file
-    string log_path = fl->log_path;
-    remove(log_path.c_str());
-
+    gtfs->log_prealloc = 0; // Files open already keep their logs as they are
     ret = 0;
 
     VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
     return ret;
 }
 
-char* gtfs_read_file(gtfs_t* gtfs, file_t* fl, int offset, int length) {
-    char* ret_data = NULL;
-    if (gtfs and fl) {
-        VERBOSE_PRINT(do_verbose, "Reading " << length << " bytes starting from offset " << offset << " inside file " << fl->filename << "\n");
-    } else {
-        VERBOSE_PRINT(do_verbose, "GTFileSystem or file does not exist\n");
-        return NULL;
+// Helper function to check a durability level and its interval
+bool valid_durability(int level, int interval_ms) {
+    if (level < GTFS_DURABLE_PROCESS || level > GTFS_DURABLE_DSYNC) {
+        VERBOSE_PRINT(do_verbose, "Invalid durability level\n");
+        return false;
     }
-    //TODO: Add any additional initializations and checks, and complete the functionality
-
-    // Check that read is valid
-    if (offset < 0 || length < 0 || offset + length > fl->file_length) {
-        VERBOSE_PRINT(do_verbose, "Invalid offset or length\n");
-        return NULL;
+    if (level == GTFS_DURABLE_PERIODIC && interval_ms <= 0) {
+        VERBOSE_PRINT(do_verbose, "A periodic durability level needs a positive interval\n");
+        return false;
     }
+    return true;
+}
 
-    // Allocate memory for the read data
-    ret_data = (char*)malloc(length + 1);
-    if (!ret_data) {
-        VERBOSE_PRINT(do_verbose, "Memory allocation failed for read\n");
-        return NULL;
+int gtfs_set_durability(gtfs_t *gtfs, int level, int interval_ms) {
+    int ret = -1;
+    if (gtfs) {
+        VERBOSE_PRINT(do_verbose, "Setting durability level " << level << " inside directory " << gtfs->dirname << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
+        return ret;
     }
 
-    memcpy(ret_data, fl->data + offset, length);
-    ret_data[length] = '\0'; // Null-terminate the string
-
-    VERBOSE_PRINT(do_verbose, "Value read: " << ret_data << "(END)\n");
+    if (!valid_durability(level, interval_ms)) {
+        return ret;
+    }
+    {
+        lock_guard<mutex> wal_lock(gtfs->wal_mutex);
+        // Records appended before the level was raised are covered as well
+        if (gtfs->wal && level != GTFS_DURABLE_PROCESS && !wal_flush_active(gtfs)) {
+            return ret;
+        }
+        gtfs->durability = level; // Taken up by the WAL at once and by the next opens
+        gtfs->durable_interval_ms = level == GTFS_DURABLE_PERIODIC ? interval_ms : 0;
+    }
+    if (level == GTFS_DURABLE_PERIODIC) {
+        ensure_syncer(gtfs, true);
+    } else {
+        stop_syncer(gtfs);
+    }
+    ret = 0;
 
-    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns pointer to data read.
-    return ret_data;
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
 }
 
-write_t* gtfs_write_file(gtfs_t* gtfs, file_t* fl, int offset, int length, const char* data) {
-    write_t *write_id = NULL;
+int gtfs_set_file_durability(gtfs_t *gtfs, file_t *fl, int level, int interval_ms) {
+    int ret = -1;
     if (gtfs and fl) {
-        VERBOSE_PRINT(do_verbose, "Writting " << length << " bytes starting from offset " << offset << " inside file " << fl->filename << "\n");
+        VERBOSE_PRINT(do_verbose, "Setting durability level " << level << " of file " << fl->filename << "\n");
     } else {
         VERBOSE_PRINT(do_verbose, "GTFileSystem or file does not exist\n");
-        return NULL;
+        return ret;
     }
-    //TODO: Add any additional initializations and checks, and complete the functionality
 
-    //Modify in memmory copy of the file but not the actual file
-
-    write_id = new write_t();
-    write_id->filename = fl->filename;
-    write_id->fl = fl;
-    write_id->offset = offset;
-    write_id->length = length;
-    write_id->data = (char*)malloc(length);
-    write_id->synced = 0;
-    write_id->aborted = 0;
-    write_id->old_data = (char*)malloc(length);
-
-    if (write_id->data == NULL || write_id->old_data == NULL) {
-        VERBOSE_PRINT(do_verbose, "Could not allocate memory for write struct\n");
-        free(write_id->data);
-        free(write_id->old_data);
-        free(write_id);
-        return NULL;
+    if (!valid_durability(level, interval_ms)) {
+        return ret;
     }
-    // Copy data over to the write struct
-    memcpy(write_id->data, data, length);
-    memcpy(write_id->old_data, fl->data + offset, length);
-
-    //Write data to the in memory copy
-    memcpy(fl->data + offset, data, length);
-
-    VERBOSE_PRINT(do_verbose, "Value written: " << data << "(END)\n");
+    if (gtfs->wal) {
+        VERBOSE_PRINT(do_verbose, "The WAL has one durability level for all files, see gtfs_set_durability\n");
+        return ret;
+    }
+    {
+        unique_lock<mutex> file_lock(fl->mtx);
+        if (fl->data == NULL || fl->log_fd < 0) {
+            VERBOSE_PRINT(do_verbose, "File " << fl->filename << " is not open for writing\n");
+            return ret;
+        }
+        // No append may be running on the descriptor that is replaced
+        fl->inflight_cv.wait(file_lock, [fl] { return fl->inflight == 0 && fl->async_pending == 0; });
+        if ((level == GTFS_DURABLE_DSYNC) != (fl->durability == GTFS_DURABLE_DSYNC)) {
+            int log_fd = open(fl->log_path.c_str(), O_RDWR | (level == GTFS_DURABLE_DSYNC ? O_DSYNC : 0));
+            if (log_fd == -1) {
+                VERBOSE_PRINT(do_verbose, "Failed to reopen log " << fl->log_path << "\n");
+                return ret;
+            }
+            close(fl->log_fd);
+            fl->log_fd = log_fd;
+        }
+        // Records appended before the change are covered by the new level, and a periodic
+        // log is flushed when it stops being one, as the syncer will not get to it
+        if (fl->log_unflushed && (level != GTFS_DURABLE_PROCESS || fl->durability == GTFS_DURABLE_PERIODIC) &&
+            !flush_file_log(fl, NULL)) {
+            VERBOSE_PRINT(do_verbose, "Failed to flush log " << fl->log_path << "\n");
+            return ret;
+        }
+        fl->durability = level;
+        fl->durable_interval_ms = level == GTFS_DURABLE_PERIODIC ? interval_ms : 0;
+    }
+    if (level == GTFS_DURABLE_PERIODIC) {
+        ensure_syncer(gtfs, true);
+    } else {
+        stop_syncer(gtfs);
+    }
+    ret = 0;
 
-    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns non NULL.
-    return write_id;
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
 }
 
-int gtfs_sync_write_file(write_t* write_id) {
+int gtfs_enable_snapshots(gtfs_t *gtfs) {
     int ret = -1;
-    if (write_id) {
-        VERBOSE_PRINT(do_verbose, "Persisting write of " << write_id->length << " bytes starting from offset " << write_id->offset << " inside file " << write_id->filename << "\n");
+    if (gtfs) {
+        VERBOSE_PRINT(do_verbose, "Enabling snapshot reads inside directory " << gtfs->dirname << "\n");
     } else {
-        VERBOSE_PRINT(do_verbose, "Write operation does not exist\n");
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
         return ret;
     }
-    //TODO: Add any additional initializations and checks, and complete the functionality
-
-    // Writes the commit to the log
-    // Maybe store a strict metadata struct?
 
-    /* May need to include a reference to gtfs to have syncs work*/
-    /* Assume this works for now*/
+    gtfs->snapshots = 1; // Taken up by the next opens
+    ret = 0;
 
-    gtfs_t *gtfs = write_id->fl->gtfs;
-    file_t *fl = write_id->fl;
-    
-    string log_path = get_log_path(gtfs->dirname, write_id->filename);
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
 
-    /* Need to acquire or spin until lock is obtained*/
+int gtfs_disable_snapshots(gtfs_t *gtfs) {
+    int ret = -1;
+    if (gtfs) {
+        VERBOSE_PRINT(do_verbose, "Disabling snapshot reads inside directory " << gtfs->dirname << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
+        return ret;
+    }
 
-    //FILE* log_file = fopen(log_path.c_str(), "ab");
+    gtfs->snapshots = 0; // Files open already keep their versions
+    ret = 0;
 
-    //Open for both r/w in binary mode
-    FILE* log_file = fopen(log_path.c_str(), "rb+");
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
 
-    //Do safety checks, create file if it doesn't exist already
-    if (!log_file) {
-        log_file = fopen(log_path.c_str(), "wb+");
-        if (!log_file) {
-            VERBOSE_PRINT(do_verbose, "Failed to open log file during sync. \n");
-            fclose(log_file);
-        return -1;
-        }
+int gtfs_begin_snapshot(gtfs_t *gtfs, file_t *fl, gtfs_snapshot_t *snapshot) {
+    int ret = -1;
+    if (gtfs and fl and snapshot) {
+        VERBOSE_PRINT(do_verbose, "Taking a snapshot of file " << fl->filename << "\n");
+    } else {
+        VERBOSE_PRINT(do_verbose, "GTFileSystem, file or snapshot does not exist\n");
+        return ret;
     }
-    
 
-    // Go to the end of the log file
-    if(fseek(log_file, 0, SEEK_END) != 0) {
-        VERBOSE_PRINT(do_verbose, "Failed to seek to the end of the log!\n");
-        fclose(log_file);
-        return -1;
+    lock_guard<mutex> file_lock(fl->mtx);
+    if (fl->data == NULL || !fl->mvcc) {
+        VERBOSE_PRINT(do_verbose, "File " << fl->filename << " is not open for writing with snapshots enabled\n");
+        return ret;
     }
+    snapshot->fl = fl;
+    snapshot->version = fl->commit_version;
+    fl->snapshot_versions.insert(snapshot->version);
+    ret = 0;
 
-    commit_t commit_meta;
-    commit_meta.offset = write_id->offset;
-    commit_meta.length = write_id->length;
-    commit_meta.commited = 0;
-
-    VERBOSE_PRINT(do_verbose, "Size of commit: " << sizeof(commit_t) <<" bytes!\n");
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
+    return ret;
+}
 
-    // Write commit metadata to log
-    if (fwrite(&commit_meta, sizeof(commit_t), 1, log_file) != 1) {
-        VERBOSE_PRINT(do_verbose, "Failed to write commit metadata\n");
-        fclose(log_file);
-        return -1;
+int64_t gtfs_read_snapshot(gtfs_snapshot_t *snapshot, int64_t offset, int64_t length, char *buf) {
+    int64_t ret = -1;
+    if (snapshot and snapshot->fl and buf) {
+        VERBOSE_PRINT(do_verbose, "Reading " << length << " bytes starting from offset " << offset << " inside snapshot " << snapshot->version << " of file " << snapshot->fl->filename << "\n");
     } else {
-        VERBOSE_PRINT(do_verbose, "Wrote commit metadata to log\n");
-        VERBOSE_PRINT(do_verbose, "Commit metadata. Offset: " << commit_meta.offset << " length: " << commit_meta.length << "\n");
+        VERBOSE_PRINT(do_verbose, "Snapshot or buffer does not exist, or the snapshot was ended\n");
+        return ret;
     }
+    file_t *fl = snapshot->fl;
+    GTFS_TRACE_CALL(GTFS_OP_READ, fl->trace_id, offset, length, ret);
 
-    //Write the data to the log
-    if (fwrite(write_id->data, sizeof(char), write_id->length, log_file) != (size_t)write_id->length) {
-        VERBOSE_PRINT(do_verbose, "Failed to write data to log\n");
-        fclose(log_file);
-        return -1;
-    } else {
-        VERBOSE_PRINT(do_verbose, "Wrote data to log. Data: " << write_id->data << "(END)\n");
+    if (offset < 0 || length < 0 || offset > fl->file_length - length) {
+        VERBOSE_PRINT(do_verbose, "Invalid offset or length\n");
+        return ret;
+    }
+    if (!pin_file(fl)) {
+        VERBOSE_PRINT(do_verbose, "File " << fl->filename << " is not open\n");
+        return ret;
     }
 
-    //Ensure that the commit is written to disk
-    fflush(log_file);
+    {
+        lock_guard<mutex> file_lock(fl->mtx);
+        if (fl->overlaid.load() && !materialize_overlay(fl, offset, length)) {
+            unpin_file(fl);
+            return ret;
+        }
+        // Each page comes from the oldest version replaced after the snapshot, else from the
+        // committed copy, else from the mapping
+        int64_t page = sysconf(_SC_PAGESIZE);
+        for (int64_t pos = offset; pos < offset + length;) {
+            int64_t p = pos / page;
+            int64_t to = min(offset + length, (p + 1) * page);
+            const char *src = fl->data + p * page;
+            auto versions = fl->page_versions.find(p);
+            auto committed = fl->committed_pages.find(p);
+            if (versions != fl->page_versions.end() && versions->second.back().until > snapshot->version) {
+                for (const page_version_t& version : versions->second) {
+                    if (version.until > snapshot->version) {
+                        src = version.bytes.data();
+                        break;
+                    }
+                }
+            } else if (committed != fl->committed_pages.end()) {
+                src = committed->second.data();
+            }
+            memcpy(buf + (pos - offset), src + (pos - p * page), to - pos);
+            pos = to;
+        }
+    }
+    unpin_file(fl);
+    ret = length;
 
-    commit_meta.commited = 1;
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns number of bytes read.
+    return ret;
+}
 
-    //Set pointer back to the start of the commit message
-    fseek(log_file, -((long)write_id->length + sizeof(commit_t)), SEEK_CUR);
-    if (fwrite(&commit_meta, sizeof(commit_t), 1, log_file) != 1) {
-        VERBOSE_PRINT(do_verbose, "Failed to set commit bit in log\n");
-        fclose(log_file);
-        return -1;
+int gtfs_end_snapshot(gtfs_snapshot_t *snapshot) {
+    int ret = -1;
+    if (snapshot and snapshot->fl) {
+        VERBOSE_PRINT(do_verbose, "Ending snapshot " << snapshot->version << " of file " << snapshot->fl->filename << "\n");
     } else {
-        VERBOSE_PRINT(do_verbose, "Set commit bit within log\n");
+        VERBOSE_PRINT(do_verbose, "Snapshot does not exist or was already ended\n");
+        return ret;
     }
 
-    fflush(log_file);
-    fclose(log_file);
-
-    write_id->synced = 1;
-    ret = write_id->length; // Set return code to the number of bytes written
-
+    file_t *fl = snapshot->fl;
+    {
+        lock_guard<mutex> file_lock(fl->mtx);
+        fl->snapshot_versions.erase(fl->snapshot_versions.find(snapshot->version));
+        // Versions replaced at or before the oldest snapshot left are not read any more
+        uint64_t oldest = fl->snapshot_versions.empty() ? UINT64_MAX : *fl->snapshot_versions.begin();
+        for (auto it = fl->page_versions.begin(); it != fl->page_versions.end();) {
+            vector<page_version_t>& versions = it->second;
+            size_t stale = 0;
+            while (stale < versions.size() && versions[stale].until <= oldest) {
+                stale++;
+            }
+            versions.erase(versions.begin(), versions.begin() + stale);
+            it = versions.empty() ? fl->page_versions.erase(it) : next(it);
+        }
+    }
+    snapshot->fl = NULL;
+    ret = 0;
 
-    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns number of bytes written.
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
     return ret;
 }
 
-int gtfs_abort_write_file(write_t* write_id) {
+int gtfs_enable_wal(gtfs_t *gtfs, int64_t segment_size, int max_segments) {
     int ret = -1;
-    if (write_id) {
-        VERBOSE_PRINT(do_verbose, "Aborting write of " << write_id->length << " bytes starting from offset " << write_id->offset << " inside file " << write_id->filename << "\n");
+    if (gtfs) {
+        VERBOSE_PRINT(do_verbose, "Enabling WAL (" << segment_size << " byte segments, max " << max_segments << ") inside directory " << gtfs->dirname << "\n");
     } else {
-        VERBOSE_PRINT(do_verbose, "Write operation does not exist\n");
+        VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
         return ret;
     }
-    //TODO: Add any additional initializations and checks, and complete the functionality
-    if (write_id->fl == NULL) {
-        VERBOSE_PRINT(do_verbose, "Write_id file does not exist\n");
+
+    if (segment_size < 2 * LOG_HEADER_SIZE || max_segments < 2) {
+        VERBOSE_PRINT(do_verbose, "Invalid WAL segment size or count\n");
+        return ret;
     }
 
-    if (write_id->synced) {
-        VERBOSE_PRINT(do_verbose, "Cannot abort a write that has been synced!\n");
+    {
+        lock_guard<mutex> files_lock(gtfs->files_mutex);
+        if (gtfs->wal || !gtfs->open_files.empty()) {
+            VERBOSE_PRINT(do_verbose, "WAL is already enabled or files are open\n");
+            return ret;
+        }
+    }
+
+    string wal_dir = get_wal_dir(gtfs->dirname);
+    if (!create_directory(wal_dir)) {
+        VERBOSE_PRINT(do_verbose, "Failed to create or access WAL directory " << wal_dir << "\n");
         return ret;
     }
-    
-    file_t *fl = write_id->fl;
-    memcpy(fl->data + write_id->offset, write_id->old_data, write_id->length);
-    write_id->aborted = 1;
+    int lock_fd = open((wal_dir + "/lock").c_str(), O_RDWR | O_CREAT, 0644);
+    if (lock_fd == -1 || flock(lock_fd, LOCK_EX | LOCK_NB) != 0) {
+        VERBOSE_PRINT(do_verbose, "WAL of " << gtfs->dirname << " is in use by another process\n");
+        if (lock_fd != -1) {
+            close(lock_fd);
+        }
+        return ret;
+    }
+    // Whatever an earlier owner left behind is applied before the WAL starts over
+    if (!replay_wal(gtfs->dirname, "", -1, stats_shard(gtfs->stats))) {
+        VERBOSE_PRINT(do_verbose, "Failed to recover the previous WAL of " << gtfs->dirname << "\n");
+        close(lock_fd);
+        return ret;
+    }
+
+    lock_guard<mutex> wal_lock(gtfs->wal_mutex);
+    gtfs->wal_segment_size = segment_size;
+    gtfs->wal_max_segments = max_segments;
+    gtfs->wal_lock_fd = lock_fd;
+    gtfs->wal_pid = getpid();
+    gtfs->wal_next_seq = 1;
+    gtfs->wal_next_index = 1;
+    gtfs->wal_next_name = 0;
+    if (!wal_roll_segment(gtfs, 0)) {
+        close(lock_fd);
+        gtfs->wal_lock_fd = -1;
+        return ret;
+    }
+    gtfs->wal = 1;
+    if (gtfs->registry) {
+        registry_lock(gtfs->registry);
+        gtfs->registry->wal_owner = getpid();
+        registry_unlock(gtfs->registry);
+    }
     ret = 0;
 
-    VERBOSE_PRINT(do_verbose, "Success.\n"); //On success returns 0.
+    VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
     return ret;
 }
 
-// BONUS: Implement below API calls to get bonus credits
-
-int gtfs_clean_n_bytes(gtfs_t *gtfs, int bytes){
+int gtfs_disable_wal(gtfs_t *gtfs) {
     int ret = -1;
     if (gtfs) {
-        VERBOSE_PRINT(do_verbose, "Cleaning up [ " << bytes << " bytes ] GTFileSystem inside directory " << gtfs->dirname << "\n");
+        VERBOSE_PRINT(do_verbose, "Disabling WAL inside directory " << gtfs->dirname << "\n");
     } else {
         VERBOSE_PRINT(do_verbose, "GTFileSystem does not exist\n");
         return ret;
     }
 
+    {
+        lock_guard<mutex> files_lock(gtfs->files_mutex);
+        if (!gtfs->wal || gtfs->wal_pid != getpid() || !gtfs->open_files.empty()) {
+            VERBOSE_PRINT(do_verbose, "WAL is not enabled here or files are open\n");
+            return ret;
+        }
+    }
+
+    // Closing a file applies its records, so nothing in the segments is needed any more
+    lock_guard<mutex> wal_lock(gtfs->wal_mutex);
+    for (wal_segment_t *segment : gtfs->wal_segments) {
+        drop_wal_segment(segment);
+    }
+    gtfs->wal_segments.clear();
+    close(gtfs->wal_lock_fd);
+    gtfs->wal_lock_fd = -1;
+    gtfs->wal_pid = 0;
+    gtfs->wal = 0;
+    if (gtfs->registry) {
+        registry_lock(gtfs->registry);
+        gtfs->registry->wal_owner = 0;
+        registry_unlock(gtfs->registry);
+    }
+    ret = 0;
+
     VERBOSE_PRINT(do_verbose, "Success\n"); //On success returns 0.
     return ret;
 }
 
-int gtfs_sync_write_file_n_bytes(write_t* write_id, int bytes){
+int gtfs_sync_write_file_n_bytes(write_t* write_id, int64_t bytes){
     int ret = -1;
     if (write_id) {
         VERBOSE_PRINT(do_verbose, "Persisting [ " << bytes << " bytes ] write of " << write_id->length << " bytes starting from offset " << write_id->offset << " inside file " << write_id->filename << "\n");
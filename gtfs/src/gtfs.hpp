@@ -2,6 +2,7 @@
 #define GTFS
 
 #include <string>
+#include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <iostream>
@@ -13,10 +14,31 @@
 #include <sys/stat.h>
 #include <sys/file.h>
 #include <sys/mman.h>
+#include <sys/uio.h>
+#include <climits>
 #include <fcntl.h>
 #include <cstring>
 #include <dirent.h>
 #include <errno.h>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
+#include <deque>
+#include <vector>
+#include <map>
+#include <set>
+#include <atomic>
+#include <algorithm>
+#include <random>
+#include <pthread.h>
+#include <new>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include "crc32c.hpp"
+#include "delta.hpp"
+#include "trace.hpp"
 
 using namespace std;
 
@@ -27,31 +49,458 @@ using namespace std;
 
 #define MAX_FILENAME_LEN 255
 #define MAX_NUM_FILES_PER_DIR 1024
+#define GTFS_MAX_RECOVERY_THREADS 8 // Threads used by gtfs_init to look at pending logs
 
 extern int do_verbose;
 
+// Want a small commit metadata struct
+// A log record is a commit_t header, the payload, then a commit_trailer_t.
+// The trailer carries a CRC32C over the payload and the header, so a record
+// only counts as committed when the checksum matches. Recovery stops at the
+// first record that is torn, corrupt or out of sequence.
+#define LOG_FORMAT_VERSION 1
+#define COMMIT_MAGIC 0x52544647 // "GFTR"
+#define COMMIT_TRAILER_MAGIC 0x43465447 // "GTFC"
+#define COMMIT_TYPE_WRITE 1 // Payload is the new data for [offset, offset + length)
+#define COMMIT_TYPE_MULTI 2 // Payload is a list of commit_extent_t, each followed by its data (offset is unused)
+#define COMMIT_TYPE_TXN 3 // Transaction logs only: a list of txn_part_t, each followed by the file name and a COMMIT_TYPE_MULTI payload
+
+typedef struct commit {
+    uint32_t magic; // COMMIT_MAGIC
+    uint16_t version; // LOG_FORMAT_VERSION
+    uint16_t type; // COMMIT_TYPE_*
+    uint64_t seq; // Position of the record in its log, the first record is 1
+    int64_t offset;
+    int64_t length;
+} commit_t;
+
+typedef struct commit_trailer {
+    uint32_t crc; // CRC32C over the payload, then the header
+    uint32_t magic; // COMMIT_TRAILER_MAGIC
+} commit_trailer_t;
+
+// One extent of a COMMIT_TYPE_MULTI record, its length bytes of data follow it
+typedef struct commit_extent {
+    int64_t offset;
+    int64_t length;
+} commit_extent_t;
+
+// Transactions that span several files are committed by a single COMMIT_TYPE_TXN
+// record in the transaction log of the committing process. Its parts are copied
+// into the files' own logs right after, under the sequence numbers reserved for
+// them. If a crash comes in between, recovery takes the missing record of a file
+// from the transaction log: a part applies when its log_id matches the file's log
+// and its seq is the one right after the last valid record in that log.
+typedef struct txn_part {
+    uint64_t log_id; // log_id of the file's log at commit time
+    uint64_t seq; // Sequence number of the transaction's record in that log
+    uint32_t name_length; // Length of the file name that follows
+    uint32_t reserved;
+    int64_t length; // Bytes of the COMMIT_TYPE_MULTI payload after the name
+} txn_part_t;
+
+// Recovery: a file's part of a cross-file transaction, as found in a transaction log
+typedef struct txn_redo {
+    uint64_t log_id;
+    uint64_t seq;
+    vector<char> payload; // COMMIT_TYPE_MULTI payload
+} txn_redo_t;
+
+// Recovery: a byte range of the data file whose newest committed contents are
+// at src inside the mapped log. Kept in a map keyed by the start offset.
+typedef struct log_extent {
+    int64_t end;
+    const char *src;
+} log_extent_t;
+
+// Incremental cleaning: a byte range of an open file and the sequence number of
+// the newest record in its log that covers it. Kept in a map keyed by the start offset.
+typedef struct seq_extent {
+    int64_t end;
+    uint64_t seq;
+} seq_extent_t;
+
+// Lazy open: a byte range of an open file whose newest committed contents are still
+// only in its log, starting at log offset pos. Kept in a map keyed by the start offset.
+typedef struct overlay_extent {
+    int64_t end;
+    int64_t pos;
+} overlay_extent_t;
+
+// Committed bytes of a page as they were before commit number until, kept for the snapshots
+// taken before it (see gtfs_begin_snapshot)
+typedef struct page_version {
+    uint64_t until;
+    vector<char> bytes;
+} page_version_t;
+
+// Log file layout: a LOG_HEADER_SIZE block with two copies of log_meta_t, then
+// the records. The head only moves forward as records are applied to the data
+// file, so later cleans and crash recovery resume from it. Header writes alternate
+// between the two slots and the valid copy with the highest generation wins, so
+// a torn header write never loses the previous head.
+#define LOG_HEADER_MAGIC 0x484c5447 // "GTLH"
+#define LOG_HEADER_SIZE 4096 // Offset of the first record
+#define LOG_HEADER_SLOT_SIZE 512 // Each copy of log_meta_t sits in its own sector
+#define GTFS_LOG_SEGMENT_SIZE (1 << 20) // Applied records are punched out of the log a segment at a time
+
+typedef struct log_meta {
+    uint32_t magic; // LOG_HEADER_MAGIC
+    uint16_t version; // LOG_FORMAT_VERSION
+    uint16_t reserved;
+    uint64_t generation; // Bumped on every header write
+    int64_t head; // Offset of the first record that is not fully applied yet
+    uint64_t head_seq; // Sequence number of the record at head
+    int64_t head_done; // Payload bytes of the record at head that are already applied
+    uint64_t log_id; // Random, picked when the log is created (ties transaction parts to it)
+    uint32_t crc; // CRC32C over the fields above
+} log_meta_t;
+
+// Directory-wide WAL (gtfs_enable_wal): a single log for every file of the directory,
+// kept in fixed-size preallocated segments under .logs/.wal. A record is a commit_t of
+// type COMMIT_TYPE_WAL whose payload is a list of wal_part_t, each followed by the
+// COMMIT_TYPE_WRITE or COMMIT_TYPE_MULTI payload of one file. Files are tagged by an id
+// that a COMMIT_TYPE_WAL_NAME record names in every segment before its first use.
+// Sequence numbers run on across segments, so recovery replays the chain of segments
+// in order and stops at the first record that is torn, corrupt or out of sequence.
+// Segments are reused oldest first, once every record in them has been applied.
+#define COMMIT_TYPE_WAL 4
+#define COMMIT_TYPE_WAL_NAME 5 // Payload is a wal_part_t (length is that of the name), then the name
+#define COMMIT_TYPE_WAL_CLOSE 6 // Payload is a wal_part_t: the file was closed, its earlier records are applied
+#define WAL_SEGMENT_MAGIC 0x53575447 // "GTWS"
+
+typedef struct wal_part {
+    uint32_t file_id;
+    uint16_t type; // COMMIT_TYPE_WRITE or COMMIT_TYPE_MULTI
+    uint16_t reserved;
+    int64_t offset; // As in commit_t
+    int64_t length; // Bytes of payload that follow
+} wal_part_t;
+
+// Sits at the start of every segment, the records follow at LOG_HEADER_SIZE
+typedef struct wal_segment_header {
+    uint32_t magic; // WAL_SEGMENT_MAGIC
+    uint16_t version; // LOG_FORMAT_VERSION
+    uint16_t reserved;
+    uint64_t index; // Position of the segment in the WAL, a reused segment gets a new one
+    uint64_t first_seq; // Sequence number of the first record in the segment
+    uint32_t crc; // CRC32C over the fields above
+} wal_segment_header_t;
+
+typedef struct wal_segment {
+    string path;
+    int fd;
+    char *map; // Read-only mapping of the whole segment, checkpoints read records from it
+    int64_t size;
+    uint64_t index;
+    uint64_t first_seq;
+    int64_t tail; // Where the next record goes
+    int pending; // Records that are not applied to their data file yet
+    vector<uint32_t> named; // Files whose COMMIT_TYPE_WAL_NAME record is in the segment
+} wal_segment_t;
+
+// A record of an open file that sits in the WAL and is not applied yet
+typedef struct wal_ref {
+    wal_segment_t *segment;
+    int64_t pos; // Offset of the file's payload inside the segment
+    uint16_t type; // As in the wal_part_t
+    int64_t offset;
+    int64_t length;
+    uint64_t seq;
+    int64_t bytes; // Share of the segment taken by the record, for the checkpoint thresholds
+} wal_ref_t;
+
+// Runtime statistics (gtfs_get_stats). They are kept in the registry, so every process
+// using a directory adds to the same counters and any process can take a snapshot; without
+// a registry a gtfs_t and its files count on their own. Counters only grow, they are bumped
+// with relaxed atomics and a snapshot reads each one atomically (but not all at once).
+// Latencies go into histograms with a power of two bucket per range of nanoseconds.
+// The statistics of the directory are split in shards, each thread bumps its own so threads
+// working on different files do not fight over the same cache lines; a snapshot sums them.
+#define GTFS_STATS_BUCKETS 40 // Bucket i counts latencies in [2^i, 2^(i+1)) ns, the last one all longer ones
+#define GTFS_STATS_SHARDS 16
+
+typedef struct gtfs_histogram {
+    uint64_t count;
+    uint64_t sum_ns;
+    uint64_t max_ns;
+    uint64_t buckets[GTFS_STATS_BUCKETS];
+} gtfs_histogram_t;
+
+typedef struct gtfs_stats {
+    uint64_t bytes_written; // Bytes handed to gtfs_write_file
+    uint64_t bytes_logged; // Record bytes appended to file logs, the WAL and transaction logs
+    uint64_t commits; // Successful syncs and transaction commits
+    uint64_t aborts; // Aborted writes, on their own or with their transaction
+    uint64_t flushes; // fdatasync calls on data files and logs
+    uint64_t checkpoint_bytes; // Logged bytes applied to data files by checkpoints and cleans
+    uint64_t recovery_records; // Records replayed or adopted by recovery after a crash
+    int64_t log_bytes; // Log bytes not applied yet, only filled in by a snapshot
+    gtfs_histogram_t sync_latency; // gtfs_sync_write_file and gtfs_commit_txn
+    gtfs_histogram_t clean_latency; // gtfs_clean, gtfs_clean_n_bytes and background checkpoints
+    gtfs_histogram_t recovery_latency; // Recovery of a file from its log at open or gtfs_init
+    gtfs_histogram_t durable_latency; // What a durability level above GTFS_DURABLE_PROCESS costs: flushes of logs, O_DSYNC appends
+} gtfs_stats_t;
+
+typedef struct alignas(64) gtfs_stats_shard {
+    gtfs_stats_t stats; // Of the threads that picked the shard, see stats_shard
+} gtfs_stats_shard_t;
+
+// Registry shared by every process using a directory: a file in .logs mapped by all of
+// them. It remembers which files are open (a crash leaves them marked open) and the log
+// state of each, so gtfs_init only has to look at the files a dead process left open and
+// gtfs_open_file can skip recovery for a file that was closed cleanly. The writer lock on
+// the data file stays the authority on ownership, the registry only tells where to look:
+// it is never flushed, so a log with records past its head is recovered whatever the
+// registry says, and a registry left by an earlier boot is started over.
+#define GTFS_REGISTRY_MAGIC 0x52535447 // "GTSR"
+#define GTFS_REGISTRY_VERSION 5
+#define GTFS_BOOT_ID_LEN 36 // /proc/sys/kernel/random/boot_id without the newline
+#define GTFS_REGISTRY_SLOTS (2 * MAX_NUM_FILES_PER_DIR) // Open addressing, keyed by the file name
+
+typedef struct gtfs_registry_entry {
+    char filename[MAX_FILENAME_LEN + 1];
+    int used; // Set once filename is filled in, slots are never freed
+    int open; // 1 from open until a clean close, still 1 after a crash
+    pid_t owner; // Process that has the file open
+    int64_t file_length;
+    int64_t log_head; // Published by the owner after every append and clean
+    int64_t log_tail;
+    uint64_t head_seq;
+    uint64_t next_seq;
+    gtfs_stats_t stats; // Of the file, across every process and open since the registry was created
+} gtfs_registry_entry_t;
+
+typedef struct gtfs_registry {
+    uint32_t magic; // GTFS_REGISTRY_MAGIC, set last when the registry is created
+    uint32_t version; // GTFS_REGISTRY_VERSION
+    char boot_id[GTFS_BOOT_ID_LEN + 1]; // Boot the registry was created in
+    pthread_mutex_t lock; // Robust and process-shared, guards slot allocation and the fields below
+    int files; // Slots in use
+    int txn_logs; // Transaction logs in .logs, so gtfs_init knows whether to look for dead ones
+    pid_t wal_owner; // Process using the directory WAL, 0 if none
+    gtfs_stats_shard_t stats[GTFS_STATS_SHARDS]; // Of the whole directory
+    gtfs_registry_entry_t entries[GTFS_REGISTRY_SLOTS];
+} gtfs_registry_t;
+
+struct pending_commit;
+
+// Writes are carved from pooled chunks: a write_t, its data and its undo copy share one
+// block of the smallest size class that fits. Released blocks go on the free list of
+// their class, so once the pool is warm gtfs_write_file does not call malloc. Blocks
+// larger than the largest class are malloc'd on their own. Each thread keeps a few
+// blocks of every class to itself (see pool_cache_t), so a thread that writes and
+// releases over and over takes no lock; it trades them with the free lists in batches.
+// Chunks are shared by all classes, what is left at the end of one when a block does not
+// fit goes to the smaller classes. A clean that finds every block free gives the chunks back.
+#define GTFS_POOL_MIN_SHIFT 8 // Smallest blocks are 256 bytes
+#define GTFS_POOL_CLASSES 9 // Largest blocks are 64 KiB
+#define GTFS_POOL_CHUNK_SIZE (256 << 10)
+#define GTFS_POOL_CACHE_BLOCKS 16 // Blocks of one class a thread keeps, half of them move at a time
+
+typedef struct pool_class {
+    mutex mtx;
+    void *free_list; // Released blocks, each holds a pointer to the next one
+    int64_t free_blocks; // On free_list
+} pool_class_t;
+
+typedef struct write_pool {
+    uint64_t id; // Tells the pool apart in the caches of the threads, never reused
+    pool_class_t classes[GTFS_POOL_CLASSES];
+    mutex chunk_mutex; // Guards the fields below, taken before the mutex of a class
+    vector<char*> chunks; // Every chunk malloc'd, so they can be given back
+    char *carve; // Part of the newest chunk not handed out yet
+    char *carve_end;
+} write_pool_t;
+
 typedef struct gtfs {
     string dirname;
     // TODO: Add any additional fields if necessary
+    gtfs_registry_t *registry; // Shared with every process using the directory, NULL if unavailable
+    write_pool_t write_pool; // Blocks for writes, see gtfs_release_write
+    gtfs_stats_shard_t *stats; // In the registry, or local_stats without one
+    gtfs_stats_shard_t local_stats[GTFS_STATS_SHARDS];
+
+    // Group commit: syncs are queued and a background flusher appends them in batches
+    int group_commit; // 0: every sync writes its own record, 1: syncs go through the flusher
+    int group_commit_window_us; // How long the flusher waits for more syncs to join a batch
+    int group_commit_max_batch; // Flush as soon as this many syncs are queued
+    mutex gc_mutex;
+    condition_variable gc_cv; // Signals the flusher that work is queued
+    condition_variable gc_done_cv; // Signals waiting syncs that a batch is durable
+    deque<struct pending_commit*> gc_queue;
+    thread *gc_flusher;
+    pid_t gc_flusher_pid; // Process that owns the flusher (a forked child must start its own)
+    int gc_stop;
+
+    // Open files, so clean and the checkpointer can reach them
+    map<string, struct file*> open_files;
+    mutex files_mutex;
+    string clean_cursor; // File where the next gtfs_clean_n_bytes picks up
+
+    // Background checkpointer: applies and truncates logs that grow too large or too old
+    int checkpointer_enabled;
+    int64_t checkpoint_bytes; // Checkpoint a file once its log reaches this size (0: no size limit)
+    int checkpoint_age_ms; // Checkpoint a file once its oldest record is this old (0: no age limit)
+    mutex ckpt_mutex;
+    condition_variable ckpt_cv;
+    thread *checkpointer;
+    pid_t checkpointer_pid;
+    int ckpt_stop;
+
+    // Transaction log of this process, created by the first cross-file commit
+    mutex txn_mutex;
+    int txn_fd; // .logs/.txn.<pid>-<n>, -1 until first used
+    pid_t txn_pid; // Process that created txn_fd (a forked child must create its own)
+    int64_t txn_tail;
+    uint64_t txn_next_seq;
+    int txn_inflight; // Commits whose parts are not in the file logs yet, the log is only cut back at 0
+
+    // Directory-wide WAL, replaces the per-file logs while enabled
+    int wal; // 0: one log per file, 1: every file logs to the WAL
+    int64_t wal_segment_size;
+    int wal_max_segments; // Beyond this the checkpointer applies the files that hold on to the oldest segment
+    mutex wal_mutex;
+    int wal_lock_fd; // .logs/.wal/lock, held while the WAL is in use
+    pid_t wal_pid; // Process that enabled the WAL (a forked child cannot share it)
+    deque<wal_segment_t*> wal_segments; // Oldest first, records are appended to the last one
+    uint64_t wal_next_seq;
+    uint64_t wal_next_index;
+    uint32_t wal_next_file_id;
+    int wal_next_name; // Suffix of the next segment file created
+
+    // Asynchronous syncs, the engine is started by the first gtfs_sync_write_file_async
+    mutex async_mutex;
+    struct async_engine *async_engine;
+    pid_t async_pid; // Process that started the engine (a forked child must start its own)
+
+    int64_t huge_page_min; // Files opened with at least this many bytes are mapped for huge pages, 0: never
+    int delta_records; // Syncs log only the bytes a write changed, see gtfs_enable_delta_records
+    int private_mapping; // Writers opened from now on map their file copy-on-write, see gtfs_enable_private_mapping
+    int64_t log_prealloc; // Logs of files opened from now on are allocated and recycled in extents of this many bytes, 0: never
+    int snapshots; // Writers opened from now on keep committed versions of their pages, see gtfs_enable_snapshots
+
+    // Durability, see gtfs_set_durability: the level of the WAL and of files opened from now on
+    int durability; // GTFS_DURABLE_*
+    int durable_interval_ms; // Flush period of GTFS_DURABLE_PERIODIC
+    int wal_unflushed; // Records were appended to the active WAL segment since it was last flushed, under wal_mutex
+    chrono::steady_clock::time_point wal_flushed; // When the syncer last flushed the WAL, under wal_mutex
+
+    // Background syncer: flushes the logs of GTFS_DURABLE_PERIODIC files, started when the level is
+    // chosen or such a file is opened, and gone once no periodic file or WAL is left
+    int syncer_wanted; // A periodic level was chosen since the syncer's last pass
+    int syncer_running;
+    int syncer_stop;
+    mutex syncer_mutex;
+    condition_variable syncer_cv;
+    thread *syncer;
+    pid_t syncer_pid; // Process that owns the syncer (a forked child must start its own)
+    atomic<uint64_t> periodic_parts; // Transaction parts appended to the logs of GTFS_DURABLE_PERIODIC files
+    atomic<uint64_t> periodic_flushed; // periodic_parts as of the start of the syncer's last pass, all of them are flushed
 } gtfs_t;
 
+// Open modes of gtfs_open_file_mode. A file has at most one writing process at a time,
+// any number of processes may read it meanwhile. Locks are OFD fcntl locks on the data
+// file: the writer holds the byte at GTFS_WRITER_LOCK_OFFSET, a write holds its bytes
+// exclusively until it is synced or aborted, and a reader holds the bytes it reads shared
+// (for as long as a view is not released), so it never sees uncommitted data.
+#define GTFS_OPEN_WRITE 0
+#define GTFS_OPEN_READ 1
+#define GTFS_WRITER_LOCK_OFFSET (1LL << 62) // Past any data, locks may lie beyond the end of file
+
+// Durability levels, see gtfs_set_durability. Each one says what a successful sync or
+// commit survives.
+#define GTFS_DURABLE_PROCESS 0 // A crash of the process: the record is in the page cache (default)
+#define GTFS_DURABLE_COMMIT 1 // A crash of the machine: the log is flushed with fdatasync before the call returns
+#define GTFS_DURABLE_PERIODIC 2 // A crash of the machine, once the background syncer has flushed the log (every interval_ms)
+#define GTFS_DURABLE_DSYNC 3 // A crash of the machine: the log is opened O_DSYNC, so every append is written through
+
+// A record appended to a file's log while fl->mtx is not held. Records are committed in
+// log order (see settle_appends), the appending sync waits until its own is settled.
+typedef struct append_slot {
+    int64_t pos; // Log offset of the record
+    uint64_t seq;
+    struct write *write_id;
+    int written; // 0: pwritev running, 1: on the log, -1: failed
+    int state; // 0: pending, 1: committed, -1: lost (it or a record before it failed)
+    struct append_slot *next; // Next record in the log
+    struct async_request *async; // Asynchronous sync that is told when the slot settles, NULL for a blocking one
+} append_slot_t;
+
 typedef struct file {
     string filename;
-    int file_length;
+    uint32_t trace_id; // Tags the file's events in the trace, see trace.hpp
+    int64_t file_length;
     // TODO: Add any additional fields if necessary
     char *data; // In memory copy of the data
+    int huge_pages; // The mapping is aligned to GTFS_HUGE_PAGE_SIZE and advised MADV_HUGEPAGE
+    int private_map; // MAP_PRIVATE: written pages are copies, the data file only gets bytes applied from the log
+    int durability; // GTFS_DURABLE_*, see gtfs_set_file_durability
+    int durable_interval_ms; // Flush period of GTFS_DURABLE_PERIODIC
+    int log_unflushed; // Records were appended to the log since it was last flushed
+    chrono::steady_clock::time_point log_flushed; // When the syncer last flushed the log
+
+    // Snapshot reads (gtfs_enable_snapshots), pages are _SC_PAGESIZE bytes, all under mtx
+    int mvcc; // Committed bytes are kept for snapshots
+    uint64_t commit_version; // Writes committed so far, a snapshot sees the ones up to its version
+    map<int64_t, vector<char>> committed_pages; // Committed bytes of the pages outstanding writes touch, by page number
+    map<int64_t, vector<page_version_t>> page_versions; // Older committed bytes open snapshots still need, oldest first
+    multiset<uint64_t> snapshot_versions; // Versions of the open snapshots
     
     //Log file path
     int fd; // This is to allow OS flocks to be acquired and released
+    int mode; // GTFS_OPEN_WRITE or GTFS_OPEN_READ
     string log_path;
-    gtfs *gtfs; //This is to simplify sync implementation
+    int log_fd; // Log held open from open until close, -1 when closed
+    uint64_t next_seq; // Sequence number for the next record appended to the log
+    log_meta_t log_meta; // In-memory copy of the log header
+    int64_t log_tail; // Offset where the next record is appended
+    int64_t log_reclaimed; // Log bytes before this offset have been punched out
+    int64_t log_prealloc; // Extent the log is allocated in and kept at when it is emptied, 0: it is truncated instead
+    int64_t log_allocated; // Log bytes allocated, appends below this offset overwrite earlier records in place
+    chrono::steady_clock::time_point log_oldest; // When the oldest record still in the log was appended
+    map<int64_t, struct seq_extent> newest; // Sequence number of the newest logged record for every logged byte
+    map<int64_t, struct overlay_extent> overlay; // Bytes a log adopted at open holds newer than the mapping, under mtx
+    atomic<int> overlaid; // overlay is not empty, lets accesses skip mtx once it is
+
+    // Only used while the directory WAL is enabled (log_fd is -1 then)
+    uint32_t wal_id; // Tags the file's records in the WAL
+    deque<wal_ref_t> wal_records; // Records not applied yet, oldest first
+    int64_t wal_pending; // Sum of their bytes
+    int64_t wal_done; // Payload bytes of the oldest one that gtfs_clean_n_bytes already applied
+
+    mutex mtx; // Serializes log appends, checkpoints and updates of the in-memory copy
+
+    // Syncs reserve their record's place in the log under mtx and write it without, as do
+    // writes with their copy into the mapping. Checkpoints wait until none is running.
+    int inflight; // Appends and copies running without mtx
+    condition_variable inflight_cv; // Signalled (with mtx) when one of them finishes
+    append_slot_t *appends; // Appends not settled yet, oldest first (on the syncing threads' stacks, or in async requests)
+    append_slot_t *appends_tail;
+    int64_t append_failed; // Log offset of the first record that failed, -1 if none
+    uint64_t append_failed_seq; // Its sequence number
+    vector<pair<int64_t, int64_t>> copying; // Byte ranges (offset, length) being copied into the mapping, sorted
+    int async_pending; // Asynchronous syncs that have not completed, close waits for them
+
+    // Readers pin the mapping so that close cannot unmap it underneath them
+    atomic<int> pins;
+    atomic<int> closing; // Set by close, no new pins are handed out afterwards
+    atomic<int> remapping; // Set while gtfs_resize_file moves the mapping, new pins wait for it
+    condition_variable pins_cv; // Signalled (with mtx) when the last pin goes away during close or a move, and after a move
+    vector<struct write*> outstanding; // Writes that are neither synced nor aborted, oldest first
+    mutex range_mtx; // Protects ranges
+    vector<pair<int64_t, int64_t>> ranges; // Byte ranges (offset, length) locked by writes or reads in progress, sorted
+    struct gtfs *gtfs; //This is to simplify sync implementation
+    gtfs_registry_entry_t *reg; // Entry of the file in the shared registry, NULL without one
+    gtfs_stats_t *stats; // In the file's registry entry, or local_stats without one
+    gtfs_stats_t local_stats;
 
 } file_t;
 
 typedef struct write {
-    string filename;
-    int offset;
-    int length;
+    const char *filename; // Points into fl->filename
+    int64_t offset;
+    int64_t length;
     char *data;
     // TODO: Add any additional fields if necessary
 
@@ -59,40 +508,227 @@ typedef struct write {
     int synced; // 0: not synced, 1: synced
     int aborted; // 0: not aborted, 1: aborted
     char *old_data; // old data before write
+    struct txn *txn; // Transaction the write was added to, NULL if it is synced on its own
+    int delta; // old_data holds committed bytes only and no later write overlaps, its sync may log just the changes
+    int pool_class; // Size class of the block holding the write and its buffers, -1 if malloc'd
 } write_t;
 
-typedef struct log_meta {
-    int length; // Total length of the log file
-    int num_commits;
-} log_meta_t;
+// A transaction groups writes on one or more files of a gtfs_t so that they are
+// committed together by one record (see txn_part_t), or aborted together
+typedef struct txn {
+    struct gtfs *gtfs;
+    vector<write_t*> writes; // In the order they were added
+    int state; // 0: open, 1: committed, 2: aborted
+} txn_t;
 
-// Want a small commit metadata struct
-typedef struct commit {
-    int offset;
-    int length;
-    int commited; // 0: not commited, 1: commited (this is to ensure commits are not corrupted)
-} commit_t;
+// A sync waiting for the group commit flusher
+typedef struct pending_commit {
+    write_t *write_id;
+    uint32_t payload_crc; // Computed by the caller so the flusher only checksums the header
+    int done; // 0: queued, 1: record is durable (or failed)
+    int64_t ret; // Return value handed back to gtfs_sync_write_file
+} pending_commit_t;
+
+#define GTFS_DEFAULT_GROUP_COMMIT_WINDOW_US 200
+#define GTFS_DEFAULT_GROUP_COMMIT_MAX_BATCH 64
+#define GTFS_CHECKPOINT_POLL_MS 100 // Longest the checkpointer sleeps between checks
+#define GTFS_SYNCER_POLL_MS 100 // Longest the syncer sleeps between checks
+#define GTFS_TXN_LOG_RETIRE_BYTES (1 << 20) // The transaction log is cut back once it is this large and idle
+#define GTFS_DEFAULT_WAL_SEGMENT_SIZE (16 << 20)
+#define GTFS_DEFAULT_WAL_MAX_SEGMENTS 8
+#define GTFS_ASYNC_RING_ENTRIES 256 // Submission queue of the io_uring behind asynchronous syncs
+#define GTFS_ASYNC_POOL_THREADS 4 // Threads that run asynchronous syncs when io_uring cannot
+#define GTFS_HUGE_PAGE_SIZE (2 << 20)
+
+// Access hints of gtfs_prefetch, passed on to madvise
+#define GTFS_ACCESS_NORMAL 0 // MADV_NORMAL
+#define GTFS_ACCESS_SEQUENTIAL 1 // MADV_SEQUENTIAL: aggressive readahead, pages behind are dropped early
+#define GTFS_ACCESS_RANDOM 2 // MADV_RANDOM: no readahead
+#define GTFS_ACCESS_WILLNEED 3 // MADV_WILLNEED: start reading the range in now
+
+// A read-only view straight into the mapping of an open file. The file stays
+// pinned (close waits for it) until the view is released with gtfs_release_view.
+typedef struct gtfs_view {
+    const char *data;
+    int64_t length;
+    file_t *fl; // Pinned file, NULL once released
+} gtfs_view_t;
+
+// A snapshot of an open file (gtfs_begin_snapshot), filled in by the library
+typedef struct gtfs_snapshot {
+    file_t *fl; // NULL once ended
+    uint64_t version; // Commits of the file the snapshot sees
+} gtfs_snapshot_t;
+
+// An asynchronous sync (gtfs_sync_write_file_async). The caller fills in callback, arg and
+// eventfd and keeps the struct alive until the sync has completed, the library fills in
+// the rest. On completion eventfd is incremented, then done is set (gtfs_async_poll and
+// gtfs_async_wait look at it), then callback runs. The library does not touch the struct
+// after setting done, so a callback may be the one to free it.
+typedef void (*gtfs_async_callback_t)(write_t *write_id, int64_t ret, void *arg);
+
+typedef struct gtfs_async {
+    gtfs_async_callback_t callback; // NULL for none, runs on a library thread and should not block
+    void *arg; // Handed to callback
+    int eventfd; // Gets an 8 byte 1 written on completion (an eventfd adds it up), -1 for none
+    write_t *write_id;
+    int64_t ret; // What gtfs_sync_write_file would have returned, valid once done is set
+    atomic<int> done; // 0 while in flight, 1 once completed
+    struct async_engine *engine; // Engine completing the sync, NULL if it failed to start
+} gtfs_async_t;
 
 // GTFileSystem basic API calls
 
 gtfs_t* gtfs_init(string directory, int verbose_flag);
 int gtfs_clean(gtfs_t *gtfs);
 
-file_t* gtfs_open_file(gtfs_t* gtfs, string filename, int file_length);
+file_t* gtfs_open_file(gtfs_t* gtfs, string filename, int64_t file_length);
 int gtfs_close_file(gtfs_t* gtfs, file_t* fl);
 int gtfs_remove_file(gtfs_t* gtfs, file_t* fl);
 
-char* gtfs_read_file(gtfs_t* gtfs, file_t* fl, int offset, int length);
-write_t* gtfs_write_file(gtfs_t* gtfs, file_t* fl, int offset, int length, const char* data);
-int gtfs_sync_write_file(write_t* write_id);
+char* gtfs_read_file(gtfs_t* gtfs, file_t* fl, int64_t offset, int64_t length);
+write_t* gtfs_write_file(gtfs_t* gtfs, file_t* fl, int64_t offset, int64_t length, const char* data);
+int64_t gtfs_sync_write_file(write_t* write_id);
 int gtfs_abort_write_file(write_t* write_id);
 
 // BONUS: Implement below API calls to get bonus credits
 
-int gtfs_clean_n_bytes(gtfs_t *gtfs, int bytes);
-int gtfs_sync_write_file_n_bytes(write_t* write_id, int bytes);
+// Applies at most bytes bytes of logged data across the open files and advances
+// their log heads. Returns the number of bytes applied (0 once there is nothing left).
+int64_t gtfs_clean_n_bytes(gtfs_t *gtfs, int64_t bytes);
+int gtfs_sync_write_file_n_bytes(write_t* write_id, int64_t bytes);
 
 // TODO: Add here any additional data structures or API calls
 
+// Group commit: batch concurrent and back-to-back syncs into a single log append.
+// window_us is how long a batch stays open for more syncs, max_batch caps its size.
+int gtfs_enable_group_commit(gtfs_t *gtfs, int window_us, int max_batch);
+int gtfs_disable_group_commit(gtfs_t *gtfs);
+
+// Background checkpointing: a file's committed records are applied and its log
+// truncated once the log reaches max_log_bytes or its oldest record is older
+// than max_log_age_ms (either threshold may be 0 to disable it).
+int gtfs_enable_checkpointer(gtfs_t *gtfs, int64_t max_log_bytes, int max_log_age_ms);
+int gtfs_disable_checkpointer(gtfs_t *gtfs);
+
+// Opens a file for writing (GTFS_OPEN_WRITE, what gtfs_open_file does) or read only
+// (GTFS_OPEN_READ). A read open does not wait for the writer of the file, the file must
+// already be at least file_length bytes long. Reads wait only for writes to the same bytes.
+file_t* gtfs_open_file_mode(gtfs_t* gtfs, string filename, int64_t file_length, int mode);
+
+// Gives the memory of a synced or aborted write back to the pool of its gtfs_t. The
+// handle must not be used afterwards. Fails for a write that is still outstanding.
+int gtfs_release_write(write_t* write_id);
+
+// Statistics of a directory (gtfs_get_stats) or of one file (gtfs_get_file_stats), see
+// gtfs_stats_t. gtfs_read_stats takes the same snapshot from outside: it only maps the
+// registry of directory, so a monitoring process does not have to call gtfs_init. An
+// empty filename asks for the statistics of the whole directory.
+int gtfs_get_stats(gtfs_t *gtfs, gtfs_stats_t *stats);
+int gtfs_get_file_stats(file_t *fl, gtfs_stats_t *stats);
+int gtfs_read_stats(string directory, string filename, gtfs_stats_t *stats);
+
+// Tracing: API calls (and internal events at higher trace levels) are recorded in rings
+// per thread, gtfs_trace_dump (see trace.hpp) writes them to a file for tools/gtfs_trace.
+
+// Zero-copy reads: gtfs_read_view hands out a pinned view into the mapping,
+// gtfs_read_file_into copies into a caller supplied buffer (no allocation).
+int gtfs_read_view(gtfs_t* gtfs, file_t* fl, int64_t offset, int64_t length, gtfs_view_t *view);
+int gtfs_release_view(gtfs_view_t *view);
+int64_t gtfs_read_file_into(gtfs_t* gtfs, file_t* fl, int64_t offset, int64_t length, char *buf);
+
+// Directory-wide WAL: every file of gtfs appends to one log made of segment_size
+// byte segments instead of a log of its own. Segments are reused once all of their
+// records are applied, the checkpointer (when enabled) applies the files that keep
+// more than max_segments segments alive. Only possible while no file is open, and
+// while no other process uses a WAL in the same directory.
+int gtfs_enable_wal(gtfs_t *gtfs, int64_t segment_size, int max_segments);
+int gtfs_disable_wal(gtfs_t *gtfs);
+
+// Large files: sizes and offsets are 64-bit throughout. gtfs_resize_file grows an open
+// file (never shrinks it) with mremap: in place when the address space after the mapping
+// is free, otherwise the mapping moves once no view or copy into it is left (a thread that
+// holds a view must not resize). gtfs_enable_huge_pages maps files opened afterwards with
+// at least min_length bytes at a huge page boundary and advises MADV_HUGEPAGE, which
+// cuts TLB misses on random access where the kernel and file system back it with huge
+// pages. gtfs_prefetch passes a GTFS_ACCESS_* hint for a range of a file to madvise.
+int gtfs_resize_file(gtfs_t* gtfs, file_t* fl, int64_t file_length);
+int gtfs_enable_huge_pages(gtfs_t *gtfs, int64_t min_length);
+int gtfs_disable_huge_pages(gtfs_t *gtfs);
+int gtfs_prefetch(gtfs_t* gtfs, file_t* fl, int64_t offset, int64_t length, int hint);
+
+// Delta encoded records: once enabled, a sync compares the write with the bytes it replaced
+// and logs only the runs that changed, as a COMMIT_TYPE_MULTI record. A write is logged in
+// full when the delta would not be smaller, and when it overlaps another write that was
+// outstanding at some point before it was synced (its saved bytes are not the committed
+// ones then). Applies to syncs that go to the file's own log without group commit.
+int gtfs_enable_delta_records(gtfs_t *gtfs);
+int gtfs_disable_delta_records(gtfs_t *gtfs);
+
+// Private mapping: files opened for writing afterwards are mapped MAP_PRIVATE, so the bytes
+// of a write stay in a copy of its pages and never reach the data file through writeback.
+// Only committed bytes do, when a checkpoint or clean applies them from the log, and the
+// copies that then hold nothing newer than the data file are given back. An abort drops
+// the pages of the write instead of copying the old bytes back, unless another outstanding
+// write or a committed record that is not applied yet shares them. Readers in other
+// processes see committed bytes once they are applied. Files open already keep their mappings.
+int gtfs_enable_private_mapping(gtfs_t *gtfs);
+int gtfs_disable_private_mapping(gtfs_t *gtfs);
+
+// Log preallocation: the logs of files opened for writing afterwards are allocated with
+// fallocate in extents of extent_size bytes and never truncated or removed while the file
+// is in use. A checkpoint only moves the head back to the start, later records overwrite
+// the applied ones in place, and a log is kept at close for the next open to reuse. Old
+// records are told apart by their sequence numbers. A log grows by whole extents when the
+// records outrun it, and goes back to one extent once it is emptied. Files open already
+// keep their logs as they are.
+int gtfs_enable_log_preallocation(gtfs_t *gtfs, int64_t extent_size);
+int gtfs_disable_log_preallocation(gtfs_t *gtfs);
+
+// Durability levels (GTFS_DURABLE_*): what a sync or transaction commit has survived once it
+// returns. gtfs_set_durability sets the level of files opened afterwards and of the WAL,
+// gtfs_set_file_durability changes it for one open file (not while the WAL is enabled, it
+// has one level for all files). interval_ms is the flush period of GTFS_DURABLE_PERIODIC
+// and must be positive then, it is ignored otherwise. A cross-file commit flushes the
+// transaction log before it copies the parts when any file in it is above
+// GTFS_DURABLE_PROCESS. Asynchronous syncs are flushed at every level. The time spent
+// making records durable goes into durable_latency of the stats.
+int gtfs_set_durability(gtfs_t *gtfs, int level, int interval_ms);
+int gtfs_set_file_durability(gtfs_t *gtfs, file_t *fl, int level, int interval_ms);
+
+// Snapshot reads: once enabled, files opened for writing afterwards keep a copy of the
+// committed bytes of every page an outstanding write touches, and older copies that open
+// snapshots still need once later commits replace them. gtfs_begin_snapshot pins the
+// commits of a file so far, gtfs_read_snapshot then returns exactly the bytes they left,
+// whatever was written, synced or aborted since. Reads never wait for writes, they copy
+// under the file's mutex. A snapshot needs the writing handle of this process; readers in
+// other processes keep their locked reads. Snapshots are ended with gtfs_end_snapshot,
+// reads fail once the file is closed.
+int gtfs_enable_snapshots(gtfs_t *gtfs);
+int gtfs_disable_snapshots(gtfs_t *gtfs);
+int gtfs_begin_snapshot(gtfs_t *gtfs, file_t *fl, gtfs_snapshot_t *snapshot);
+int64_t gtfs_read_snapshot(gtfs_snapshot_t *snapshot, int64_t offset, int64_t length, char *buf);
+int gtfs_end_snapshot(gtfs_snapshot_t *snapshot);
+
+// Asynchronous syncs: queues the sync of write_id and returns 0 at once, or -1 if it cannot
+// be queued (nothing is delivered then). Completion is reported through async, see
+// gtfs_async_t: ret is the number of bytes committed, or -1. A completed sync is also
+// durable, its record is flushed with fdatasync. Syncs of files with their own log go to
+// io_uring as a linked write and fdatasync; with group commit or the directory WAL, or when
+// the kernel has no io_uring, they run on a small thread pool. gtfs_async_poll returns 1
+// once the sync has completed and 0 before, gtfs_async_wait blocks until then and returns ret.
+int gtfs_sync_write_file_async(write_t* write_id, gtfs_async_t *async);
+int gtfs_async_poll(gtfs_async_t *async);
+int64_t gtfs_async_wait(gtfs_async_t *async);
+
+// Transactions: writes from gtfs_write_file (on any open files of gtfs) are added
+// to a transaction and then committed atomically with a single record, or aborted
+// together. Commit returns the number of bytes committed, both calls free the
+// transaction on success. A failed commit leaves it open so it can be aborted.
+txn_t* gtfs_begin_txn(gtfs_t *gtfs);
+int gtfs_add_write_txn(txn_t *txn, write_t *write_id);
+int64_t gtfs_commit_txn(txn_t *txn);
+int gtfs_abort_txn(txn_t *txn);
+
 
 #endif
@@ -0,0 +1,14 @@
+#ifndef GTFS_TESTING_HPP
+#define GTFS_TESTING_HPP
+
+// Fault injection seams for the tests. They only exist in the library built with
+// GTFS_TESTING defined (make testing, bin/libgtfs_testing.a, which tests/ links), the
+// production library never looks at them.
+#ifdef GTFS_TESTING
+
+// While not 0, submissions to io_uring fail with this errno
+extern int gtfs_async_submit_fault;
+
+#endif
+
+#endif
@@ -0,0 +1,140 @@
+#include "trace.hpp"
+#include "crc32c.hpp"
+
+#include <atomic>
+#include <cstdio>
+#include <ctime>
+#include <map>
+#include <mutex>
+#include <vector>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+using namespace std;
+
+// One ring per live thread. Only its thread writes to it: the record goes in first and
+// head is published after it, so a dump reading concurrently knows which records are
+// complete. Rings of threads that exit are handed to the next new thread, they keep
+// their events until they are overwritten.
+typedef struct trace_ring {
+    atomic<uint64_t> head; // Events recorded so far, the next one goes to head % GTFS_TRACE_RING_RECORDS
+    atomic<uint32_t> tid;
+    gtfs_trace_record_t records[GTFS_TRACE_RING_RECORDS];
+} trace_ring_t;
+
+static mutex trace_mutex; // Guards the lists below, taken once per thread and by dumps
+static vector<trace_ring_t*> trace_rings;
+static vector<trace_ring_t*> trace_free_rings;
+static map<uint32_t, string> trace_names;
+
+// Gives the ring of a thread back when the thread exits
+struct trace_ring_owner {
+    trace_ring_t *ring = NULL;
+
+    ~trace_ring_owner() {
+        if (ring) {
+            lock_guard<mutex> lock(trace_mutex);
+            trace_free_rings.push_back(ring);
+        }
+    }
+};
+
+static thread_local trace_ring_owner trace_owner;
+
+// Helper function to get the ring of the calling thread, taking one on its first event
+static trace_ring_t* trace_ring() {
+    if (trace_owner.ring) {
+        return trace_owner.ring;
+    }
+    lock_guard<mutex> lock(trace_mutex);
+    trace_ring_t *ring;
+    if (!trace_free_rings.empty()) {
+        ring = trace_free_rings.back();
+        trace_free_rings.pop_back();
+    } else {
+        ring = new trace_ring_t();
+        ring->head.store(0);
+        trace_rings.push_back(ring);
+    }
+    ring->tid.store(syscall(SYS_gettid));
+    trace_owner.ring = ring;
+    return ring;
+}
+
+uint64_t gtfs_trace_now() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint32_t gtfs_trace_file_id(const string& filename) {
+    uint32_t file_id = crc32c(0, filename.data(), filename.length()) | 1; // Never 0
+    lock_guard<mutex> lock(trace_mutex);
+    trace_names[file_id] = filename;
+    return file_id;
+}
+
+void gtfs_trace_record(uint16_t op, uint32_t file_id, int64_t offset, int64_t length, int64_t result, uint64_t start_ns, uint64_t duration_ns) {
+    trace_ring_t *ring = trace_ring();
+    uint64_t head = ring->head.load(memory_order_relaxed);
+    gtfs_trace_record_t *record = &ring->records[head % GTFS_TRACE_RING_RECORDS];
+    record->timestamp_ns = start_ns;
+    record->duration_ns = duration_ns;
+    record->file_id = file_id;
+    record->op = op;
+    record->reserved = 0;
+    record->offset = offset;
+    record->length = length;
+    record->result = result;
+    ring->head.store(head + 1, memory_order_release);
+}
+
+// Helper function to write exactly length bytes to f
+static bool write_all(FILE *f, const void *buf, size_t length) {
+    return length == 0 || fwrite(buf, length, 1, f) == 1;
+}
+
+int gtfs_trace_dump(const string& path) {
+    FILE *f = fopen(path.c_str(), "wb");
+    if (!f) {
+        return -1;
+    }
+    lock_guard<mutex> lock(trace_mutex);
+    gtfs_trace_header_t header = { GTFS_TRACE_MAGIC, GTFS_TRACE_VERSION, sizeof(gtfs_trace_record_t),
+                                   (uint32_t)trace_names.size(), (uint32_t)trace_rings.size(), (uint32_t)getpid() };
+    bool ok = write_all(f, &header, sizeof(header));
+    for (auto &entry : trace_names) {
+        gtfs_trace_name_t name = { entry.first, (uint32_t)entry.second.length() };
+        ok = ok && write_all(f, &name, sizeof(name)) && write_all(f, entry.second.data(), name.length);
+    }
+
+    // Threads keep recording meanwhile. Records are copied oldest first, those that may
+    // have been overwritten while they were copied are left out.
+    vector<gtfs_trace_record_t> copy(GTFS_TRACE_RING_RECORDS);
+    for (trace_ring_t *ring : trace_rings) {
+        uint64_t head = ring->head.load(memory_order_acquire);
+        uint64_t first = head > GTFS_TRACE_RING_RECORDS ? head - GTFS_TRACE_RING_RECORDS : 0;
+        for (uint64_t i = first; i < head; i++) {
+            copy[i - first] = ring->records[i % GTFS_TRACE_RING_RECORDS];
+        }
+        atomic_thread_fence(memory_order_acquire);
+        // The thread may be writing record now, over record now - GTFS_TRACE_RING_RECORDS
+        uint64_t now = ring->head.load(memory_order_relaxed);
+        uint64_t intact = now + 1 > GTFS_TRACE_RING_RECORDS ? now + 1 - GTFS_TRACE_RING_RECORDS : 0;
+        uint64_t skip = intact > first ? min(head - first, intact - first) : 0;
+        gtfs_trace_ring_header_t ring_header = { ring->tid.load(), (uint32_t)(head - first - skip), first + skip };
+        ok = ok && write_all(f, &ring_header, sizeof(ring_header)) &&
+             write_all(f, copy.data() + skip, ring_header.count * sizeof(gtfs_trace_record_t));
+    }
+    ok = fclose(f) == 0 && ok;
+    return ok ? 0 : -1;
+}
+
+const char* gtfs_trace_op_name(uint16_t op) {
+    static const char *names[GTFS_OP_COUNT] = {
+        "?", "init", "open", "close", "remove", "read", "write", "sync", "abort", "release",
+        "txn_commit", "txn_abort", "clean", "clean_n_bytes", "sync_async", "resize", "prefetch",
+        "log_append", "group_flush", "wal_append", "checkpoint", "clean_file", "recover", "async_done"
+    };
+    return op < GTFS_OP_COUNT ? names[op] : "?";
+}
@@ -0,0 +1,142 @@
+#ifndef GTFS_TRACE
+#define GTFS_TRACE
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+// Binary tracing. Every traced event is one fixed-size gtfs_trace_record_t written into
+// a ring buffer of the calling thread, so recording takes no lock, does no formatting and
+// never touches payload bytes. The newest GTFS_TRACE_RING_RECORDS events of every thread
+// are kept; gtfs_trace_dump writes them to a file that tools/gtfs_trace decodes.
+//
+// What is compiled in is chosen with GTFS_TRACE_LEVEL (make TRACE_LEVEL=n):
+//   0  nothing, not even the verbose text
+//   1  one event per API call, with its duration and result
+//   2  also log appends, checkpoints, cleans and recoveries inside the library
+//   3  also the VERBOSE_PRINT text, printed when gtfs_init gets a verbose flag
+#define GTFS_TRACE_OFF 0
+#define GTFS_TRACE_API 1
+#define GTFS_TRACE_DETAIL 2
+#define GTFS_TRACE_TEXT 3
+
+#ifndef GTFS_TRACE_LEVEL
+#define GTFS_TRACE_LEVEL GTFS_TRACE_API
+#endif
+
+#define GTFS_TRACE_RING_RECORDS 4096 // Per thread, a power of two
+#define GTFS_TRACE_MAGIC 0x52545447 // "GTTR"
+#define GTFS_TRACE_VERSION 3
+
+// Operations, the first ones are API calls and the others internal events
+enum gtfs_trace_op {
+    GTFS_OP_INIT = 1,
+    GTFS_OP_OPEN, // offset is the open mode
+    GTFS_OP_CLOSE,
+    GTFS_OP_REMOVE,
+    GTFS_OP_READ,
+    GTFS_OP_WRITE,
+    GTFS_OP_SYNC,
+    GTFS_OP_ABORT,
+    GTFS_OP_RELEASE,
+    GTFS_OP_TXN_COMMIT,
+    GTFS_OP_TXN_ABORT,
+    GTFS_OP_CLEAN,
+    GTFS_OP_CLEAN_N_BYTES,
+    GTFS_OP_SYNC_ASYNC, // Queueing only, the completion is an ASYNC_DONE event
+    GTFS_OP_RESIZE, // length is the new file length
+    GTFS_OP_PREFETCH, // offset and length of the range advised
+    GTFS_OP_LOG_APPEND, // offset and length of the bytes appended to the file's log
+    GTFS_OP_GROUP_FLUSH, // length is the number of syncs in the batch
+    GTFS_OP_WAL_APPEND, // offset and length of the bytes appended to the active segment
+    GTFS_OP_CHECKPOINT, // length is the number of log bytes applied
+    GTFS_OP_CLEAN_FILE, // length is the number of payload bytes applied
+    GTFS_OP_RECOVER, // length is the number of records replayed
+    GTFS_OP_ASYNC_DONE, // Completion of a SYNC_ASYNC, traced with the API calls: its result and time since queueing
+    GTFS_OP_COUNT
+};
+
+typedef struct gtfs_trace_record {
+    uint64_t timestamp_ns; // CLOCK_MONOTONIC when the operation started
+    uint64_t duration_ns; // 0 for internal events
+    uint32_t file_id; // gtfs_trace_file_id of the file name, 0 if there is no file
+    uint16_t op; // gtfs_trace_op
+    uint16_t reserved;
+    int64_t offset;
+    int64_t length;
+    int64_t result; // Return value of the call (1 for a non NULL pointer), or of the event
+} gtfs_trace_record_t;
+
+// A dump is a gtfs_trace_header_t, its file names (a gtfs_trace_name_t and the name each)
+// and its rings (a gtfs_trace_ring_header_t and the ring's records, oldest first, each).
+typedef struct gtfs_trace_header {
+    uint32_t magic; // GTFS_TRACE_MAGIC
+    uint32_t version; // GTFS_TRACE_VERSION
+    uint32_t record_size; // sizeof(gtfs_trace_record_t)
+    uint32_t names;
+    uint32_t rings;
+    uint32_t pid;
+} gtfs_trace_header_t;
+
+typedef struct gtfs_trace_name {
+    uint32_t file_id;
+    uint32_t length;
+} gtfs_trace_name_t;
+
+typedef struct gtfs_trace_ring_header {
+    uint32_t tid; // Thread that filled the ring (the last one, rings are reused)
+    uint32_t count;
+    uint64_t dropped; // Older events that were overwritten
+} gtfs_trace_ring_header_t;
+
+// Id of a file in trace records, remembers the name for gtfs_trace_dump
+uint32_t gtfs_trace_file_id(const std::string& filename);
+
+// Records one event in the ring of the calling thread
+void gtfs_trace_record(uint16_t op, uint32_t file_id, int64_t offset, int64_t length, int64_t result, uint64_t start_ns, uint64_t duration_ns);
+
+uint64_t gtfs_trace_now();
+
+// Writes the rings of every thread of this process to path. Returns 0 on success, -1 on failure.
+int gtfs_trace_dump(const std::string& path);
+
+const char* gtfs_trace_op_name(uint16_t op);
+
+// Traces an API call from here to the end of the scope. result is the variable that the
+// call returns, so every return path is recorded with its return value.
+template <typename T>
+struct gtfs_trace_scope {
+    uint16_t op;
+    uint32_t file_id;
+    int64_t offset;
+    int64_t length;
+    const T& result;
+    uint64_t start_ns;
+
+    gtfs_trace_scope(uint16_t op, uint32_t file_id, int64_t offset, int64_t length, const T& result)
+        : op(op), file_id(file_id), offset(offset), length(length), result(result), start_ns(gtfs_trace_now()) {}
+
+    ~gtfs_trace_scope() {
+        gtfs_trace_record(op, file_id, offset, length, value(result), start_ns, gtfs_trace_now() - start_ns);
+    }
+
+    template <typename P>
+    static int64_t value(P *p) { return p != NULL; }
+    static int64_t value(int64_t v) { return v; }
+};
+
+#if GTFS_TRACE_LEVEL >= GTFS_TRACE_API
+#define GTFS_TRACE_CALL(op, file_id, offset, length, result) \
+    gtfs_trace_scope<decltype(result)> gtfs_trace_call_scope(op, file_id, offset, length, result)
+#else
+#define GTFS_TRACE_CALL(op, file_id, offset, length, result) do { } while (0)
+#endif
+
+#if GTFS_TRACE_LEVEL >= GTFS_TRACE_DETAIL
+#define GTFS_TRACE_EVENT(op, file_id, offset, length, result) \
+    gtfs_trace_record(op, file_id, offset, length, result, gtfs_trace_now(), 0)
+#else
+#define GTFS_TRACE_EVENT(op, file_id, offset, length, result) do { } while (0)
+#endif
+
+#endif
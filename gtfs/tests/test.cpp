@@ -1,4 +1,7 @@
 #include "../src/gtfs.hpp"
+#include "../src/gtfs_testing.hpp"
+#include <poll.h>
+#include <sys/eventfd.h>
 
 // Assumes files are located within the current directory
 string directory;
@@ -153,6 +156,1780 @@ void test_multiple_writes() {
     
 }
 
+// **Test 5**: Testing that concurrent syncs with group commit enabled are all persisted.
+
+void group_commit_writer(gtfs_t *gtfs, file_t *fl, int id, int *results) {
+    string str = "Thread " + to_string(id) + " data";
+    write_t *wrt = gtfs_write_file(gtfs, fl, id * 20, str.length(), str.c_str());
+    results[id] = gtfs_sync_write_file(wrt);
+}
+
+void test_group_commit() {
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    string filename = "test5.txt";
+    file_t *fl = gtfs_open_file(gtfs, filename, 200);
+    gtfs_enable_group_commit(gtfs, 1000, 4);
+
+    const int num_threads = 8;
+    int results[num_threads];
+    vector<thread> threads;
+    for (int i = 0; i < num_threads; i++) {
+        threads.push_back(thread(group_commit_writer, gtfs, fl, i, results));
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    gtfs_disable_group_commit(gtfs);
+    gtfs_close_file(gtfs, fl);
+
+    // Every record must have made it to the log and be recovered on reopen
+    bool ok = true;
+    fl = gtfs_open_file(gtfs, filename, 200);
+    for (int i = 0; i < num_threads; i++) {
+        string str = "Thread " + to_string(i) + " data";
+        char *data = gtfs_read_file(gtfs, fl, i * 20, str.length());
+        if (results[i] != (int)str.length() || data == NULL || str.compare(string(data)) != 0) {
+            ok = false;
+        }
+        free(data);
+    }
+
+    // Syncs racing with group commit being turned off and on neither hang nor fail
+    atomic<bool> stop(false);
+    atomic<int> failed(0);
+    vector<thread> syncers;
+    for (int i = 0; i < 4; i++) {
+        syncers.push_back(thread([&, i] {
+            string str = "Toggle " + to_string(i);
+            while (!stop) {
+                if (gtfs_sync_write_file(gtfs_write_file(gtfs, fl, i * 20, str.length(), str.c_str())) != (int64_t)str.length()) {
+                    failed++;
+                }
+            }
+        }));
+    }
+    for (int round = 0; round < 50; round++) {
+        gtfs_enable_group_commit(gtfs, 100, 4);
+        usleep(200);
+        gtfs_disable_group_commit(gtfs);
+    }
+    stop = true;
+    for (auto &t : syncers) {
+        t.join();
+    }
+    ok = ok && failed == 0;
+    ok ? cout << PASS : cout << FAIL;
+    gtfs_close_file(gtfs, fl);
+}
+
+// **Test 6**: Testing that recovery keeps committed records and drops a corrupt one.
+
+void test_corrupt_record() {
+    string filename = "test6.txt";
+    string first = "Committed record.";
+    string second = "Corrupted record.";
+
+    int pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(-1);
+    }
+    if (pid == 0) {
+        gtfs_t *gtfs = gtfs_init(directory, verbose);
+        file_t *fl = gtfs_open_file(gtfs, filename, 100);
+        gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, first.length(), first.c_str()));
+        gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 50, second.length(), second.c_str()));
+
+        // Flip a payload byte of the last record, then crash without closing
+        int log_fd = open(fl->log_path.c_str(), O_RDWR);
+        struct stat st;
+        fstat(log_fd, &st);
+        off_t pos = st.st_size - sizeof(commit_trailer_t) - second.length();
+        char c = 'X';
+        pwrite(log_fd, &c, 1, pos);
+        close(log_fd);
+
+        // Also undo the in-memory write so only recovery can bring it back
+        string zeros(second.length(), '\0');
+        memcpy(fl->data + 50, zeros.c_str(), second.length());
+        _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    file_t *fl = gtfs_open_file(gtfs, filename, 100);
+    char *data1 = gtfs_read_file(gtfs, fl, 0, first.length());
+    char *data2 = gtfs_read_file(gtfs, fl, 50, second.length());
+    if (data1 != NULL && data2 != NULL && first.compare(string(data1)) == 0 && string(data2).compare("") == 0) {
+        cout << PASS;
+    } else {
+        cout << FAIL;
+    }
+    free(data1);
+    free(data2);
+    gtfs_close_file(gtfs, fl);
+}
+
+// **Test 7**: Testing that recovery of overlapping records keeps the newest bytes.
+
+void test_recover_overlapping() {
+    string filename = "test7.txt";
+    char expected[100];
+    memset(expected, 0, sizeof(expected));
+
+    // Deterministic overlapping writes, mirrored into the expected contents
+    int pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(-1);
+    }
+    if (pid == 0) {
+        gtfs_t *gtfs = gtfs_init(directory, verbose);
+        file_t *fl = gtfs_open_file(gtfs, filename, 100);
+        for (int i = 0; i < 50; i++) {
+            string str(10 + (i * 7) % 30, 'a' + i % 26);
+            int offset = (i * 13) % (100 - str.length());
+            gtfs_sync_write_file(gtfs_write_file(gtfs, fl, offset, str.length(), str.c_str()));
+        }
+        // Crash without closing, the mapping is reset so only the log has the data
+        memset(fl->data, 0, 100);
+        _exit(0);
+    }
+    for (int i = 0; i < 50; i++) {
+        string str(10 + (i * 7) % 30, 'a' + i % 26);
+        int offset = (i * 13) % (100 - str.length());
+        memcpy(expected + offset, str.c_str(), str.length());
+    }
+    waitpid(pid, NULL, 0);
+
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    file_t *fl = gtfs_open_file(gtfs, filename, 100);
+    char data[100];
+    gtfs_read_file_into(gtfs, fl, 0, 100, data) == 100 && memcmp(data, expected, 100) == 0 ? cout << PASS : cout << FAIL;
+    gtfs_close_file(gtfs, fl);
+}
+
+// **Test 8**: Testing that the background checkpointer and gtfs_clean truncate logs.
+
+// Bytes of records in a file's log, not counting the log header
+off_t log_size(file_t *fl) {
+    struct stat st;
+    return stat(fl->log_path.c_str(), &st) == 0 ? st.st_size - LOG_HEADER_SIZE : -1;
+}
+
+void test_checkpointer() {
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    string filename = "test8.txt";
+    file_t *fl = gtfs_open_file(gtfs, filename, 100);
+    gtfs_enable_checkpointer(gtfs, 64, 0);
+
+    string str(80, 'c');
+    gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, str.length(), str.c_str()));
+
+    // The log crossed the size threshold, the checkpointer should truncate it
+    bool truncated = false;
+    for (int i = 0; i < 100 && !truncated; i++) {
+        truncated = log_size(fl) == 0;
+        usleep(10000);
+    }
+    gtfs_disable_checkpointer(gtfs);
+
+    // A synchronous clean keeps outstanding writes visible
+    string committed = "committed";
+    string pending = "pending";
+    gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 85, committed.length(), committed.c_str()));
+    write_t *wrt = gtfs_write_file(gtfs, fl, 85, pending.length(), pending.c_str());
+    bool cleaned = gtfs_clean(gtfs) == 0 && log_size(fl) == 0;
+    char *data = gtfs_read_file(gtfs, fl, 85, pending.length());
+    bool kept = data != NULL && pending.compare(string(data)) == 0;
+    free(data);
+    gtfs_abort_write_file(wrt);
+    data = gtfs_read_file(gtfs, fl, 85, committed.length());
+    bool restored = data != NULL && committed.compare(string(data)) == 0;
+    free(data);
+
+    truncated && cleaned && kept && restored ? cout << PASS : cout << FAIL;
+    gtfs_close_file(gtfs, fl);
+}
+
+// **Test 9**: Testing incremental cleaning and recovery from the persisted log head.
+
+void test_clean_n_bytes() {
+    string filename = "test9.txt";
+    string strs[] = { "aaaaaaaaaaaaaaaaaaaa", "bbbbbbbbbb", "cccccccccccccccccccccccccccccc", "dddd" };
+    int offsets[] = { 0, 5, 30, 10 };
+    char expected[100];
+    memset(expected, 0, sizeof(expected));
+    for (int i = 0; i < 4; i++) {
+        memcpy(expected + offsets[i], strs[i].c_str(), strs[i].length());
+    }
+
+    int pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(-1);
+    }
+    if (pid == 0) {
+        gtfs_t *gtfs = gtfs_init(directory, verbose);
+        file_t *fl = gtfs_open_file(gtfs, filename, 100);
+        for (int i = 0; i < 4; i++) {
+            gtfs_sync_write_file(gtfs_write_file(gtfs, fl, offsets[i], strs[i].length(), strs[i].c_str()));
+        }
+        // Clean in small slices, the file contents must never go back to older data
+        bool ok = true;
+        int64_t head = fl->log_meta.head;
+        for (int i = 0; i < 3; i++) {
+            int cleaned = gtfs_clean_n_bytes(gtfs, 15);
+            ok = ok && cleaned > 0 && cleaned <= 15 && memcmp(fl->data, expected, 100) == 0;
+            ok = ok && fl->log_meta.head >= head;
+            head = fl->log_meta.head;
+        }
+        ok = ok && head > LOG_HEADER_SIZE;
+        // Crash halfway through the log
+        _exit(ok ? 0 : 1);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    file_t *fl = gtfs_open_file(gtfs, filename, 100);
+    char data[100];
+    bool recovered = gtfs_read_file_into(gtfs, fl, 0, 100, data) == 100 && memcmp(data, expected, 100) == 0;
+    // Open adopted the rest of the log, a clean applies it
+    bool drained = gtfs_clean(gtfs) == 0 && gtfs_clean_n_bytes(gtfs, 1000) == 0 && memcmp(fl->data, expected, 100) == 0;
+    WIFEXITED(status) && WEXITSTATUS(status) == 0 && recovered && drained ? cout << PASS : cout << FAIL;
+    gtfs_close_file(gtfs, fl);
+}
+
+// **Test 10**: Testing zero-copy views and that close waits for them to be released.
+
+void test_read_view() {
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    string filename = "test10.txt";
+    file_t *fl = gtfs_open_file(gtfs, filename, 100);
+
+    string str = "Zero copy read.";
+    gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 10, str.length(), str.c_str()));
+
+    gtfs_view_t view;
+    char buf[32];
+    bool ok = gtfs_read_view(gtfs, fl, 10, str.length(), &view) == 0;
+    ok = ok && view.data == fl->data + 10 && string(view.data, view.length) == str;
+    ok = ok && gtfs_read_file_into(gtfs, fl, 10, str.length(), buf) == (int)str.length();
+    ok = ok && string(buf, str.length()) == str;
+
+    // Release the view a little later from another thread, close has to wait for it
+    atomic<bool> released(false);
+    thread reader([&]() {
+        usleep(50000);
+        ok = ok && string(view.data, view.length) == str; // Still mapped
+        released = true;
+        gtfs_release_view(&view);
+    });
+    gtfs_close_file(gtfs, fl);
+    ok = ok && released;
+    reader.join();
+
+    // No new views once the file is closed
+    ok = ok && gtfs_read_view(gtfs, fl, 10, str.length(), &view) == -1;
+    ok ? cout << PASS : cout << FAIL;
+}
+
+// **Test 11**: Testing transactions: a commit covers writes on several files,
+// recovery takes a part that never reached its file's log from the transaction
+// log, and a torn transaction applies nowhere.
+
+// Crashes after committing a transaction on two files, with the second file's part
+// cut off its log. corrupt also cuts the first part and tears the transaction record.
+void crash_after_txn(string file1, string file2, bool corrupt) {
+    string blank = "--------";
+    int pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(-1);
+    }
+    if (pid == 0) {
+        gtfs_t *gtfs = gtfs_init(directory, verbose);
+        file_t *fl1 = gtfs_open_file(gtfs, file1, 100);
+        file_t *fl2 = gtfs_open_file(gtfs, file2, 100);
+        gtfs_sync_write_file(gtfs_write_file(gtfs, fl1, 0, blank.length(), blank.c_str()));
+        gtfs_sync_write_file(gtfs_write_file(gtfs, fl2, 0, blank.length(), blank.c_str()));
+        struct stat st1, st2;
+        stat(fl1->log_path.c_str(), &st1);
+        stat(fl2->log_path.c_str(), &st2);
+
+        txn_t *txn = gtfs_begin_txn(gtfs);
+        gtfs_add_write_txn(txn, gtfs_write_file(gtfs, fl1, 0, 8, "txn_one!"));
+        gtfs_add_write_txn(txn, gtfs_write_file(gtfs, fl2, 0, 8, "txn_two!"));
+        gtfs_commit_txn(txn);
+
+        // As if the crash came before the part reached the second file's log
+        truncate(fl2->log_path.c_str(), st2.st_size);
+        if (corrupt) {
+            truncate(fl1->log_path.c_str(), st1.st_size);
+            struct stat txn_st;
+            fstat(gtfs->txn_fd, &txn_st);
+            char c = 'X';
+            pwrite(gtfs->txn_fd, &c, 1, txn_st.st_size - sizeof(commit_trailer_t) - 1);
+        }
+        // Only the logs may bring the data back
+        memcpy(fl1->data, blank.c_str(), blank.length());
+        memcpy(fl2->data, blank.c_str(), blank.length());
+        _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+}
+
+void test_transactions() {
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    file_t *fl1 = gtfs_open_file(gtfs, "test11a.txt", 100);
+    file_t *fl2 = gtfs_open_file(gtfs, "test11b.txt", 100);
+
+    txn_t *txn = gtfs_begin_txn(gtfs);
+    gtfs_add_write_txn(txn, gtfs_write_file(gtfs, fl1, 0, 5, "alpha"));
+    gtfs_add_write_txn(txn, gtfs_write_file(gtfs, fl1, 20, 4, "beta"));
+    gtfs_add_write_txn(txn, gtfs_write_file(gtfs, fl2, 0, 5, "gamma"));
+    int committed = gtfs_commit_txn(txn);
+
+    txn = gtfs_begin_txn(gtfs);
+    write_t *wrt = gtfs_write_file(gtfs, fl1, 0, 5, "zzzzz");
+    gtfs_add_write_txn(txn, wrt);
+    gtfs_add_write_txn(txn, gtfs_write_file(gtfs, fl2, 0, 5, "zzzzz"));
+    int synced_alone = gtfs_sync_write_file(wrt); // Must go through the transaction
+    gtfs_abort_txn(txn);
+
+    char *data1 = gtfs_read_file(gtfs, fl1, 0, 5);
+    char *data2 = gtfs_read_file(gtfs, fl1, 20, 4);
+    char *data3 = gtfs_read_file(gtfs, fl2, 0, 5);
+    bool ok = committed == 14 && synced_alone == -1 && string(data1) == "alpha" && string(data2) == "beta" && string(data3) == "gamma";
+    free(data1);
+    free(data2);
+    free(data3);
+    gtfs_close_file(gtfs, fl1);
+    gtfs_close_file(gtfs, fl2);
+
+    crash_after_txn("test11c.txt", "test11d.txt", false);
+    crash_after_txn("test11e.txt", "test11f.txt", true);
+
+    gtfs = gtfs_init(directory, verbose);
+    const char *names[4] = { "test11c.txt", "test11d.txt", "test11e.txt", "test11f.txt" };
+    const char *expected[4] = { "txn_one!", "txn_two!", "--------", "--------" };
+    for (int i = 0; i < 4; i++) {
+        file_t *fl = gtfs_open_file(gtfs, names[i], 100);
+        char *data = gtfs_read_file(gtfs, fl, 0, 8);
+        ok = ok && data != NULL && string(data) == expected[i];
+        free(data);
+        gtfs_close_file(gtfs, fl);
+    }
+
+    if (ok) {
+        cout << PASS;
+    } else {
+        cout << FAIL;
+    }
+}
+
+// **Test 12**: Testing the directory WAL: writes to several files share one segmented
+// log, segments are reused once applied, and a crash is recovered from the segments.
+
+// Helper to count the segment files of the directory WAL
+int count_wal_segments() {
+    int count = 0;
+    DIR *dir = opendir((directory + "/.logs/.wal").c_str());
+    struct dirent *entry;
+    while (dir && (entry = readdir(dir)) != NULL) {
+        count += strncmp(entry->d_name, "segment.", 8) == 0;
+    }
+    if (dir) {
+        closedir(dir);
+    }
+    return count;
+}
+
+void test_wal() {
+    const char *names[3] = { "test12a.txt", "test12b.txt", "test12c.txt" };
+    char expected[3][1000];
+    memset(expected, 0, sizeof(expected));
+    for (int i = 0; i < 100; i++) {
+        string str(20 + i % 40, 'a' + i % 26);
+        int offset = (i * 37) % (1000 - str.length());
+        memcpy(expected[i % 3] + offset, str.c_str(), str.length());
+    }
+    memcpy(expected[0], "txn_one!", 8);
+    memcpy(expected[1], "txn_two!", 8);
+
+    int pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(-1);
+    }
+    if (pid == 0) {
+        gtfs_t *gtfs = gtfs_init(directory, verbose);
+        bool ok = gtfs_enable_wal(gtfs, 64 * 1024, 2) == 0;
+
+        file_t *fl[3];
+        for (int i = 0; i < 3; i++) {
+            fl[i] = gtfs_open_file(gtfs, names[i], 1000);
+            memset(fl[i]->data, 0, 1000);
+            gtfs_sync_write_file(gtfs_write_file(gtfs, fl[i], 0, 1000, fl[i]->data));
+        }
+        // Enough traffic to go through several segments, cleaning lets them be reused
+        for (int round = 0; round < 20; round++) {
+            for (int i = 0; i < 100; i++) {
+                string str(20 + i % 40, 'a' + i % 26);
+                int offset = (i * 37) % (1000 - str.length());
+                gtfs_sync_write_file(gtfs_write_file(gtfs, fl[i % 3], offset, str.length(), str.c_str()));
+            }
+            gtfs_clean_n_bytes(gtfs, 4000);
+            if (round % 5 == 4) {
+                gtfs_clean(gtfs);
+            }
+        }
+        txn_t *txn = gtfs_begin_txn(gtfs);
+        gtfs_add_write_txn(txn, gtfs_write_file(gtfs, fl[0], 0, 8, "txn_one!"));
+        gtfs_add_write_txn(txn, gtfs_write_file(gtfs, fl[1], 0, 8, "txn_two!"));
+        ok = ok && gtfs_commit_txn(txn) == 16;
+
+        // Written and closed: the WAL still has the records, but must not replay them
+        // over what happens to the file afterwards
+        file_t *closed = gtfs_open_file(gtfs, "test12d.txt", 100);
+        gtfs_sync_write_file(gtfs_write_file(gtfs, closed, 0, 6, "stale!"));
+        gtfs_close_file(gtfs, closed);
+        int fd = open((directory + "/test12d.txt").c_str(), O_RDWR);
+        pwrite(fd, "fresh!", 6, 0);
+        close(fd);
+
+        struct stat st;
+        ok = ok && count_wal_segments() <= 3 && stat(fl[0]->log_path.c_str(), &st) != 0;
+        // Crash without closing, only the WAL has the data
+        for (int i = 0; i < 3; i++) {
+            memset(fl[i]->data, 0, 1000);
+        }
+        _exit(ok ? 0 : 1);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0 && count_wal_segments() == 0;
+    for (int i = 0; i < 3; i++) {
+        file_t *fl = gtfs_open_file(gtfs, names[i], 1000);
+        char buf[1000];
+        ok = ok && gtfs_read_file_into(gtfs, fl, 0, 1000, buf) == 1000 && memcmp(buf, expected[i], 1000) == 0;
+        gtfs_close_file(gtfs, fl);
+    }
+    file_t *fl = gtfs_open_file(gtfs, "test12d.txt", 100);
+    char *data = gtfs_read_file(gtfs, fl, 0, 6);
+    ok = ok && string(data) == "fresh!";
+    free(data);
+    gtfs_close_file(gtfs, fl);
+
+    if (ok) {
+        cout << PASS;
+    } else {
+        cout << FAIL;
+    }
+}
+
+// **Test 13**: Testing the shared registry: another process sees which files are open
+// and how much log they have, and recovery after a crash goes through the registry. The
+// registry is only a hint: a log it takes for empty is still recovered, and a registry
+// from another boot is started over.
+
+// Helper to find the registry entry of a file
+gtfs_registry_entry_t* find_registry_entry(gtfs_t *gtfs, string filename) {
+    for (int slot = 0; gtfs->registry && slot < GTFS_REGISTRY_SLOTS; slot++) {
+        gtfs_registry_entry_t *entry = &gtfs->registry->entries[slot];
+        if (entry->used && filename == entry->filename) {
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+void test_registry() {
+    string str = "Registered";
+    int ready[2], done[2];
+    if (pipe(ready) != 0 || pipe(done) != 0) {
+        perror("pipe");
+        exit(-1);
+    }
+    int pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(-1);
+    }
+    if (pid == 0) {
+        gtfs_t *gtfs = gtfs_init(directory, verbose);
+        file_t *fl = gtfs_open_file(gtfs, "test13.txt", 100);
+        gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, str.length(), str.c_str()));
+        char c = 0;
+        write(ready[1], &c, 1);
+        read(done[0], &c, 1);
+        // Crash with the write only in the log
+        memset(fl->data, 0, str.length());
+        _exit(0);
+    }
+    char c = 0;
+    read(ready[0], &c, 1);
+
+    // The file is in use by the child, with its write still in the log
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    gtfs_registry_entry_t *entry = find_registry_entry(gtfs, "test13.txt");
+    bool ok = entry != NULL && entry->open == 1 && entry->owner == pid &&
+              entry->file_length == 100 && entry->log_tail > entry->log_head && entry->next_seq == 2;
+    write(done[1], &c, 1);
+    waitpid(pid, NULL, 0);
+
+    // Found through the registry and left for the next open, no longer owned
+    gtfs = gtfs_init(directory, verbose);
+    entry = find_registry_entry(gtfs, "test13.txt");
+    ok = ok && entry != NULL && entry->open == 1 && entry->owner == 0;
+    file_t *fl = gtfs_open_file(gtfs, "test13.txt", 100);
+    char *data = gtfs_read_file(gtfs, fl, 0, str.length());
+    ok = ok && data != NULL && string(data) == str && entry->open == 1 && entry->owner == getpid();
+    free(data);
+    gtfs_close_file(gtfs, fl);
+    ok = ok && entry->open == 0;
+    for (int i = 0; i < 2; i++) {
+        close(ready[i]);
+        close(done[i]);
+    }
+
+    // An entry that did not reach the disk before a power loss may still say closed while the
+    // log holds committed records, open recovers them anyway
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(-1);
+    }
+    if (pid == 0) {
+        gtfs_t *gtfs = gtfs_init(directory, verbose);
+        file_t *fl = gtfs_open_file(gtfs, "test13.txt", 100);
+        gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 20, str.length(), str.c_str()));
+        memset(fl->data + 20, 0, str.length());
+        _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+    entry->open = 0;
+    entry->owner = 0;
+    gtfs = gtfs_init(directory, verbose);
+    fl = gtfs_open_file(gtfs, "test13.txt", 100);
+    data = gtfs_read_file(gtfs, fl, 20, str.length());
+    ok = ok && data != NULL && string(data) == str;
+    free(data);
+    gtfs_close_file(gtfs, fl);
+
+    // A registry left by another boot is started over
+    memset(gtfs->registry->boot_id, 'x', GTFS_BOOT_ID_LEN);
+    gtfs = gtfs_init(directory, verbose);
+    ok = ok && gtfs->registry != NULL && gtfs->registry->boot_id[0] != 'x' && find_registry_entry(gtfs, "test13.txt") == NULL;
+
+    if (ok) {
+        cout << PASS;
+    } else {
+        cout << FAIL;
+    }
+}
+
+// **Test 14**: Testing read opens and byte-range locks: a reader opens a file while its
+// writer has it open, reads committed bytes next to a pending write without waiting, and
+// waits for the pending write only when it reads its bytes.
+void test_range_locks() {
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    file_t *fl = gtfs_open_file(gtfs, "test14.txt", 100);
+    gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, 10, "committed!"));
+    write_t *pending = gtfs_write_file(gtfs, fl, 50, 8, "pending!");
+
+    int results[2];
+    if (pipe(results) != 0) {
+        perror("pipe");
+        exit(-1);
+    }
+    int pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(-1);
+    }
+    if (pid == 0) {
+        gtfs_t *gtfs = gtfs_init(directory, verbose);
+        file_t *fl = gtfs_open_file_mode(gtfs, "test14.txt", 100, GTFS_OPEN_READ);
+        char buf[18] = { 0 };
+        bool ok = fl != NULL && gtfs_write_file(gtfs, fl, 0, 1, "x") == NULL &&
+                  gtfs_read_file_into(gtfs, fl, 0, 10, buf) == 10;
+        write(results[1], buf, 10);
+        ok = ok && gtfs_read_file_into(gtfs, fl, 50, 8, buf + 10) == 8; // Waits for the sync
+        write(results[1], buf + 10, 8);
+        gtfs_close_file(gtfs, fl);
+        _exit(ok ? 0 : 1);
+    }
+
+    char buf[18] = { 0 };
+    bool ok = read(results[0], buf, 10) == 10 && memcmp(buf, "committed!", 10) == 0;
+    // The second read must still be waiting
+    struct pollfd pfd = { results[0], POLLIN, 0 };
+    ok = ok && poll(&pfd, 1, 200) == 0;
+    ok = ok && gtfs_sync_write_file(pending) == 8;
+    ok = ok && read(results[0], buf + 10, 8) == 8 && memcmp(buf + 10, "pending!", 8) == 0;
+    int status;
+    waitpid(pid, &status, 0);
+    ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    gtfs_close_file(gtfs, fl);
+    close(results[0]);
+    close(results[1]);
+
+    // A read open needs the file to exist
+    ok = ok && gtfs_open_file_mode(gtfs, "test14_missing.txt", 100, GTFS_OPEN_READ) == NULL;
+
+    if (ok) {
+        cout << PASS;
+    } else {
+        cout << FAIL;
+    }
+}
+
+// **Test 15**: Stress test of threads writing and syncing their own parts of one file:
+// every sync must reach the log in a recoverable order, also while the checkpointer runs.
+// Prints the syncs per second for growing thread counts, on one file and on a file per
+// thread, and checks that threads on their own files scale past one thread.
+
+#define STRESS_REGION 512
+#define STRESS_SYNCS 2000
+
+// Each thread keeps rewriting its region, the last write of a round fills all of it
+void stress_writer(gtfs_t *gtfs, file_t *fl, int id, int *failures) {
+    char buf[STRESS_REGION];
+    for (int i = 0; i < STRESS_SYNCS; i++) {
+        int length = (i == STRESS_SYNCS - 1) ? STRESS_REGION : 16 + (i * 7) % (STRESS_REGION - 16);
+        memset(buf, 'a' + (id + i) % 26, length);
+        write_t *wrt = gtfs_write_file(gtfs, fl, id * STRESS_REGION, length, buf);
+        if (wrt == NULL || gtfs_sync_write_file(wrt) != length) {
+            (*failures)++;
+        }
+    }
+}
+
+bool stress_region_ok(const char *data, int id) {
+    for (int k = 0; k < STRESS_REGION; k++) {
+        if (data[k] != 'a' + (id + STRESS_SYNCS - 1) % 26) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Thread i writes to files[i % files.size()]
+double run_stress(gtfs_t *gtfs, const vector<file_t*>& files, int num_threads, int *failures) {
+    vector<thread> threads;
+    auto start = chrono::steady_clock::now();
+    for (int i = 0; i < num_threads; i++) {
+        threads.push_back(thread(stress_writer, gtfs, files[i % files.size()], i, &failures[i]));
+    }
+    for (auto &t : threads) {
+        t.join();
+    }
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    return num_threads * STRESS_SYNCS / elapsed.count();
+}
+
+void test_stress() {
+    const int max_threads = 8;
+    string filename = "test15.txt";
+    int failures[max_threads] = { 0 };
+
+    // Crash after the threads are done: only the log has their data
+    int pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(-1);
+    }
+    if (pid == 0) {
+        gtfs_t *gtfs = gtfs_init(directory, verbose);
+        file_t *fl = gtfs_open_file(gtfs, filename, max_threads * STRESS_REGION);
+        run_stress(gtfs, { fl }, max_threads, failures);
+        memset(fl->data, 0, max_threads * STRESS_REGION);
+        int failed = 0;
+        for (int i = 0; i < max_threads; i++) {
+            failed += failures[i];
+        }
+        _exit(failed == 0 ? 0 : 1);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    file_t *fl = gtfs_open_file(gtfs, filename, max_threads * STRESS_REGION);
+    char region[STRESS_REGION];
+    for (int i = 0; i < max_threads; i++) {
+        ok = ok && gtfs_read_file_into(gtfs, fl, i * STRESS_REGION, STRESS_REGION, region) == STRESS_REGION && stress_region_ok(region, i);
+    }
+
+    // Same again with the checkpointer applying the log underneath the threads
+    gtfs_enable_checkpointer(gtfs, 64 * 1024, 0);
+    run_stress(gtfs, { fl }, max_threads, failures);
+    gtfs_disable_checkpointer(gtfs);
+    for (int i = 0; i < max_threads; i++) {
+        ok = ok && failures[i] == 0 && stress_region_ok(fl->data + i * STRESS_REGION, i);
+    }
+
+    // Throughput without the checkpointer, whose cleans would be timed along. Threads on
+    // their own files share no file lock, with more than one core they must get more done
+    // than one thread alone.
+    vector<file_t*> own_files;
+    for (int i = 0; i < max_threads; i++) {
+        own_files.push_back(gtfs_open_file(gtfs, "test15_" + to_string(i) + ".txt", max_threads * STRESS_REGION));
+        ok = ok && own_files.back() != NULL;
+    }
+    double single = 0, best_multi = 0;
+    for (int num_threads = 1; ok && num_threads <= max_threads; num_threads *= 2) {
+        gtfs_clean(gtfs);
+        double shared_rate = run_stress(gtfs, { fl }, num_threads, failures);
+        gtfs_clean(gtfs);
+        double own_rate = run_stress(gtfs, own_files, num_threads, failures);
+        cout << num_threads << " threads: " << (long)shared_rate << " syncs/s on one file, " << (long)own_rate << " syncs/s on their own files\n";
+        if (num_threads == 1) {
+            single = own_rate;
+        } else {
+            best_multi = max(best_multi, own_rate);
+        }
+    }
+    ok = ok && (thread::hardware_concurrency() <= 1 || best_multi >= single);
+    for (int i = 0; i < max_threads; i++) {
+        ok = ok && failures[i] == 0 && stress_region_ok(own_files[i]->data + i * STRESS_REGION, i);
+        gtfs_close_file(gtfs, own_files[i]);
+    }
+    gtfs_close_file(gtfs, fl);
+
+    if (ok) {
+        cout << PASS;
+    } else {
+        cout << FAIL;
+    }
+}
+
+// **Test 16**: Testing that write handles are released: a released block is reused by
+// the next write of the same size class, outstanding writes cannot be released, and
+// writes larger than any class still work. A clean gives the chunks of the pool back
+// once all their blocks are free, and no part of a chunk is left unused.
+void test_release_write() {
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    file_t *fl = gtfs_open_file(gtfs, "test16.txt", 200000);
+
+    write_t *wrt = gtfs_write_file(gtfs, fl, 0, 100, string(100, 'a').c_str());
+    bool ok = gtfs_release_write(wrt) == -1; // Still outstanding
+    ok = ok && gtfs_sync_write_file(wrt) == 100 && gtfs_release_write(wrt) == 0;
+
+    // Steady state: sync, abort and release over and over without the pool growing
+    write_t *first = NULL;
+    for (int i = 0; i < 1000; i++) {
+        wrt = gtfs_write_file(gtfs, fl, i % 100, 50, string(50, 'b' + i % 20).c_str());
+        first = first ? first : wrt;
+        ok = ok && wrt == first;
+        ok = ok && (i % 2 ? gtfs_abort_write_file(wrt) == 0 : gtfs_sync_write_file(wrt) == 50);
+        gtfs_release_write(wrt);
+    }
+
+    // Bigger than the largest block
+    string big(150000, 'z');
+    wrt = gtfs_write_file(gtfs, fl, 1000, big.length(), big.c_str());
+    ok = ok && gtfs_sync_write_file(wrt) == (int)big.length() && gtfs_release_write(wrt) == 0;
+    char *data = gtfs_read_file(gtfs, fl, 1000, big.length());
+    ok = ok && data != NULL && big == data;
+    free(data);
+
+    // A clean gives the chunks back once every block is free, not while a write is outstanding
+    wrt = gtfs_write_file(gtfs, fl, 0, 10, "0123456789");
+    ok = ok && gtfs_clean(gtfs) == 0 && !gtfs->write_pool.chunks.empty();
+    ok = ok && gtfs_sync_write_file(wrt) == 10 && gtfs_release_write(wrt) == 0;
+    ok = ok && gtfs_clean(gtfs) == 0 && gtfs->write_pool.chunks.empty();
+
+    // A block released on another thread goes back to the pool when that thread ends
+    wrt = gtfs_write_file(gtfs, fl, 0, 10, "0123456789");
+    ok = ok && gtfs_sync_write_file(wrt) == 10;
+    thread([wrt]() { gtfs_release_write(wrt); }).join();
+    ok = ok && gtfs_clean(gtfs) == 0 && gtfs->write_pool.chunks.empty();
+
+    // What is left of a chunk when a block does not fit goes to the smaller classes
+    vector<write_t*> writes;
+    writes.push_back(gtfs_write_file(gtfs, fl, 0, 1, "x"));
+    string large(20000, 'l'), medium(10000, 'm'); // 64 KiB and 32 KiB blocks
+    for (int i = 0; i < 4; i++) {
+        writes.push_back(gtfs_write_file(gtfs, fl, 0, large.length(), large.c_str()));
+    }
+    writes.push_back(gtfs_write_file(gtfs, fl, 0, medium.length(), medium.c_str()));
+    ok = ok && gtfs->write_pool.chunks.size() == 2;
+    char *first_chunk = gtfs->write_pool.chunks[0];
+    ok = ok && (char*)writes.back() >= first_chunk && (char*)writes.back() < first_chunk + GTFS_POOL_CHUNK_SIZE;
+    for (auto it = writes.rbegin(); it != writes.rend(); it++) {
+        ok = ok && *it && gtfs_abort_write_file(*it) == 0 && gtfs_release_write(*it) == 0;
+    }
+    ok = ok && gtfs_clean(gtfs) == 0 && gtfs->write_pool.chunks.empty();
+    gtfs_close_file(gtfs, fl);
+
+    if (ok) {
+        cout << PASS;
+    } else {
+        cout << FAIL;
+    }
+}
+
+// **Test 17**: Testing the statistics: counters and histograms of a file and of its
+// directory follow writes, syncs, aborts, transactions and cleans, and another process
+// reads them from the registry without gtfs_init, also after a crash left a log behind.
+void test_stats() {
+    string filename = "test17.txt";
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    file_t *fl = gtfs_open_file(gtfs, filename, 1000);
+    gtfs_stats_t before, after, dir_before, dir_after;
+    bool ok = gtfs_get_file_stats(fl, &before) == 0 && gtfs_get_stats(gtfs, &dir_before) == 0;
+
+    write_t *wrt = gtfs_write_file(gtfs, fl, 0, 100, string(100, 'a').c_str());
+    ok = ok && gtfs_sync_write_file(wrt) == 100;
+    wrt = gtfs_write_file(gtfs, fl, 100, 50, string(50, 'b').c_str());
+    ok = ok && gtfs_abort_write_file(wrt) == 0;
+    txn_t *txn = gtfs_begin_txn(gtfs);
+    gtfs_add_write_txn(txn, gtfs_write_file(gtfs, fl, 200, 50, string(50, 'c').c_str()));
+    gtfs_add_write_txn(txn, gtfs_write_file(gtfs, fl, 300, 50, string(50, 'd').c_str()));
+    ok = ok && gtfs_commit_txn(txn) == 100;
+
+    ok = ok && gtfs_get_file_stats(fl, &after) == 0;
+    ok = ok && after.bytes_written - before.bytes_written == 250;
+    ok = ok && after.commits - before.commits == 2 && after.aborts - before.aborts == 1;
+    ok = ok && after.bytes_logged - before.bytes_logged > 200;
+    ok = ok && after.sync_latency.count - before.sync_latency.count == 2;
+    ok = ok && after.log_bytes == (int64_t)(after.bytes_logged - before.bytes_logged);
+
+    // Cleaning applies the log
+    ok = ok && gtfs_clean(gtfs) == 0;
+    before = after;
+    ok = ok && gtfs_get_file_stats(fl, &after) == 0 && gtfs_get_stats(gtfs, &dir_after) == 0;
+    ok = ok && after.log_bytes == 0 && after.checkpoint_bytes - before.checkpoint_bytes == (uint64_t)before.log_bytes;
+    ok = ok && after.flushes > before.flushes;
+    ok = ok && dir_after.commits - dir_before.commits >= 2 && dir_after.clean_latency.count > dir_before.clean_latency.count;
+    gtfs_close_file(gtfs, fl);
+
+    // Threads syncing their own files count in their own shards, a snapshot adds them all up
+    ok = ok && gtfs_get_stats(gtfs, &dir_before) == 0;
+    vector<thread> threads;
+    for (int t = 0; t < 4; t++) {
+        threads.emplace_back([gtfs, t]() {
+            file_t *fl = gtfs_open_file(gtfs, "test17_" + to_string(t) + ".txt", 1000);
+            for (int i = 0; i < 20; i++) {
+                gtfs_sync_write_file(gtfs_write_file(gtfs, fl, i * 10, 10, "0123456789"));
+            }
+            gtfs_close_file(gtfs, fl);
+        });
+    }
+    for (thread &t : threads) {
+        t.join();
+    }
+    ok = ok && gtfs_get_stats(gtfs, &dir_after) == 0 && dir_after.commits - dir_before.commits == 80;
+    ok = ok && dir_after.sync_latency.count - dir_before.sync_latency.count == 80 && dir_after.sync_latency.max_ns > 0;
+    ok = ok && gtfs_read_stats(directory, "", &dir_before) == 0 && dir_before.commits == dir_after.commits;
+
+    // A crash leaves three records in the log, another process sees them
+    int pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(-1);
+    }
+    if (pid == 0) {
+        gtfs_t *gtfs = gtfs_init(directory, verbose);
+        file_t *fl = gtfs_open_file(gtfs, filename, 1000);
+        for (int i = 0; i < 3; i++) {
+            gtfs_sync_write_file(gtfs_write_file(gtfs, fl, i * 10, 10, "0123456789"));
+        }
+        _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+    before = after;
+    ok = ok && gtfs_read_stats(directory, filename, &after) == 0;
+    ok = ok && after.commits - before.commits == 3 && after.log_bytes > 0;
+    ok = ok && gtfs_read_stats(directory, "test17_missing.txt", &after) == -1;
+
+    // The next open adopts them and a clean applies them
+    before = after;
+    gtfs = gtfs_init(directory, verbose);
+    fl = gtfs_open_file(gtfs, filename, 1000);
+    ok = ok && fl && gtfs_read_stats(directory, filename, &after) == 0;
+    ok = ok && after.recovery_records - before.recovery_records == 3 && after.log_bytes > 0;
+    ok = ok && after.recovery_latency.count - before.recovery_latency.count == 1;
+    ok = ok && gtfs_clean(gtfs) == 0 && gtfs_read_stats(directory, filename, &after) == 0 && after.log_bytes == 0;
+    gtfs_close_file(gtfs, fl);
+    uint64_t bucketed = 0;
+    for (int i = 0; i < GTFS_STATS_BUCKETS; i++) {
+        bucketed += after.sync_latency.buckets[i];
+    }
+    ok = ok && bucketed == after.sync_latency.count && after.sync_latency.max_ns > 0;
+
+    if (ok) {
+        cout << PASS;
+    } else {
+        cout << FAIL;
+    }
+}
+
+// **Test 18**: Testing the binary trace: writes, syncs and aborts show up in a dump with
+// their offsets, lengths and results, and no payload byte goes into it.
+void test_trace() {
+    string filename = "test18.txt";
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    file_t *fl = gtfs_open_file(gtfs, filename, 100);
+    write_t *wrt = gtfs_write_file(gtfs, fl, 10, 7, "secret!");
+    bool ok = gtfs_sync_write_file(wrt) == 7;
+    wrt = gtfs_write_file(gtfs, fl, 30, 7, "secret!");
+    ok = ok && gtfs_abort_write_file(wrt) == 0;
+    ok = ok && gtfs_sync_write_file(wrt) == -1;
+    gtfs_close_file(gtfs, fl);
+
+    string dump = directory + "/test18.trace";
+    ok = ok && gtfs_trace_dump(dump) == 0;
+    FILE *f = fopen(dump.c_str(), "rb");
+    vector<char> bytes;
+    char buf[4096];
+    size_t n;
+    while (f && (n = fread(buf, 1, sizeof(buf), f)) > 0) {
+        bytes.insert(bytes.end(), buf, buf + n);
+    }
+    if (f) {
+        fclose(f);
+    }
+    ok = ok && search(bytes.begin(), bytes.end(), "secret!", "secret!" + 7) == bytes.end();
+
+#if GTFS_TRACE_LEVEL >= GTFS_TRACE_API
+    // Walk the dump: header, names, then rings
+    gtfs_trace_header_t header;
+    ok = ok && bytes.size() >= sizeof(header);
+    if (ok) {
+        memcpy(&header, bytes.data(), sizeof(header));
+        ok = header.magic == GTFS_TRACE_MAGIC && header.record_size == sizeof(gtfs_trace_record_t);
+    }
+    size_t pos = sizeof(header);
+    uint32_t file_id = 0;
+    for (uint32_t i = 0; ok && i < header.names; i++) {
+        gtfs_trace_name_t name;
+        memcpy(&name, bytes.data() + pos, sizeof(name));
+        if (string(bytes.data() + pos + sizeof(name), name.length) == filename) {
+            file_id = name.file_id;
+        }
+        pos += sizeof(name) + name.length;
+    }
+    int writes = 0, syncs = 0, aborts = 0;
+    for (uint32_t r = 0; ok && r < header.rings; r++) {
+        gtfs_trace_ring_header_t ring;
+        memcpy(&ring, bytes.data() + pos, sizeof(ring));
+        pos += sizeof(ring);
+        for (uint32_t i = 0; i < ring.count; i++, pos += sizeof(gtfs_trace_record_t)) {
+            gtfs_trace_record_t record;
+            memcpy(&record, bytes.data() + pos, sizeof(record));
+            if (record.file_id != file_id || file_id == 0) {
+                continue;
+            }
+            writes += record.op == GTFS_OP_WRITE && record.length == 7 && record.result == 1;
+            syncs += record.op == GTFS_OP_SYNC && record.offset == 10 && record.result == 7;
+            syncs += record.op == GTFS_OP_SYNC && record.offset == 30 && record.result == -1;
+            aborts += record.op == GTFS_OP_ABORT && record.offset == 30 && record.result == 0;
+        }
+    }
+    ok = ok && pos == bytes.size() && writes == 2 && syncs == 2 && aborts == 1;
+#endif
+
+    if (ok) {
+        cout << PASS;
+    } else {
+        cout << FAIL;
+    }
+}
+
+// **Test 19**: Testing asynchronous syncs: one thread keeps syncs of several files in flight
+// at once, each completes through gtfs_async_wait, gtfs_async_poll, an eventfd and its
+// callback. A crash right after the completions loses none of them. With group commit the
+// syncs run on the thread pool instead.
+atomic<int> async_callbacks(0);
+
+void count_async(write_t *write_id, int64_t ret, void *arg) {
+    if (arg == write_id && ret == write_id->length) {
+        async_callbacks++;
+    }
+}
+
+void test_async_sync() {
+    const int files = 4, per_file = 32, total = files * per_file;
+    int pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(-1);
+    }
+    if (pid == 0) {
+        gtfs_t *gtfs = gtfs_init(directory, verbose);
+        int efd = eventfd(0, 0);
+        bool ok = efd >= 0;
+        vector<file_t*> fls;
+        for (int f = 0; f < files; f++) {
+            fls.push_back(gtfs_open_file(gtfs, "test19_" + to_string(f) + ".txt", per_file * 10));
+            ok = ok && fls.back() != NULL;
+        }
+        vector<gtfs_async_t> asyncs(total);
+        for (int i = 0; ok && i < per_file; i++) {
+            for (int f = 0; f < files; f++) {
+                string str = "a" + to_string(f) + "-" + to_string(100 + i) + "!!!!";
+                write_t *wrt = gtfs_write_file(gtfs, fls[f], i * 10, str.length(), str.c_str());
+                gtfs_async_t& async = asyncs[i * files + f];
+                async.callback = count_async;
+                async.arg = wrt;
+                async.eventfd = efd;
+                ok = ok && gtfs_sync_write_file_async(wrt, &async) == 0;
+            }
+        }
+        for (int k = 0; ok && k < total; k++) {
+            ok = gtfs_async_wait(&asyncs[k]) == 10 && gtfs_async_poll(&asyncs[k]) == 1;
+        }
+        uint64_t completions = 0;
+        ok = ok && read(efd, &completions, sizeof(completions)) == sizeof(completions) && completions == total;
+        for (int spins = 0; async_callbacks.load() < total && spins < 1000; spins++) {
+            usleep(1000);
+        }
+        _exit(ok && async_callbacks.load() == total ? 0 : 1);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    for (int f = 0; ok && f < files; f++) {
+        file_t *fl = gtfs_open_file(gtfs, "test19_" + to_string(f) + ".txt", per_file * 10);
+        for (int i = 0; ok && i < per_file; i++) {
+            char buf[10];
+            ok = gtfs_read_file_into(gtfs, fl, i * 10, 10, buf) == 10 &&
+                 string(buf, 10) == "a" + to_string(f) + "-" + to_string(100 + i) + "!!!!";
+        }
+        gtfs_close_file(gtfs, fl);
+    }
+
+    // Group commit: the syncs go through the flusher on pool threads, an abort fails at once
+    ok = ok && gtfs_enable_group_commit(gtfs, 100, 16) == 0;
+    file_t *fl = gtfs_open_file(gtfs, "test19_0.txt", per_file * 10);
+    vector<gtfs_async_t> asyncs(8);
+    for (int i = 0; ok && i < 8; i++) {
+        asyncs[i].callback = NULL;
+        asyncs[i].eventfd = -1;
+        ok = gtfs_sync_write_file_async(gtfs_write_file(gtfs, fl, i * 10, 10, "group-sync"), &asyncs[i]) == 0;
+    }
+    write_t *wrt = gtfs_write_file(gtfs, fl, 100, 10, "aborted!!!");
+    gtfs_abort_write_file(wrt);
+    gtfs_async_t aborted;
+    aborted.callback = NULL;
+    aborted.eventfd = -1;
+    ok = ok && gtfs_sync_write_file_async(wrt, &aborted) == -1 && gtfs_async_poll(&aborted) == 1 && gtfs_async_wait(&aborted) == -1;
+    for (int i = 0; ok && i < 8; i++) {
+        ok = gtfs_async_wait(&asyncs[i]) == 10;
+    }
+    gtfs_close_file(gtfs, fl);
+    gtfs_disable_group_commit(gtfs);
+    fl = gtfs_open_file(gtfs, "test19_0.txt", per_file * 10);
+    char buf[10];
+    ok = ok && gtfs_read_file_into(gtfs, fl, 70, 10, buf) == 10 && string(buf, 10) == "group-sync";
+
+    // A submission the kernel refuses fails the sync instead of leaving it hanging, the write
+    // stays outstanding and a later sync commits it
+    gtfs_async_submit_fault = EINVAL;
+    gtfs_async_t refused;
+    refused.callback = NULL;
+    refused.eventfd = -1;
+    wrt = gtfs_write_file(gtfs, fl, 0, 10, "refused!!!");
+    ok = ok && gtfs_sync_write_file_async(wrt, &refused) == 0 && gtfs_async_wait(&refused) == -1;
+    gtfs_async_submit_fault = 0;
+    ok = ok && gtfs_sync_write_file_async(wrt, &refused) == 0 && gtfs_async_wait(&refused) == 10;
+    gtfs_close_file(gtfs, fl);
+    fl = gtfs_open_file(gtfs, "test19_0.txt", per_file * 10);
+    ok = ok && gtfs_read_file_into(gtfs, fl, 0, 10, buf) == 10 && string(buf, 10) == "refused!!!";
+    gtfs_close_file(gtfs, fl);
+
+    if (ok) {
+        cout << PASS;
+    } else {
+        cout << FAIL;
+    }
+}
+
+// **Test 20**: Testing large files: a sparse file past 4 GiB takes a write beyond the
+// 32-bit range that survives a crash, and offsets that would overflow are refused. A file
+// grows while open and keeps its data, huge page mappings start on a huge page boundary
+// and access hints are accepted for valid ranges only.
+void test_large_files() {
+    const int64_t big = 5LL << 30, far = (4LL << 30) + 12345;
+    string filename = "test20.txt";
+    int pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(-1);
+    }
+    if (pid == 0) {
+        gtfs_t *gtfs = gtfs_init(directory, verbose);
+        file_t *fl = gtfs_open_file(gtfs, filename, big);
+        write_t *wrt = gtfs_write_file(gtfs, fl, far, 9, "beyond4G!");
+        _exit(fl && gtfs_sync_write_file(wrt) == 9 ? 0 : 1);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    file_t *fl = gtfs_open_file(gtfs, filename, big);
+    char buf[10];
+    ok = ok && fl && gtfs_read_file_into(gtfs, fl, far, 9, buf) == 9 && string(buf, 9) == "beyond4G!";
+    ok = ok && gtfs_write_file(gtfs, fl, INT64_MAX - 2, 9, "overflow!") == NULL;
+    ok = ok && gtfs_write_file(gtfs, fl, big - 5, 9, "overflow!") == NULL;
+    ok = ok && gtfs_read_file(gtfs, fl, -1, 9) == NULL;
+    ok = ok && gtfs_prefetch(gtfs, fl, far, 9, GTFS_ACCESS_WILLNEED) == 0;
+    ok = ok && gtfs_prefetch(gtfs, fl, 0, big, GTFS_ACCESS_RANDOM) == 0;
+    ok = ok && gtfs_prefetch(gtfs, fl, big - 5, 9, GTFS_ACCESS_SEQUENTIAL) == -1;
+    ok = ok && gtfs_prefetch(gtfs, fl, 0, 9, 7) == -1;
+    gtfs_close_file(gtfs, fl);
+    gtfs_remove_file(gtfs, fl);
+
+    // Growing an open file, the view is released before so the mapping may move
+    fl = gtfs_open_file(gtfs, "test20_grow.txt", 1 << 20);
+    ok = ok && gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 100, 6, "before")) == 6;
+    gtfs_view_t view;
+    ok = ok && gtfs_read_view(gtfs, fl, 100, 6, &view) == 0 && gtfs_release_view(&view) == 0;
+    ok = ok && gtfs_resize_file(gtfs, fl, 8 << 20) == 0 && gtfs_resize_file(gtfs, fl, 4 << 20) == -1;
+    ok = ok && gtfs_sync_write_file(gtfs_write_file(gtfs, fl, (8 << 20) - 5, 5, "after")) == 5;
+    ok = ok && gtfs_read_file_into(gtfs, fl, 100, 6, buf) == 6 && string(buf, 6) == "before";
+    gtfs_close_file(gtfs, fl);
+    fl = gtfs_open_file(gtfs, "test20_grow.txt", 8 << 20);
+    ok = ok && gtfs_read_file_into(gtfs, fl, (8 << 20) - 5, 5, buf) == 5 && string(buf, 5) == "after";
+    gtfs_close_file(gtfs, fl);
+    gtfs_remove_file(gtfs, fl); // So that the next run starts small again
+
+    // Huge pages only for files of at least the minimum length
+    ok = ok && gtfs_enable_huge_pages(gtfs, 4 << 20) == 0;
+    fl = gtfs_open_file(gtfs, "test20_huge.txt", 4 << 20);
+    ok = ok && fl && ((uintptr_t)fl->data & (GTFS_HUGE_PAGE_SIZE - 1)) == 0 && fl->huge_pages == 1;
+    ok = ok && gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 3 << 20, 4, "huge")) == 4;
+    ok = ok && gtfs_read_file_into(gtfs, fl, 3 << 20, 4, buf) == 4 && string(buf, 4) == "huge";
+    gtfs_close_file(gtfs, fl);
+    fl = gtfs_open_file(gtfs, "test20_small.txt", 1 << 20);
+    ok = ok && fl && fl->huge_pages == 0;
+    gtfs_close_file(gtfs, fl);
+    ok = ok && gtfs_disable_huge_pages(gtfs) == 0;
+
+    if (ok) {
+        cout << PASS;
+    } else {
+        cout << FAIL;
+    }
+}
+
+// **Test 21**: Testing lazy recovery: a crashed writer leaves a log of many records. gtfs_init leaves it
+// in place and the next open adopts the log instead of applying it, the data file stays behind while reads,
+// views and writes see the newest bytes, until a clean brings it up to date. A second crash
+// after a lazy open keeps both the adopted records and the new ones.
+string test21_data(const string& filename, int64_t offset, int64_t length) {
+    string buf(length, '\0');
+    int fd = open((directory + "/" + filename).c_str(), O_RDONLY);
+    if (fd < 0 || pread(fd, &buf[0], length, offset) != length) {
+        buf = "";
+    }
+    close(fd);
+    return buf;
+}
+
+void test_lazy_open() {
+    const int slots = 64;
+    string filename = "test21.txt";
+    int pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(-1);
+    }
+    if (pid == 0) {
+        gtfs_t *gtfs = gtfs_init(directory, verbose);
+        file_t *fl = gtfs_open_file(gtfs, filename, slots * 10);
+        bool ok = fl != NULL;
+        for (int round = 0; ok && round < 2; round++) {
+            for (int i = round; ok && i < slots; i += round + 1) {
+                string str = (round ? "newest-" : "older--") + to_string(10 + i) + "!";
+                ok = gtfs_sync_write_file(gtfs_write_file(gtfs, fl, i * 10, 10, str.c_str())) == 10;
+            }
+        }
+        // Crash without closing, the mapping is reset so only the log has the data
+        memset(fl->data, 0, slots * 10);
+        _exit(ok ? 0 : 1);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    bool ok = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    auto expected = [](int i) { return string(i % 2 ? "newest-" : "older--") + to_string(10 + i) + "!"; };
+
+    // Nothing was applied by gtfs_init or at open, the bytes come from the log
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    ok = ok && test21_data(filename, 10, 10) != expected(1);
+    file_t *fl = gtfs_open_file(gtfs, filename, slots * 10);
+    ok = ok && fl && fl->overlaid.load() == 1 && test21_data(filename, 10, 10) != expected(1);
+    char buf[10];
+    for (int i = 0; ok && i < slots; i += 2) {
+        ok = gtfs_read_file_into(gtfs, fl, i * 10, 10, buf) == 10 && string(buf, 10) == expected(i);
+    }
+    gtfs_view_t view;
+    ok = ok && gtfs_read_view(gtfs, fl, 30, 10, &view) == 0 && string(view.data, 10) == expected(3) && gtfs_release_view(&view) == 0;
+    write_t *wrt = gtfs_write_file(gtfs, fl, 50, 10, "aborted!!!");
+    ok = ok && wrt && gtfs_abort_write_file(wrt) == 0;
+    char *read = gtfs_read_file(gtfs, fl, 50, 10);
+    ok = ok && read && string(read, 10) == expected(5);
+    free(read);
+
+    // Cleans apply the adopted records, a partial one leaves the rest overlaid
+    ok = ok && gtfs_clean_n_bytes(gtfs, 200) == 200 && fl->overlaid.load() == 1;
+    for (int i = 0; ok && i < slots; i++) {
+        ok = gtfs_read_file_into(gtfs, fl, i * 10, 10, buf) == 10 && string(buf, 10) == expected(i);
+    }
+    ok = ok && gtfs_clean(gtfs) == 0 && fl->overlaid.load() == 0;
+    for (int i = 0; ok && i < slots; i++) {
+        ok = test21_data(filename, i * 10, 10) == expected(i);
+    }
+
+    // Crash again after a lazy open with more records in the log
+    gtfs_close_file(gtfs, fl);
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(-1);
+    }
+    if (pid == 0) {
+        gtfs_t *gtfs = gtfs_init(directory, verbose);
+        file_t *fl = gtfs_open_file(gtfs, filename, slots * 10);
+        _exit(fl && gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, 10, "crash-one!")) == 10 ? 0 : 1);
+    }
+    waitpid(pid, &status, 0);
+    ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(-1);
+    }
+    if (pid == 0) {
+        file_t *fl = gtfs_open_file(gtfs, filename, slots * 10);
+        _exit(fl && fl->overlaid.load() == 1 && gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 20, 10, "crash-two!")) == 10 ? 0 : 1);
+    }
+    waitpid(pid, &status, 0);
+    ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    fl = gtfs_open_file(gtfs, filename, slots * 10);
+    ok = ok && fl && gtfs_read_file_into(gtfs, fl, 0, 10, buf) == 10 && string(buf, 10) == "crash-one!";
+    ok = ok && gtfs_read_file_into(gtfs, fl, 20, 10, buf) == 10 && string(buf, 10) == "crash-two!";
+    ok = ok && gtfs_read_file_into(gtfs, fl, 10, 10, buf) == 10 && string(buf, 10) == expected(1);
+    gtfs_close_file(gtfs, fl);
+    ok = ok && test21_data(filename, 0, 10) == "crash-one!" && test21_data(filename, 20, 10) == "crash-two!";
+    gtfs_remove_file(gtfs, fl);
+
+    if (ok) {
+        cout << PASS;
+    } else {
+        cout << FAIL;
+    }
+}
+
+// **Test 22**: Testing delta encoded records: once they are enabled, rewriting a large record
+// with a few bytes changed only logs those bytes, and recovery after a crash puts the record
+// together again. A write that overlaps an outstanding one is logged in full. The vector
+// diff agrees with the word at a time version.
+bool test22_same_runs(const vector<delta_run_t>& a, const vector<delta_run_t>& b) {
+    if (a.size() != b.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < a.size(); i++) {
+        if (a[i].offset != b[i].offset || a[i].length != b[i].length) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void test_delta_records() {
+    // Random buffers with scattered changes, the runs must turn the old buffer into the new one
+    bool ok = true;
+    mt19937 rng(22);
+    for (int round = 0; ok && round < 200; round++) {
+        size_t len = rng() % 5000;
+        vector<char> before(len);
+        for (char& c : before) {
+            c = rng();
+        }
+        vector<char> after = before;
+        for (int k = rng() % 20; k > 0 && len > 0; k--) {
+            after[rng() % len] ^= 1 + rng() % 255;
+        }
+        size_t limit = round % 2 ? len : SIZE_MAX;
+        vector<delta_run_t> fast, slow;
+        bool fits = delta_runs(before.data(), after.data(), len, sizeof(commit_extent_t), limit, fast);
+        ok = fits == delta_runs_sw(before.data(), after.data(), len, sizeof(commit_extent_t), limit, slow);
+        ok = ok && (!fits || test22_same_runs(fast, slow));
+        for (const delta_run_t& run : fast) {
+            memcpy(before.data() + run.offset, after.data() + run.offset, run.length);
+        }
+        ok = ok && (!fits || before == after);
+    }
+
+    const int size = 4096;
+    string filename = "test22.txt";
+    string image(size, 'a');
+    string changed = image;
+    changed[100] = changed[2000] = changed[4000] = 'X';
+    string rewritten = changed;
+    rewritten[3000] = 'Y';
+    int pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(-1);
+    }
+    if (pid == 0) {
+        gtfs_t *gtfs = gtfs_init(directory, verbose);
+        file_t *fl = gtfs_open_file(gtfs, filename, size);
+        bool ok = fl && gtfs_enable_delta_records(gtfs) == 0;
+        ok = ok && gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, size, image.c_str())) == size;
+        off_t logged = log_size(fl);
+        ok = ok && gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, size, changed.c_str())) == size;
+        ok = ok && log_size(fl) - logged < 200;
+
+        // The outstanding write makes the next one log every byte
+        logged = log_size(fl);
+        write_t *outstanding = gtfs_write_file(gtfs, fl, 0, 10, "0123456789");
+        write_t *full = gtfs_write_file(gtfs, fl, 0, size, rewritten.c_str());
+        ok = ok && gtfs_sync_write_file(outstanding) == 10 && gtfs_sync_write_file(full) == size;
+        ok = ok && log_size(fl) - logged > size;
+
+        // Crash without closing, the mapping is reset so only the log has the data
+        memset(fl->data, 0, size);
+        _exit(ok ? 0 : 1);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    file_t *fl = gtfs_open_file(gtfs, filename, size);
+    char *data = gtfs_read_file(gtfs, fl, 0, size);
+    ok = ok && data && string(data, size) == rewritten;
+    free(data);
+
+    // Rewriting the same bytes logs an empty record, unless delta records are off
+    ok = ok && gtfs_enable_delta_records(gtfs) == 0;
+    off_t logged = log_size(fl);
+    ok = ok && gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, size, rewritten.c_str())) == size;
+    ok = ok && log_size(fl) - logged == sizeof(commit_t) + sizeof(commit_trailer_t);
+    ok = ok && gtfs_disable_delta_records(gtfs) == 0;
+    logged = log_size(fl);
+    ok = ok && gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, size, rewritten.c_str())) == size;
+    ok = ok && log_size(fl) - logged > size;
+    gtfs_close_file(gtfs, fl);
+
+    if (ok) {
+        cout << PASS;
+    } else {
+        cout << FAIL;
+    }
+}
+
+// **Test 23**: Testing private mappings: the bytes of a write stay out of the data file until a clean
+// applies them once committed. An abort gives the bytes back whether its pages are dropped or
+// shared with a committed record, and a writer that crashes leaves only its committed bytes behind.
+void test_private_mapping() {
+    int64_t page = sysconf(_SC_PAGESIZE);
+    string filename = "test23.txt";
+    // Initialized first, so the log of the writer that crashes is left to open
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    bool ok = gtfs_enable_private_mapping(gtfs) == 0;
+    file_t *fl = gtfs_open_file(gtfs, filename, 4 * page);
+    ok = ok && fl && fl->private_map == 1;
+
+    // Outstanding and aborted bytes never show up in the file
+    write_t *wrt = gtfs_write_file(gtfs, fl, 0, 10, "private!!!");
+    ok = ok && wrt && string(fl->data, 10) == "private!!!" && test21_data(filename, 0, 10) == string(10, '\0');
+    ok = ok && gtfs_abort_write_file(wrt) == 0 && string(fl->data, 10) == string(10, '\0');
+
+    // Committed bytes only reach the file when cleaned, an abort next to them keeps them
+    ok = ok && gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 100, 10, "committed!")) == 10;
+    wrt = gtfs_write_file(gtfs, fl, 105, 10, "aborted!!!");
+    ok = ok && wrt && gtfs_abort_write_file(wrt) == 0 && string(fl->data + 100, 15) == string("committed!") + string(5, '\0');
+    ok = ok && test21_data(filename, 100, 10) == string(10, '\0');
+    write_t *pending = gtfs_write_file(gtfs, fl, page + 10, 10, "pending!!!");
+    ok = ok && pending && gtfs_clean(gtfs) == 0 && test21_data(filename, 100, 10) == "committed!";
+    ok = ok && string(fl->data + page + 10, 10) == "pending!!!" && test21_data(filename, page + 10, 10) == string(10, '\0');
+    ok = ok && gtfs_sync_write_file(pending) == 10 && gtfs_clean(gtfs) == 0 && test21_data(filename, page + 10, 10) == "pending!!!";
+    char buf[10];
+    ok = ok && gtfs_read_file_into(gtfs, fl, 100, 10, buf) == 10 && string(buf, 10) == "committed!";
+    gtfs_close_file(gtfs, fl);
+
+    // A crash leaves the unsynced write out of the file without touching the mapping
+    int pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(-1);
+    }
+    if (pid == 0) {
+        gtfs_t *gtfs = gtfs_init(directory, verbose);
+        gtfs_enable_private_mapping(gtfs);
+        file_t *fl = gtfs_open_file(gtfs, filename, 4 * page);
+        bool ok = fl && gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 2 * page, 10, "crashed!!!")) == 10;
+        ok = ok && gtfs_write_file(gtfs, fl, 3 * page, 10, "lost!!!!!!") != NULL;
+        _exit(ok ? 0 : 1);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    ok = ok && test21_data(filename, 2 * page, 10) == string(10, '\0') && test21_data(filename, 3 * page, 10) == string(10, '\0');
+    fl = gtfs_open_file(gtfs, filename, 4 * page);
+    ok = ok && fl && gtfs_read_file_into(gtfs, fl, 2 * page, 10, buf) == 10 && string(buf, 10) == "crashed!!!";
+    ok = ok && gtfs_read_file_into(gtfs, fl, 3 * page, 10, buf) == 10 && string(buf, 10) == string(10, '\0');
+    ok = ok && gtfs_clean(gtfs) == 0 && test21_data(filename, 2 * page, 10) == "crashed!!!";
+    gtfs_close_file(gtfs, fl);
+    gtfs_remove_file(gtfs, fl);
+    ok = ok && gtfs_disable_private_mapping(gtfs) == 0;
+
+    if (ok) {
+        cout << PASS;
+    } else {
+        cout << FAIL;
+    }
+}
+
+// **Test 24**: Testing checkpoints from the mapping: once the payload of a record in the log is
+// overwritten, a clean and a close still bring the data file up to date, so neither read the
+// log back. An outstanding write over a committed record makes a checkpoint use the log.
+bool test24_spoil_log(file_t *fl, const string& payload) {
+    int fd = open(fl->log_path.c_str(), O_RDWR);
+    struct stat st;
+    bool ok = fd >= 0 && fstat(fd, &st) == 0;
+    string log(ok ? st.st_size : 0, '\0');
+    ok = ok && pread(fd, &log[0], log.size(), 0) == (ssize_t)log.size();
+    size_t pos = ok ? log.find(payload) : string::npos;
+    ok = pos != string::npos && pwrite(fd, string(payload.size(), '#').c_str(), payload.size(), pos) == (ssize_t)payload.size();
+    close(fd);
+    return ok;
+}
+
+void test_mapping_checkpoint() {
+    int64_t page = sysconf(_SC_PAGESIZE);
+    string filename = "test24.txt";
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    file_t *fl = gtfs_open_file(gtfs, filename, 4 * page);
+    bool ok = fl && gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 10, 10, "mapped!!!!")) == 10;
+    ok = ok && gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 2 * page, 10, "second!!!!")) == 10;
+    ok = ok && test24_spoil_log(fl, "mapped!!!!") && test24_spoil_log(fl, "second!!!!");
+    ok = ok && gtfs_clean(gtfs) == 0 && test21_data(filename, 10, 10) == "mapped!!!!" && test21_data(filename, 2 * page, 10) == "second!!!!";
+    ok = ok && gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 30, 10, "closing!!!")) == 10 && test24_spoil_log(fl, "closing!!!");
+    ok = ok && gtfs_close_file(gtfs, fl) == 0 && test21_data(filename, 30, 10) == "closing!!!";
+
+    // A private mapping holds the outstanding bytes, the committed ones come from the log
+    ok = ok && gtfs_enable_private_mapping(gtfs) == 0;
+    fl = gtfs_open_file(gtfs, filename, 4 * page);
+    ok = ok && fl && gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 50, 10, "committed!")) == 10;
+    write_t *pending = gtfs_write_file(gtfs, fl, 55, 10, "pending!!!");
+    ok = ok && pending && gtfs_clean(gtfs) == 0 && test21_data(filename, 50, 15) == string("committed!") + string(5, '\0');
+    ok = ok && gtfs_abort_write_file(pending) == 0 && string(fl->data + 50, 10) == "committed!";
+    ok = ok && gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 3 * page, 10, "private!!!")) == 10 && test24_spoil_log(fl, "private!!!");
+    ok = ok && gtfs_clean(gtfs) == 0 && test21_data(filename, 3 * page, 10) == "private!!!";
+    gtfs_close_file(gtfs, fl);
+    gtfs_remove_file(gtfs, fl);
+    gtfs_disable_private_mapping(gtfs);
+
+    if (ok) {
+        cout << PASS;
+    } else {
+        cout << FAIL;
+    }
+}
+
+// **Test 25**: Testing preallocated logs: a log is allocated in whole extents and keeps its inode
+// and size through syncs, checkpoints and close. A record that outruns it grows it by an extent,
+// the next checkpoint takes it back to one. A reopened file reuses its log with new records
+// numbered past the old ones, and a crash after that recovers exactly the committed bytes.
+// A log replayed by recovery is kept with its header reset, not deleted.
+void test_preallocated_logs() {
+    const int64_t extent = 64 * 1024;
+    string filename = "test25.txt";
+    // Initialized first, so the log of the writer that crashes is left to open
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    bool ok = gtfs_enable_log_preallocation(gtfs, 100) == -1 && gtfs_enable_log_preallocation(gtfs, extent) == 0;
+    file_t *fl = gtfs_open_file(gtfs, filename, 4 * extent);
+    string log_path = fl ? fl->log_path : "";
+    struct stat first, st;
+    ok = ok && fl && stat(log_path.c_str(), &first) == 0 && first.st_size == extent;
+
+    // A large record grows the log, the checkpoint takes it back to one extent
+    string big(extent + 100, 'b');
+    ok = ok && gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 2 * extent, big.size(), big.c_str())) == (int64_t)big.size();
+    ok = ok && stat(log_path.c_str(), &st) == 0 && st.st_size == 2 * extent;
+    ok = ok && gtfs_clean(gtfs) == 0 && stat(log_path.c_str(), &st) == 0 && st.st_size == extent && test21_data(filename, 2 * extent, 10) == "bbbbbbbbbb";
+
+    // Syncs and checkpoints overwrite the same bytes
+    auto value = [](int round, int slot) { return "round" + to_string(round) + "-" + to_string(slot) + "!!"; };
+    for (int round = 0; ok && round < 3; round++) {
+        for (int slot = 0; ok && slot < 8; slot++) {
+            ok = gtfs_sync_write_file(gtfs_write_file(gtfs, fl, slot * 10, 10, value(round, slot).c_str())) == 10;
+        }
+        ok = ok && stat(log_path.c_str(), &st) == 0 && st.st_ino == first.st_ino && st.st_size == extent;
+        ok = ok && gtfs_clean(gtfs) == 0 && stat(log_path.c_str(), &st) == 0 && st.st_ino == first.st_ino && st.st_size == extent;
+    }
+    uint64_t last_seq = fl ? fl->next_seq : 0;
+    ok = ok && gtfs_close_file(gtfs, fl) == 0 && stat(log_path.c_str(), &st) == 0 && st.st_ino == first.st_ino;
+
+    int pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(-1);
+    }
+    if (pid == 0) {
+        gtfs_t *gtfs = gtfs_init(directory, verbose);
+        gtfs_enable_log_preallocation(gtfs, extent);
+        file_t *fl = gtfs_open_file(gtfs, filename, 4 * extent);
+        bool ok = fl && fl->next_seq > last_seq && gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, 10, "crashed!!!")) == 10;
+        ok = ok && gtfs_write_file(gtfs, fl, 500, 10, "lost!!!!!!") != NULL;
+        // Crash without closing, the mapping is reset so only the log has the data
+        memset(fl->data, 0, 10);
+        memset(fl->data + 500, 0, 10);
+        _exit(ok ? 0 : 1);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    fl = gtfs_open_file(gtfs, filename, 4 * extent);
+    char buf[10];
+    ok = ok && fl && gtfs_read_file_into(gtfs, fl, 0, 10, buf) == 10 && string(buf, 10) == "crashed!!!";
+    for (int slot = 1; ok && slot < 8; slot++) {
+        ok = gtfs_read_file_into(gtfs, fl, slot * 10, 10, buf) == 10 && string(buf, 10) == value(2, slot);
+    }
+    ok = ok && gtfs_read_file_into(gtfs, fl, 500, 10, buf) == 10 && string(buf, 10) == string(10, '\0');
+    ok = ok && stat(log_path.c_str(), &st) == 0 && st.st_ino == first.st_ino && st.st_size == extent;
+    gtfs_close_file(gtfs, fl);
+    ok = ok && test21_data(filename, 0, 10) == "crashed!!!";
+
+    // A reader recovers the next crash by replaying the log, which keeps its inode and blocks:
+    // only its header is reset, so the writer after it replays nothing and reuses the log
+    pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(-1);
+    }
+    if (pid == 0) {
+        gtfs_t *gtfs = gtfs_init(directory, verbose);
+        gtfs_enable_log_preallocation(gtfs, extent);
+        file_t *fl = gtfs_open_file(gtfs, filename, 4 * extent);
+        bool ok = fl && gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, 10, "replayed!!")) == 10;
+        memset(fl->data, 0, 10);
+        _exit(ok ? 0 : 1);
+    }
+    waitpid(pid, &status, 0);
+    ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    file_t *reader = gtfs_open_file_mode(gtfs, filename, 4 * extent, GTFS_OPEN_READ);
+    ok = ok && reader && test21_data(filename, 0, 10) == "replayed!!";
+    ok = ok && stat(log_path.c_str(), &st) == 0 && st.st_ino == first.st_ino && st.st_size == extent;
+    gtfs_close_file(gtfs, reader);
+    // A second replay would bring the logged bytes back over these
+    int data_fd = open((directory + "/" + filename).c_str(), O_WRONLY);
+    ok = ok && data_fd != -1 && pwrite(data_fd, "overwrite!", 10, 0) == 10;
+    close(data_fd);
+    fl = gtfs_open_file(gtfs, filename, 4 * extent);
+    ok = ok && fl && gtfs_read_file_into(gtfs, fl, 0, 10, buf) == 10 && string(buf, 10) == "overwrite!";
+    ok = ok && stat(log_path.c_str(), &st) == 0 && st.st_ino == first.st_ino && st.st_size == extent;
+    gtfs_close_file(gtfs, fl);
+    gtfs_remove_file(gtfs, fl);
+    ok = ok && stat(log_path.c_str(), &st) != 0 && gtfs_disable_log_preallocation(gtfs) == 0;
+
+    if (ok) {
+        cout << PASS;
+    } else {
+        cout << FAIL;
+    }
+}
+
+// **Test 26**: Testing durability levels: the setters check the level, a sync at the commit level
+// flushes the log before it returns, a log at the O_DSYNC level is opened with the flag, and the
+// syncer flushes a periodic log on its own. Each costs time in durable_latency, the default level
+// none. A cross-file commit flushes the transaction log, and a crash recovers every level.
+void test_durability_levels() {
+    string filename = "test26.txt";
+    string other = "test26b.txt";
+    // Initialized first, so the log of the writer that crashes is left to open
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    bool ok = gtfs_set_durability(gtfs, 7, 0) == -1 && gtfs_set_durability(gtfs, GTFS_DURABLE_PERIODIC, 0) == -1 &&
+              gtfs_set_durability(gtfs, GTFS_DURABLE_COMMIT, 0) == 0;
+    file_t *fl = gtfs_open_file(gtfs, filename, 1000);
+    gtfs_stats_t before, after;
+
+    // Commit: one flush per sync
+    ok = ok && fl && fl->durability == GTFS_DURABLE_COMMIT && gtfs_get_file_stats(fl, &before) == 0;
+    ok = ok && gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, 10, "commit!!!!")) == 10;
+    ok = ok && gtfs_get_file_stats(fl, &after) == 0 && after.durable_latency.count == before.durable_latency.count + 1 &&
+         after.flushes == before.flushes + 1;
+
+    // O_DSYNC: the log is reopened with the flag, every append counts
+    ok = ok && gtfs_set_file_durability(gtfs, fl, GTFS_DURABLE_DSYNC, 0) == 0 && (fcntl(fl->log_fd, F_GETFL) & O_DSYNC);
+    ok = ok && gtfs_get_file_stats(fl, &before) == 0 && gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 10, 10, "dsync!!!!!")) == 10;
+    ok = ok && gtfs_get_file_stats(fl, &after) == 0 && after.durable_latency.count == before.durable_latency.count + 1 &&
+         after.flushes == before.flushes;
+
+    // Process: nothing on top of the append
+    ok = ok && gtfs_set_file_durability(gtfs, fl, GTFS_DURABLE_PROCESS, 0) == 0 && !(fcntl(fl->log_fd, F_GETFL) & O_DSYNC);
+    ok = ok && gtfs_get_file_stats(fl, &before) == 0 && gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 20, 10, "process!!!")) == 10;
+    ok = ok && gtfs_get_file_stats(fl, &after) == 0 && after.durable_latency.count == before.durable_latency.count;
+
+    // Periodic: the sync returns at once, the syncer flushes the log soon after
+    ok = ok && gtfs_set_file_durability(gtfs, fl, GTFS_DURABLE_PERIODIC, 0) == -1 && gtfs_set_file_durability(gtfs, fl, GTFS_DURABLE_PERIODIC, 20) == 0;
+    ok = ok && gtfs_get_file_stats(fl, &before) == 0 && gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 30, 10, "periodic!!")) == 10;
+    for (int i = 0; ok && i < 100; i++) {
+        ok = gtfs_get_file_stats(fl, &after) == 0;
+        if (after.durable_latency.count > before.durable_latency.count) {
+            break;
+        }
+        usleep(10000);
+    }
+    ok = ok && after.durable_latency.count > before.durable_latency.count && after.flushes > before.flushes;
+
+    // Leaving the periodic level stops and joins the syncer, choosing it again starts a new one
+    ok = ok && gtfs->syncer_running == 1 && gtfs_set_file_durability(gtfs, fl, GTFS_DURABLE_PROCESS, 0) == 0;
+    ok = ok && gtfs->syncer == NULL && gtfs->syncer_running == 0;
+    ok = ok && gtfs_set_file_durability(gtfs, fl, GTFS_DURABLE_PERIODIC, 20) == 0 && gtfs->syncer != NULL && gtfs->syncer_running == 1;
+
+    // A transaction across a periodic and a commit level file flushes the transaction log
+    file_t *fl2 = gtfs_open_file(gtfs, other, 1000);
+    gtfs_stats_t dir_before, dir_after;
+    ok = ok && fl2 && fl2->durability == GTFS_DURABLE_COMMIT && gtfs_get_stats(gtfs, &dir_before) == 0;
+    txn_t *txn = gtfs_begin_txn(gtfs);
+    ok = ok && txn && gtfs_add_write_txn(txn, gtfs_write_file(gtfs, fl, 40, 10, "txn-one!!!")) == 0 &&
+         gtfs_add_write_txn(txn, gtfs_write_file(gtfs, fl2, 0, 10, "txn-two!!!")) == 0 && gtfs_commit_txn(txn) == 20;
+    ok = ok && gtfs_get_stats(gtfs, &dir_after) == 0 && dir_after.durable_latency.count >= dir_before.durable_latency.count + 2;
+    gtfs_close_file(gtfs, fl2);
+    ok = ok && test21_data(other, 0, 10) == "txn-two!!!";
+    gtfs_remove_file(gtfs, fl2);
+    gtfs_close_file(gtfs, fl);
+
+    // With no periodic file left the syncer exits on its own
+    for (int i = 0; gtfs->syncer_running && i < 100; i++) {
+        usleep(10000);
+    }
+    ok = ok && gtfs->syncer_running == 0;
+
+    int pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        exit(-1);
+    }
+    if (pid == 0) {
+        gtfs_t *gtfs = gtfs_init(directory, verbose);
+        gtfs_set_durability(gtfs, GTFS_DURABLE_DSYNC, 0);
+        file_t *fl = gtfs_open_file(gtfs, filename, 1000);
+        bool ok = fl && (fcntl(fl->log_fd, F_GETFL) & O_DSYNC) && gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, 10, "crashed!!!")) == 10;
+        ok = ok && gtfs_write_file(gtfs, fl, 500, 10, "lost!!!!!!") != NULL;
+        // Crash without closing, the mapping is reset so only the log has the data
+        memset(fl->data, 0, 10);
+        memset(fl->data + 500, 0, 10);
+        _exit(ok ? 0 : 1);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+    ok = ok && WIFEXITED(status) && WEXITSTATUS(status) == 0;
+    fl = gtfs_open_file(gtfs, filename, 1000);
+    char buf[50];
+    ok = ok && fl && gtfs_read_file_into(gtfs, fl, 0, 50, buf) == 50 && string(buf, 50) == "crashed!!!dsync!!!!!process!!!periodic!!txn-one!!!";
+    ok = ok && gtfs_read_file_into(gtfs, fl, 500, 10, buf) == 10 && string(buf, 10) == string(10, '\0');
+    gtfs_close_file(gtfs, fl);
+    gtfs_remove_file(gtfs, fl);
+    ok = ok && gtfs_set_durability(gtfs, GTFS_DURABLE_PROCESS, 0) == 0;
+
+    if (ok) {
+        cout << PASS;
+    } else {
+        cout << FAIL;
+    }
+}
+
+// **Test 27**: Testing snapshot reads: a snapshot sees the bytes committed when it was taken and
+// nothing written, synced or aborted afterwards, across page boundaries and while later snapshots
+// see newer commits. Reader threads take snapshots while a writer commits transactions that
+// change two pages together, and never see one page without the other.
+void test_snapshot_reads() {
+    string filename = "test27.txt";
+    int64_t page = sysconf(_SC_PAGESIZE);
+    gtfs_t *gtfs = gtfs_init(directory, verbose);
+    file_t *fl = gtfs_open_file(gtfs, filename, 8 * page);
+    gtfs_snapshot_t s1, s2, s3;
+    bool ok = fl && gtfs_begin_snapshot(gtfs, fl, &s1) == -1; // Not enabled when it was opened
+    gtfs_close_file(gtfs, fl);
+    ok = ok && gtfs_enable_snapshots(gtfs) == 0;
+    fl = gtfs_open_file(gtfs, filename, 8 * page);
+    auto read = [&](gtfs_snapshot_t *snapshot, int64_t offset) {
+        char buf[10];
+        return gtfs_read_snapshot(snapshot, offset, 10, buf) == 10 ? string(buf, 10) : string("failed");
+    };
+
+    // Outstanding bytes are not in a snapshot, neither are later commits
+    ok = ok && fl && gtfs_sync_write_file(gtfs_write_file(gtfs, fl, 0, 10, "committed1")) == 10;
+    write_t *dirty = gtfs_write_file(gtfs, fl, 0, 10, "dirty!!!!!");
+    ok = ok && dirty && gtfs_begin_snapshot(gtfs, fl, &s1) == 0 && read(&s1, 0) == "committed1";
+    ok = ok && gtfs_sync_write_file(dirty) == 10 && read(&s1, 0) == "committed1";
+    ok = ok && gtfs_begin_snapshot(gtfs, fl, &s2) == 0 && read(&s2, 0) == "dirty!!!!!";
+
+    // Across a page boundary: an abort leaves every snapshot as it was, commits only the later ones
+    ok = ok && gtfs_abort_write_file(gtfs_write_file(gtfs, fl, page - 5, 10, "aborted!!!")) == 0;
+    ok = ok && read(&s1, page - 5) == string(10, '\0') && read(&s2, page - 5) == string(10, '\0');
+    ok = ok && gtfs_sync_write_file(gtfs_write_file(gtfs, fl, page - 5, 10, "straddle!!")) == 10;
+    ok = ok && gtfs_sync_write_file(gtfs_write_file(gtfs, fl, page - 5, 10, "straddle-2")) == 10;
+    ok = ok && gtfs_begin_snapshot(gtfs, fl, &s3) == 0 && read(&s3, page - 5) == "straddle-2";
+    ok = ok && read(&s1, page - 5) == string(10, '\0') && read(&s2, page - 5) == string(10, '\0');
+    ok = ok && gtfs_write_file(gtfs, fl, page, 10, "pending!!!") != NULL && read(&s3, page - 5) == "straddle-2";
+
+    // Versions go once no snapshot needs them
+    ok = ok && gtfs_end_snapshot(&s1) == 0 && gtfs_end_snapshot(&s1) == -1 && read(&s1, 0) == "failed";
+    ok = ok && gtfs_end_snapshot(&s2) == 0 && gtfs_end_snapshot(&s3) == 0 && fl->page_versions.empty();
+
+    // Both pages of every transaction, or neither
+    atomic<bool> stop(false);
+    atomic<int> torn(0);
+    thread writer([&] {
+        for (int i = 0; i < 300 && ok; i++) {
+            string value = "value" + to_string(10000 + i);
+            txn_t *txn = gtfs_begin_txn(gtfs);
+            gtfs_add_write_txn(txn, gtfs_write_file(gtfs, fl, 2 * page, 10, value.c_str()));
+            gtfs_add_write_txn(txn, gtfs_write_file(gtfs, fl, 6 * page, 10, value.c_str()));
+            write_t *abandoned = gtfs_write_file(gtfs, fl, 6 * page, 10, "abandoned!");
+            if (gtfs_commit_txn(txn) != 20 || gtfs_abort_write_file(abandoned) != 0) {
+                torn++;
+            }
+        }
+        stop = true;
+    });
+    vector<thread> readers;
+    for (int r = 0; r < 3; r++) {
+        readers.push_back(thread([&] {
+            while (!stop) {
+                gtfs_snapshot_t snapshot;
+                if (gtfs_begin_snapshot(gtfs, fl, &snapshot) != 0 || read(&snapshot, 2 * page) != read(&snapshot, 6 * page) ||
+                    gtfs_end_snapshot(&snapshot) != 0) {
+                    torn++;
+                }
+            }
+        }));
+    }
+    writer.join();
+    for (thread& reader : readers) {
+        reader.join();
+    }
+    ok = ok && torn == 0 && fl->page_versions.empty();
+
+    gtfs_close_file(gtfs, fl);
+    ok = ok && test21_data(filename, 2 * page, 10) == "value10299" && test21_data(filename, page - 5, 10) == "straddle-2";
+    gtfs_remove_file(gtfs, fl);
+    ok = ok && gtfs_disable_snapshots(gtfs) == 0;
+
+    if (ok) {
+        cout << PASS;
+    } else {
+        cout << FAIL;
+    }
+}
+
 // TODO: Implement any additional tests
 
 int main(int argc, char **argv) {
@@ -188,4 +1965,96 @@ int main(int argc, char **argv) {
     cout << "Testing multiple writes\n";
     test_multiple_writes();
 
+    cout << "================== Test 5 ==================\n";
+    cout << "Testing group commit of concurrent syncs\n";
+    test_group_commit();
+
+    cout << "================== Test 6 ==================\n";
+    cout << "Testing recovery with a corrupt log record\n";
+    test_corrupt_record();
+
+    cout << "================== Test 7 ==================\n";
+    cout << "Testing recovery of overlapping records\n";
+    test_recover_overlapping();
+
+    cout << "================== Test 8 ==================\n";
+    cout << "Testing background checkpointing and clean\n";
+    test_checkpointer();
+
+    cout << "================== Test 9 ==================\n";
+    cout << "Testing incremental cleaning\n";
+    test_clean_n_bytes();
+
+    cout << "================== Test 10 ==================\n";
+    cout << "Testing zero-copy reads\n";
+    test_read_view();
+
+    cout << "================== Test 11 ==================\n";
+    cout << "Testing atomic transactions across files\n";
+    test_transactions();
+
+    cout << "================== Test 12 ==================\n";
+    cout << "Testing the directory-wide WAL\n";
+    test_wal();
+
+    cout << "================== Test 13 ==================\n";
+    cout << "Testing the shared registry of open files\n";
+    test_registry();
+
+    cout << "================== Test 14 ==================\n";
+    cout << "Testing read opens and byte-range locks\n";
+    test_range_locks();
+
+    cout << "================== Test 15 ==================\n";
+    cout << "Stress testing concurrent syncs on one file\n";
+    test_stress();
+
+    cout << "================== Test 16 ==================\n";
+    cout << "Testing pooled write handles\n";
+    test_release_write();
+
+    cout << "================== Test 17 ==================\n";
+    cout << "Testing runtime statistics\n";
+    test_stats();
+
+    cout << "================== Test 18 ==================\n";
+    cout << "Testing the binary trace\n";
+    test_trace();
+
+    cout << "================== Test 19 ==================\n";
+    cout << "Testing asynchronous syncs\n";
+    test_async_sync();
+
+    cout << "================== Test 20 ==================\n";
+    cout << "Testing large files, growth and huge pages\n";
+    test_large_files();
+
+    cout << "================== Test 21 ==================\n";
+    cout << "Testing lazy open of a file with a crashed writer's log\n";
+    test_lazy_open();
+
+    cout << "================== Test 22 ==================\n";
+    cout << "Testing delta encoded log records\n";
+    test_delta_records();
+
+    cout << "================== Test 23 ==================\n";
+    cout << "Testing private mappings\n";
+    test_private_mapping();
+
+    cout << "================== Test 24 ==================\n";
+    cout << "Testing checkpoints from the mapping\n";
+    test_mapping_checkpoint();
+
+    cout << "================== Test 25 ==================\n";
+    cout << "Testing preallocated, recycled logs\n";
+    test_preallocated_logs();
+
+    cout << "================== Test 26 ==================\n";
+    cout << "Testing durability levels\n";
+    test_durability_levels();
+
+    cout << "================== Test 27 ==================\n";
+    cout << "Testing snapshot reads\n";
+    test_snapshot_reads();
+
 }
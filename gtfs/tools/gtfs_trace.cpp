@@ -0,0 +1,111 @@
+#include "../src/gtfs.hpp"
+
+// Decodes a trace written by gtfs_trace_dump. The events of every thread are merged and
+// printed one per line in time order:
+//
+//   <microseconds since the first event> <thread> <op> <file> off=<offset> len=<length> ret=<result> [dur=<microseconds>]
+//
+// Usage: ./gtfs_trace dump_file [--op name] [--file name]
+
+typedef struct event {
+    gtfs_trace_record_t record;
+    uint32_t tid;
+} event_t;
+
+bool read_exact(FILE *f, void *buf, size_t length) {
+    return length == 0 || fread(buf, length, 1, f) == 1;
+}
+
+int main(int argc, char **argv) {
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s dump_file [--op name] [--file name]\n", argv[0]);
+        return 1;
+    }
+    string only_op, only_file;
+    for (int i = 2; i + 1 < argc; i += 2) {
+        string arg = argv[i];
+        if (arg == "--op") {
+            only_op = argv[i + 1];
+        } else if (arg == "--file") {
+            only_file = argv[i + 1];
+        } else {
+            fprintf(stderr, "Unknown option %s\n", argv[i]);
+            return 1;
+        }
+    }
+
+    FILE *f = fopen(argv[1], "rb");
+    if (!f) {
+        perror(argv[1]);
+        return 1;
+    }
+    gtfs_trace_header_t header;
+    if (!read_exact(f, &header, sizeof(header)) || header.magic != GTFS_TRACE_MAGIC ||
+        header.version != GTFS_TRACE_VERSION || header.record_size != sizeof(gtfs_trace_record_t)) {
+        fprintf(stderr, "%s is not a trace of this version\n", argv[1]);
+        fclose(f);
+        return 1;
+    }
+
+    map<uint32_t, string> names;
+    for (uint32_t i = 0; i < header.names; i++) {
+        gtfs_trace_name_t name;
+        if (!read_exact(f, &name, sizeof(name)) || name.length > MAX_FILENAME_LEN) {
+            fprintf(stderr, "Truncated trace\n");
+            fclose(f);
+            return 1;
+        }
+        string filename(name.length, '\0');
+        if (!read_exact(f, &filename[0], name.length)) {
+            fprintf(stderr, "Truncated trace\n");
+            fclose(f);
+            return 1;
+        }
+        names[name.file_id] = filename;
+    }
+
+    vector<event_t> events;
+    uint64_t dropped = 0;
+    for (uint32_t r = 0; r < header.rings; r++) {
+        gtfs_trace_ring_header_t ring;
+        if (!read_exact(f, &ring, sizeof(ring)) || ring.count > GTFS_TRACE_RING_RECORDS) {
+            fprintf(stderr, "Truncated trace\n");
+            fclose(f);
+            return 1;
+        }
+        dropped += ring.dropped;
+        for (uint32_t i = 0; i < ring.count; i++) {
+            event_t event;
+            if (!read_exact(f, &event.record, sizeof(gtfs_trace_record_t))) {
+                fprintf(stderr, "Truncated trace\n");
+                fclose(f);
+                return 1;
+            }
+            event.tid = ring.tid;
+            events.push_back(event);
+        }
+    }
+    fclose(f);
+
+    stable_sort(events.begin(), events.end(), [](const event_t& a, const event_t& b) {
+        return a.record.timestamp_ns < b.record.timestamp_ns;
+    });
+    printf("# pid %u, %zu events, %llu older events overwritten\n", header.pid, events.size(), (unsigned long long)dropped);
+    uint64_t base = events.empty() ? 0 : events.front().record.timestamp_ns;
+    for (const event_t& event : events) {
+        const gtfs_trace_record_t& record = event.record;
+        const char *op = gtfs_trace_op_name(record.op);
+        auto name = names.find(record.file_id);
+        string file = record.file_id == 0 ? "-" : name != names.end() ? name->second : "#" + to_string(record.file_id);
+        if ((!only_op.empty() && only_op != op) || (!only_file.empty() && only_file != file)) {
+            continue;
+        }
+        printf("%.3f %u %s %s off=%lld len=%lld ret=%lld", (record.timestamp_ns - base) / 1000.0, event.tid, op, file.c_str(),
+               (long long)record.offset, (long long)record.length, (long long)record.result);
+        if (record.duration_ns) {
+            printf(" dur=%.3f", record.duration_ns / 1000.0);
+        }
+        printf("\n");
+    }
+    return 0;
+}